@@ -0,0 +1,41 @@
+@echo off
+
+call .\set_vars.bat
+
+if not exist "..\.build" mkdir "..\.build"
+
+pushd ..\.build
+cl %INCLUDES% %OPTIONS% /O2 /DRELEASE %* /utf-8 samplerate.lib ^
+..\code\tools\resampler_bench.cpp ..\code\player\resampler.cpp ..\code\player\cpu.cpp ..\code\player\log.cpp ^
+/Fe:..\data\Bin\resampler_bench.exe %LINKER_OPTIONS%
+cl %INCLUDES% %OPTIONS% /O2 /DRELEASE %* /utf-8 ^
+..\code\tools\pcm_bench.cpp ..\code\player\pcm.cpp ..\code\player\cpu.cpp ..\code\player\log.cpp ^
+/Fe:..\data\Bin\pcm_bench.exe %LINKER_OPTIONS%
+cl %INCLUDES% %OPTIONS% /O2 /DRELEASE %* /utf-8 ^
+..\code\tools\dsp_bench.cpp ..\code\player\dsp.cpp ..\code\player\convolver.cpp ..\code\player\fft.cpp ..\code\player\pcm.cpp ..\code\player\cpu.cpp ..\code\player\log.cpp ^
+/Fe:..\data\Bin\dsp_bench.exe %LINKER_OPTIONS%
+cl %INCLUDES% %OPTIONS% /O2 /DRELEASE %* /utf-8 FLAC.lib ^
+..\code\tools\flac_parallel_bench.cpp ..\code\player\decoders\flac.cpp ..\code\player\pcm.cpp ..\code\player\cpu.cpp ^
+..\code\player\log.cpp ..\code\player\platform_win32.cpp ..\code\third_party\xxhash.c ^
+/Fe:..\data\Bin\flac_parallel_bench.exe %LINKER_OPTIONS%
+cl %INCLUDES% %OPTIONS% /O2 /DRELEASE %* /utf-8 opusfile.lib ogg.lib opus.lib FLAC.lib ^
+..\code\tools\decoder_bench.cpp ..\code\player\decoders.cpp ..\code\player\decoders\*.cpp ..\code\player\pcm.cpp ^
+..\code\player\cpu.cpp ..\code\player\log.cpp ..\code\player\platform_win32.cpp ..\code\third_party\xxhash.c ^
+/Fe:..\data\Bin\decoder_bench.exe %LINKER_OPTIONS%
+cl %INCLUDES% %OPTIONS% /O2 /DRELEASE %* /utf-8 samplerate.lib opusfile.lib ogg.lib opus.lib FLAC.lib ^
+..\code\tools\render.cpp ..\code\player\pipeline.cpp ..\code\player\dsp.cpp ..\code\player\convolver.cpp ..\code\player\fft.cpp ^
+..\code\player\impulse_response.cpp ..\code\player\resampler.cpp ..\code\player\audio_ring.cpp ^
+..\code\player\realtime_check.cpp ..\code\player\decoders.cpp ..\code\player\decoders\*.cpp ..\code\player\pcm.cpp ..\code\player\cpu.cpp ^
+..\code\player\log.cpp ..\code\player\platform_win32.cpp ..\code\third_party\xxhash.c ^
+/Fe:..\data\Bin\render.exe %LINKER_OPTIONS%
+cl %INCLUDES% %OPTIONS% /O2 /DRELEASE %* /utf-8 ole32.lib samplerate.lib opusfile.lib ogg.lib opus.lib FLAC.lib ^
+..\code\tools\play.cpp ..\code\player\player.cpp ..\code\player\output.cpp ..\code\player\outputs\*.cpp ^
+..\code\player\pipeline.cpp ..\code\player\dsp.cpp ..\code\player\convolver.cpp ..\code\player\fft.cpp ^
+..\code\player\impulse_response.cpp ..\code\player\resampler.cpp ..\code\player\audio_ring.cpp ..\code\player\telemetry.cpp ..\code\player\realtime_check.cpp ^
+..\code\player\decoders.cpp ^
+..\code\player\decoders\*.cpp ..\code\player\pcm.cpp ..\code\player\cpu.cpp ..\code\player\log.cpp ^
+..\code\player\platform_win32.cpp ..\code\third_party\xxhash.c ^
+/Fe:..\data\Bin\play.exe %LINKER_OPTIONS%
+popd
+
+@echo on
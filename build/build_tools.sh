@@ -0,0 +1,32 @@
+#!/bin/sh
+# Builds the headless tools for Linux: the decoder and DSP benchmarks, the offline renderer, the player and
+# the pipeline's allocation check. The player and the check count heap allocations on the real-time path.
+# Needs the libFLAC, opusfile, libogg, libsamplerate and ALSA development packages.
+# Run from this directory, like the .bat files.
+
+mkdir -p ../.build ../data/Bin
+cd ../.build || exit 1
+
+CXX=${CXX:-c++}
+CC=${CC:-cc}
+FLAGS="-O2 -DRELEASE -I../code/third_party $(pkg-config --cflags flac opusfile samplerate alsa)"
+DECODERS="../code/player/decoders.cpp ../code/player/decoders/*.cpp ../code/player/pcm.cpp ../code/player/cpu.cpp \
+	../code/player/log.cpp ../code/player/platform_posix.cpp"
+
+$CC $FLAGS -c ../code/third_party/xxhash.c -o xxhash.o || exit 1
+$CXX -std=c++17 $FLAGS "$@" ../code/tools/decoder_bench.cpp $DECODERS xxhash.o \
+	$(pkg-config --libs flac opusfile) -lpthread -o ../data/Bin/decoder_bench || exit 1
+$CXX -std=c++17 $FLAGS "$@" ../code/tools/dsp_bench.cpp ../code/player/dsp.cpp ../code/player/convolver.cpp \
+	../code/player/fft.cpp ../code/player/pcm.cpp ../code/player/cpu.cpp ../code/player/log.cpp -o ../data/Bin/dsp_bench || exit 1
+$CXX -std=c++17 $FLAGS "$@" ../code/tools/render.cpp ../code/player/pipeline.cpp ../code/player/dsp.cpp ../code/player/convolver.cpp ../code/player/fft.cpp \
+	../code/player/impulse_response.cpp ../code/player/resampler.cpp \
+	../code/player/audio_ring.cpp ../code/player/realtime_check.cpp $DECODERS xxhash.o \
+	$(pkg-config --libs flac opusfile samplerate) -lpthread -o ../data/Bin/render || exit 1
+$CXX -std=c++17 $FLAGS -DPLAYER_REALTIME_CHECKS "$@" ../code/tools/pipeline_check.cpp ../code/player/pipeline.cpp \
+	../code/player/resampler.cpp ../code/player/audio_ring.cpp ../code/player/realtime_check.cpp $DECODERS xxhash.o \
+	$(pkg-config --libs flac opusfile samplerate) -lpthread -o ../data/Bin/pipeline_check || exit 1
+$CXX -std=c++17 $FLAGS -DPLAYER_REALTIME_CHECKS "$@" ../code/tools/play.cpp ../code/player/player.cpp ../code/player/output.cpp \
+	../code/player/outputs/*.cpp ../code/player/pipeline.cpp ../code/player/dsp.cpp ../code/player/convolver.cpp ../code/player/fft.cpp \
+	../code/player/impulse_response.cpp ../code/player/resampler.cpp \
+	../code/player/audio_ring.cpp ../code/player/telemetry.cpp ../code/player/realtime_check.cpp \
+	$DECODERS xxhash.o $(pkg-config --libs flac opusfile samplerate alsa) -lpthread -o ../data/Bin/play
@@ -0,0 +1,90 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "audio_ring.h"
+#include <stdlib.h>
+#include <string.h>
+
+void Audio_Ring::init(u32 min_frames, u32 channels) {
+	u32 capacity = 1;
+	while (capacity < min_frames) capacity <<= 1;
+	
+	this->samples = (float*)malloc(capacity * channels * sizeof(float));
+	this->capacity = capacity;
+	this->channels = channels;
+	this->write_index.store(0);
+	this->read_index.store(0);
+	this->discard_index.store(0);
+}
+
+void Audio_Ring::free() {
+	::free(this->samples);
+	this->samples = NULL;
+	this->capacity = 0;
+}
+
+u32 Audio_Ring::get_free_frames() const {
+	// Flushed frames still count as used until the consumer has skipped them, it might be reading them
+	u64 used = this->write_index.load(std::memory_order_relaxed) - this->read_index.load(std::memory_order_acquire);
+	return this->capacity - (u32)used;
+}
+
+void Audio_Ring::write(const float *frames, u32 count) {
+	u64 write_index = this->write_index.load(std::memory_order_relaxed);
+	u32 offset = (u32)(write_index & (this->capacity - 1));
+	u32 first = MIN(count, this->capacity - offset);
+	
+	DEBUG_ASSERT(count <= this->get_free_frames());
+	
+	memcpy(&this->samples[offset * this->channels], frames, first * this->channels * sizeof(float));
+	memcpy(this->samples, &frames[first * this->channels], (count - first) * this->channels * sizeof(float));
+	
+	this->write_index.store(write_index + count, std::memory_order_release);
+}
+
+void Audio_Ring::flush() {
+	this->discard_index.store(this->write_index.load(std::memory_order_relaxed), std::memory_order_release);
+}
+
+u32 Audio_Ring::read(float *frames, u32 max_count) {
+	u64 read_index = this->read_index.load(std::memory_order_relaxed);
+	u64 discard_index = this->discard_index.load(std::memory_order_acquire);
+	u64 write_index = this->write_index.load(std::memory_order_acquire);
+	
+	if (read_index < discard_index) read_index = discard_index;
+	
+	u32 count = MIN((u32)(write_index - read_index), max_count);
+	u32 offset = (u32)(read_index & (this->capacity - 1));
+	u32 first = MIN(count, this->capacity - offset);
+	
+	if (count) {
+		memcpy(frames, &this->samples[offset * this->channels], first * this->channels * sizeof(float));
+		memcpy(&frames[first * this->channels], this->samples, (count - first) * this->channels * sizeof(float));
+	}
+	
+	// Also moves past flushed frames when nothing is copied, which gives their space back to the producer
+	this->read_index.store(read_index + count, std::memory_order_release);
+	return count;
+}
+
+u32 Audio_Ring::get_fill() const {
+	u64 read_index = this->read_index.load(std::memory_order_acquire);
+	u64 discard_index = this->discard_index.load(std::memory_order_acquire);
+	u64 write_index = this->write_index.load(std::memory_order_acquire);
+	
+	if (read_index < discard_index) read_index = discard_index;
+	if (read_index > write_index) return 0;
+	return (u32)(write_index - read_index);
+}
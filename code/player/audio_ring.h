@@ -0,0 +1,53 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#ifndef AUDIO_RING_H
+#define AUDIO_RING_H
+
+#include "common.h"
+#include <atomic>
+
+// Single-producer single-consumer ring of interleaved float frames. Neither side ever blocks.
+// Indices count frames since the ring was created and never wrap.
+struct Audio_Ring {
+	float *samples;
+	// In frames, always a power of two
+	u32 capacity;
+	u32 channels;
+	
+	std::atomic<u64> write_index;
+	std::atomic<u64> read_index;
+	// Frames before this were flushed by the producer and get skipped by the consumer
+	std::atomic<u64> discard_index;
+	
+	// Capacity is rounded up to a power of two
+	void init(u32 min_frames, u32 channels);
+	void free();
+	
+	// Producer side
+	u32 get_free_frames() const;
+	// Count must not be more than get_free_frames()
+	void write(const float *frames, u32 count);
+	// Drop everything that hasn't been read yet
+	void flush();
+	
+	// Consumer side. Returns the number of frames copied. Frames can be NULL if max_count is 0.
+	u32 read(float *frames, u32 max_count);
+	
+	// Frames waiting to be read. Safe from either side.
+	u32 get_fill() const;
+};
+
+#endif //AUDIO_RING_H
@@ -51,6 +51,7 @@ typedef int8_t  s8;
 
 void fatal_error(const char *message, ...);
 void user_warning(const char *message, ...);
+void user_message(const char *message, ...);
 
 enum {
 	LOG_LEVEL_ERROR,
@@ -71,6 +72,7 @@ enum PCM_Type {
 	PCM_TYPE_S24,
 	PCM_TYPE_S16,
 	PCM_TYPE_F32,
+	PCM_TYPE_S32,
 };
 
 struct PCM_Format {
@@ -132,6 +134,61 @@ struct Track_Array {
 	void free();
 };
 
+// Open-addressed set of track IDs for bulk membership tests
+struct Track_Id_Set {
+	u32 *ids;
+	u8 *used;
+	u32 capacity;
+	u32 count;
+	
+	void reserve(u32 count);
+	// Returns true if the ID wasn't already in the set
+	bool add(u32 id);
+	bool contains(u32 id) const;
+	void remove(u32 id);
+	void reset();
+	void free();
+};
+
+enum Query_Field {
+	// Artist, title or path
+	QUERY_FIELD_ANY,
+	QUERY_FIELD_ARTIST,
+	QUERY_FIELD_TITLE,
+	QUERY_FIELD_ALBUM,
+	QUERY_FIELD_PATH,
+};
+
+#define QUERY_MAX_TERMS 16
+
+struct Query_Term {
+	u8 field;
+	bool negate;
+	// Match the whole value instead of a substring
+	bool exact;
+	u8 needle_length;
+	// Lowercased at compile time
+	char needle[60];
+};
+
+// A query like: artist:"the beatles" -title:live album=abbey
+// Every term must match. Compiled once and then evaluated per track. A query with no terms matches
+// nothing, so a new or cleared smart playlist is empty rather than the whole library.
+struct Track_Query {
+	char text[256];
+	Query_Term terms[QUERY_MAX_TERMS];
+	u32 term_count;
+	// The text didn't compile. It is kept so it can be fixed, and nothing matches until it is.
+	bool invalid;
+};
+
+// Returns false and leaves out as it was if the text isn't a valid query
+bool compile_track_query(const char *text, Track_Query *out);
+// For text that was valid once, like a saved query that this version can't read. Compiles it, or keeps
+// the text in an invalid query. Returns false if it is invalid.
+bool load_track_query(const char *text, Track_Query *out);
+bool track_matches_query(const Track_Query *query, const Track_Info *track);
+
 struct Playlist {
 	// Keep a separate array for all ids because invalid ids are stil allowed in the playlist
 	Large_Auto_Array<u32> track_ids;
@@ -139,24 +196,63 @@ struct Playlist {
 	Track_Array tracks;
 	char name[64];
 	
+	// Smart playlists are defined by a query. Their track IDs are maintained from the library
+	// and aren't saved.
+	bool is_smart;
+	Track_Query query;
+	Track_Id_Set smart_members;
+	
 	// Update tracks after a library scan
 	void update_tracks();
 	u32 get_id();
 	bool has_track(u32 id);
 	void add_track(const Track_Info *track);
+	// Add every track in the array that isn't already in the playlist
+	void add_tracks(const Track_Array *tracks);
 	void remove(u32 index);
+	// Remove every track whose ID is in the set
+	void remove_ids(const Track_Id_Set *ids);
 	void remove_range(u32 start, u32 end);
 	void save_to_file();
 	void free();
 };
 
+struct Playlist_Rebind_Report {
+	// Tracks that resolved before the rebind and no longer exist in the library
+	u32 missing;
+	// Tracks that were missing before the rebind and are back in the library
+	u32 reappeared;
+	u32 playlists_changed;
+};
+
 // Delete playlist file
 void delete_playlist(Playlist *playlist);
+// Re-resolve every playlist against the current library in one parallel pass.
+// The report is optional.
+void rebind_playlists(Playlist *playlists, u32 count, Playlist_Rebind_Report *report);
+// Rebuild the membership of every smart playlist from the whole library in a single pass
+void evaluate_smart_playlists(Playlist *playlists, u32 count);
+// Re-evaluate only the given tracks against every smart playlist. IDs that are no longer in the
+// library are removed. Call rebind_playlists() afterwards to refresh the track views.
+void update_smart_playlists(Playlist *playlists, u32 count, const u32 *changed_ids, u32 changed_count);
+
+struct Playlist_Import_Report {
+	u32 entries;
+	u32 resolved;
+	u32 unresolved;
+	u32 duplicates;
+};
+
+// Import an .m3u, .m3u8 or .pls file into an empty playlist. Entries that aren't in the library
+// are skipped and counted in the report. The playlist is named after the file but not saved.
+bool import_playlist(const wchar_t *path, Playlist *playlist, Playlist_Import_Report *report);
+// Export to .m3u, .m3u8 or .pls depending on the file extension
+bool export_playlist(const Playlist *playlist, const wchar_t *path);
 
-extern template Large_Auto_Array<Track_Info>;
-extern template Large_Auto_Array<u32>;
-extern template Large_Auto_Array<char>;
-extern template Large_Auto_Array<Playlist>;
+extern template struct Large_Auto_Array<Track_Info>;
+extern template struct Large_Auto_Array<u32>;
+extern template struct Large_Auto_Array<char>;
+extern template struct Large_Auto_Array<Playlist>;
 
 void load_playlists(Large_Auto_Array<Playlist> *out);
 
@@ -0,0 +1,207 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+// A level with blocks of B frames runs every B frames of input. It transforms the last 2B frames,
+// multiplies the spectra of its last few blocks with its partitions of the impulse response, and
+// the second half of the inverse transform is B frames of output. Those frames start B frames back,
+// plus the level's offset into the impulse response. Output only goes out CONVOLVER_BLOCK_FRAMES
+// after it came in, so a level can start as early as B - CONVOLVER_BLOCK_FRAMES into the impulse
+// response, and everything before that is left to the levels with shorter blocks.
+//
+// The levels all run on the block that completes them, so every so often one call does a lot more
+// work than usual. The device queue is much longer than that takes.
+#include "convolver.h"
+#include <stdlib.h>
+#include <string.h>
+
+void Impulse_Response::free() {
+	::free(this->frames);
+	this->frames = NULL;
+	this->frame_count = 0;
+}
+
+static void init_level(Convolver_Level *level, const Impulse_Response *impulse_response, float *scratch) {
+	const u32 fft_size = level->block_frames * 2;
+	const u32 partition_count = level->partition_count;
+	// The inverse transform scales up by block_frames, which is taken back out here once
+	const float scale = 1.f / level->block_frames;
+	
+	level->fft.init(fft_size);
+	level->filter = (float*)malloc(partition_count * 2 * fft_size * sizeof(float));
+	level->input_spectra = (float*)calloc(partition_count * 2 * fft_size, sizeof(float));
+	level->spectrum_index = 0;
+	
+	for (u32 c = 0; c < 2; ++c) {
+		for (u32 p = 0; p < partition_count; ++p) {
+			u32 start = level->offset + p * level->block_frames;
+			u32 count = MIN(level->block_frames, impulse_response->frame_count - MIN(start, impulse_response->frame_count));
+			
+			memset(scratch, 0, fft_size * sizeof(float));
+			for (u32 i = 0; i < count; ++i) scratch[i] = impulse_response->frames[(start + i) * 2 + c] * scale;
+			level->fft.forward(scratch, &level->filter[(c * partition_count + p) * fft_size]);
+		}
+	}
+}
+
+bool Convolver::init(const Impulse_Response *impulse_response) {
+	const u32 frame_count = impulse_response->frame_count;
+	u32 block_frames = CONVOLVER_BLOCK_FRAMES;
+	u32 offset = 0;
+	
+	memset(this, 0, sizeof(Convolver));
+	if (!frame_count || frame_count > CONVOLVER_MAX_FRAMES) return false;
+	this->frame_count = frame_count;
+	this->sample_rate = impulse_response->sample_rate;
+	
+	// Each level takes up to where the next one can start, and the last one takes the rest
+	while (1) {
+		Convolver_Level *level = &this->levels[this->level_count++];
+		u32 next_block_frames = MIN(block_frames * CONVOLVER_LEVEL_GROWTH, CONVOLVER_MAX_BLOCK_FRAMES);
+		u32 next_offset = next_block_frames - CONVOLVER_BLOCK_FRAMES;
+		bool last = block_frames == CONVOLVER_MAX_BLOCK_FRAMES || next_offset >= frame_count ||
+			this->level_count == CONVOLVER_MAX_LEVELS;
+		
+		level->block_frames = block_frames;
+		level->offset = offset;
+		level->partition_count = last ? (frame_count - offset + block_frames - 1) / block_frames :
+			(next_offset - offset) / block_frames;
+		
+		if (last) break;
+		block_frames = next_block_frames;
+		offset = next_offset;
+	}
+	
+	// The rings have to hold two of the biggest blocks
+	const u32 biggest_block = this->levels[this->level_count - 1].block_frames;
+	this->history_frames = biggest_block * 2;
+	this->output_frames = biggest_block * 2;
+	this->history = (float*)calloc(this->history_frames * 2, sizeof(float));
+	this->output = (float*)calloc(this->output_frames * 2, sizeof(float));
+	this->scratch = (float*)malloc(biggest_block * 4 * sizeof(float));
+	this->position = 0;
+	
+	for (u32 i = 0; i < this->level_count; ++i) init_level(&this->levels[i], impulse_response, this->scratch);
+	
+	log_debug("Convolver: %u frames in %u levels, up to %u frame blocks (%s)\n", frame_count, this->level_count,
+			  biggest_block, get_fft_kernel_name());
+	return true;
+}
+
+void Convolver::reset() {
+	memset(this->history, 0, this->history_frames * 2 * sizeof(float));
+	memset(this->output, 0, this->output_frames * 2 * sizeof(float));
+	
+	for (u32 i = 0; i < this->level_count; ++i) {
+		Convolver_Level *level = &this->levels[i];
+		memset(level->input_spectra, 0, level->partition_count * 2 * level->fft.size * sizeof(float));
+		level->spectrum_index = 0;
+	}
+	
+	this->position = 0;
+}
+
+// Runs every level that has a whole block, now that the input is up to position
+static void process_levels(Convolver *convolver) {
+	const u64 end = convolver->position;
+	const u32 history_mask = convolver->history_frames - 1;
+	const u32 output_mask = convolver->output_frames - 1;
+	
+	for (u32 i = 0; i < convolver->level_count; ++i) {
+		Convolver_Level *level = &convolver->levels[i];
+		const u32 block_frames = level->block_frames;
+		const u32 fft_size = block_frames * 2;
+		const u32 partition_count = level->partition_count;
+		float *time = convolver->scratch;
+		float *spectrum = &convolver->scratch[fft_size];
+		
+		if (end % block_frames) continue;
+		
+		for (u32 c = 0; c < 2; ++c) {
+			const float *history = &convolver->history[c * convolver->history_frames];
+			float *output = &convolver->output[c * convolver->output_frames];
+			float *input_spectra = &level->input_spectra[c * partition_count * fft_size];
+			const float *filter = &level->filter[c * partition_count * fft_size];
+			
+			// The last two blocks of input. Before there were two, the ring is still silent where it wraps.
+			u32 start = (u32)(end - fft_size) & history_mask;
+			u32 first_count = MIN(fft_size, convolver->history_frames - start);
+			memcpy(time, &history[start], first_count * sizeof(float));
+			memcpy(&time[first_count], history, (fft_size - first_count) * sizeof(float));
+			level->fft.forward(time, &input_spectra[level->spectrum_index * fft_size]);
+			
+			// The newest block goes with the first partition, the one before with the second and so on
+			memset(spectrum, 0, fft_size * sizeof(float));
+			for (u32 p = 0; p < partition_count; ++p) {
+				u32 slot = level->spectrum_index >= p ? level->spectrum_index - p : level->spectrum_index + partition_count - p;
+				fft_multiply_accumulate(&level->fft, &input_spectra[slot * fft_size], &filter[p * fft_size], spectrum);
+			}
+			
+			level->fft.inverse(spectrum, time);
+			
+			u32 output_start = (u32)(end - block_frames + level->offset) & output_mask;
+			u32 output_count = MIN(block_frames, convolver->output_frames - output_start);
+			for (u32 j = 0; j < output_count; ++j) output[output_start + j] += time[block_frames + j];
+			for (u32 j = output_count; j < block_frames; ++j) output[j - output_count] += time[block_frames + j];
+		}
+		
+		level->spectrum_index = level->spectrum_index + 1 == partition_count ? 0 : level->spectrum_index + 1;
+	}
+}
+
+void Convolver::process(float *frames, u32 frame_count) {
+	const u32 history_mask = this->history_frames - 1;
+	const u32 output_mask = this->output_frames - 1;
+	float *history_left = this->history;
+	float *history_right = &this->history[this->history_frames];
+	float *output_left = this->output;
+	float *output_right = &this->output[this->output_frames];
+	
+	for (u32 i = 0; i < frame_count;) {
+		// Up to the end of the block. Both rings are whole blocks long, so this never wraps.
+		u32 block_used = (u32)(this->position % CONVOLVER_BLOCK_FRAMES);
+		u32 count = MIN(frame_count - i, CONVOLVER_BLOCK_FRAMES - block_used);
+		u32 in = (u32)this->position & history_mask;
+		u32 out = (u32)(this->position - CONVOLVER_BLOCK_FRAMES) & output_mask;
+		float *block = &frames[i * 2];
+		
+		for (u32 j = 0; j < count; ++j) {
+			history_left[in + j] = block[j*2+0];
+			history_right[in + j] = block[j*2+1];
+			block[j*2+0] = output_left[out + j];
+			block[j*2+1] = output_right[out + j];
+			// Ready to be added to for its next time around the ring
+			output_left[out + j] = 0.f;
+			output_right[out + j] = 0.f;
+		}
+		
+		i += count;
+		this->position += count;
+		if (this->position % CONVOLVER_BLOCK_FRAMES == 0) process_levels(this);
+	}
+}
+
+void Convolver::free() {
+	for (u32 i = 0; i < this->level_count; ++i) {
+		Convolver_Level *level = &this->levels[i];
+		level->fft.free();
+		::free(level->filter);
+		::free(level->input_spectra);
+	}
+	
+	::free(this->history);
+	::free(this->output);
+	::free(this->scratch);
+	memset(this, 0, sizeof(Convolver));
+}
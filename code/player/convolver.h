@@ -0,0 +1,91 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#ifndef CONVOLVER_H
+#define CONVOLVER_H
+
+#include "common.h"
+#include "fft.h"
+
+// Convolves interleaved stereo floats with a long impulse response, such as a room correction filter,
+// one per channel. The impulse response is cut into partitions that get longer further into it, so the
+// start is handled in short blocks for low latency and the long tail in a few big ones. Every
+// partition is convolved by uniformly partitioned overlap-save in the frequency domain.
+
+// Size of the shortest partitions, which is how far the output is behind the input
+#define CONVOLVER_BLOCK_FRAMES 256
+#define CONVOLVER_MAX_BLOCK_FRAMES 8192
+// Each level's partitions are this many times longer than the level before
+#define CONVOLVER_LEVEL_GROWTH 4
+#define CONVOLVER_MAX_LEVELS 8
+// About 11 seconds at 96kHz
+#define CONVOLVER_MAX_FRAMES (1 << 20)
+
+// Interleaved stereo at the rate it is going to be used at
+struct Impulse_Response {
+	float *frames;
+	u32 frame_count;
+	u32 sample_rate;
+	
+	void free();
+};
+
+// Decodes an impulse response from any file the player can decode, resampled to sample_rate.
+// Mono files are used on both channels. Lives in impulse_response.cpp, since it needs the decoders.
+bool load_impulse_response(const wchar_t *path, u32 sample_rate, Impulse_Response *out);
+
+// Partitions of one size, covering a stretch of the impulse response
+struct Convolver_Level {
+	u32 block_frames;
+	// Where the first partition starts in the impulse response
+	u32 offset;
+	u32 partition_count;
+	Fft fft;
+	// partition_count spectra of the impulse response for each channel
+	float *filter;
+	// The input spectra of the last partition_count blocks for each channel, used as a ring.
+	// The newest is at spectrum_index.
+	float *input_spectra;
+	u32 spectrum_index;
+};
+
+// Nothing after init() allocates
+struct Convolver {
+	u32 frame_count;
+	// Only right for audio at the rate the impulse response was loaded at
+	u32 sample_rate;
+	Convolver_Level levels[CONVOLVER_MAX_LEVELS];
+	u32 level_count;
+	
+	// Planar rings of the input so far and of the output being added up. Their sizes are powers of two.
+	float *history;
+	u32 history_frames;
+	float *output;
+	u32 output_frames;
+	// Frames of input since the last reset
+	u64 position;
+	// Two spectra the size of the biggest level's
+	float *scratch;
+	
+	// Returns false if the impulse response is empty or longer than CONVOLVER_MAX_FRAMES
+	bool init(const Impulse_Response *impulse_response);
+	// Forget all input
+	void reset();
+	// In place. The output is CONVOLVER_BLOCK_FRAMES behind the input.
+	void process(float *frames, u32 frame_count);
+	void free();
+};
+
+#endif //CONVOLVER_H
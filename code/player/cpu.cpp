@@ -0,0 +1,122 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "cpu.h"
+#include <stdio.h>
+#include <string.h>
+
+#if defined(CPU_X86)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <immintrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+static u32 g_detected_features = UINT32_MAX;
+static u32 g_features = UINT32_MAX;
+
+#if defined(CPU_X86)
+static void cpuid(u32 leaf, u32 subleaf, u32 out[4]) {
+#if defined(_MSC_VER)
+	__cpuidex((int*)out, leaf, subleaf);
+#else
+	__cpuid_count(leaf, subleaf, out[0], out[1], out[2], out[3]);
+#endif
+}
+
+static u64 read_xcr0() {
+#if defined(_MSC_VER)
+	return _xgetbv(0);
+#else
+	u32 eax, edx;
+	__asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return ((u64)edx << 32) | eax;
+#endif
+}
+#endif
+
+static u32 detect_cpu_features() {
+	u32 features = 0;
+	
+#if defined(CPU_X86)
+	u32 regs[4];
+	
+	cpuid(0, 0, regs);
+	u32 max_leaf = regs[0];
+	
+	cpuid(1, 0, regs);
+	if (regs[3] & (1<<26)) features |= CPU_FEATURE_SSE2;
+	if (regs[2] & (1<<19)) features |= CPU_FEATURE_SSE41;
+	
+	// AVX needs the OS to save the YMM registers
+	bool os_saves_ymm = (regs[2] & (1<<27)) && ((read_xcr0() & 6) == 6);
+	if (os_saves_ymm) {
+		if (regs[2] & (1<<28)) features |= CPU_FEATURE_AVX;
+		if (regs[2] & (1<<12)) features |= CPU_FEATURE_FMA;
+		
+		if (max_leaf >= 7) {
+			cpuid(7, 0, regs);
+			if (regs[1] & (1<<5)) features |= CPU_FEATURE_AVX2;
+		}
+	}
+#elif defined(CPU_ARM64)
+	// Always there on AArch64
+	features |= CPU_FEATURE_NEON;
+#endif
+	
+	return features;
+}
+
+u32 get_cpu_features() {
+	if (g_detected_features == UINT32_MAX) {
+		g_detected_features = detect_cpu_features();
+		log_info("CPU features: %s\n", get_cpu_feature_string(g_detected_features));
+	}
+	
+	if (g_features == UINT32_MAX) g_features = g_detected_features;
+	return g_features;
+}
+
+void override_cpu_features(u32 features) {
+	if (g_detected_features == UINT32_MAX) get_cpu_features();
+	g_features = features & g_detected_features;
+}
+
+const char *get_cpu_feature_string(u32 features) {
+	static const struct {
+		u32 flag;
+		const char *name;
+	} names[] = {
+		{CPU_FEATURE_SSE2, "SSE2"},
+		{CPU_FEATURE_SSE41, "SSE4.1"},
+		{CPU_FEATURE_AVX, "AVX"},
+		{CPU_FEATURE_AVX2, "AVX2"},
+		{CPU_FEATURE_FMA, "FMA"},
+		{CPU_FEATURE_NEON, "NEON"},
+	};
+	static char buffer[64];
+	
+	buffer[0] = 0;
+	for (u32 i = 0; i < ARRAY_LENGTH(names); ++i) {
+		if (!(features & names[i].flag)) continue;
+		if (buffer[0]) strcat(buffer, " ");
+		strcat(buffer, names[i].name);
+	}
+	
+	if (!buffer[0]) strcpy(buffer, "none");
+	return buffer;
+}
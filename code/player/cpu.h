@@ -0,0 +1,51 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#ifndef CPU_H
+#define CPU_H
+
+#include "common.h"
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(_M_IX86) || defined(__i386__)
+#define CPU_X86 1
+#elif defined(_M_ARM64) || defined(__aarch64__)
+#define CPU_ARM64 1
+#endif
+
+// MSVC lets any function use any intrinsic. GCC and Clang need to be told per function.
+#if defined(CPU_X86) && (defined(__GNUC__) || defined(__clang__))
+#define TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#else
+#define TARGET_AVX2
+#define TARGET_SSE41
+#endif
+
+enum {
+	CPU_FEATURE_SSE2 = 1<<0,
+	CPU_FEATURE_SSE41 = 1<<1,
+	CPU_FEATURE_AVX = 1<<2,
+	CPU_FEATURE_AVX2 = 1<<3,
+	CPU_FEATURE_FMA = 1<<4,
+	CPU_FEATURE_NEON = 1<<5,
+};
+
+// Detected once and cached. Only includes features the OS has enabled.
+u32 get_cpu_features();
+// For benchmarks. Features not supported by the CPU stay off.
+void override_cpu_features(u32 features);
+const char *get_cpu_feature_string(u32 features);
+
+#endif //CPU_H
@@ -0,0 +1,98 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "decoders.h"
+#include <wchar.h>
+
+static const Decoder_Functions g_flac_functions = {
+	&open_flac, &decode_flac, &get_sample_flac, &seek_flac, &close_flac,
+};
+
+static const Decoder_Functions g_mp3_functions = {
+	&open_mp3, &decode_mp3, &get_sample_mp3, &seek_mp3, &close_mp3,
+};
+
+static const Decoder_Functions g_opus_functions = {
+	&open_opus, &decode_opus, &get_sample_opus, &seek_opus, &close_opus,
+};
+
+static const Decoder_Functions g_wav_functions = {
+	&open_wav, &decode_wav, &get_sample_wav, &seek_wav, &close_wav,
+};
+
+const Decoder_Functions *get_decoder_functions(enum Codec codec) {
+	switch (codec) {
+		case CODEC_FLAC: return &g_flac_functions;
+		case CODEC_MP3: return &g_mp3_functions;
+		case CODEC_OPUS: return &g_opus_functions;
+		case CODEC_WAV: return &g_wav_functions;
+		default: return NULL;
+	}
+}
+
+enum Codec find_codec_from_file_name(const wchar_t *path) {
+	wchar_t *extension = wcsrchr((wchar_t*)path, '.');
+	
+	if (!extension) {
+		return CODEC_NONE;
+	}
+	else if (!wcscmp(extension, L".mp3")) {
+		return CODEC_MP3;
+	}
+	else if (!wcscmp(extension, L".opus") || !wcscmp(extension, L".ogg")) {
+		return CODEC_OPUS;
+	}
+	else if (!wcscmp(extension, L".wav")) {
+		return CODEC_WAV;
+	}
+	else if (!wcscmp(extension, L".flac")) {
+		return CODEC_FLAC;
+	}
+	else {
+		return CODEC_NONE;
+	}
+}
+
+bool Decoder::open(const wchar_t *path, float buffer_duration_ms, PCM_Format *format) {
+	DEBUG_ASSERT(!this->stream);
+	
+	this->codec = find_codec_from_file_name(path);
+	this->functions = get_decoder_functions(this->codec);
+	
+	if (!this->functions) {
+		log_error("No decoder for \"%ls\"\n", path);
+		return false;
+	}
+	
+	this->stream = this->functions->open_func(path, buffer_duration_ms, format);
+	return this->stream != NULL;
+}
+
+u32 Decoder::decode(u32 num_frames, float *buffer) {
+	return this->functions->decode_func(this->stream, num_frames, buffer);
+}
+
+u64 Decoder::get_sample() {
+	return this->functions->get_sample_func(this->stream);
+}
+
+bool Decoder::seek(u64 sample) {
+	return this->functions->seek_func(this->stream, sample);
+}
+
+void Decoder::close() {
+	if (this->stream) this->functions->close_func(this->stream);
+	this->stream = NULL;
+}
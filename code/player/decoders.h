@@ -17,17 +17,22 @@
 #define DECODERS_H
 
 #include "common.h"
+#include <stddef.h>
 
-// Return true on success. Needs to write the format to the given pointer
-typedef int Decoder_Open_Function(const wchar_t *path, float buffer_duration_ms, PCM_Format *format);
-// Return false to close the stream
-typedef int Decoder_Decode_Function(u32 num_frames, float *buffer);
+// Each codec keeps all of its state in the stream it returns from open, so any number of streams can be 
+// decoded at once. A stream must only be used by one thread at a time.
+
+// Return the new stream, or NULL on failure. Needs to write the format to the given pointer
+typedef void *Decoder_Open_Function(const wchar_t *path, float buffer_duration_ms, PCM_Format *format);
+// Return the number of stereo frames written. Fewer than asked for means the stream has ended.
+typedef u32 Decoder_Decode_Function(void *stream, u32 num_frames, float *buffer);
 // Get the current sample number
-typedef u64 Decoder_Get_Sample_Function();
-typedef int Decoder_Seek_Function(u64 sample);
-typedef void Decoder_Close_Function();
+typedef u64 Decoder_Get_Sample_Function(void *stream);
+typedef int Decoder_Seek_Function(void *stream, u64 sample);
+// Frees the stream
+typedef void Decoder_Close_Function(void *stream);
 
-struct Decoder {
+struct Decoder_Functions {
 	Decoder_Open_Function *open_func;
 	Decoder_Decode_Function *decode_func;
 	Decoder_Get_Sample_Function *get_sample_func;
@@ -35,28 +40,71 @@ struct Decoder {
 	Decoder_Close_Function *close_func;
 };
 
-int open_opus(const wchar_t *path, float buffer_duration_ms, PCM_Format *format);
-int decode_opus(u32 num_frames, float *buffer);
-int seek_opus(u64 sample);
-u64 get_sample_opus();
-void close_opus();
-
-int open_mp3(const wchar_t *path, float buffer_duration_ms, PCM_Format *format);
-int decode_mp3(u32 num_frames, float *buffer);
-int seek_mp3(u64 sample);
-u64 get_sample_mp3();
-void close_mp3();
-
-int open_flac(const wchar_t *path, float buffer_duration_ms, PCM_Format *format);
-int decode_flac(u32 num_frames, float *buffer);
-int seek_flac(u64 sample);
-u64 get_sample_flac();
-void close_flac();
-
-int open_wav(const wchar_t *path, float buffer_duration_ms, PCM_Format *format);
-int decode_wav(u32 num_frames, float *buffer);
-int seek_wav(u64 sample);
-u64 get_sample_wav();
-void close_wav();
+// An open stream of any codec. Zero initialized means closed.
+struct Decoder {
+	const Decoder_Functions *functions;
+	void *stream;
+	enum Codec codec;
+	
+	// Picks the codec from the file extension
+	bool open(const wchar_t *path, float buffer_duration_ms, PCM_Format *format);
+	u32 decode(u32 num_frames, float *buffer);
+	u64 get_sample();
+	bool seek(u64 sample);
+	// Safe to call on a closed decoder
+	void close();
+	bool is_open() const {return this->stream != NULL;}
+};
+
+// Where decoders keep the seek indexes they build, so a track only has to be scanned once
+#define SEEK_INDEX_DIRECTORY "../Seek_Index"
+
+// NULL if the codec can't be decoded
+const Decoder_Functions *get_decoder_functions(enum Codec codec);
+
+void *open_opus(const wchar_t *path, float buffer_duration_ms, PCM_Format *format);
+u32 decode_opus(void *stream, u32 num_frames, float *buffer);
+int seek_opus(void *stream, u64 sample);
+u64 get_sample_opus(void *stream);
+void close_opus(void *stream);
+
+void *open_mp3(const wchar_t *path, float buffer_duration_ms, PCM_Format *format);
+u32 decode_mp3(void *stream, u32 num_frames, float *buffer);
+int seek_mp3(void *stream, u64 sample);
+u64 get_sample_mp3(void *stream);
+void close_mp3(void *stream);
+
+void *open_flac(const wchar_t *path, float buffer_duration_ms, PCM_Format *format);
+u32 decode_flac(void *stream, u32 num_frames, float *buffer);
+int seek_flac(void *stream, u64 sample);
+u64 get_sample_flac(void *stream);
+void close_flac(void *stream);
+// Decodes the whole file and checks it against the MD5 signature in its header. Playback doesn't do this.
+bool verify_flac(const wchar_t *path);
+
+// Gets blocks of interleaved stereo from any of the worker threads, in no particular order.
+// first_frame is where the block goes in the track, so blocks can be written into one shared buffer.
+typedef void Flac_Block_Callback(void *user_data, u64 first_frame, u32 frame_count, const float *samples);
+
+struct Flac_Parallel_Stats {
+	u64 total_frames;
+	u32 sample_rate;
+	u32 thread_count;
+	u32 chunk_count;
+	// Frames that failed their CRC or couldn't be decoded. Their samples are missing from the output.
+	u32 error_count;
+	bool used_seek_table;
+};
+
+// Decodes a whole FLAC file on thread_count threads, or one per core if 0, by cutting it up at frame 
+// boundaries. For analysis, verification and transcoding, not playback.
+bool decode_flac_parallel(const wchar_t *path, u32 thread_count, Flac_Block_Callback *callback, void *user_data, 
+						  Flac_Parallel_Stats *stats);
+
+void *open_wav(const wchar_t *path, float buffer_duration_ms, PCM_Format *format);
+u32 decode_wav(void *stream, u32 num_frames, float *buffer);
+int seek_wav(void *stream, u64 sample);
+u64 get_sample_wav(void *stream);
+void close_wav(void *stream);
 
 #endif //DECODERS_H
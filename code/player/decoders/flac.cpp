@@ -14,50 +14,260 @@
    limitations under the License.
 */
 #include <assert.h>
+#include <atomic>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <wctype.h>
+#include <sys/stat.h>
 #include <FLAC/stream_decoder.h>
+#include <xxhash.h>
 #include "../decoders.h"
+#include "../pcm.h"
+#include "../platform.h"
 
-static struct Flac_Stream {
+// Seeking goes through a per-track index of frame offsets instead of libFLAC's search, which has to
+// bisect the file when there is no SEEKTABLE. The index is filled in while a track plays from the
+// start and saved to ../Seek_Index when the stream is closed, so it picks up where it left off next
+// time and every seek in the part that has been played is a single file seek.
+
+#define FLAC_INDEX_MAGIC 0x58494656 // "VFIX"
+#define FLAC_INDEX_VERSION 1
+// Seeks decode and throw away up to this much audio after the point they land on
+#define FLAC_INDEX_SPACING_MS 500
+// The largest block the format allows, for streams whose STREAMINFO doesn't say
+#define FLAC_MAX_BLOCK_SIZE 65535
+#define FLAC_MAX_CHANNELS 8
+
+// Left and right gains for each channel when mixing down to stereo, in FLAC's channel order. The LFE
+// channel is dropped. Each side is normalized by the sum of its gains, so nothing can clip.
+static const float g_downmix_gains[FLAC_MAX_CHANNELS+1][FLAC_MAX_CHANNELS][2] = {
+	{}, {}, {},
+	// L R C
+	{{1.f, 0.f}, {0.f, 1.f}, {0.7071f, 0.7071f}},
+	// FL FR BL BR
+	{{1.f, 0.f}, {0.f, 1.f}, {0.7071f, 0.f}, {0.f, 0.7071f}},
+	// FL FR FC BL BR
+	{{1.f, 0.f}, {0.f, 1.f}, {0.7071f, 0.7071f}, {0.7071f, 0.f}, {0.f, 0.7071f}},
+	// FL FR FC LFE BL BR
+	{{1.f, 0.f}, {0.f, 1.f}, {0.7071f, 0.7071f}, {0.f, 0.f}, {0.7071f, 0.f}, {0.f, 0.7071f}},
+	// FL FR FC LFE BC SL SR
+	{{1.f, 0.f}, {0.f, 1.f}, {0.7071f, 0.7071f}, {0.f, 0.f}, {0.5f, 0.5f}, {0.7071f, 0.f}, {0.f, 0.7071f}},
+	// FL FR FC LFE BL BR SL SR
+	{{1.f, 0.f}, {0.f, 1.f}, {0.7071f, 0.7071f}, {0.f, 0.f}, {0.7071f, 0.f}, {0.f, 0.7071f}, {0.7071f, 0.f}, {0.f, 0.7071f}},
+};
+
+struct Flac_Index_Point {
+	u64 frame;
+	u64 offset;
+};
+
+struct Flac_Index_Header {
+	u32 magic;
+	u32 version;
+	// The index is thrown away if the file has changed since
+	u64 file_size;
+	u64 write_time;
+	u64 total_frames;
+	// Frames from the start that the points cover
+	u64 indexed_frames;
+	u32 point_count;
+	u32 reserved;
+};
+
+struct Flac_Stream {
 	FLAC__StreamDecoder *decoder;
+	// Owned by the decoder, but seeking with the index moves it directly
+	FILE *file;
+	// Only set while opening, for the metadata callback
+	PCM_Format *format;
+	// The caller's buffer during decode_flac(). Blocks are converted straight into it.
 	float *buffer;
-	float *overflow_buffer;
-	u32 overflow_position;
-	u32 overflow_size;
+	u32 buffer_frames;
 	u32 buffer_position;
-	u32 buffer_size;
-	u32 current_sample;
-} g_flac;
+	// The rest of the last block if it didn't fit, as stereo. Big enough for any block, so nothing
+	// is ever dropped, and only refilled once it has been used up.
+	float *block;
+	u32 block_capacity;
+	u32 block_frames;
+	u32 block_position;
+	u64 current_sample;
+	u32 max_block_size;
+	u32 sample_rate;
+	u64 total_frames;
+	// Frames before this are dropped after seeking with the index
+	u64 skip_until_frame;
+	
+	Flac_Index_Point *index;
+	u32 index_count;
+	u32 index_capacity;
+	u32 index_spacing;
+	u64 indexed_frames;
+	// Where the frame after the last one decoded starts, or 0 if that isn't known after a seek
+	u64 next_frame_offset;
+	u64 file_size;
+	u64 write_time;
+	char index_path[64];
+	bool index_dirty;
+};
+
+static void get_index_path(const wchar_t *path, char *out, u32 out_max) {
+	wchar_t lower[512];
+	u32 length = 0;
+	
+	// Paths are case insensitive on Windows
+	for (; path[length] && length < ARRAY_LENGTH(lower); ++length) lower[length] = towlower(path[length]);
+	
+	u64 hash = XXH64(lower, length * sizeof(wchar_t), 0);
+	snprintf(out, out_max, SEEK_INDEX_DIRECTORY "/%016llx", (unsigned long long)hash);
+}
+
+static void load_index(Flac_Stream *stream) {
+	Flac_Index_Header header;
+	FILE *file = fopen(stream->index_path, "rb");
+	
+	if (!file) return;
+	
+	if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != FLAC_INDEX_MAGIC || 
+		header.version != FLAC_INDEX_VERSION || header.file_size != stream->file_size || 
+		header.write_time != stream->write_time || header.total_frames != stream->total_frames || 
+		header.point_count > stream->index_capacity) {
+		fclose(file);
+		return;
+	}
+	
+	if (fread(stream->index, sizeof(Flac_Index_Point), header.point_count, file) == header.point_count) {
+		stream->index_count = header.point_count;
+		stream->indexed_frames = header.indexed_frames;
+	}
+	
+	fclose(file);
+}
+
+static void save_index(Flac_Stream *stream) {
+	Flac_Index_Header header = {};
+	
+	_mkdir(SEEK_INDEX_DIRECTORY);
+	
+	FILE *file = fopen(stream->index_path, "wb");
+	if (!file) {
+		log_warning("Failed to save FLAC seek index\n");
+		return;
+	}
+	
+	header.magic = FLAC_INDEX_MAGIC;
+	header.version = FLAC_INDEX_VERSION;
+	header.file_size = stream->file_size;
+	header.write_time = stream->write_time;
+	header.total_frames = stream->total_frames;
+	header.indexed_frames = stream->indexed_frames;
+	header.point_count = stream->index_count;
+	
+	// A file cut short by a crash has fewer points than the header says, so it is ignored on load
+	fwrite(&header, sizeof(header), 1, file);
+	fwrite(stream->index, sizeof(Flac_Index_Point), stream->index_count, file);
+	fclose(file);
+}
+
+// Extend the index if this frame carries on from the part that is already covered
+static void update_index(Flac_Stream *stream, const FLAC__StreamDecoder *decoder, const FLAC__Frame *frame) {
+	u64 first_frame = frame->header.number.sample_number;
+	u64 frame_offset = stream->next_frame_offset;
+	
+	// Once the frame has been read this is where the next one starts
+	if (!FLAC__stream_decoder_get_decode_position(decoder, &stream->next_frame_offset)) stream->next_frame_offset = 0;
+	
+	if (!stream->index_capacity || !frame_offset || first_frame != stream->indexed_frames) return;
+	
+	const Flac_Index_Point *last = stream->index_count ? &stream->index[stream->index_count-1] : NULL;
+	
+	if ((!last || first_frame >= last->frame + stream->index_spacing) && stream->index_count < stream->index_capacity) {
+		Flac_Index_Point *point = &stream->index[stream->index_count++];
+		point->frame = first_frame;
+		point->offset = frame_offset;
+	}
+	
+	stream->indexed_frames += frame->header.blocksize;
+	stream->index_dirty = true;
+}
+
+static void downmix_to_stereo(const FLAC__int32 *const channels[], u32 channel_count, u32 first, u32 count, 
+							  u32 bits_per_sample, float *out) {
+	const float (*gains)[2] = g_downmix_gains[channel_count];
+	float left_total = 0.f, right_total = 0.f;
+	
+	for (u32 c = 0; c < channel_count; ++c) {
+		left_total += gains[c][0];
+		right_total += gains[c][1];
+	}
+	
+	float scale = 1.f / (float)(1ull << (bits_per_sample - 1));
+	float left_scale = scale / left_total;
+	float right_scale = scale / right_total;
+	
+	for (u32 i = first; i < first + count; ++i) {
+		float left = 0.f, right = 0.f;
+		for (u32 c = 0; c < channel_count; ++c) {
+			float sample = (float)channels[c][i];
+			left += sample * gains[c][0];
+			right += sample * gains[c][1];
+		}
+		*out++ = left * left_scale;
+		*out++ = right * right_scale;
+	}
+}
+
+// Convert frames [first, first+count) of a block to interleaved stereo
+static void convert_block(const FLAC__Frame *frame, const FLAC__int32 *const channels[], u32 first, u32 count, float *out) {
+	u32 channel_count = frame->header.channels;
+	u32 bits_per_sample = frame->header.bits_per_sample;
+	
+	if (!count) return;
+	
+	if (channel_count <= 2) {
+		const s32 *left = &channels[0][first];
+		const s32 *right = channel_count == 2 ? &channels[1][first] : left;
+		pcm_planar_s32_to_f32(left, right, out, count, bits_per_sample);
+	}
+	else {
+		downmix_to_stereo(channels, channel_count, first, count, bits_per_sample, out);
+	}
+}
 
 static FLAC__StreamDecoderWriteStatus write_callback(const FLAC__StreamDecoder *decoder, 
 														  const FLAC__Frame *frame, const FLAC__int32 *const buffer[], 
 														  void *client_data) {
 	Flac_Stream *stream = (Flac_Stream*)client_data;
 	
-	u32 bits_per_sample = FLAC__stream_decoder_get_bits_per_sample(g_flac.decoder);
-	s32 sample_max = 0;
-	for (u32 i = 0; i < bits_per_sample; ++i) sample_max |= 1<<i;
-	
-	sample_max /= 2;
+	update_index(stream, decoder, frame);
 	
-	bool fill_overflow = false;
-	u32 i = 0;
+	u32 block_size = frame->header.blocksize;
+	u64 first_frame = frame->header.number.sample_number;
+	u32 skip = 0;
 	
-	for (; (i < frame->header.blocksize) && !fill_overflow; ++i) {
-		g_flac.buffer[g_flac.buffer_position+0] = (double)buffer[0][i] / (double)sample_max;
-		g_flac.buffer[g_flac.buffer_position+1] = (double)buffer[1][i] / (double)sample_max;
-		
-		g_flac.buffer_position += 2;
-		
-		if (g_flac.buffer_position >= g_flac.buffer_size) fill_overflow = true;
+	if (frame->header.channels > FLAC_MAX_CHANNELS || block_size > stream->block_capacity) {
+		log_error("FLAC frame with %u channels and %u samples can't be decoded\n", frame->header.channels, block_size);
+		return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
 	}
 	
-	for (; (i < frame->header.blocksize) && (g_flac.overflow_position < g_flac.overflow_size); ++i) {
-		g_flac.overflow_buffer[g_flac.overflow_position+0] = (double)buffer[0][i] / (double)sample_max;
-		g_flac.overflow_buffer[g_flac.overflow_position+1] = (double)buffer[1][i] / (double)sample_max;
-		g_flac.overflow_position += 2;
+	// Seeking with the index lands on the frame before the target
+	if (stream->skip_until_frame > first_frame) {
+		skip = (u32)MIN(stream->skip_until_frame - first_frame, (u64)block_size);
 	}
 	
+	u32 frame_count = block_size - skip;
+	u32 direct_frames = MIN(frame_count, stream->buffer_frames - stream->buffer_position);
+	
+	convert_block(frame, buffer, skip, direct_frames, &stream->buffer[stream->buffer_position * 2]);
+	stream->buffer_position += direct_frames;
+	
+	// Only called once the last block has been used up, so this can't overwrite anything
+	DEBUG_ASSERT(stream->block_position == stream->block_frames);
+	convert_block(frame, buffer, skip + direct_frames, frame_count - direct_frames, stream->block);
+	stream->block_frames = frame_count - direct_frames;
+	stream->block_position = 0;
+	
 	return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
 }
 
@@ -69,72 +279,631 @@ static void error_callback(const FLAC__StreamDecoder *decoder,
 
 static void metadata_callback(const FLAC__StreamDecoder *decoder, const FLAC__StreamMetadata *metadata, 
 								   void *client_data) {
-	PCM_Format *format = (PCM_Format*)client_data;
+	Flac_Stream *stream = (Flac_Stream*)client_data;
+	PCM_Format *format = stream->format;
 	
-	if(metadata->type == FLAC__METADATA_TYPE_STREAMINFO) {
-		format->total_samples = metadata->data.stream_info.total_samples;
+	if(metadata->type == FLAC__METADATA_TYPE_STREAMINFO && format) {
+		// Interleaved, like the other codecs
+		format->total_samples = metadata->data.stream_info.total_samples * 2;
 		format->sample_rate = metadata->data.stream_info.sample_rate;
+		// The smallest type that holds every bit, which is what the player can play out exactly
+		u32 bits_per_sample = metadata->data.stream_info.bits_per_sample;
+		format->sample_type = bits_per_sample <= 16 ? PCM_TYPE_S16 : bits_per_sample <= 24 ? PCM_TYPE_S24 : PCM_TYPE_S32;
+		format->sample_size = bits_per_sample <= 16 ? 2 : bits_per_sample <= 24 ? 3 : 4;
+		stream->max_block_size = metadata->data.stream_info.max_blocksize;
+		stream->sample_rate = format->sample_rate;
+		stream->total_frames = metadata->data.stream_info.total_samples;
 		
 		log_debug("Sample rate: %u Hz\n", format->sample_rate);
 		log_debug("Total samples: %u\n", format->total_samples);
 	}
 }
 
-int open_flac(const wchar_t *path, float buffer_duration_ms, PCM_Format *format) {
+void *open_flac(const wchar_t *path, float buffer_duration_ms, PCM_Format *format) {
 	FLAC__StreamDecoderInitStatus status;
 	FILE *file = _wfopen(path, L"rb");
+	struct _stat64 file_info;
 	
-	g_flac.decoder = FLAC__stream_decoder_new();
-	g_flac.buffer = NULL;
-	g_flac.current_sample = 0;
-	g_flac.overflow_position = 0;
+	if (!file) {
+		log_error("Failed to open FLAC stream \"%ls\"\n", path);
+		return NULL;
+	}
+	
+	Flac_Stream *stream = (Flac_Stream*)calloc(1, sizeof(Flac_Stream));
+	stream->decoder = FLAC__stream_decoder_new();
+	stream->file = file;
+	stream->format = format;
+	
+	if (!_fstat64(_fileno(file), &file_info)) {
+		stream->file_size = file_info.st_size;
+		stream->write_time = file_info.st_mtime;
+	}
 	
-	FLAC__stream_decoder_set_md5_checking(g_flac.decoder, true);
-	status = FLAC__stream_decoder_init_FILE(g_flac.decoder, file, &write_callback, 
+	// MD5 checking costs time on every frame and can only fail once the whole track has played, 
+	// so it's left to verify_flac()
+	status = FLAC__stream_decoder_init_FILE(stream->decoder, file, &write_callback, 
 											&metadata_callback, 
-											&error_callback, format);
-	if (status != FLAC__STREAM_DECODER_INIT_STATUS_OK) return false;
+											&error_callback, stream);
+	if (status != FLAC__STREAM_DECODER_INIT_STATUS_OK) {
+		log_error("Failed to open FLAC stream \"%ls\": %s\n", path, FLAC__StreamDecoderInitStatusString[status]);
+		// The decoder only owns the file once init succeeds
+		fclose(file);
+		FLAC__stream_decoder_delete(stream->decoder);
+		free(stream);
+		return NULL;
+	}
+	
+	FLAC__stream_decoder_process_until_end_of_metadata(stream->decoder);
+	stream->format = NULL;
+	
+	// Sized here so decoding never allocates
+	stream->block_capacity = stream->max_block_size ? stream->max_block_size : FLAC_MAX_BLOCK_SIZE;
+	stream->block = (float*)malloc(stream->block_capacity * 2 * sizeof(float));
 	
-	FLAC__stream_decoder_process_until_end_of_metadata(g_flac.decoder);
+	// Streams that don't say how long they are don't get an index
+	stream->index_spacing = MAX(stream->sample_rate * FLAC_INDEX_SPACING_MS / 1000, 1u);
+	if (stream->total_frames) {
+		stream->index_capacity = (u32)(stream->total_frames / stream->index_spacing) + 2;
+		stream->index = (Flac_Index_Point*)malloc(stream->index_capacity * sizeof(Flac_Index_Point));
+		get_index_path(path, stream->index_path, sizeof(stream->index_path));
+		load_index(stream);
+		if (stream->index_count) log_debug("Loaded FLAC seek index with %u points\n", stream->index_count);
+	}
+	
+	// The first frame starts right after the metadata
+	if (!FLAC__stream_decoder_get_decode_position(stream->decoder, &stream->next_frame_offset)) {
+		stream->next_frame_offset = 0;
+	}
 	
-	g_flac.overflow_size = (buffer_duration_ms / 1000.f) * format->sample_rate;
-	g_flac.overflow_buffer = (float*)malloc(g_flac.overflow_size * sizeof(float) * 2);
+	return stream;
+}
+
+u32 decode_flac(void *stream_data, u32 num_frames, float *buffer) {
+	Flac_Stream *stream = (Flac_Stream*)stream_data;
+	
+	// Use up what the last block left over first
+	u32 leftover = MIN(stream->block_frames - stream->block_position, num_frames);
+	memcpy(buffer, &stream->block[stream->block_position * 2], leftover * 2 * sizeof(float));
+	stream->block_position += leftover;
+	
+	stream->buffer = buffer;
+	stream->buffer_frames = num_frames;
+	stream->buffer_position = leftover;
+	
+	// The write callback fills the rest. If the buffer isn't full the leftover block is empty.
+	while (stream->buffer_position < num_frames) {
+		if (!FLAC__stream_decoder_process_single(stream->decoder)) break;
+		if (FLAC__stream_decoder_get_state(stream->decoder) == FLAC__STREAM_DECODER_END_OF_STREAM) break;
+	}
+	
+	u32 frames_written = stream->buffer_position;
+	stream->buffer = NULL;
+	stream->buffer_frames = 0;
+	stream->buffer_position = 0;
+	stream->current_sample += frames_written * 2;
+	
+	return frames_written;
+}
+
+u64 get_sample_flac(void *stream) {
+	return ((Flac_Stream*)stream)->current_sample;
+}
+
+// Move the file to the last indexed frame at or before the target and let the write callback drop the
+// rest. Returns false if the target is past the indexed part.
+static bool seek_with_index(Flac_Stream *stream, u64 frame) {
+	if (!stream->index_count || frame >= stream->indexed_frames) return false;
 	
+	// Last point at or before the frame
+	u32 low = 0, high = stream->index_count;
+	while (high - low > 1) {
+		u32 middle = (low + high) / 2;
+		if (stream->index[middle].frame <= frame) low = middle;
+		else high = middle;
+	}
+	
+	const Flac_Index_Point *point = &stream->index[low];
+	if (point->frame > frame) return false;
+	
+	// Flushing drops what the decoder had read ahead and makes it look for the next frame header
+	if (_fseeki64(stream->file, point->offset, SEEK_SET) || !FLAC__stream_decoder_flush(stream->decoder)) return false;
+	
+	stream->next_frame_offset = point->offset;
+	stream->skip_until_frame = frame;
+	return true;
+}
+
+int seek_flac(void *stream_data, u64 sample) {
+	Flac_Stream *stream = (Flac_Stream*)stream_data;
+	// Samples are interleaved, libFLAC counts frames
+	u64 frame = sample / 2;
+	
+	// libFLAC writes the frame it lands on while seeking, which goes into the empty block
+	stream->block_frames = 0;
+	stream->block_position = 0;
+	stream->skip_until_frame = 0;
+	
+	if (!seek_with_index(stream, frame)) {
+		stream->next_frame_offset = 0;
+		if (!FLAC__stream_decoder_seek_absolute(stream->decoder, frame)) {
+			// A failed seek leaves the decoder needing a flush before it can decode again
+			FLAC__stream_decoder_flush(stream->decoder);
+			return false;
+		}
+	}
+	
+	stream->current_sample = frame * 2;
 	return true;
 }
 
-int decode_flac(u32 num_frames, float *buffer) {
-	g_flac.buffer = buffer;
-	g_flac.buffer_position = 0;
-	g_flac.buffer_size = num_frames*2;
+void close_flac(void *stream_data) {
+	Flac_Stream *stream = (Flac_Stream*)stream_data;
+	if (stream->index_dirty) save_index(stream);
+	// Also closes the file
+	FLAC__stream_decoder_delete(stream->decoder);
+	free(stream->block);
+	free(stream->index);
+	free(stream);
+}
+
+struct Flac_Verify_State {
+	u32 error_count;
+	bool has_md5;
+};
+
+static FLAC__StreamDecoderWriteStatus verify_write_callback(const FLAC__StreamDecoder *decoder, 
+																 const FLAC__Frame *frame, const FLAC__int32 *const buffer[], 
+																 void *client_data) {
+	// libFLAC has already added the frame to the MD5 by now
+	return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+}
+
+static void verify_metadata_callback(const FLAC__StreamDecoder *decoder, const FLAC__StreamMetadata *metadata, 
+									 void *client_data) {
+	Flac_Verify_State *state = (Flac_Verify_State*)client_data;
+	
+	if (metadata->type == FLAC__METADATA_TYPE_STREAMINFO) {
+		const FLAC__byte *md5 = metadata->data.stream_info.md5sum;
+		for (u32 i = 0; i < 16; ++i) if (md5[i]) state->has_md5 = true;
+	}
+}
+
+static void verify_error_callback(const FLAC__StreamDecoder *decoder, FLAC__StreamDecoderErrorStatus status, 
+								  void *client_data) {
+	Flac_Verify_State *state = (Flac_Verify_State*)client_data;
+	state->error_count++;
+	log_error("FLAC error: %s\n", FLAC__StreamDecoderErrorStatusString[status]);
+}
+
+bool verify_flac(const wchar_t *path) {
+	Flac_Verify_State state = {};
+	FILE *file = _wfopen(path, L"rb");
 	
-	for (u32 i = 0; i < g_flac.overflow_position; i += 2) {
-		buffer[i+0] = g_flac.overflow_buffer[i+0];
-		buffer[i+1] = g_flac.overflow_buffer[i+1];
+	if (!file) {
+		log_error("Failed to open \"%ls\" for verification\n", path);
+		return false;
 	}
 	
-	g_flac.buffer_position += g_flac.overflow_position;
-	g_flac.overflow_position = 0;
+	FLAC__StreamDecoder *decoder = FLAC__stream_decoder_new();
+	FLAC__stream_decoder_set_md5_checking(decoder, true);
 	
-	while (g_flac.buffer_position < (num_frames*2)) {
-		FLAC__stream_decoder_process_single(g_flac.decoder);
+	FLAC__StreamDecoderInitStatus status = FLAC__stream_decoder_init_FILE(decoder, file, &verify_write_callback, 
+																		   &verify_metadata_callback, 
+																		   &verify_error_callback, &state);
+	if (status != FLAC__STREAM_DECODER_INIT_STATUS_OK) {
+		log_error("Failed to open \"%ls\" for verification: %s\n", path, FLAC__StreamDecoderInitStatusString[status]);
+		fclose(file);
+		FLAC__stream_decoder_delete(decoder);
+		return false;
 	}
 	
-	g_flac.current_sample += g_flac.buffer_position;
+	bool decoded = FLAC__stream_decoder_process_until_end_of_stream(decoder);
+	// Fails if the MD5 of the decoded audio doesn't match the one in the header
+	bool md5_matches = FLAC__stream_decoder_finish(decoder);
+	FLAC__stream_decoder_delete(decoder);
+	
+	if (!decoded || state.error_count) {
+		log_error("\"%ls\" has %u decoding errors\n", path, state.error_count);
+		return false;
+	}
+	
+	if (!md5_matches) {
+		log_error("\"%ls\" does not match its MD5 signature\n", path);
+		return false;
+	}
+	
+	if (!state.has_md5) log_warning("\"%ls\" has no MD5 signature; only frame checksums were verified\n", path);
+	else log_info("\"%ls\" verified\n", path);
 	
 	return true;
 }
 
-u64 get_sample_flac() {
-	return g_flac.current_sample;
+// Parallel decoding. Frames only depend on STREAMINFO, so the file is cut into chunks at frame 
+// boundaries and each worker runs its own libFLAC decoder over the metadata followed by one chunk at a 
+// time. Boundaries come from the SEEKTABLE when there is one, or else from scanning for a frame header
+// whose CRC-8 checks out and that agrees with the first frame about the stream's format.
+
+#define FLAC_PARALLEL_CHUNKS_PER_THREAD 8
+#define FLAC_SCAN_WINDOW_SIZE (64<<10)
+// Longest possible frame header, including the CRC
+#define FLAC_MAX_FRAME_HEADER_SIZE 16
+
+struct Flac_Stream_Layout {
+	// Everything before the first frame. Every worker's decoder is given this first.
+	u8 *header;
+	u64 header_size;
+	u64 file_size;
+	u64 total_frames;
+	u32 sample_rate;
+	u32 max_block_size;
+	// Absolute offsets of the SEEKTABLE points, in order
+	u64 *seek_offsets;
+	u32 seek_offset_count;
+	// Bytes 1 to 3 of the first frame header, which every frame header has to agree with
+	u8 first_frame_header[4];
+};
+
+struct Flac_Parallel_Job {
+	const wchar_t *path;
+	const Flac_Stream_Layout *layout;
+	// chunk_count+1 offsets; chunk i is [boundaries[i], boundaries[i+1])
+	const u64 *boundaries;
+	u32 chunk_count;
+	std::atomic<u32> next_chunk;
+	std::atomic<u32> error_count;
+	Flac_Block_Callback *callback;
+	void *user_data;
+};
+
+struct Flac_Parallel_Worker {
+	Flac_Parallel_Job *job;
+	void *thread;
+	FILE *file;
+	u64 header_position;
+	u64 position;
+	u64 end;
+	float *samples;
+};
+
+static u32 read_big_endian(const u8 *p, u32 bytes) {
+	u32 result = 0;
+	for (u32 i = 0; i < bytes; ++i) result = (result << 8) | p[i];
+	return result;
+}
+
+static u8 flac_crc8(const u8 *data, u32 length) {
+	u8 crc = 0;
+	for (u32 i = 0; i < length; ++i) {
+		crc ^= data[i];
+		for (u32 bit = 0; bit < 8; ++bit) crc = (crc & 0x80) ? (u8)((crc << 1) ^ 0x07) : (u8)(crc << 1);
+	}
+	return crc;
+}
+
+static u32 get_channel_count_from_code(u32 code) {
+	// Codes past 7 are the stereo decorrelation modes
+	return code <= 7 ? code + 1 : 2;
+}
+
+static bool is_frame_header(const u8 *p, u32 available, const u8 *first_header) {
+	if (available < 6 || p[0] != 0xff || (p[1] & 0xfe) != 0xf8) return false;
+	
+	u32 block_size_code = p[2] >> 4;
+	u32 rate_code = p[2] & 0xf;
+	u32 channel_code = p[3] >> 4;
+	
+	if (!block_size_code || rate_code == 15 || channel_code > 10 || (p[3] & 1)) return false;
+	
+	// The blocking strategy, sample rate, sample size and number of channels don't change
+	if (first_header && (p[1] != first_header[0] || rate_code != (first_header[1] & 0xf) || 
+						 (p[3] & 0x0e) != (first_header[2] & 0x0e) ||
+						 get_channel_count_from_code(channel_code) != get_channel_count_from_code(first_header[2] >> 4))) {
+		return false;
+	}
+	
+	// Frame or sample number, coded like UTF-8 but up to 7 bytes
+	u32 extra_bytes;
+	if (!(p[4] & 0x80)) extra_bytes = 0;
+	else if ((p[4] & 0xe0) == 0xc0) extra_bytes = 1;
+	else if ((p[4] & 0xf0) == 0xe0) extra_bytes = 2;
+	else if ((p[4] & 0xf8) == 0xf0) extra_bytes = 3;
+	else if ((p[4] & 0xfc) == 0xf8) extra_bytes = 4;
+	else if ((p[4] & 0xfe) == 0xfc) extra_bytes = 5;
+	else if (p[4] == 0xfe) extra_bytes = 6;
+	else return false;
+	
+	u32 length = 5 + extra_bytes;
+	if (block_size_code == 6) length += 1;
+	else if (block_size_code == 7) length += 2;
+	if (rate_code == 12) length += 1;
+	else if (rate_code == 13 || rate_code == 14) length += 2;
+	
+	if (available < length + 1) return false;
+	for (u32 i = 0; i < extra_bytes; ++i) if ((p[5+i] & 0xc0) != 0x80) return false;
+	
+	return flac_crc8(p, length) == p[length];
+}
+
+// Offset of the first frame header at or after the given offset, or the end of the file
+static u64 find_frame_boundary(FILE *file, const Flac_Stream_Layout *layout, u64 offset, u8 *window) {
+	while (offset < layout->file_size) {
+		_fseeki64(file, offset, SEEK_SET);
+		u32 read = (u32)fread(window, 1, FLAC_SCAN_WINDOW_SIZE, file);
+		bool last_window = offset + read >= layout->file_size;
+		// A header that starts near the end of the window is checked again at the start of the next one
+		u32 scan_end = last_window ? read : read - FLAC_MAX_FRAME_HEADER_SIZE;
+		
+		if (!read) break;
+		
+		for (u32 i = 0; i < scan_end; ++i) {
+			if (window[i] == 0xff && is_frame_header(&window[i], read - i, layout->first_frame_header)) return offset + i;
+		}
+		
+		if (last_window) break;
+		offset += scan_end;
+	}
+	
+	return layout->file_size;
+}
+
+static void free_stream_layout(Flac_Stream_Layout *layout) {
+	free(layout->header);
+	free(layout->seek_offsets);
 }
 
-int seek_flac(u64 sample) {
-	FLAC__stream_decoder_seek_absolute(g_flac.decoder, sample);
-	g_flac.current_sample = sample;
+// Read the metadata and find where the frames start
+static bool read_stream_layout(FILE *file, Flac_Stream_Layout *layout) {
+	u8 block_header[4];
+	u64 offset = 0;
+	bool have_stream_info = false;
+	bool last_block = false;
+	
+	memset(layout, 0, sizeof(*layout));
+	_fseeki64(file, 0, SEEK_END);
+	layout->file_size = _ftelli64(file);
+	_fseeki64(file, 0, SEEK_SET);
+	
+	// libFLAC skips an ID3v2 tag in front of the stream, so the workers get it as well
+	u8 id3[10];
+	if (fread(id3, 1, 10, file) == 10 && !memcmp(id3, "ID3", 3)) {
+		offset = 10 + ((id3[6] & 0x7f) << 21 | (id3[7] & 0x7f) << 14 | (id3[8] & 0x7f) << 7 | (id3[9] & 0x7f));
+		if (id3[5] & 0x10) offset += 10;
+	}
+	
+	char marker[4];
+	_fseeki64(file, offset, SEEK_SET);
+	if (fread(marker, 1, 4, file) != 4 || memcmp(marker, "fLaC", 4)) return false;
+	offset += 4;
+	
+	while (!last_block) {
+		if (fread(block_header, 1, 4, file) != 4) return false;
+		
+		last_block = block_header[0] & 0x80;
+		u32 type = block_header[0] & 0x7f;
+		u32 length = read_big_endian(&block_header[1], 3);
+		u64 block_start = offset + 4;
+		
+		if (type == 0 && length >= 34) {
+			u8 info[34];
+			if (fread(info, 1, 34, file) != 34) return false;
+			layout->max_block_size = read_big_endian(&info[2], 2);
+			layout->sample_rate = read_big_endian(&info[10], 3) >> 4;
+			layout->total_frames = ((u64)(info[13] & 0xf) << 32) | read_big_endian(&info[14], 4);
+			have_stream_info = true;
+		}
+		else if (type == 3) {
+			u32 point_count = length / 18;
+			layout->seek_offsets = (u64*)malloc(MAX(point_count, 1u) * sizeof(u64));
+			for (u32 i = 0; i < point_count; ++i) {
+				u8 point[18];
+				if (fread(point, 1, 18, file) != 18) return false;
+				// Placeholders have all bits of the sample number set
+				if (read_big_endian(point, 4) == 0xffffffff && read_big_endian(&point[4], 4) == 0xffffffff) continue;
+				u64 point_offset = ((u64)read_big_endian(&point[8], 4) << 32) | read_big_endian(&point[12], 4);
+				layout->seek_offsets[layout->seek_offset_count++] = point_offset;
+			}
+		}
+		
+		offset = block_start + length;
+		_fseeki64(file, offset, SEEK_SET);
+	}
+	
+	if (!have_stream_info) return false;
+	
+	// Seek points are relative to the first frame
+	for (u32 i = 0; i < layout->seek_offset_count; ++i) layout->seek_offsets[i] += offset;
+	
+	u8 first_frame[FLAC_MAX_FRAME_HEADER_SIZE];
+	u32 read = (u32)fread(first_frame, 1, sizeof(first_frame), file);
+	if (!is_frame_header(first_frame, read, NULL)) return false;
+	memcpy(layout->first_frame_header, &first_frame[1], 3);
+	
+	layout->header_size = offset;
+	layout->header = (u8*)malloc(offset);
+	_fseeki64(file, 0, SEEK_SET);
+	if (fread(layout->header, 1, offset, file) != offset) return false;
+	
+	if (!layout->max_block_size) layout->max_block_size = FLAC_MAX_BLOCK_SIZE;
 	return true;
 }
 
-void close_flac() {
-	free(g_flac.overflow_buffer);
+// Cut the frames into about target_count chunks. Returns the number of chunks.
+static u32 find_chunk_boundaries(FILE *file, const Flac_Stream_Layout *layout, u32 target_count, u64 *boundaries) {
+	u64 audio_size = layout->file_size - layout->header_size;
+	u8 *window = NULL;
+	u32 count = 0;
+	
+	boundaries[count++] = layout->header_size;
+	
+	for (u32 i = 1; i < target_count; ++i) {
+		u64 target = layout->header_size + audio_size * i / target_count;
+		u64 boundary = layout->file_size;
+		
+		if (layout->seek_offset_count) {
+			for (u32 p = 0; p < layout->seek_offset_count; ++p) {
+				if (layout->seek_offsets[p] >= target) {
+					boundary = layout->seek_offsets[p];
+					break;
+				}
+			}
+		}
+		else {
+			if (!window) window = (u8*)malloc(FLAC_SCAN_WINDOW_SIZE);
+			boundary = find_frame_boundary(file, layout, target, window);
+		}
+		
+		// Long frames or sparse seek points can put two targets on the same frame
+		if (boundary > boundaries[count-1] && boundary < layout->file_size) boundaries[count++] = boundary;
+	}
+	
+	boundaries[count] = layout->file_size;
+	free(window);
+	return count;
+}
+
+static FLAC__StreamDecoderReadStatus parallel_read_callback(const FLAC__StreamDecoder *decoder, FLAC__byte buffer[], 
+															size_t *bytes, void *client_data) {
+	Flac_Parallel_Worker *worker = (Flac_Parallel_Worker*)client_data;
+	const Flac_Stream_Layout *layout = worker->job->layout;
+	size_t wanted = *bytes;
+	size_t written = 0;
+	
+	// The metadata, then the chunk
+	if (worker->header_position < layout->header_size) {
+		written = (size_t)MIN((u64)wanted, layout->header_size - worker->header_position);
+		memcpy(buffer, &layout->header[worker->header_position], written);
+		worker->header_position += written;
+	}
+	
+	if (written < wanted && worker->position < worker->end) {
+		size_t count = (size_t)MIN((u64)(wanted - written), worker->end - worker->position);
+		count = fread(&buffer[written], 1, count, worker->file);
+		worker->position += count;
+		written += count;
+	}
+	
+	*bytes = written;
+	return written ? FLAC__STREAM_DECODER_READ_STATUS_CONTINUE : FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM;
+}
+
+static FLAC__StreamDecoderWriteStatus parallel_write_callback(const FLAC__StreamDecoder *decoder, const FLAC__Frame *frame, 
+															  const FLAC__int32 *const buffer[], void *client_data) {
+	Flac_Parallel_Worker *worker = (Flac_Parallel_Worker*)client_data;
+	u32 block_size = frame->header.blocksize;
+	
+	if (frame->header.channels > FLAC_MAX_CHANNELS || block_size > worker->job->layout->max_block_size) {
+		log_error("FLAC frame with %u channels and %u samples can't be decoded\n", frame->header.channels, block_size);
+		return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+	}
+	
+	convert_block(frame, buffer, 0, block_size, worker->samples);
+	worker->job->callback(worker->job->user_data, frame->header.number.sample_number, block_size, worker->samples);
+	return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+}
+
+static void parallel_error_callback(const FLAC__StreamDecoder *decoder, FLAC__StreamDecoderErrorStatus status, 
+									void *client_data) {
+	Flac_Parallel_Worker *worker = (Flac_Parallel_Worker*)client_data;
+	worker->job->error_count++;
+	log_error("FLAC error: %s\n", FLAC__StreamDecoderErrorStatusString[status]);
+}
+
+static void flac_parallel_worker_entry(void *user_data) {
+	Flac_Parallel_Worker *worker = (Flac_Parallel_Worker*)user_data;
+	Flac_Parallel_Job *job = worker->job;
+	FLAC__StreamDecoder *decoder = FLAC__stream_decoder_new();
+	u32 chunk;
+	
+	while ((chunk = job->next_chunk++) < job->chunk_count) {
+		worker->header_position = 0;
+		worker->position = job->boundaries[chunk];
+		worker->end = job->boundaries[chunk+1];
+		_fseeki64(worker->file, worker->position, SEEK_SET);
+		
+		FLAC__StreamDecoderInitStatus status = FLAC__stream_decoder_init_stream(decoder, &parallel_read_callback, 
+																				 NULL, NULL, NULL, NULL, 
+																				 &parallel_write_callback, NULL, 
+																				 &parallel_error_callback, worker);
+		if (status != FLAC__STREAM_DECODER_INIT_STATUS_OK) {
+			log_error("Failed to start FLAC decoder: %s\n", FLAC__StreamDecoderInitStatusString[status]);
+			job->error_count++;
+			continue;
+		}
+		
+		if (!FLAC__stream_decoder_process_until_end_of_stream(decoder)) job->error_count++;
+		FLAC__stream_decoder_finish(decoder);
+	}
+	
+	FLAC__stream_decoder_delete(decoder);
+}
+
+bool decode_flac_parallel(const wchar_t *path, u32 thread_count, Flac_Block_Callback *callback, void *user_data, 
+						  Flac_Parallel_Stats *stats) {
+	Flac_Stream_Layout layout;
+	Flac_Parallel_Job job;
+	FILE *file = _wfopen(path, L"rb");
+	
+	memset(stats, 0, sizeof(*stats));
+	
+	if (!file) {
+		log_error("Failed to open FLAC stream \"%ls\"\n", path);
+		return false;
+	}
+	
+	if (!read_stream_layout(file, &layout)) {
+		log_error("Failed to read FLAC metadata from \"%ls\"\n", path);
+		free_stream_layout(&layout);
+		fclose(file);
+		return false;
+	}
+	
+	if (!thread_count) thread_count = get_processor_count();
+	
+	u32 target_chunk_count = thread_count > 1 ? thread_count * FLAC_PARALLEL_CHUNKS_PER_THREAD : 1;
+	u64 *boundaries = (u64*)malloc((target_chunk_count + 1) * sizeof(u64));
+	
+	job.path = path;
+	job.layout = &layout;
+	job.boundaries = boundaries;
+	job.chunk_count = find_chunk_boundaries(file, &layout, target_chunk_count, boundaries);
+	job.next_chunk = 0;
+	job.error_count = 0;
+	job.callback = callback;
+	job.user_data = user_data;
+	fclose(file);
+	
+	// No point in threads that would have nothing to do
+	thread_count = MIN(thread_count, job.chunk_count);
+	Flac_Parallel_Worker *workers = (Flac_Parallel_Worker*)calloc(thread_count, sizeof(Flac_Parallel_Worker));
+	
+	for (u32 i = 0; i < thread_count; ++i) {
+		workers[i].job = &job;
+		workers[i].file = _wfopen(path, L"rb");
+		workers[i].samples = (float*)malloc(layout.max_block_size * 2 * sizeof(float));
+		if (workers[i].file) workers[i].thread = create_thread(&flac_parallel_worker_entry, &workers[i]);
+	}
+	
+	for (u32 i = 0; i < thread_count; ++i) {
+		if (workers[i].thread) join_thread(workers[i].thread);
+		if (workers[i].file) fclose(workers[i].file);
+		free(workers[i].samples);
+	}
+	
+	// Only happens if none of the threads could start
+	if (job.next_chunk.load() < job.chunk_count) {
+		log_error("Failed to start FLAC decoding threads\n");
+		job.error_count++;
+	}
+	
+	stats->total_frames = layout.total_frames;
+	stats->sample_rate = layout.sample_rate;
+	stats->thread_count = thread_count;
+	stats->chunk_count = job.chunk_count;
+	stats->error_count = job.error_count;
+	stats->used_seek_table = layout.seek_offset_count != 0;
+	
+	free(workers);
+	free(boundaries);
+	free_stream_layout(&layout);
+	return true;
 }
@@ -18,34 +18,243 @@
 #include "../decoders.h"
 #include <minimp3.h>
 #include <minimp3_ex.h>
+#include <xxhash.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "../platform.h"
 
-static mp3dec_ex_t g_mp3;
+// Without a VBR header minimp3 has to find every frame in the file to know how long it is, and with one
+// it does the same on the first seek. The frame index it builds is saved to ../Seek_Index, keyed by
+// a fingerprint of the file's contents, so that only ever happens once per file. Frames are stored as 
+// varint deltas, which is about 4 bytes each.
 
-int open_mp3(const wchar_t *path, float buffer_duration_ms, PCM_Format *format) {
-	if (mp3dec_ex_open_w(&g_mp3, path, MP3D_SEEK_TO_SAMPLE)) {
-		log_error("Failed to open mp3 stream \"%ls\"\n", path);
+#define MP3_INDEX_MAGIC 0x58494d56 // "VMIX"
+#define MP3_INDEX_VERSION 1
+// Bytes from each end of the file that go into the fingerprint
+#define MP3_FINGERPRINT_SIZE (64<<10)
+
+struct MP3_Index_Header {
+	u32 magic;
+	u32 version;
+	u64 file_size;
+	u64 start_offset;
+	u64 samples;
+	u64 detected_samples;
+	u64 frame_count;
+	u64 data_size;
+};
+
+struct MP3_Stream {
+	mp3dec_ex_t mp3;
+	char index_path[64];
+	// Set if the index came from the cache or there is nothing to save
+	bool index_saved;
+};
+
+static void get_index_path(const mp3dec_ex_t *mp3, char *out, u32 out_max) {
+	const u8 *file = mp3->file.buffer;
+	u64 size = mp3->file.size;
+	u64 edge = MIN(size, (u64)MP3_FINGERPRINT_SIZE);
+	
+	u64 hash = XXH64(file, (size_t)edge, size);
+	hash = XXH64(&file[size - edge], (size_t)edge, hash);
+	snprintf(out, out_max, SEEK_INDEX_DIRECTORY "/%016llx", (unsigned long long)hash);
+}
+
+static u8 *write_varint(u8 *out, u64 value) {
+	while (value >= 0x80) {
+		*out++ = (u8)(value | 0x80);
+		value >>= 7;
+	}
+	*out++ = (u8)value;
+	return out;
+}
+
+static const u8 *read_varint(const u8 *in, const u8 *end, u64 *value) {
+	u64 result = 0;
+	for (u32 shift = 0; in < end && shift < 64; shift += 7) {
+		u8 byte = *in++;
+		result |= (u64)(byte & 0x7f) << shift;
+		if (!(byte & 0x80)) {
+			*value = result;
+			return in;
+		}
+	}
+	return NULL;
+}
+
+// Hand a cached index to minimp3 as if it had scanned the file itself
+static bool load_index(MP3_Stream *stream) {
+	mp3dec_ex_t *mp3 = &stream->mp3;
+	MP3_Index_Header header;
+	FILE *file = fopen(stream->index_path, "rb");
+	
+	if (!file) return false;
+	
+	if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != MP3_INDEX_MAGIC || 
+		header.version != MP3_INDEX_VERSION || header.file_size != mp3->file.size || 
+		header.start_offset != mp3->start_offset || !header.frame_count || 
+		header.data_size > header.frame_count * 20) {
+		fclose(file);
 		return false;
 	}
 	
-	format->total_samples = g_mp3.samples;
-	format->sample_rate = g_mp3.info.hz;
+	u8 *data = (u8*)malloc(header.data_size);
+	mp3dec_frame_t *frames = (mp3dec_frame_t*)malloc(header.frame_count * sizeof(mp3dec_frame_t));
+	bool valid = fread(data, 1, header.data_size, file) == header.data_size;
+	const u8 *in = data;
+	const u8 *end = data + header.data_size;
+	u64 sample = 0, offset = 0;
+	
+	fclose(file);
+	
+	for (u64 i = 0; valid && i < header.frame_count; ++i) {
+		u64 sample_delta, offset_delta;
+		in = read_varint(in, end, &sample_delta);
+		if (in) in = read_varint(in, end, &offset_delta);
+		if (!in) {
+			valid = false;
+			break;
+		}
+		sample += sample_delta;
+		offset += offset_delta;
+		frames[i].sample = sample;
+		frames[i].offset = offset;
+	}
+	
+	free(data);
 	
+	if (!valid) {
+		free(frames);
+		return false;
+	}
+	
+	mp3->index.frames = frames;
+	mp3->index.num_frames = header.frame_count;
+	mp3->index.capacity = header.frame_count;
+	mp3->samples = header.samples;
+	mp3->detected_samples = header.detected_samples;
+	mp3->indexes_built = 1;
 	return true;
 }
 
-int decode_mp3(u32 num_frames, float *buffer) {
-	return mp3dec_ex_read(&g_mp3, buffer, num_frames*2) == (num_frames*2);
+static void save_index(MP3_Stream *stream) {
+	const mp3dec_ex_t *mp3 = &stream->mp3;
+	MP3_Index_Header header = {};
+	u8 *data = (u8*)malloc(mp3->index.num_frames * 20);
+	u8 *out = data;
+	u64 sample = 0, offset = 0;
+	
+	for (size_t i = 0; i < mp3->index.num_frames; ++i) {
+		out = write_varint(out, mp3->index.frames[i].sample - sample);
+		out = write_varint(out, mp3->index.frames[i].offset - offset);
+		sample = mp3->index.frames[i].sample;
+		offset = mp3->index.frames[i].offset;
+	}
+	
+	header.magic = MP3_INDEX_MAGIC;
+	header.version = MP3_INDEX_VERSION;
+	header.file_size = mp3->file.size;
+	header.start_offset = mp3->start_offset;
+	header.samples = mp3->samples;
+	header.detected_samples = mp3->detected_samples;
+	header.frame_count = mp3->index.num_frames;
+	header.data_size = out - data;
+	
+	_mkdir(SEEK_INDEX_DIRECTORY);
+	
+	FILE *file = fopen(stream->index_path, "wb");
+	if (file) {
+		fwrite(&header, sizeof(header), 1, file);
+		fwrite(data, 1, header.data_size, file);
+		fclose(file);
+	}
+	else {
+		log_warning("Failed to save MP3 seek index\n");
+	}
+	
+	free(data);
+}
+
+static int open_mp3_file(mp3dec_ex_t *mp3, const wchar_t *path, int flags) {
+#ifdef _WIN32
+	return mp3dec_ex_open_w(mp3, path, flags);
+#else
+	char path_u8[1024];
+	if (!utf16_to_utf8(path, path_u8, sizeof(path_u8))) return MP3D_E_IOERROR;
+	return mp3dec_ex_open(mp3, path_u8, flags);
+#endif
 }
 
-u64 get_sample_mp3() {
-	return g_mp3.cur_sample;
+void *open_mp3(const wchar_t *path, float buffer_duration_ms, PCM_Format *format) {
+	MP3_Stream *stream = (MP3_Stream*)calloc(1, sizeof(MP3_Stream));
+	mp3dec_ex_t *mp3 = &stream->mp3;
+	
+	// Only reads up to the first frame. The file is mapped, so the fingerprint costs nothing much.
+	if (open_mp3_file(mp3, path, MP3D_SEEK_TO_SAMPLE|MP3D_DO_NOT_SCAN)) {
+		log_error("Failed to open mp3 stream \"%ls\"\n", path);
+		free(stream);
+		return NULL;
+	}
+	
+	get_index_path(mp3, stream->index_path, sizeof(stream->index_path));
+	stream->index_saved = load_index(stream);
+	
+	if (!stream->index_saved && !mp3->vbr_tag_found) {
+		// The length has to come from a full scan
+		mp3dec_ex_close(mp3);
+		if (open_mp3_file(mp3, path, MP3D_SEEK_TO_SAMPLE)) {
+			log_error("Failed to open mp3 stream \"%ls\"\n", path);
+			free(stream);
+			return NULL;
+		}
+	}
+	
+	// minimp3 counts samples of the file's own channels, but decode_mp3() always gives stereo
+	format->total_samples = mp3->info.channels == 1 ? mp3->samples * 2 : mp3->samples;
+	format->sample_rate = mp3->info.hz;
+	format->sample_type = PCM_TYPE_F32;
+	format->sample_size = 4;
+	
+	return stream;
+}
+
+// minimp3 skips the encoder delay and cuts the padding given in the LAME/Xing header
+u32 decode_mp3(void *stream, u32 num_frames, float *buffer) {
+	mp3dec_ex_t *mp3 = &((MP3_Stream*)stream)->mp3;
+	
+	if (mp3->info.channels == 1) {
+		u32 read = (u32)mp3dec_ex_read(mp3, buffer, num_frames);
+		// Spread mono out to both channels, back to front so nothing is overwritten before it is read
+		for (u32 i = read; i--;) {
+			buffer[i*2+0] = buffer[i];
+			buffer[i*2+1] = buffer[i];
+		}
+		return read;
+	}
+	
+	return (u32)mp3dec_ex_read(mp3, buffer, num_frames*2) / 2;
+}
+
+// Positions are in stereo samples like everywhere else, so mono files count each sample twice
+u64 get_sample_mp3(void *stream) {
+	mp3dec_ex_t *mp3 = &((MP3_Stream*)stream)->mp3;
+	return mp3->info.channels == 1 ? mp3->cur_sample * 2 : mp3->cur_sample;
 }
 
-int seek_mp3(u64 sample) {
-	mp3dec_ex_seek(&g_mp3, sample);
+int seek_mp3(void *stream, u64 sample) {
+	mp3dec_ex_t *mp3 = &((MP3_Stream*)stream)->mp3;
+	mp3dec_ex_seek(mp3, mp3->info.channels == 1 ? sample / 2 : sample);
 	return true;
 }
 
-void close_mp3() {
-	mp3dec_ex_close(&g_mp3);
-}
\ No newline at end of file
+void close_mp3(void *stream_data) {
+	MP3_Stream *stream = (MP3_Stream*)stream_data;
+	mp3dec_ex_t *mp3 = &stream->mp3;
+	
+	// Files with a VBR header only build the index on the first seek
+	if (!stream->index_saved && mp3->indexes_built && mp3->index.num_frames) save_index(stream);
+	
+	mp3dec_ex_close(mp3);
+	free(stream);
+}
@@ -16,52 +16,58 @@
 #include "../decoders.h"
 #include <opus/opusfile.h>
 
-static OggOpusFile *g_opus;
-
-int open_opus(const wchar_t *path, float buffer_duration_ms, PCM_Format *format) {
+// The stream is the OggOpusFile itself
+void *open_opus(const wchar_t *path, float buffer_duration_ms, PCM_Format *format) {
 	char path_u8[512];
 	utf16_to_utf8(path, path_u8, sizeof(path_u8));
 	
 	int error;
-	g_opus = op_open_file(path_u8, &error);
+	OggOpusFile *opus = op_open_file(path_u8, &error);
 	
-	if (!g_opus || error) {
+	if (!opus || error) {
 		log_error("Failed to open opus stream \"%s\"\n", path_u8);
-		return false;
+		if (opus) op_free(opus);
+		return NULL;
 	}
 	
-	format->total_samples = op_pcm_total(g_opus, -1);
+	// opusfile counts frames, but the player counts interleaved stereo samples
+	format->total_samples = op_pcm_total(opus, -1) * 2;
 	format->sample_rate = 48000;
+	format->sample_type = PCM_TYPE_F32;
+	format->sample_size = 4;
 	
-	return true;
+	return opus;
 }
 
-int decode_opus(u32 num_frames, float *buffer) {
-	int total_read = 0;
+// opusfile drops the pre-skip and end padding itself, so what comes out is exactly the track
+u32 decode_opus(void *stream, u32 num_frames, float *buffer) {
+	OggOpusFile *opus = (OggOpusFile*)stream;
+	u32 total_read = 0;
 	
 	while (total_read < num_frames) {
 		int max_readable = (num_frames - total_read) * 2;
-		int read = op_read_float_stereo(g_opus, &buffer[total_read*2], max_readable);
+		int read = op_read_float_stereo(opus, &buffer[total_read*2], max_readable);
 		
-		if (read == 0) return false;
+		if (read == 0) break;
 		else if (read < 0) {
 			log_error("An OPUS streaming error occured\n");
-			return false;
+			break;
 		}
 		
 		total_read += read;
 	}
 
-	return true;
+	return total_read;
 }
 
-u64 get_sample_opus() {
-	return op_pcm_tell(g_opus);
+// Positions are in stereo samples like everywhere else, so twice opusfile's frames
+u64 get_sample_opus(void *stream) {
+	return op_pcm_tell((OggOpusFile*)stream) * 2;
 }
 
-int seek_opus(u64 sample) {
+int seek_opus(void *stream, u64 sample) {
 	int error;
-	error = op_pcm_seek(g_opus, sample);
+	error = op_pcm_seek((OggOpusFile*)stream, sample / 2);
 	
 	if (error) {
 		log_error("op_pcm_seek() failed with code %d\n", error);
@@ -71,6 +77,6 @@ int seek_opus(u64 sample) {
 	return true;
 }
 
-void close_opus() {
-	op_free(g_opus);
+void close_opus(void *stream) {
+	op_free((OggOpusFile*)stream);
 }
\ No newline at end of file
@@ -14,18 +14,35 @@
    limitations under the License.
 */
 #include "../decoders.h"
-#include <stdio.h>
-#include <assert.h>
+#include "../pcm.h"
+#include "../platform.h"
 #include <string.h>
 #include <stdlib.h>
 
+// The whole file is mapped and samples are converted straight from the mapping into the caller's
+// buffer. The pages ahead of the read position are prefetched in windows so large files stream
+// without waiting on page faults, and seeking is just moving the position.
+
+#define WAV_PREFETCH_SIZE (4<<20)
+
+#define WAVE_FORMAT_PCM 1
+#define WAVE_FORMAT_IEEE_FLOAT 3
+#define WAVE_FORMAT_EXTENSIBLE 0xfffe
+
+#pragma pack(push, 1)
 struct WAV_Fmt_Chunk {
 	u16 sample_type;
 	u16 num_channels;
 	u32 sample_rate;
 	u32 bytes_per_second;
-	u16 bits_per_frame;
+	u16 bytes_per_frame;
 	u16 bits_per_sample;
+	// Only there for WAVE_FORMAT_EXTENSIBLE
+	u16 extension_size;
+	u16 valid_bits_per_sample;
+	u32 channel_mask;
+	// The first two bytes are the format tag, the rest is the same for every format
+	u8 sub_format[16];
 };
 
 struct WAV_Chunk_Header {
@@ -39,127 +56,202 @@ struct WAV_Header {
 	char wave_header[4];
 };
 
-static struct WAV_Stream {
-	FILE *io;
-	// For converting from integer to float and vice versa
-	s32 *conversion_buffer;
-	u64 current_sample;
-	u32 pcm_start_offset;
-	u32 conversion_buffer_size;
-	u32 sample_size;
-	u64 total_samples;
-} g_wav;
-
-int open_wav(const wchar_t *path, float buffer_duration_ms, PCM_Format *format) {
-	WAV_Header header;
-	WAV_Fmt_Chunk fmt;
-	WAV_Chunk_Header chunk;
-	
-	g_wav.io = _wfopen(path, L"rb");
-	
-	if (!g_wav.io) {
+// RF64 files are WAVs over 4GB. Their 32-bit sizes are 0xffffffff and the real ones are in here.
+struct WAV_DS64_Chunk {
+	u64 riff_size;
+	u64 data_size;
+	u64 sample_count;
+};
+#pragma pack(pop)
+
+static const u8 WAV_SUBFORMAT_GUID_TAIL[14] = {
+	0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71,
+};
+
+struct WAV_Stream {
+	const u8 *view;
+	const u8 *data;
+	u64 file_size;
+	u64 total_frames;
+	u64 current_frame;
+	// Everything before this offset into the data has been asked for already
+	u64 prefetch_end;
+	u32 bytes_per_frame;
+	PCM_Type sample_type;
+};
+
+static void prefetch_wav(WAV_Stream *wav, u64 offset) {
+	u64 data_size = wav->total_frames * wav->bytes_per_frame;
+	u64 end = MIN(offset + WAV_PREFETCH_SIZE, data_size);
+	
+	if (offset >= end) return;
+	
+	prefetch_mapped_range(&wav->data[offset], end - offset);
+	wav->prefetch_end = end;
+}
+
+static bool parse_fmt_chunk(const WAV_Fmt_Chunk *fmt, u32 length, PCM_Type *type) {
+	if (length < 16) return false;
+	
+	u32 tag = fmt->sample_type;
+	u32 bits = fmt->bits_per_sample;
+	
+	if (tag == WAVE_FORMAT_EXTENSIBLE) {
+		if (length < sizeof(WAV_Fmt_Chunk) || memcmp(&fmt->sub_format[2], WAV_SUBFORMAT_GUID_TAIL, 14)) return false;
+		tag = fmt->sub_format[0] | (fmt->sub_format[1] << 8);
+		// Samples are left justified in their container, so 20 bits in 24 converts the same as 24 in 24
+	}
+	
+	if (!fmt->bytes_per_frame || fmt->bytes_per_frame != fmt->num_channels * (bits / 8)) return false;
+	
+	if (tag == WAVE_FORMAT_PCM && bits == 16) *type = PCM_TYPE_S16;
+	else if (tag == WAVE_FORMAT_PCM && bits == 24) *type = PCM_TYPE_S24;
+	else if (tag == WAVE_FORMAT_PCM && bits == 32) *type = PCM_TYPE_S32;
+	else if (tag == WAVE_FORMAT_IEEE_FLOAT && bits == 32) *type = PCM_TYPE_F32;
+	else return false;
+	
+	return true;
+}
+
+void *open_wav(const wchar_t *path, float buffer_duration_ms, PCM_Format *format) {
+	WAV_Stream wav = {};
+	const WAV_Fmt_Chunk *fmt = NULL;
+	u64 offset = sizeof(WAV_Header);
+	u64 rf64_data_size = 0;
+	
+	wav.view = map_file(path, &wav.file_size);
+	
+	if (!wav.view) {
 		log_error("Failed to open WAV stream \"%ls\"\n", path);
-		return false;
+		return NULL;
 	}
 	
-	fread(&header, sizeof(header), 1, g_wav.io);
+	const WAV_Header *header = (const WAV_Header*)wav.view;
 	
-	if (strncmp(header.signature, "RIFF", 4)) {
+	if (wav.file_size < sizeof(WAV_Header) || (strncmp(header->signature, "RIFF", 4) && strncmp(header->signature, "RF64", 4)) || 
+		strncmp(header->wave_header, "WAVE", 4)) {
 		log_error("Malformed WAV header for \"%ls\"\n", path);
-		return false;
+		unmap_file(wav.view, wav.file_size);
+		return NULL;
 	}
 	
 	while (1) {
-		fread(&chunk, sizeof(chunk), 1, g_wav.io);
-		if (!strncmp(chunk.type, "fmt", 3)) {
-			fread(&fmt, sizeof(fmt), 1, g_wav.io);
-			format->sample_rate = fmt.sample_rate;
-			format->sample_size = fmt.bits_per_sample / 8;
+		if (offset + sizeof(WAV_Chunk_Header) > wav.file_size) {
+			log_error("No data chunk in \"%ls\"\n", path);
+			unmap_file(wav.view, wav.file_size);
+			return NULL;
+		}
+		
+		const WAV_Chunk_Header *chunk = (const WAV_Chunk_Header*)&wav.view[offset];
+		u64 chunk_start = offset + sizeof(WAV_Chunk_Header);
+		// Truncated files and streams written with an unknown length run to the end of the file
+		u64 chunk_length = MIN((u64)chunk->length, wav.file_size - chunk_start);
+		
+		if (!strncmp(chunk->type, "ds64", 4) && chunk_length >= sizeof(WAV_DS64_Chunk)) {
+			rf64_data_size = ((const WAV_DS64_Chunk*)&wav.view[chunk_start])->data_size;
+		}
+		else if (!strncmp(chunk->type, "fmt ", 4)) {
+			fmt = (const WAV_Fmt_Chunk*)&wav.view[chunk_start];
+			if (!parse_fmt_chunk(fmt, (u32)chunk_length, &wav.sample_type)) {
+				log_error("Unsupported WAV format in \"%ls\" (format %u, %u bits)\n", path, 
+						  chunk_length >= 16 ? fmt->sample_type : 0, chunk_length >= 16 ? fmt->bits_per_sample : 0);
+				unmap_file(wav.view, wav.file_size);
+				return NULL;
+			}
 		} 
-		else if (!strncmp(chunk.type, "data", 4)) {
-			format->total_samples = chunk.length / format->sample_size;
-			g_wav.pcm_start_offset = ftell(g_wav.io);
+		else if (!strncmp(chunk->type, "data", 4)) {
+			if (!fmt) {
+				log_error("WAV data chunk before format chunk in \"%ls\"\n", path);
+				unmap_file(wav.view, wav.file_size);
+				return NULL;
+			}
+			if (chunk->length == 0xffffffff && rf64_data_size) {
+				chunk_length = MIN(rf64_data_size, wav.file_size - chunk_start);
+			}
+			wav.data = &wav.view[chunk_start];
+			wav.bytes_per_frame = fmt->bytes_per_frame;
+			wav.total_frames = chunk_length / wav.bytes_per_frame;
 			break;
 		}
 		else {
-			log_debug("Skipping chunk \"%s\"\n", chunk.type);
-			fseek(g_wav.io, chunk.length, SEEK_CUR);
+			log_debug("Skipping chunk \"%.4s\"\n", chunk->type);
 		}
+		
+		// Chunks are padded to an even length
+		offset = chunk_start + chunk->length + (chunk->length & 1);
 	};
 	
+	format->sample_rate = fmt->sample_rate;
+	format->sample_size = fmt->bits_per_sample / 8;
+	format->sample_type = wav.sample_type;
+	format->total_samples = wav.total_frames * fmt->num_channels;
+	
 	log_debug("WAV Header:\n"
 			  "Channels: %d\n"
 			  "Sample rate: %u Hz\n"
 			  "Sample size: %u bytes\n"
-			  "Total samples: %u\n",
-			  fmt.num_channels,
+			  "Total samples: %llu\n",
+			  fmt->num_channels,
 			  format->sample_rate,
 			  format->sample_size,
 			  format->total_samples);
 	
-	if (fmt.num_channels != 2) {
+	if (fmt->num_channels != 2) {
 		log_error("Non-stereo WAV streaming not implemented\n");
-		return false;
+		unmap_file(wav.view, wav.file_size);
+		return NULL;
 	}
 	
-	g_wav.total_samples = format->total_samples;
-	g_wav.sample_size = format->sample_size;
-	g_wav.current_sample = 0;
-	// 1 second of buffer.
-	g_wav.conversion_buffer_size = (buffer_duration_ms / 1000.f) * format->sample_rate;
-	g_wav.conversion_buffer = (s32*)malloc(g_wav.conversion_buffer_size * 4 * 2);
-	return true;
-}
-
-static void convert_24bit_to_float(void *in_bytes, float *out, u32 count) {
-	u32 bytes_read = 0;
-	u8 *in = (u8*)in_bytes;
-	for (u32 i = 0; i < count*3; i += 3) {		
-		out[i/3] = ((in[i] << 8) | (in[i+1] << 16) | (in[i+2] << 24)) / (float)INT32_MAX;
-	}
-}
-
-static void convert_16bit_to_float(void *in_bytes, float *out, u32 count) {
-	s16 *in = (s16*)in_bytes;
-	for (u32 i = 0; i < count; ++i) {
-		out[i] = in[i] / (float)INT16_MAX;
-	}
+	prefetch_wav(&wav, 0);
+	
+	WAV_Stream *stream = (WAV_Stream*)malloc(sizeof(WAV_Stream));
+	*stream = wav;
+	return stream;
 }
 
-int decode_wav(u32 num_frames, float *out_buffer) {
-	u8 *buffer = (u8*)g_wav.conversion_buffer;
-	
-	fread(buffer, num_frames*2, g_wav.sample_size, g_wav.io);
+u32 decode_wav(void *stream, u32 num_frames, float *out_buffer) {
+	WAV_Stream *wav = (WAV_Stream*)stream;
+	u32 frame_count = (u32)MIN((u64)num_frames, wav->total_frames - wav->current_frame);
+	u64 offset = wav->current_frame * wav->bytes_per_frame;
+	const u8 *in = &wav->data[offset];
+	u32 sample_count = frame_count * 2;
 	
-	if (feof(g_wav.io) || g_wav.current_sample >= g_wav.total_samples)
-		return false;
+	// Ask for the next window while there is still half of this one left to read
+	if (offset + WAV_PREFETCH_SIZE/2 >= wav->prefetch_end) prefetch_wav(wav, wav->prefetch_end);
 	
-	u32 num_samples = num_frames * 2;
-	
-	switch (g_wav.sample_size) {
-		case 3:
-		convert_24bit_to_float(buffer, out_buffer, num_samples);
+	switch (wav->sample_type) {
+		case PCM_TYPE_S16:
+		pcm_s16_to_f32((const s16*)in, out_buffer, sample_count);
+		break;
+		case PCM_TYPE_S24:
+		pcm_s24_to_f32(in, out_buffer, sample_count);
+		break;
+		case PCM_TYPE_S32:
+		pcm_s32_to_f32((const s32*)in, out_buffer, sample_count);
 		break;
-		case 2:
-		convert_16bit_to_float(buffer, out_buffer, num_samples);
+		case PCM_TYPE_F32:
+		memcpy(out_buffer, in, sample_count * sizeof(float));
 		break;
 	}
 	
-	g_wav.current_sample += num_samples;
-	return true;
+	wav->current_frame += frame_count;
+	return frame_count;
 }
 
-int seek_wav(u64 sample) {
-	fseek(g_wav.io, g_wav.pcm_start_offset + (g_wav.sample_size * sample), SEEK_SET);
-	g_wav.current_sample = sample;
+int seek_wav(void *stream, u64 sample) {
+	WAV_Stream *wav = (WAV_Stream*)stream;
+	// Samples are interleaved, so round down to the start of a frame
+	wav->current_frame = MIN(sample / 2, wav->total_frames);
+	prefetch_wav(wav, wav->current_frame * wav->bytes_per_frame);
 	return true;
 }
 
-u64 get_sample_wav() {
-	return g_wav.current_sample;
+u64 get_sample_wav(void *stream) {
+	return ((WAV_Stream*)stream)->current_frame * 2;
 }
 
-void close_wav() {
-	fclose(g_wav.io);
-	free(g_wav.conversion_buffer);
-}
\ No newline at end of file
+void close_wav(void *stream) {
+	WAV_Stream *wav = (WAV_Stream*)stream;
+	unmap_file(wav->view, wav->file_size);
+	free(wav);
+}
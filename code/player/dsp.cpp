@@ -0,0 +1,501 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "dsp.h"
+#include "cpu.h"
+#include "pcm.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(CPU_X86)
+#include <immintrin.h>
+#elif defined(CPU_ARM64)
+#include <arm_neon.h>
+#endif
+
+// Set on the shared slot index when the writer has swapped in something the reader hasn't taken
+#define DSP_SETTINGS_NEW 0x80000000u
+// Bands closer to flat than this are left out
+#define DSP_EQ_MIN_GAIN_DB 0.01f
+// The limiter's running sum is recomputed this often so rounding can't build up
+#define DSP_LIMITER_RESUM_INTERVAL (1u << 20)
+#define PI 3.14159265358979323846
+
+void Dsp_Settings_Exchange::init(const Dsp_Settings *settings) {
+	for (u32 i = 0; i < 3; ++i) this->slots[i] = *settings;
+	this->latest = *settings;
+	this->write_slot = 0;
+	this->read_slot = 1;
+	this->shared_slot.store(2);
+}
+
+void Dsp_Settings_Exchange::write(const Dsp_Settings *settings) {
+	this->slots[this->write_slot] = *settings;
+	this->latest = *settings;
+	u32 previous = this->shared_slot.exchange(this->write_slot | DSP_SETTINGS_NEW, std::memory_order_acq_rel);
+	this->write_slot = previous & ~DSP_SETTINGS_NEW;
+}
+
+bool Dsp_Settings_Exchange::read(const Dsp_Settings **settings) {
+	bool changed = false;
+	
+	if (this->shared_slot.load(std::memory_order_relaxed) & DSP_SETTINGS_NEW) {
+		u32 previous = this->shared_slot.exchange(this->read_slot, std::memory_order_acq_rel);
+		this->read_slot = previous & ~DSP_SETTINGS_NEW;
+		changed = true;
+	}
+	
+	*settings = &this->slots[this->read_slot];
+	return changed;
+}
+
+void get_default_dsp_settings(Dsp_Settings *settings) {
+	static const float frequencies[DSP_MAX_EQ_BANDS] = {31.f, 62.f, 125.f, 250.f, 500.f, 1000.f, 2000.f, 4000.f, 8000.f, 16000.f};
+	
+	memset(settings, 0, sizeof(Dsp_Settings));
+	for (u32 i = 0; i < DSP_MAX_EQ_BANDS; ++i) {
+		settings->bands[i].type = EQ_BAND_PEAK;
+		settings->bands[i].frequency = frequencies[i];
+		// One octave wide
+		settings->bands[i].q = 1.41f;
+	}
+	
+	settings->band_count = DSP_MAX_EQ_BANDS;
+	settings->limiter_threshold_db = -1.f;
+	settings->limiter_release_ms = 100.f;
+	settings->volume = 1.f;
+}
+
+const char *get_eq_band_type_name(enum Eq_Band_Type type) {
+	static const char *names[EQ_BAND_TYPE_COUNT] = {"Peak", "Low shelf", "High shelf", "Low pass", "High pass"};
+	return type < EQ_BAND_TYPE_COUNT ? names[type] : "Unknown";
+}
+
+static inline float db_to_gain(float db) {
+	return powf(10.f, db / 20.f);
+}
+
+// Robert Bristow-Johnson's cookbook filters. Returns false if the band wouldn't change anything.
+static bool design_biquad(const Eq_Band *band, u32 sample_rate, Biquad_Coefficients *out) {
+	const double nyquist = sample_rate * 0.5;
+	const bool is_pass = band->type == EQ_BAND_LOW_PASS || band->type == EQ_BAND_HIGH_PASS;
+	
+	if (band->frequency <= 0.f || band->frequency >= nyquist * 0.99 || band->q <= 0.f) return false;
+	if (!is_pass && fabsf(band->gain_db) < DSP_EQ_MIN_GAIN_DB) return false;
+	
+	const double a = pow(10.0, band->gain_db / 40.0);
+	const double w0 = 2.0 * PI * band->frequency / sample_rate;
+	const double cos_w0 = cos(w0);
+	const double alpha = sin(w0) / (2.0 * band->q);
+	const double sqrt_a_alpha = 2.0 * sqrt(a) * alpha;
+	double b0, b1, b2, a0, a1, a2;
+	
+	switch (band->type) {
+		case EQ_BAND_PEAK:
+		b0 = 1.0 + alpha * a;
+		b1 = -2.0 * cos_w0;
+		b2 = 1.0 - alpha * a;
+		a0 = 1.0 + alpha / a;
+		a1 = -2.0 * cos_w0;
+		a2 = 1.0 - alpha / a;
+		break;
+		case EQ_BAND_LOW_SHELF:
+		b0 = a * ((a + 1.0) - (a - 1.0) * cos_w0 + sqrt_a_alpha);
+		b1 = 2.0 * a * ((a - 1.0) - (a + 1.0) * cos_w0);
+		b2 = a * ((a + 1.0) - (a - 1.0) * cos_w0 - sqrt_a_alpha);
+		a0 = (a + 1.0) + (a - 1.0) * cos_w0 + sqrt_a_alpha;
+		a1 = -2.0 * ((a - 1.0) + (a + 1.0) * cos_w0);
+		a2 = (a + 1.0) + (a - 1.0) * cos_w0 - sqrt_a_alpha;
+		break;
+		case EQ_BAND_HIGH_SHELF:
+		b0 = a * ((a + 1.0) + (a - 1.0) * cos_w0 + sqrt_a_alpha);
+		b1 = -2.0 * a * ((a - 1.0) + (a + 1.0) * cos_w0);
+		b2 = a * ((a + 1.0) + (a - 1.0) * cos_w0 - sqrt_a_alpha);
+		a0 = (a + 1.0) - (a - 1.0) * cos_w0 + sqrt_a_alpha;
+		a1 = 2.0 * ((a - 1.0) - (a + 1.0) * cos_w0);
+		a2 = (a + 1.0) - (a - 1.0) * cos_w0 - sqrt_a_alpha;
+		break;
+		case EQ_BAND_LOW_PASS:
+		b0 = (1.0 - cos_w0) * 0.5;
+		b1 = 1.0 - cos_w0;
+		b2 = (1.0 - cos_w0) * 0.5;
+		a0 = 1.0 + alpha;
+		a1 = -2.0 * cos_w0;
+		a2 = 1.0 - alpha;
+		break;
+		case EQ_BAND_HIGH_PASS:
+		b0 = (1.0 + cos_w0) * 0.5;
+		b1 = -(1.0 + cos_w0);
+		b2 = (1.0 + cos_w0) * 0.5;
+		a0 = 1.0 + alpha;
+		a1 = -2.0 * cos_w0;
+		a2 = 1.0 - alpha;
+		break;
+		default:
+		return false;
+	}
+	
+	for (u32 i = 0; i < 4; ++i) {
+		out->b0[i] = (float)(b0 / a0);
+		out->b1[i] = (float)(b1 / a0);
+		out->b2[i] = (float)(b2 / a0);
+		out->a1[i] = (float)(a1 / a0);
+		out->a2[i] = (float)(a2 / a0);
+	}
+	
+	return true;
+}
+
+// Every band runs on a frame before the next frame, since each filter feeds back on itself
+static void eq_scalar(const Biquad_Coefficients *coefficients, Biquad_State *state, u32 band_count,
+					  float *frames, u32 frame_count) {
+	for (u32 i = 0; i < frame_count; ++i) {
+		for (u32 c = 0; c < 2; ++c) {
+			float x = frames[i*2+c];
+			
+			for (u32 b = 0; b < band_count; ++b) {
+				const Biquad_Coefficients *k = &coefficients[b];
+				Biquad_State *s = &state[b];
+				float y = k->b0[0] * x + s->z1[c];
+				s->z1[c] = k->b1[0] * x - k->a1[0] * y + s->z2[c];
+				s->z2[c] = k->b2[0] * x - k->a2[0] * y;
+				x = y;
+			}
+			
+			frames[i*2+c] = x;
+		}
+	}
+}
+
+#if defined(CPU_X86)
+// Left and right go through each band together in the low two lanes
+static void eq_sse(const Biquad_Coefficients *coefficients, Biquad_State *state, u32 band_count,
+				   float *frames, u32 frame_count) {
+	__m128 z1[DSP_MAX_EQ_BANDS], z2[DSP_MAX_EQ_BANDS];
+	
+	for (u32 b = 0; b < band_count; ++b) {
+		z1[b] = _mm_loadu_ps(state[b].z1);
+		z2[b] = _mm_loadu_ps(state[b].z2);
+	}
+	
+	for (u32 i = 0; i < frame_count; ++i) {
+		__m128 x = _mm_castpd_ps(_mm_load_sd((const double*)&frames[i*2]));
+		
+		for (u32 b = 0; b < band_count; ++b) {
+			const Biquad_Coefficients *k = &coefficients[b];
+			__m128 y = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(k->b0), x), z1[b]);
+			z1[b] = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(k->b1), x), _mm_mul_ps(_mm_loadu_ps(k->a1), y)), z2[b]);
+			z2[b] = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(k->b2), x), _mm_mul_ps(_mm_loadu_ps(k->a2), y));
+			x = y;
+		}
+		
+		_mm_store_sd((double*)&frames[i*2], _mm_castps_pd(x));
+	}
+	
+	for (u32 b = 0; b < band_count; ++b) {
+		_mm_storeu_ps(state[b].z1, z1[b]);
+		_mm_storeu_ps(state[b].z2, z2[b]);
+	}
+}
+#endif
+
+#if defined(CPU_ARM64)
+static void eq_neon(const Biquad_Coefficients *coefficients, Biquad_State *state, u32 band_count,
+					float *frames, u32 frame_count) {
+	float32x2_t z1[DSP_MAX_EQ_BANDS], z2[DSP_MAX_EQ_BANDS];
+	
+	for (u32 b = 0; b < band_count; ++b) {
+		z1[b] = vld1_f32(state[b].z1);
+		z2[b] = vld1_f32(state[b].z2);
+	}
+	
+	for (u32 i = 0; i < frame_count; ++i) {
+		float32x2_t x = vld1_f32(&frames[i*2]);
+		
+		for (u32 b = 0; b < band_count; ++b) {
+			const Biquad_Coefficients *k = &coefficients[b];
+			float32x2_t y = vfma_f32(z1[b], vld1_f32(k->b0), x);
+			z1[b] = vfms_f32(vfma_f32(z2[b], vld1_f32(k->b1), x), vld1_f32(k->a1), y);
+			z2[b] = vfms_f32(vmul_f32(vld1_f32(k->b2), x), vld1_f32(k->a2), y);
+			x = y;
+		}
+		
+		vst1_f32(&frames[i*2], x);
+	}
+	
+	for (u32 b = 0; b < band_count; ++b) {
+		vst1_f32(state[b].z1, z1[b]);
+		vst1_f32(state[b].z2, z2[b]);
+	}
+}
+#endif
+
+static Dsp_Eq_Kernel *pick_eq_kernel(const char **name) {
+	u32 features = get_cpu_features();
+
+#if defined(CPU_X86)
+	if (features & CPU_FEATURE_SSE2) {
+		*name = "SSE";
+		return &eq_sse;
+	}
+#elif defined(CPU_ARM64)
+	if (features & CPU_FEATURE_NEON) {
+		*name = "NEON";
+		return &eq_neon;
+	}
+#endif
+	
+	*name = "scalar";
+	return &eq_scalar;
+}
+
+const char *get_dsp_kernel_name() {
+	const char *name;
+	pick_eq_kernel(&name);
+	return name;
+}
+
+void Smoothed_Gain::init(float gain, u32 ramp_frames) {
+	this->current = gain;
+	this->target = gain;
+	this->step = 0.f;
+	this->ramp_frames = MAX(ramp_frames, 1);
+	this->ramp_remaining = 0;
+}
+
+void Smoothed_Gain::set_target(float gain) {
+	if (gain == this->target) return;
+	this->target = gain;
+	this->ramp_remaining = this->ramp_frames;
+	this->step = (gain - this->current) / this->ramp_frames;
+}
+
+void Smoothed_Gain::process(float *frames, u32 frame_count) {
+	u32 ramp_count = MIN(this->ramp_remaining, frame_count);
+	
+	for (u32 i = 0; i < ramp_count; ++i) {
+		this->current += this->step;
+		frames[i*2+0] *= this->current;
+		frames[i*2+1] *= this->current;
+	}
+	
+	this->ramp_remaining -= ramp_count;
+	// Land exactly on the target, whatever rounding did on the way
+	if (ramp_count && !this->ramp_remaining) this->current = this->target;
+	
+	if (ramp_count < frame_count && this->current != 1.f) {
+		pcm_scale_f32(&frames[ramp_count*2], &frames[ramp_count*2], (frame_count - ramp_count) * 2, this->current);
+	}
+}
+
+void Lookahead_Limiter::init(u32 sample_rate) {
+	this->lookahead_frames = MAX((sample_rate * DSP_LIMITER_LOOKAHEAD_MS) / 1000, 1);
+	this->delay = (float*)malloc(this->lookahead_frames * 2 * sizeof(float));
+	this->needed_gains = (float*)malloc((this->lookahead_frames + 1) * sizeof(float));
+	this->minimum_queue = (u32*)malloc((this->lookahead_frames + 1) * sizeof(u32));
+	this->minimums = (float*)malloc(this->lookahead_frames * sizeof(float));
+	this->threshold = 1.f;
+	this->release = 0.f;
+	this->reset();
+}
+
+void Lookahead_Limiter::set(float threshold_db, float release_ms, u32 sample_rate) {
+	this->threshold = db_to_gain(MIN(threshold_db, 0.f));
+	this->release = (float)exp(-1.0 / (MAX(release_ms, 1.f) * 0.001 * sample_rate));
+}
+
+void Lookahead_Limiter::reset() {
+	const u32 window = this->lookahead_frames + 1;
+	
+	memset(this->delay, 0, this->lookahead_frames * 2 * sizeof(float));
+	for (u32 i = 0; i < window; ++i) this->needed_gains[i] = 1.f;
+	for (u32 i = 0; i < this->lookahead_frames; ++i) this->minimums[i] = 1.f;
+	this->minimum_sum = this->lookahead_frames;
+	this->frames_since_resum = 0;
+	this->delay_index = 0;
+	this->gain_index = 0;
+	this->queue_head = 0;
+	this->queue_count = 0;
+	this->envelope = 1.f;
+}
+
+void Lookahead_Limiter::process(float *frames, u32 frame_count) {
+	const u32 window = this->lookahead_frames + 1;
+	const double inverse_length = 1.0 / this->lookahead_frames;
+	const float threshold = this->threshold;
+	
+	for (u32 i = 0; i < frame_count; ++i) {
+		const u32 delay_index = this->delay_index;
+		const u32 gain_index = this->gain_index;
+		float left = frames[i*2+0], right = frames[i*2+1];
+		float peak = MAX(fabsf(left), fabsf(right));
+		float needed = peak > threshold ? threshold / peak : 1.f;
+		
+		// Sliding minimum over this frame and the lookahead_frames before it. The slot being written
+		// held the frame that just left the window. Gains at the back that aren't smaller than the
+		// new one can never be the minimum again.
+		if (this->queue_count && this->minimum_queue[this->queue_head] == gain_index) {
+			this->queue_head = this->queue_head + 1 == window ? 0 : this->queue_head + 1;
+			this->queue_count--;
+		}
+		while (this->queue_count) {
+			u32 back = this->queue_head + this->queue_count - 1;
+			if (back >= window) back -= window;
+			if (this->needed_gains[this->minimum_queue[back]] < needed) break;
+			this->queue_count--;
+		}
+		u32 tail = this->queue_head + this->queue_count;
+		this->minimum_queue[tail >= window ? tail - window : tail] = gain_index;
+		this->queue_count++;
+		this->needed_gains[gain_index] = needed;
+		float minimum = this->needed_gains[this->minimum_queue[this->queue_head]];
+		
+		// Every minimum averaged here covers the frame leaving the delay line, so the average is never
+		// more than that frame needs
+		this->minimum_sum += minimum - this->minimums[delay_index];
+		this->minimums[delay_index] = minimum;
+		if (++this->frames_since_resum == DSP_LIMITER_RESUM_INTERVAL) {
+			this->minimum_sum = 0.0;
+			for (u32 j = 0; j < this->lookahead_frames; ++j) this->minimum_sum += this->minimums[j];
+			this->frames_since_resum = 0;
+		}
+		float average = (float)(this->minimum_sum * inverse_length);
+		
+		// Down as fast as the average goes, back up at the release rate
+		if (average < this->envelope) this->envelope = average;
+		else this->envelope = average + (this->envelope - average) * this->release;
+		
+		float out_left = this->delay[delay_index*2+0] * this->envelope;
+		float out_right = this->delay[delay_index*2+1] * this->envelope;
+		this->delay[delay_index*2+0] = left;
+		this->delay[delay_index*2+1] = right;
+		
+		// Only rounding can get past the envelope
+		frames[i*2+0] = MIN(MAX(out_left, -threshold), threshold);
+		frames[i*2+1] = MIN(MAX(out_right, -threshold), threshold);
+		
+		this->delay_index = delay_index + 1 == this->lookahead_frames ? 0 : delay_index + 1;
+		this->gain_index = gain_index + 1 == window ? 0 : gain_index + 1;
+	}
+}
+
+void Lookahead_Limiter::free() {
+	::free(this->delay);
+	::free(this->needed_gains);
+	::free(this->minimum_queue);
+	::free(this->minimums);
+	this->delay = NULL;
+	this->needed_gains = NULL;
+	this->minimum_queue = NULL;
+	this->minimums = NULL;
+}
+
+void Dsp_Chain::init(u32 sample_rate, const Dsp_Settings *settings) {
+	const char *kernel_name;
+	u32 ramp_frames = (sample_rate * DSP_GAIN_RAMP_MS) / 1000;
+	
+	this->sample_rate = sample_rate;
+	this->eq_kernel = pick_eq_kernel(&kernel_name);
+	this->active_band_count = 0;
+	this->convolver = NULL;
+	this->limiter_enabled = false;
+	this->limiter.init(sample_rate);
+	// Start where the settings are rather than ramping up to them
+	this->preamp.init(db_to_gain(settings->preamp_db), ramp_frames);
+	this->volume.init(settings->volume, ramp_frames);
+	this->apply_settings(settings);
+	
+	log_debug("DSP chain at %uHz (%s)\n", sample_rate, kernel_name);
+}
+
+void Dsp_Chain::apply_settings(const Dsp_Settings *settings) {
+	Biquad_State old_state[DSP_MAX_EQ_BANDS];
+	u32 old_bands[DSP_MAX_EQ_BANDS];
+	u32 old_count = this->active_band_count;
+	
+	memcpy(old_state, this->state, sizeof(Biquad_State) * old_count);
+	memcpy(old_bands, this->active_bands, sizeof(u32) * old_count);
+	this->active_band_count = 0;
+	
+	for (u32 i = 0; settings->eq_enabled && i < MIN(settings->band_count, DSP_MAX_EQ_BANDS); ++i) {
+		u32 slot = this->active_band_count;
+		if (!design_biquad(&settings->bands[i], this->sample_rate, &this->coefficients[slot])) continue;
+		
+		memset(&this->state[slot], 0, sizeof(Biquad_State));
+		for (u32 j = 0; j < old_count; ++j) {
+			if (old_bands[j] == i && this->settings.bands[i].type == settings->bands[i].type) {
+				this->state[slot] = old_state[j];
+				break;
+			}
+		}
+		
+		this->active_bands[slot] = i;
+		this->active_band_count++;
+	}
+	
+	this->preamp.set_target(db_to_gain(settings->preamp_db));
+	this->volume.set_target(MIN(MAX(settings->volume, 0.f), 1.f));
+	this->limiter.set(settings->limiter_threshold_db, settings->limiter_release_ms, this->sample_rate);
+	
+	// Turning these on starts from silence rather than whatever was left from last time
+	if (settings->limiter_enabled && !this->limiter_enabled) this->limiter.reset();
+	if (settings->convolution_enabled && !this->settings.convolution_enabled && this->convolver) this->convolver->reset();
+	this->limiter_enabled = settings->limiter_enabled;
+	this->settings = *settings;
+}
+
+Convolver *Dsp_Chain::set_convolver(Convolver *convolver) {
+	Convolver *previous = this->convolver;
+	this->convolver = convolver;
+	return previous;
+}
+
+void Dsp_Chain::reset() {
+	memset(this->state, 0, sizeof(this->state));
+	this->limiter.reset();
+	if (this->convolver) this->convolver->reset();
+}
+
+void Dsp_Chain::process(float *frames, u32 frame_count) {
+	if (!frame_count || this->is_bypassed()) return;
+
+#if defined(CPU_X86)
+	// Filter tails decay into denormals, which are very slow on x86
+	u32 csr = _mm_getcsr();
+	_mm_setcsr(csr | 0x8040);
+#endif
+	
+	if (this->active_band_count) {
+		this->eq_kernel(this->coefficients, this->state, this->active_band_count, frames, frame_count);
+	}
+	if (this->convolver && this->settings.convolution_enabled) this->convolver->process(frames, frame_count);
+	if (!this->preamp.is_unity()) this->preamp.process(frames, frame_count);
+	if (this->limiter_enabled) this->limiter.process(frames, frame_count);
+	if (!this->volume.is_unity()) this->volume.process(frames, frame_count);
+
+#if defined(CPU_X86)
+	_mm_setcsr(csr);
+#endif
+}
+
+bool Dsp_Chain::is_bypassed() const {
+	bool convolving = this->convolver && this->settings.convolution_enabled;
+	return !this->active_band_count && !convolving && this->preamp.is_unity() && !this->limiter_enabled && this->volume.is_unity();
+}
+
+void Dsp_Chain::free() {
+	this->limiter.free();
+}
@@ -0,0 +1,193 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#ifndef DSP_H
+#define DSP_H
+
+#include "common.h"
+#include "convolver.h"
+#include <atomic>
+
+// Processing on output-rate interleaved stereo floats, between the ring and the device.
+// The chain runs in this order: EQ, convolution, preamp, limiter, volume.
+
+#define DSP_MAX_EQ_BANDS 10
+// Gain changes are spread over this long so they don't click
+#define DSP_GAIN_RAMP_MS 20
+// How far ahead the limiter looks, which is also how much it delays the audio
+#define DSP_LIMITER_LOOKAHEAD_MS 5
+
+enum Eq_Band_Type {
+	EQ_BAND_PEAK,
+	EQ_BAND_LOW_SHELF,
+	EQ_BAND_HIGH_SHELF,
+	// Gain is ignored by the passes
+	EQ_BAND_LOW_PASS,
+	EQ_BAND_HIGH_PASS,
+	EQ_BAND_TYPE_COUNT,
+};
+
+struct Eq_Band {
+	enum Eq_Band_Type type;
+	// Hz. Bands above the output Nyquist frequency are left out.
+	float frequency;
+	float gain_db;
+	float q;
+};
+
+// Everything about the chain that can be changed while it runs
+struct Dsp_Settings {
+	Eq_Band bands[DSP_MAX_EQ_BANDS];
+	u32 band_count;
+	bool eq_enabled;
+	// Only does anything once the chain has a convolver
+	bool convolution_enabled;
+	float preamp_db;
+	bool limiter_enabled;
+	// Peaks are held under this
+	float limiter_threshold_db;
+	float limiter_release_ms;
+	// 0 to 1
+	float volume;
+};
+
+// Hands settings from one writer thread to the audio thread without either side waiting. A triple
+// buffer: the writer fills a slot of its own and swaps it with the shared one, and the reader swaps
+// its slot for the shared one when the shared one is newer.
+struct Dsp_Settings_Exchange {
+	Dsp_Settings slots[3];
+	// Index of the shared slot, with DSP_SETTINGS_NEW set until the reader takes it
+	std::atomic<u32> shared_slot;
+	u32 write_slot;
+	u32 read_slot;
+	// What was written last, for the writer to read back
+	Dsp_Settings latest;
+	
+	void init(const Dsp_Settings *settings);
+	// Writer side
+	void write(const Dsp_Settings *settings);
+	// Reader side. Always gives the newest settings, and returns true if they changed since the last call.
+	bool read(const Dsp_Settings **settings);
+};
+
+// Ten octave bands from 31Hz to 16kHz, all flat, EQ and limiter off and full volume
+void get_default_dsp_settings(Dsp_Settings *settings);
+const char *get_eq_band_type_name(enum Eq_Band_Type type);
+
+// Normalized transposed direct form II coefficients. Each one is stored four times so the SIMD
+// kernels can load them as they are.
+struct Biquad_Coefficients {
+	float b0[4];
+	float b1[4];
+	float b2[4];
+	float a1[4];
+	float a2[4];
+};
+
+// Left and right delay state of one biquad, padded to a vector each
+struct Biquad_State {
+	float z1[4];
+	float z2[4];
+};
+
+typedef void Dsp_Eq_Kernel(const Biquad_Coefficients *coefficients, Biquad_State *state, u32 band_count,
+						   float *frames, u32 frame_count);
+
+// A gain that moves to its target in a straight line over DSP_GAIN_RAMP_MS
+struct Smoothed_Gain {
+	float current;
+	float target;
+	float step;
+	u32 ramp_frames;
+	u32 ramp_remaining;
+	
+	void init(float gain, u32 ramp_frames);
+	void set_target(float gain);
+	void process(float *frames, u32 frame_count);
+	// True if process() would do nothing
+	bool is_unity() const {return this->current == 1.f && !this->ramp_remaining;}
+};
+
+// Brickwall peak limiter. The gain for each frame is the smallest any frame in the lookahead window
+// needs, smoothed with a moving average over the window so it ramps down in time and never overshoots.
+struct Lookahead_Limiter {
+	u32 lookahead_frames;
+	float threshold;
+	// Per-frame release coefficient
+	float release;
+	float envelope;
+	
+	// Delay line of frames, lookahead_frames long. Also indexes minimums.
+	float *delay;
+	u32 delay_index;
+	// Gains the last lookahead_frames + 1 frames need, and a queue of indices into them that
+	// keeps the smallest at the front
+	float *needed_gains;
+	u32 gain_index;
+	u32 *minimum_queue;
+	u32 queue_head;
+	u32 queue_count;
+	// Sliding minimums, for the moving average
+	float *minimums;
+	double minimum_sum;
+	u32 frames_since_resum;
+	
+	void init(u32 sample_rate);
+	void set(float threshold_db, float release_ms, u32 sample_rate);
+	// Silent delay line and no gain reduction
+	void reset();
+	void process(float *frames, u32 frame_count);
+	void free();
+};
+
+// Runs on one thread at a time. Nothing after init() allocates.
+struct Dsp_Chain {
+	u32 sample_rate;
+	Dsp_Settings settings;
+	
+	Dsp_Eq_Kernel *eq_kernel;
+	// Only the bands that change anything, in order
+	Biquad_Coefficients coefficients[DSP_MAX_EQ_BANDS];
+	Biquad_State state[DSP_MAX_EQ_BANDS];
+	// Index into settings.bands of each of them
+	u32 active_bands[DSP_MAX_EQ_BANDS];
+	u32 active_band_count;
+	
+	// Belongs to whoever set it
+	Convolver *convolver;
+	Smoothed_Gain preamp;
+	Smoothed_Gain volume;
+	Lookahead_Limiter limiter;
+	bool limiter_enabled;
+	
+	void init(u32 sample_rate, const Dsp_Settings *settings);
+	// The convolver has to be for the chain's sample rate. Returns the one it replaces, or NULL.
+	Convolver *set_convolver(Convolver *convolver);
+	// Filter state carries over where the band is the same, so small changes don't click
+	void apply_settings(const Dsp_Settings *settings);
+	// After a seek or anything else that breaks the audio. Gains and the convolver stay where they are.
+	void reset();
+	// In place
+	void process(float *frames, u32 frame_count);
+	// True if process() would leave the audio alone
+	bool is_bypassed() const;
+	// Leaves the convolver to its owner
+	void free();
+};
+
+// Name of the EQ kernel the next init() will pick
+const char *get_dsp_kernel_name();
+
+#endif //DSP_H
@@ -0,0 +1,374 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+// Iterative radix-2 decimation in time on split complex arrays, so the butterflies of a stage are
+// plain vector loops. The first two stages need no multiplies and are done together. The inverse is
+// the forward transform with the real and imaginary arrays swapped.
+#include "fft.h"
+#include "cpu.h"
+#include <math.h>
+#include <stdlib.h>
+
+#if defined(CPU_X86)
+#include <immintrin.h>
+#elif defined(CPU_ARM64)
+#include <arm_neon.h>
+#endif
+
+#define PI 3.14159265358979323846
+
+struct Fft_Kernels {
+	const char *name;
+	// One stage of butterflies over all n points, half points apart. half is at least 4.
+	void (*butterflies)(float *re, float *im, const float *twiddle_re, const float *twiddle_im, u32 n, u32 half);
+	// acc += a * b. count is a multiple of 8.
+	void (*multiply_accumulate)(const float *a_re, const float *a_im, const float *b_re, const float *b_im,
+								float *acc_re, float *acc_im, u32 count);
+};
+
+// The SIMD kernels finish off whatever doesn't fill a vector with these
+static void butterflies_scalar(float *re, float *im, const float *twiddle_re, const float *twiddle_im, u32 n, u32 half) {
+	for (u32 group = 0; group < n; group += half * 2) {
+		float *a_re = &re[group], *a_im = &im[group];
+		float *b_re = &re[group + half], *b_im = &im[group + half];
+		
+		for (u32 j = 0; j < half; ++j) {
+			float t_re = b_re[j] * twiddle_re[j] - b_im[j] * twiddle_im[j];
+			float t_im = b_re[j] * twiddle_im[j] + b_im[j] * twiddle_re[j];
+			b_re[j] = a_re[j] - t_re;
+			b_im[j] = a_im[j] - t_im;
+			a_re[j] += t_re;
+			a_im[j] += t_im;
+		}
+	}
+}
+
+static void multiply_accumulate_scalar(const float *a_re, const float *a_im, const float *b_re, const float *b_im,
+									   float *acc_re, float *acc_im, u32 count) {
+	for (u32 i = 0; i < count; ++i) {
+		acc_re[i] += a_re[i] * b_re[i] - a_im[i] * b_im[i];
+		acc_im[i] += a_re[i] * b_im[i] + a_im[i] * b_re[i];
+	}
+}
+
+static const Fft_Kernels g_scalar_kernels = {
+	"scalar", &butterflies_scalar, &multiply_accumulate_scalar,
+};
+
+#if defined(CPU_X86)
+static void butterflies_sse(float *re, float *im, const float *twiddle_re, const float *twiddle_im, u32 n, u32 half) {
+	for (u32 group = 0; group < n; group += half * 2) {
+		float *a_re = &re[group], *a_im = &im[group];
+		float *b_re = &re[group + half], *b_im = &im[group + half];
+		
+		for (u32 j = 0; j < half; j += 4) {
+			__m128 w_re = _mm_loadu_ps(&twiddle_re[j]), w_im = _mm_loadu_ps(&twiddle_im[j]);
+			__m128 x_re = _mm_loadu_ps(&b_re[j]), x_im = _mm_loadu_ps(&b_im[j]);
+			__m128 y_re = _mm_loadu_ps(&a_re[j]), y_im = _mm_loadu_ps(&a_im[j]);
+			__m128 t_re = _mm_sub_ps(_mm_mul_ps(x_re, w_re), _mm_mul_ps(x_im, w_im));
+			__m128 t_im = _mm_add_ps(_mm_mul_ps(x_re, w_im), _mm_mul_ps(x_im, w_re));
+			_mm_storeu_ps(&b_re[j], _mm_sub_ps(y_re, t_re));
+			_mm_storeu_ps(&b_im[j], _mm_sub_ps(y_im, t_im));
+			_mm_storeu_ps(&a_re[j], _mm_add_ps(y_re, t_re));
+			_mm_storeu_ps(&a_im[j], _mm_add_ps(y_im, t_im));
+		}
+	}
+}
+
+static void multiply_accumulate_sse(const float *a_re, const float *a_im, const float *b_re, const float *b_im,
+									float *acc_re, float *acc_im, u32 count) {
+	for (u32 i = 0; i < count; i += 4) {
+		__m128 x_re = _mm_loadu_ps(&a_re[i]), x_im = _mm_loadu_ps(&a_im[i]);
+		__m128 y_re = _mm_loadu_ps(&b_re[i]), y_im = _mm_loadu_ps(&b_im[i]);
+		__m128 re = _mm_sub_ps(_mm_mul_ps(x_re, y_re), _mm_mul_ps(x_im, y_im));
+		__m128 im = _mm_add_ps(_mm_mul_ps(x_re, y_im), _mm_mul_ps(x_im, y_re));
+		_mm_storeu_ps(&acc_re[i], _mm_add_ps(_mm_loadu_ps(&acc_re[i]), re));
+		_mm_storeu_ps(&acc_im[i], _mm_add_ps(_mm_loadu_ps(&acc_im[i]), im));
+	}
+}
+
+static const Fft_Kernels g_sse_kernels = {
+	"SSE", &butterflies_sse, &multiply_accumulate_sse,
+};
+
+TARGET_AVX2 static void butterflies_avx2(float *re, float *im, const float *twiddle_re, const float *twiddle_im, u32 n, u32 half) {
+	if (half < 8) {
+		butterflies_sse(re, im, twiddle_re, twiddle_im, n, half);
+		return;
+	}
+	
+	for (u32 group = 0; group < n; group += half * 2) {
+		float *a_re = &re[group], *a_im = &im[group];
+		float *b_re = &re[group + half], *b_im = &im[group + half];
+		
+		for (u32 j = 0; j < half; j += 8) {
+			__m256 w_re = _mm256_loadu_ps(&twiddle_re[j]), w_im = _mm256_loadu_ps(&twiddle_im[j]);
+			__m256 x_re = _mm256_loadu_ps(&b_re[j]), x_im = _mm256_loadu_ps(&b_im[j]);
+			__m256 y_re = _mm256_loadu_ps(&a_re[j]), y_im = _mm256_loadu_ps(&a_im[j]);
+			__m256 t_re = _mm256_fmsub_ps(x_re, w_re, _mm256_mul_ps(x_im, w_im));
+			__m256 t_im = _mm256_fmadd_ps(x_re, w_im, _mm256_mul_ps(x_im, w_re));
+			_mm256_storeu_ps(&b_re[j], _mm256_sub_ps(y_re, t_re));
+			_mm256_storeu_ps(&b_im[j], _mm256_sub_ps(y_im, t_im));
+			_mm256_storeu_ps(&a_re[j], _mm256_add_ps(y_re, t_re));
+			_mm256_storeu_ps(&a_im[j], _mm256_add_ps(y_im, t_im));
+		}
+	}
+}
+
+TARGET_AVX2 static void multiply_accumulate_avx2(const float *a_re, const float *a_im, const float *b_re, const float *b_im,
+												 float *acc_re, float *acc_im, u32 count) {
+	for (u32 i = 0; i < count; i += 8) {
+		__m256 x_re = _mm256_loadu_ps(&a_re[i]), x_im = _mm256_loadu_ps(&a_im[i]);
+		__m256 y_re = _mm256_loadu_ps(&b_re[i]), y_im = _mm256_loadu_ps(&b_im[i]);
+		__m256 re = _mm256_fmadd_ps(x_re, y_re, _mm256_loadu_ps(&acc_re[i]));
+		__m256 im = _mm256_fmadd_ps(x_re, y_im, _mm256_loadu_ps(&acc_im[i]));
+		_mm256_storeu_ps(&acc_re[i], _mm256_fnmadd_ps(x_im, y_im, re));
+		_mm256_storeu_ps(&acc_im[i], _mm256_fmadd_ps(x_im, y_re, im));
+	}
+}
+
+static const Fft_Kernels g_avx2_kernels = {
+	"AVX2", &butterflies_avx2, &multiply_accumulate_avx2,
+};
+#endif
+
+#if defined(CPU_ARM64)
+static void butterflies_neon(float *re, float *im, const float *twiddle_re, const float *twiddle_im, u32 n, u32 half) {
+	for (u32 group = 0; group < n; group += half * 2) {
+		float *a_re = &re[group], *a_im = &im[group];
+		float *b_re = &re[group + half], *b_im = &im[group + half];
+		
+		for (u32 j = 0; j < half; j += 4) {
+			float32x4_t w_re = vld1q_f32(&twiddle_re[j]), w_im = vld1q_f32(&twiddle_im[j]);
+			float32x4_t x_re = vld1q_f32(&b_re[j]), x_im = vld1q_f32(&b_im[j]);
+			float32x4_t y_re = vld1q_f32(&a_re[j]), y_im = vld1q_f32(&a_im[j]);
+			float32x4_t t_re = vfmsq_f32(vmulq_f32(x_re, w_re), x_im, w_im);
+			float32x4_t t_im = vfmaq_f32(vmulq_f32(x_re, w_im), x_im, w_re);
+			vst1q_f32(&b_re[j], vsubq_f32(y_re, t_re));
+			vst1q_f32(&b_im[j], vsubq_f32(y_im, t_im));
+			vst1q_f32(&a_re[j], vaddq_f32(y_re, t_re));
+			vst1q_f32(&a_im[j], vaddq_f32(y_im, t_im));
+		}
+	}
+}
+
+static void multiply_accumulate_neon(const float *a_re, const float *a_im, const float *b_re, const float *b_im,
+									 float *acc_re, float *acc_im, u32 count) {
+	for (u32 i = 0; i < count; i += 4) {
+		float32x4_t x_re = vld1q_f32(&a_re[i]), x_im = vld1q_f32(&a_im[i]);
+		float32x4_t y_re = vld1q_f32(&b_re[i]), y_im = vld1q_f32(&b_im[i]);
+		float32x4_t re = vfmaq_f32(vld1q_f32(&acc_re[i]), x_re, y_re);
+		float32x4_t im = vfmaq_f32(vld1q_f32(&acc_im[i]), x_re, y_im);
+		vst1q_f32(&acc_re[i], vfmsq_f32(re, x_im, y_im));
+		vst1q_f32(&acc_im[i], vfmaq_f32(im, x_im, y_re));
+	}
+}
+
+static const Fft_Kernels g_neon_kernels = {
+	"NEON", &butterflies_neon, &multiply_accumulate_neon,
+};
+#endif
+
+static const Fft_Kernels *pick_kernels() {
+	u32 features = get_cpu_features();
+
+#if defined(CPU_X86)
+	if ((features & CPU_FEATURE_AVX2) && (features & CPU_FEATURE_FMA)) return &g_avx2_kernels;
+	if (features & CPU_FEATURE_SSE2) return &g_sse_kernels;
+#elif defined(CPU_ARM64)
+	if (features & CPU_FEATURE_NEON) return &g_neon_kernels;
+#endif
+	
+	return &g_scalar_kernels;
+}
+
+const char *get_fft_kernel_name() {
+	return pick_kernels()->name;
+}
+
+// The first two stages of every group of four. Their twiddles are 1 and -i.
+static void first_stages(float *re, float *im, u32 n) {
+	for (u32 i = 0; i < n; i += 4) {
+		float s0_re = re[i+0] + re[i+1], s0_im = im[i+0] + im[i+1];
+		float s1_re = re[i+0] - re[i+1], s1_im = im[i+0] - im[i+1];
+		float s2_re = re[i+2] + re[i+3], s2_im = im[i+2] + im[i+3];
+		float s3_re = re[i+2] - re[i+3], s3_im = im[i+2] - im[i+3];
+		
+		re[i+0] = s0_re + s2_re;
+		im[i+0] = s0_im + s2_im;
+		re[i+2] = s0_re - s2_re;
+		im[i+2] = s0_im - s2_im;
+		// s3 times -i
+		re[i+1] = s1_re + s3_im;
+		im[i+1] = s1_im - s3_re;
+		re[i+3] = s1_re - s3_im;
+		im[i+3] = s1_im + s3_re;
+	}
+}
+
+// Complex forward transform of n points that are already in bit reversed order
+static void transform(const Fft *fft, float *re, float *im, u32 n) {
+	const float *twiddle_re = fft->twiddles;
+	const float *twiddle_im = &fft->twiddles[n];
+	
+	first_stages(re, im, n);
+	for (u32 half = 4; half < n; half *= 2) {
+		fft->kernels->butterflies(re, im, &twiddle_re[half], &twiddle_im[half], n, half);
+	}
+}
+
+void Fft::init(u32 size) {
+	DEBUG_ASSERT(size >= FFT_MIN_SIZE && size <= FFT_MAX_SIZE && !(size & (size - 1)));
+	const u32 n = size / 2;
+	u32 bits = 0;
+	
+	while ((1u << bits) < n) bits++;
+	
+	this->size = size;
+	this->kernels = pick_kernels();
+	this->twiddles = (float*)malloc(n * 2 * sizeof(float));
+	this->real_twiddles = (float*)malloc((n / 2 + 1) * 2 * sizeof(float));
+	this->bit_reverse = (u32*)malloc(n * sizeof(u32));
+	
+	for (u32 half = 1; half < n; half *= 2) {
+		for (u32 j = 0; j < half; ++j) {
+			double angle = -PI * j / half;
+			this->twiddles[half + j] = (float)cos(angle);
+			this->twiddles[n + half + j] = (float)sin(angle);
+		}
+	}
+	this->twiddles[0] = 1.f;
+	this->twiddles[n] = 0.f;
+	
+	for (u32 k = 0; k <= n / 2; ++k) {
+		double angle = -PI * k / n;
+		this->real_twiddles[k] = (float)cos(angle);
+		this->real_twiddles[n / 2 + 1 + k] = (float)sin(angle);
+	}
+	
+	for (u32 i = 0; i < n; ++i) {
+		u32 reversed = 0;
+		for (u32 b = 0; b < bits; ++b) reversed |= ((i >> b) & 1) << (bits - 1 - b);
+		this->bit_reverse[i] = reversed;
+	}
+}
+
+void Fft::forward(const float *input, float *spectrum) {
+	const u32 n = this->size / 2;
+	const float *w_re = this->real_twiddles;
+	const float *w_im = &this->real_twiddles[n / 2 + 1];
+	float *re = spectrum;
+	float *im = &spectrum[n];
+	
+	// Even samples are the real parts and odd samples the imaginary parts of a half size transform
+	for (u32 i = 0; i < n; ++i) {
+		re[this->bit_reverse[i]] = input[i*2+0];
+		im[this->bit_reverse[i]] = input[i*2+1];
+	}
+	
+	transform(this, re, im, n);
+	
+	// Pull the transforms of the even and odd samples apart, and combine them into the real transform.
+	// Bins k and n - k are worked out together.
+	float z0_re = re[0], z0_im = im[0];
+	re[0] = z0_re + z0_im;
+	im[0] = z0_re - z0_im;
+	
+	for (u32 k = 1; k <= n / 2; ++k) {
+		const u32 m = n - k;
+		float even_re = 0.5f * (re[k] + re[m]);
+		float even_im = 0.5f * (im[k] - im[m]);
+		float odd_re = 0.5f * (im[k] + im[m]);
+		float odd_im = -0.5f * (re[k] - re[m]);
+		float t_re = w_re[k] * odd_re - w_im[k] * odd_im;
+		float t_im = w_re[k] * odd_im + w_im[k] * odd_re;
+		
+		re[k] = even_re + t_re;
+		im[k] = even_im + t_im;
+		if (m != k) {
+			re[m] = even_re - t_re;
+			im[m] = t_im - even_im;
+		}
+	}
+}
+
+void Fft::inverse(float *spectrum, float *output) {
+	const u32 n = this->size / 2;
+	const float *w_re = this->real_twiddles;
+	const float *w_im = &this->real_twiddles[n / 2 + 1];
+	float *re = spectrum;
+	float *im = &spectrum[n];
+	
+	// The reverse of the end of forward()
+	float x0 = re[0], x_nyquist = im[0];
+	re[0] = 0.5f * (x0 + x_nyquist);
+	im[0] = 0.5f * (x0 - x_nyquist);
+	
+	for (u32 k = 1; k <= n / 2; ++k) {
+		const u32 m = n - k;
+		float even_re = 0.5f * (re[k] + re[m]);
+		float even_im = 0.5f * (im[k] - im[m]);
+		float diff_re = 0.5f * (re[k] - re[m]);
+		float diff_im = 0.5f * (im[k] + im[m]);
+		// Times the conjugate twiddle
+		float odd_re = diff_re * w_re[k] + diff_im * w_im[k];
+		float odd_im = diff_im * w_re[k] - diff_re * w_im[k];
+		
+		re[k] = even_re - odd_im;
+		im[k] = even_im + odd_re;
+		if (m != k) {
+			re[m] = even_re + odd_im;
+			im[m] = odd_re - even_im;
+		}
+	}
+	
+	// The bit reversal permutation is its own inverse, so it can be done with swaps
+	for (u32 i = 0; i < n; ++i) {
+		u32 j = this->bit_reverse[i];
+		if (j <= i) continue;
+		float t_re = re[i], t_im = im[i];
+		re[i] = re[j];
+		im[i] = im[j];
+		re[j] = t_re;
+		im[j] = t_im;
+	}
+	
+	transform(this, im, re, n);
+	
+	for (u32 i = 0; i < n; ++i) {
+		output[i*2+0] = re[i];
+		output[i*2+1] = im[i];
+	}
+}
+
+void Fft::free() {
+	::free(this->twiddles);
+	::free(this->real_twiddles);
+	::free(this->bit_reverse);
+	this->twiddles = NULL;
+	this->real_twiddles = NULL;
+	this->bit_reverse = NULL;
+}
+
+void fft_multiply_accumulate(const Fft *fft, const float *a, const float *b, float *acc) {
+	const u32 n = fft->size / 2;
+	// Bin 0 holds two real bins, which multiply separately
+	float acc0_re = acc[0] + a[0] * b[0];
+	float acc0_im = acc[n] + a[n] * b[n];
+	
+	fft->kernels->multiply_accumulate(a, &a[n], b, &b[n], acc, &acc[n], n);
+	acc[0] = acc0_re;
+	acc[n] = acc0_im;
+}
@@ -0,0 +1,56 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#ifndef FFT_H
+#define FFT_H
+
+#include "common.h"
+
+// Smallest and largest real transform sizes
+#define FFT_MIN_SIZE 16
+#define FFT_MAX_SIZE (1 << 20)
+
+// Spectra are split: size/2 real parts followed by size/2 imaginary parts, for bins 0 to size/2 - 1.
+// Bins 0 and size/2 are both real, so the real part of bin size/2 is kept where the imaginary part of
+// bin 0 would be.
+
+struct Fft_Kernels;
+
+// Real FFT of a power of two size, done as a complex FFT of half the size
+struct Fft {
+	u32 size;
+	const Fft_Kernels *kernels;
+	// Complex twiddles for each stage, split. Stage s of the half size transform has its 2^s twiddles at 2^s.
+	float *twiddles;
+	// For turning the half size complex transform into the real one, size/4 + 1 of them, split
+	float *real_twiddles;
+	u32 *bit_reverse;
+	
+	// size must be a power of two from FFT_MIN_SIZE to FFT_MAX_SIZE
+	void init(u32 size);
+	// size samples in, a spectrum out. input and spectrum can't be the same.
+	void forward(const float *input, float *spectrum);
+	// A spectrum in, size samples out, scaled up by size/2. Overwrites the spectrum.
+	void inverse(float *spectrum, float *output);
+	void free();
+};
+
+// acc += a * b for each bin of two spectra of an FFT of the given size
+void fft_multiply_accumulate(const Fft *fft, const float *a, const float *b, float *acc);
+
+// Name of the kernels the next init() will pick
+const char *get_fft_kernel_name();
+
+#endif //FFT_H
@@ -0,0 +1,403 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#define WIN32_LEAN_AND_MEAN
+#include "history.h"
+#include "library.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <windows.h>
+
+// Play history is an append-only log of fixed size events (../history.dat). Aggregates per
+// track are kept in memory and written to ../history_stats.dat every so often along with the
+// number of events they cover, so loading only has to replay the events logged after that.
+// Queries only ever look at the aggregates.
+
+#define HISTORY_MAGIC 0x54534856 // "VHST"
+#define HISTORY_VERSION 1
+#define HISTORY_STATS_MAGIC 0x53534856 // "VHSS"
+#define HISTORY_STATS_VERSION 1
+// Write the aggregates after this many new events
+#define HISTORY_COMPACT_INTERVAL 256
+#define HISTORY_REPLAY_BATCH 4096
+
+enum {
+	HISTORY_EVENT_SKIPPED = 1<<0,
+};
+
+struct History_Event {
+	u32 track_id;
+	u32 time;
+	u32 listened_ms;
+	u32 flags;
+};
+
+struct History_Header {
+	u32 magic;
+	u32 version;
+	u32 reserved[2];
+};
+
+struct History_Stats_Header {
+	u32 magic;
+	u32 version;
+	// Number of events in the log that the aggregates include
+	u64 event_count;
+	u32 stats_count;
+	u32 reserved;
+};
+
+static struct {
+	FILE *log;
+	u64 event_count;
+	u64 compacted_event_count;
+	
+	Play_Stats *stats;
+	u32 stats_count;
+	u32 stats_capacity;
+	
+	// Open-addressed track ID -> stats index, UINT32_MAX for empty slots
+	u32 *map;
+	u32 map_capacity;
+} g_history;
+
+static inline u32 history_map_slot(u32 id, u32 capacity) {
+	// Track IDs are already hashes
+	return id & (capacity - 1);
+}
+
+static void rebuild_history_map(u32 capacity) {
+	free(g_history.map);
+	g_history.map = (u32*)malloc(capacity * sizeof(u32));
+	g_history.map_capacity = capacity;
+	memset(g_history.map, 0xff, capacity * sizeof(u32));
+	
+	for (u32 i = 0; i < g_history.stats_count; ++i) {
+		u32 slot = history_map_slot(g_history.stats[i].id, capacity);
+		while (g_history.map[slot] != UINT32_MAX) slot = (slot + 1) & (capacity - 1);
+		g_history.map[slot] = i;
+	}
+}
+
+static Play_Stats *find_stats(u32 id) {
+	if (!g_history.map_capacity) return NULL;
+	
+	u32 slot = history_map_slot(id, g_history.map_capacity);
+	while (g_history.map[slot] != UINT32_MAX) {
+		Play_Stats *stats = &g_history.stats[g_history.map[slot]];
+		if (stats->id == id) return stats;
+		slot = (slot + 1) & (g_history.map_capacity - 1);
+	}
+	
+	return NULL;
+}
+
+static Play_Stats *find_or_add_stats(u32 id) {
+	Play_Stats *stats = find_stats(id);
+	if (stats) return stats;
+	
+	if (g_history.stats_count == g_history.stats_capacity) {
+		g_history.stats_capacity = g_history.stats_capacity ? g_history.stats_capacity * 2 : 1024;
+		g_history.stats = (Play_Stats*)realloc(g_history.stats, g_history.stats_capacity * sizeof(Play_Stats));
+	}
+	
+	u32 index = g_history.stats_count++;
+	stats = &g_history.stats[index];
+	memset(stats, 0, sizeof(*stats));
+	stats->id = id;
+	
+	// Keep the load factor under 50%
+	if (g_history.stats_count * 2 > g_history.map_capacity) {
+		rebuild_history_map(g_history.map_capacity ? g_history.map_capacity * 2 : 2048);
+	}
+	else {
+		u32 slot = history_map_slot(id, g_history.map_capacity);
+		while (g_history.map[slot] != UINT32_MAX) slot = (slot + 1) & (g_history.map_capacity - 1);
+		g_history.map[slot] = index;
+	}
+	
+	return stats;
+}
+
+static void apply_event(const History_Event *event) {
+	Play_Stats *stats = find_or_add_stats(event->track_id);
+	
+	stats->listened_ms += event->listened_ms;
+	if (event->flags & HISTORY_EVENT_SKIPPED) {
+		stats->skip_count++;
+	}
+	else {
+		stats->play_count++;
+		if (event->time > stats->last_played) stats->last_played = event->time;
+	}
+}
+
+static void reset_stats() {
+	g_history.stats_count = 0;
+	if (g_history.map) memset(g_history.map, 0xff, g_history.map_capacity * sizeof(u32));
+}
+
+static bool load_history_stats() {
+	FILE *file = fopen("../history_stats.dat", "rb");
+	History_Stats_Header header;
+	
+	if (!file) return false;
+	
+	if (fread(&header, sizeof(header), 1, file) != 1 || 
+		header.magic != HISTORY_STATS_MAGIC || header.version != HISTORY_STATS_VERSION) {
+		log_warning("Ignoring invalid play statistics file\n");
+		fclose(file);
+		return false;
+	}
+	
+	g_history.stats_capacity = header.stats_count > 1024 ? header.stats_count : 1024;
+	g_history.stats = (Play_Stats*)malloc(g_history.stats_capacity * sizeof(Play_Stats));
+	
+	if (fread(g_history.stats, sizeof(Play_Stats), header.stats_count, file) != header.stats_count) {
+		log_warning("Play statistics file is truncated\n");
+		fclose(file);
+		return false;
+	}
+	
+	fclose(file);
+	
+	g_history.stats_count = header.stats_count;
+	g_history.compacted_event_count = header.event_count;
+	
+	u32 capacity = 2048;
+	while (capacity < g_history.stats_count * 2) capacity *= 2;
+	rebuild_history_map(capacity);
+	
+	return true;
+}
+
+// Open the log, creating it if needed, and find the number of complete events in it
+static bool open_history_log() {
+	History_Header header;
+	
+	g_history.log = fopen("../history.dat", "r+b");
+	
+	if (!g_history.log) {
+		g_history.log = fopen("../history.dat", "w+b");
+		if (!g_history.log) {
+			log_error("Failed to create play history log\n");
+			return false;
+		}
+		
+		memset(&header, 0, sizeof(header));
+		header.magic = HISTORY_MAGIC;
+		header.version = HISTORY_VERSION;
+		fwrite(&header, sizeof(header), 1, g_history.log);
+		fflush(g_history.log);
+		g_history.event_count = 0;
+		return true;
+	}
+	
+	if (fread(&header, sizeof(header), 1, g_history.log) != 1 || 
+		header.magic != HISTORY_MAGIC || header.version != HISTORY_VERSION) {
+		log_error("Play history log is invalid. History will not be recorded\n");
+		fclose(g_history.log);
+		g_history.log = NULL;
+		return false;
+	}
+	
+	// A partial event at the end from a crash is ignored and overwritten by the next one
+	_fseeki64(g_history.log, 0, SEEK_END);
+	u64 size = _ftelli64(g_history.log);
+	g_history.event_count = (size - sizeof(header)) / sizeof(History_Event);
+	
+	return true;
+}
+
+static void replay_history_log(u64 first_event) {
+	History_Event *batch = (History_Event*)malloc(HISTORY_REPLAY_BATCH * sizeof(History_Event));
+	u64 remaining = g_history.event_count - first_event;
+	
+	_fseeki64(g_history.log, sizeof(History_Header) + first_event * sizeof(History_Event), SEEK_SET);
+	
+	while (remaining) {
+		u32 count = (u32)MIN(remaining, HISTORY_REPLAY_BATCH);
+		u32 read = fread(batch, sizeof(History_Event), count, g_history.log);
+		for (u32 i = 0; i < read; ++i) apply_event(&batch[i]);
+		if (read != count) break;
+		remaining -= count;
+	}
+	
+	free(batch);
+}
+
+void load_history() {
+	u64 start_time = time_get_tick();
+	
+	bool have_stats = load_history_stats();
+	if (!open_history_log()) return;
+	
+	// The aggregates are useless if the log was replaced or truncated since
+	if (!have_stats || g_history.compacted_event_count > g_history.event_count) {
+		reset_stats();
+		g_history.compacted_event_count = 0;
+	}
+	
+	u64 replayed = g_history.event_count - g_history.compacted_event_count;
+	replay_history_log(g_history.compacted_event_count);
+	
+	log_info("Loaded play history (%llu events, %u tracks, %llu replayed) in %.2fms\n",
+			 g_history.event_count, g_history.stats_count, replayed,
+			 time_ticks_to_milliseconds(time_get_tick() - start_time));
+	
+	if (replayed >= HISTORY_COMPACT_INTERVAL) compact_history();
+}
+
+void compact_history() {
+	History_Stats_Header header = {};
+	
+	if (!g_history.log || g_history.compacted_event_count == g_history.event_count) return;
+	
+	header.magic = HISTORY_STATS_MAGIC;
+	header.version = HISTORY_STATS_VERSION;
+	header.event_count = g_history.event_count;
+	header.stats_count = g_history.stats_count;
+	
+	// Write to a temporary file first so a crash never leaves a half written file behind
+	FILE *file = fopen("../history_stats.tmp", "wb");
+	if (!file) {
+		log_error("Failed to write play statistics\n");
+		return;
+	}
+	
+	fwrite(&header, sizeof(header), 1, file);
+	fwrite(g_history.stats, sizeof(Play_Stats), g_history.stats_count, file);
+	fclose(file);
+	
+	if (!MoveFileExA("../history_stats.tmp", "../history_stats.dat", MOVEFILE_REPLACE_EXISTING)) {
+		log_error("Failed to replace play statistics file\n");
+		return;
+	}
+	
+	g_history.compacted_event_count = g_history.event_count;
+}
+
+void record_play(u32 track_id, u32 listened_ms, bool skipped) {
+	History_Event event;
+	
+	if (!g_history.log) return;
+	
+	event.track_id = track_id;
+	event.time = (u32)time(NULL);
+	event.listened_ms = listened_ms;
+	event.flags = skipped ? HISTORY_EVENT_SKIPPED : 0;
+	
+	_fseeki64(g_history.log, sizeof(History_Header) + g_history.event_count * sizeof(History_Event), SEEK_SET);
+	if (fwrite(&event, sizeof(event), 1, g_history.log) == 1) {
+		fflush(g_history.log);
+		g_history.event_count++;
+		apply_event(&event);
+		
+		if (g_history.event_count - g_history.compacted_event_count >= HISTORY_COMPACT_INTERVAL) {
+			compact_history();
+		}
+	}
+	else {
+		log_error("Failed to write to play history log\n");
+	}
+}
+
+bool get_play_stats(u32 track_id, Play_Stats *out) {
+	const Play_Stats *stats = find_stats(track_id);
+	if (stats) *out = *stats;
+	
+	return stats != NULL;
+}
+
+static inline bool stats_ranks_lower(const Play_Stats *a, const Play_Stats *b) {
+	if (a->play_count != b->play_count) return a->play_count < b->play_count;
+	return a->last_played < b->last_played;
+}
+
+static void sift_down(Play_Stats *heap, u32 count, u32 i) {
+	while (1) {
+		u32 smallest = i;
+		u32 left = i*2 + 1, right = i*2 + 2;
+		if (left < count && stats_ranks_lower(&heap[left], &heap[smallest])) smallest = left;
+		if (right < count && stats_ranks_lower(&heap[right], &heap[smallest])) smallest = right;
+		if (smallest == i) return;
+		Play_Stats temp = heap[i];
+		heap[i] = heap[smallest];
+		heap[smallest] = temp;
+		i = smallest;
+	}
+}
+
+static void sift_up(Play_Stats *heap, u32 i) {
+	while (i) {
+		u32 parent = (i - 1) / 2;
+		if (!stats_ranks_lower(&heap[i], &heap[parent])) return;
+		Play_Stats temp = heap[i];
+		heap[i] = heap[parent];
+		heap[parent] = temp;
+		i = parent;
+	}
+}
+
+u32 get_most_played_tracks(u32 max_count, Play_Stats *out) {
+	u32 count = 0;
+	
+	if (!max_count) return 0;
+	
+	// Keep the top tracks in a min-heap in the output buffer
+	for (u32 i = 0; i < g_history.stats_count; ++i) {
+		const Play_Stats *stats = &g_history.stats[i];
+		if (!stats->play_count) continue;
+		
+		if (count < max_count) {
+			out[count] = *stats;
+			sift_up(out, count++);
+		}
+		else if (stats_ranks_lower(&out[0], stats)) {
+			out[0] = *stats;
+			sift_down(out, count, 0);
+		}
+	}
+	
+	// Sort in place, most played first
+	for (u32 end = count; end > 1; --end) {
+		Play_Stats temp = out[0];
+		out[0] = out[end - 1];
+		out[end - 1] = temp;
+		sift_down(out, end - 1, 0);
+	}
+	
+	return count;
+}
+
+void get_tracks_not_played_since(u32 unix_time, Track_Array *out) {
+	const Track_Array *library = get_library_track_info();
+	
+	out->reset();
+	
+	for (u32 i = 0; i < library->count; ++i) {
+		u32 id = library->ids.elements[i];
+		const Play_Stats *stats = find_stats(id);
+		if (!stats || stats->last_played < unix_time) {
+			out->add(id, &library->info.elements[i]);
+		}
+	}
+}
+
+u64 get_history_event_count() {
+	return g_history.event_count;
+}
@@ -0,0 +1,45 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include "common.h"
+
+// Per-track aggregate of every play event
+struct Play_Stats {
+	u32 id;
+	u32 play_count;
+	u32 skip_count;
+	// Unix time of the last play that wasn't a skip, 0 if never
+	u32 last_played;
+	u64 listened_ms;
+};
+
+// Load the aggregates and replay any events logged after the last compaction
+void load_history();
+// Append a play event. Writes to the disk and every so often rewrites the aggregates, so it belongs on
+// the UI thread. Never call it from the player's threads or callbacks: post the event to the UI instead.
+void record_play(u32 track_id, u32 listened_ms, bool skipped);
+// Write the aggregates so the next load doesn't need to replay the log
+void compact_history();
+bool get_play_stats(u32 track_id, Play_Stats *out);
+// Fills out with up to max_count tracks, most played first. Returns the count.
+u32 get_most_played_tracks(u32 max_count, Play_Stats *out);
+// Tracks in the library that haven't been played (skips don't count) since the given unix time
+void get_tracks_not_played_since(u32 unix_time, Track_Array *out);
+u64 get_history_event_count();
+
+#endif //HISTORY_H
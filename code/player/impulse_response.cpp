@@ -0,0 +1,126 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "convolver.h"
+#include "decoders.h"
+#include "resampler.h"
+#include <samplerate.h>
+#include <math.h>
+#include <stdlib.h>
+
+#define IMPULSE_RESPONSE_DECODE_FRAMES 65536
+
+// The whole file, at its own rate
+static bool decode_impulse_response(const wchar_t *path, Impulse_Response *out) {
+	Decoder decoder = {};
+	PCM_Format format;
+	u32 capacity = IMPULSE_RESPONSE_DECODE_FRAMES;
+	
+	if (!decoder.open(path, 100.f, &format)) return false;
+	
+	out->sample_rate = format.sample_rate;
+	out->frame_count = 0;
+	out->frames = (float*)malloc(capacity * 2 * sizeof(float));
+	
+	while (1) {
+		if (out->frame_count + IMPULSE_RESPONSE_DECODE_FRAMES > capacity) {
+			capacity *= 2;
+			out->frames = (float*)realloc(out->frames, capacity * 2 * sizeof(float));
+		}
+		
+		u32 decoded = decoder.decode(IMPULSE_RESPONSE_DECODE_FRAMES, &out->frames[out->frame_count * 2]);
+		out->frame_count += decoded;
+		if (decoded < IMPULSE_RESPONSE_DECODE_FRAMES || out->frame_count > CONVOLVER_MAX_FRAMES) break;
+	}
+	
+	decoder.close();
+	return true;
+}
+
+static bool resample_impulse_response(Impulse_Response *ir, u32 sample_rate) {
+	const double ratio = (double)sample_rate / ir->sample_rate;
+	u32 capacity = (u32)ceil(ir->frame_count * ratio) + 64;
+	float *frames = (float*)malloc(capacity * 2 * sizeof(float));
+	u32 frame_count = 0;
+	Resampler resampler = {};
+	
+	if (resampler.init(ir->sample_rate, sample_rate, RESAMPLER_QUALITY_HIGH)) {
+		u32 used = 0;
+		
+		while (1) {
+			u32 input_used, generated;
+			resampler.process(&ir->frames[used * 2], ir->frame_count - used, &frames[frame_count * 2],
+							  capacity - frame_count, true, &input_used, &generated);
+			used += input_used;
+			frame_count += generated;
+			if (!generated || frame_count == capacity) break;
+		}
+		
+		resampler.free();
+	}
+	else {
+		SRC_DATA data = {};
+		data.data_in = ir->frames;
+		data.data_out = frames;
+		data.input_frames = ir->frame_count;
+		data.output_frames = capacity;
+		data.src_ratio = ratio;
+		data.end_of_input = 1;
+		
+		int error = src_simple(&data, SRC_SINC_BEST_QUALITY, 2);
+		if (error) {
+			log_error("Failed to resample the impulse response: %s\n", src_strerror(error));
+			::free(frames);
+			return false;
+		}
+		frame_count = (u32)data.output_frames_gen;
+	}
+	
+	// More samples per second means more taps adding up, so scale them down to keep the same gain
+	const float scale = (float)(1.0 / ratio);
+	for (u32 i = 0; i < frame_count * 2; ++i) frames[i] *= scale;
+	
+	::free(ir->frames);
+	ir->frames = frames;
+	ir->frame_count = frame_count;
+	ir->sample_rate = sample_rate;
+	return true;
+}
+
+bool load_impulse_response(const wchar_t *path, u32 sample_rate, Impulse_Response *out) {
+	if (!decode_impulse_response(path, out)) {
+		log_error("Failed to open the impulse response \"%ls\"\n", path);
+		return false;
+	}
+	
+	if (!out->frame_count || out->frame_count > CONVOLVER_MAX_FRAMES) {
+		log_error("Impulse responses need 1 to %u frames, \"%ls\" has %u\n", CONVOLVER_MAX_FRAMES, path, out->frame_count);
+		out->free();
+		return false;
+	}
+	
+	if (out->sample_rate != sample_rate) {
+		log_debug("Resampling the impulse response %u -> %u\n", out->sample_rate, sample_rate);
+		if (!resample_impulse_response(out, sample_rate)) {
+			out->free();
+			return false;
+		}
+	}
+	
+	// Resampling up can take it over the limit
+	out->frame_count = MIN(out->frame_count, CONVOLVER_MAX_FRAMES);
+	log_info("Loaded a %.2fs impulse response from \"%ls\"\n", out->frame_count / (float)sample_rate, path);
+	return true;
+}
@@ -16,6 +16,7 @@
 #include "library.h"
 #include "tags.h"
 #include <stdio.h>
+#include <string.h>
 #include <xxhash.h>
 #include <wchar.h>
 
@@ -30,9 +31,35 @@ struct Library_Header {
 	u32 base_path;
 };
 
+struct Track_Index_Slot {
+	u32 id;
+	// UINT32_MAX marks an empty slot
+	u32 index;
+};
+
+// Open-addressed track ID -> library index map, rebuilt every time the IDs are hashed
+struct Track_Index_Map {
+	Track_Index_Slot *slots;
+	u32 capacity;
+};
+
 struct Library {
 	Track_Array tracks;
+	Track_Index_Map id_map;
+	// Relative path hash -> library index. Built the first time a path is looked up after a scan.
+	Track_Index_Map path_map;
+	char path_map_base_path[512];
+	u32 path_map_base_length;
+	bool path_map_valid;
 	Large_Auto_Array<char> string_pool;
+	
+	// The previous scan is kept during update_library() so the new one can be diffed against it
+	Track_Array previous_tracks;
+	Track_Index_Map previous_id_map;
+	Large_Auto_Array<char> previous_string_pool;
+	// Tracks that were added, removed or retagged by the last scan
+	Large_Auto_Array<u32> changed_ids;
+	
 	u64 track_count;
 	u64 string_pool_size;
 	wchar_t base_path[512];
@@ -44,6 +71,55 @@ bool is_library_configured() {
 	return g_library.base_path[0] != 0;
 }
 
+static inline u32 id_map_slot(u32 id, u32 capacity) {
+	// IDs are already xxhash values so they only need to be masked
+	return id & (capacity - 1);
+}
+
+static void build_id_map(const Track_Array *tracks, Track_Index_Map *map) {
+	const u32 count = tracks->ids.count;
+	u32 capacity = 64;
+	
+	// Keep the load factor under 50% so probes stay short
+	while (capacity < count * 2) capacity <<= 1;
+	
+	if (capacity != map->capacity) {
+		if (map->slots) system_free(map->slots, map->capacity * sizeof(Track_Index_Slot));
+		map->slots = (Track_Index_Slot*)system_allocate(capacity * sizeof(Track_Index_Slot));
+		map->capacity = capacity;
+	}
+	
+	memset(map->slots, 0xff, capacity * sizeof(Track_Index_Slot));
+	
+	for (u32 i = 0; i < count; ++i) {
+		u32 id = tracks->ids.elements[i];
+		u32 slot = id_map_slot(id, capacity);
+		
+		while (map->slots[slot].index != UINT32_MAX) {
+			// Tracks with the same file name share an ID. The first one wins
+			if (map->slots[slot].id == id) break;
+			slot = (slot + 1) & (capacity - 1);
+		}
+		
+		if (map->slots[slot].index == UINT32_MAX) {
+			map->slots[slot].id = id;
+			map->slots[slot].index = i;
+		}
+	}
+}
+
+static u32 id_map_lookup(const Track_Index_Map *map, u32 id) {
+	if (!map->capacity) return UINT32_MAX;
+	
+	u32 slot = id_map_slot(id, map->capacity);
+	while (map->slots[slot].index != UINT32_MAX) {
+		if (map->slots[slot].id == id) return map->slots[slot].index;
+		slot = (slot + 1) & (map->capacity - 1);
+	}
+	
+	return UINT32_MAX;
+}
+
 static void hash_ids() {
 	log_debug("Hashing library track IDs\n");
 	
@@ -53,6 +129,9 @@ static void hash_ids() {
 	for (u32 i = 0; i < count; ++i) {
 		ids[i] = get_track_id(&g_library.tracks.info.elements[i]);
 	}
+	
+	build_id_map(&g_library.tracks, &g_library.id_map);
+	g_library.path_map_valid = false;
 }
 
 bool load_library() {
@@ -185,9 +264,80 @@ bool set_library_path(const wchar_t *new_path) {
 	return true;
 }
 
+static void free_id_map(Track_Index_Map *map) {
+	if (map->slots) system_free(map->slots, map->capacity * sizeof(Track_Index_Slot));
+	map->slots = NULL;
+	map->capacity = 0;
+}
+
+static void release_previous_scan() {
+	g_library.previous_tracks.free();
+	g_library.previous_tracks.count = 0;
+	g_library.previous_string_pool.free();
+	free_id_map(&g_library.previous_id_map);
+}
+
+static inline bool library_strings_differ(u32 old_location, u32 new_location) {
+	return strcmp(&g_library.previous_string_pool.elements[old_location], 
+				  &g_library.string_pool.elements[new_location]) != 0;
+}
+
+// Collect the IDs of tracks that were added, removed, moved or retagged since the previous scan
+static void diff_against_previous_scan() {
+	const Track_Array *old_tracks = &g_library.previous_tracks;
+	const Track_Array *new_tracks = &g_library.tracks;
+	u32 added = 0, removed = 0, retagged = 0;
+	
+	g_library.changed_ids.reset();
+	
+	for (u32 i = 0; i < new_tracks->count; ++i) {
+		u32 id = new_tracks->ids.elements[i];
+		u32 old_index = id_map_lookup(&g_library.previous_id_map, id);
+		
+		if (old_index == UINT32_MAX) {
+			g_library.changed_ids.push_value(id);
+			added++;
+			continue;
+		}
+		
+		const Track_Info *old_info = &old_tracks->info.elements[old_index];
+		const Track_Info *new_info = &new_tracks->info.elements[i];
+		
+		if (library_strings_differ(old_info->artist, new_info->artist) ||
+			library_strings_differ(old_info->title, new_info->title) ||
+			library_strings_differ(old_info->album, new_info->album) ||
+			library_strings_differ(old_info->relative_file_path, new_info->relative_file_path)) {
+			g_library.changed_ids.push_value(id);
+			retagged++;
+		}
+	}
+	
+	for (u32 i = 0; i < old_tracks->count; ++i) {
+		u32 id = old_tracks->ids.elements[i];
+		if (lookup_track_index(id) == UINT32_MAX) {
+			g_library.changed_ids.push_value(id);
+			removed++;
+		}
+	}
+	
+	log_debug("Library scan: %u tracks added, %u removed, %u retagged\n", added, removed, retagged);
+}
+
 bool update_library(const wchar_t *source_path) {
+	// Keep the previous scan so it can be diffed against the new one
+	Track_Array temp_tracks = g_library.previous_tracks;
+	Track_Index_Map temp_map = g_library.previous_id_map;
+	Large_Auto_Array<char> temp_pool = g_library.previous_string_pool;
+	g_library.previous_tracks = g_library.tracks;
+	g_library.previous_id_map = g_library.id_map;
+	g_library.previous_string_pool = g_library.string_pool;
+	g_library.tracks = temp_tracks;
+	g_library.id_map = temp_map;
+	g_library.string_pool = temp_pool;
+	
 	g_library.string_pool.reset();
 	g_library.tracks.reset();
+	g_library.changed_ids.reset();
 	
 	// A string location of 0 should point to an empty string
 	g_library.string_pool.push();
@@ -197,6 +347,8 @@ bool update_library(const wchar_t *source_path) {
 	else memset(g_library.base_path, sizeof(g_library.base_path), 0);
 	
 	if (!path_exists_w(source_path)) {
+		hash_ids();
+		release_previous_scan();
 		return false;
 	}
 	
@@ -229,10 +381,13 @@ bool update_library(const wchar_t *source_path) {
 		fwrite(g_library.string_pool.elements, 1, g_library.string_pool.count, output);
 		
 		fclose(output);
-		
-		hash_ids();
 	}
 	
+	// Always rehash so lookups never resolve against the previous scan
+	hash_ids();
+	diff_against_previous_scan();
+	release_previous_scan();
+	
 	return true;
 }
 
@@ -240,6 +395,100 @@ Track_Array *get_library_track_info() {
 	return &g_library.tracks;
 }
 
+// Paths are compared case-insensitively and with either slash
+static inline char normalize_path_char(char c) {
+	if (c == '/') return '\\';
+	if (c >= 'A' && c <= 'Z') return c + ('a' - 'A');
+	return c;
+}
+
+static u32 hash_library_path(const char *path) {
+	char normalized[512];
+	u32 length = 0;
+	for (; path[length] && length < sizeof(normalized); ++length) {
+		normalized[length] = normalize_path_char(path[length]);
+	}
+	return XXH32(normalized, length, 0);
+}
+
+static bool library_paths_equal(const char *a, const char *b) {
+	for (; *a && *b; ++a, ++b) {
+		if (normalize_path_char(*a) != normalize_path_char(*b)) return false;
+	}
+	return !*a && !*b;
+}
+
+static void build_path_map() {
+	Track_Index_Map *map = &g_library.path_map;
+	const u32 count = g_library.tracks.count;
+	u32 capacity = 64;
+	u64 start_time = time_get_tick();
+	
+	while (capacity < count * 2) capacity <<= 1;
+	
+	if (capacity != map->capacity) {
+		if (map->slots) system_free(map->slots, map->capacity * sizeof(Track_Index_Slot));
+		map->slots = (Track_Index_Slot*)system_allocate(capacity * sizeof(Track_Index_Slot));
+		map->capacity = capacity;
+	}
+	
+	memset(map->slots, 0xff, capacity * sizeof(Track_Index_Slot));
+	
+	// Unlike the ID map, hash collisions between different paths are kept and resolved on lookup
+	for (u32 i = 0; i < count; ++i) {
+		u32 hash = hash_library_path(get_library_string(g_library.tracks.info.elements[i].relative_file_path));
+		u32 slot = id_map_slot(hash, capacity);
+		while (map->slots[slot].index != UINT32_MAX) slot = (slot + 1) & (capacity - 1);
+		map->slots[slot].id = hash;
+		map->slots[slot].index = i;
+	}
+	
+	g_library.path_map_base_length = utf16_to_utf8(g_library.base_path, g_library.path_map_base_path, 
+												   sizeof(g_library.path_map_base_path));
+	g_library.path_map_valid = true;
+	log_debug("Built library path index in %.2fms\n", time_ticks_to_milliseconds(time_get_tick() - start_time));
+}
+
+u32 lookup_track_index_by_path(const char *path) {
+	const Track_Index_Map *map = &g_library.path_map;
+	
+	if (!g_library.tracks.count) return UINT32_MAX;
+	if (!g_library.path_map_valid) build_path_map();
+	
+	const char *base_path = g_library.path_map_base_path;
+	const u32 base_length = g_library.path_map_base_length;
+	
+	// Make full paths relative to the library
+	if (base_length) {
+		u32 i = 0;
+		while (i < base_length && path[i] && normalize_path_char(path[i]) == normalize_path_char(base_path[i])) i++;
+		if (i == base_length) path += base_length;
+	}
+	
+	while (*path == '\\' || *path == '/') path++;
+	
+	u32 hash = hash_library_path(path);
+	u32 slot = id_map_slot(hash, map->capacity);
+	while (map->slots[slot].index != UINT32_MAX) {
+		u32 index = map->slots[slot].index;
+		if (map->slots[slot].id == hash && 
+			library_paths_equal(get_library_string(g_library.tracks.info.elements[index].relative_file_path), path)) {
+			return index;
+		}
+		slot = (slot + 1) & (map->capacity - 1);
+	}
+	
+	return UINT32_MAX;
+}
+
+const wchar_t *get_library_base_path() {
+	return g_library.base_path;
+}
+
+const Large_Auto_Array<u32> *get_changed_track_ids() {
+	return &g_library.changed_ids;
+}
+
 const char *get_library_string(u32 location) {
 	return &g_library.string_pool.elements[location];
 }
@@ -265,12 +514,13 @@ u32 get_track_id(const Track_Info *info) {
 	return XXH32(filename, strlen(filename), 0);
 }
 
+u32 lookup_track_index(u32 id) {
+	return id_map_lookup(&g_library.id_map, id);
+}
+
 const Track_Info *lookup_track(u32 id) {
-	const u32 count = g_library.tracks.ids.count;
-	for (u32 i = 0; i < count; ++i) {
-		if (g_library.tracks.ids.elements[i] == id) return &g_library.tracks.info.elements[i];
-	}
-	
-	return NULL;
+	u32 index = lookup_track_index(id);
+	if (index == UINT32_MAX) return NULL;
+	return &g_library.tracks.info.elements[index];
 }
 	
\ No newline at end of file
@@ -31,6 +31,8 @@ bool set_library_path(const wchar_t *new_path);
 // If the library doesn't exist, create it.
 // Pass in NULL to use the current path
 bool update_library(const wchar_t *source_path);
+// IDs of the tracks that were added, removed or retagged by the last update_library()
+const Large_Auto_Array<u32> *get_changed_track_ids();
 void get_all_library_tracks(Large_Auto_Array<u32> *out);
 //Large_Auto_Array<Track_Info> *get_library_track_info();
 Track_Array *get_library_track_info();
@@ -41,5 +43,11 @@ bool lookup_track(u32 id, Track_Info *out);
 void search_library(const char *query, u32 tag_mask, Large_Auto_Array<Track_Info> *out);
 u32 get_track_id(const Track_Info *info);
 const Track_Info *lookup_track(u32 id);
+// Returns the index of the track in the library track array, or UINT32_MAX if no track has the ID
+u32 lookup_track_index(u32 id);
+// Same as above for a UTF-8 path, either full or relative to the library.
+// Case-insensitive and accepts either slash.
+u32 lookup_track_index_by_path(const char *path);
+const wchar_t *get_library_base_path();
 
 #endif //LIBRARY_H
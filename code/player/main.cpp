@@ -27,6 +27,18 @@
 #include "common.h"
 #include "player.h"
 #include "library.h"
+#include "selection.h"
+#include "history.h"
+#include "decoders.h"
+
+// Rewritten after every underrun and on exit, so a glitch can be looked into after the fact
+#define PLAYBACK_TELEMETRY_PATH L"../playback_telemetry.txt"
+
+// Posted to the window by the player's callbacks, since they run on its producer thread and everything
+// in G belongs to the UI thread. wparam is the track serial and lparam, for a track change, the length
+// of the track before it in milliseconds.
+#define WM_PLAYER_TRACK_END (WM_APP + 1)
+#define WM_PLAYER_TRACK_CHANGE (WM_APP + 2)
 
 enum Track_List_ID {
 	TRACK_LIST_NONE,
@@ -36,13 +48,6 @@ enum Track_List_ID {
 	TRACK_LIST_SEARCH_RESULTS,
 };
 
-enum Selection_Type {
-	SELECTION_TYPE_NONE,
-	SELECTION_TYPE_SINGLE,
-	SELECTION_TYPE_RANGE,
-	SELECTION_TYPE_LIST,
-};
-
 enum View_ID {
 	VIEW_TRACK_LIST,
 	VIEW_SETUP,
@@ -50,6 +55,9 @@ enum View_ID {
 	VIEW_HOTKEYS,
 	VIEW_ABOUT,
 	VIEW_LIBRARY_SCAN,
+	VIEW_STATISTICS,
+	VIEW_EQUALIZER,
+	VIEW_DIAGNOSTICS,
 };
 
 enum Hotkey_ID {
@@ -59,6 +67,7 @@ enum Hotkey_ID {
 };
 
 static struct {
+	HWND hwnd;
 	s32 resize_width;
 	s32 resize_height;
 	u32 width, height;
@@ -70,25 +79,37 @@ static struct {
 	Large_Auto_Array<Playlist> playlists;
 	
 	u32 current_track_id;
+	// Track whose play gets logged when playback moves on from it, 0 if none
+	u32 history_track_id;
 	Track_Info current_track_info;
 	s32 queue_next_position;
+	// Queue entry handed to the player to carry on to without a gap, -1 if none
+	s32 next_track_position;
+	u32 next_track_id;
+	Track_Info next_track_info;
 	u32 playing_track_list;
 	u32 selected_playlist_index;
 	float seek_target;
 	enum Track_List_ID viewing_track_list;
 	char track_filter[512];
+	// Edit buffer for the selected smart playlist's query
+	char smart_query_input[256];
+	Playlist *smart_query_playlist;
 	struct {
-		enum Selection_Type type;
 		enum Track_List_ID track_list;
-		union {
-			u32 single;
-			struct {u32 start, end;} range;
-			// @TODO: List selection
-		};
+		// Selected row indices in the track list
+		Selection_Set rows;
+		// Row that shift-click ranges extend from
+		u32 anchor;
 	} selection;
 	
 	enum View_ID view;
 	
+	// File name of the impulse response the player is convolving with, if any
+	char impulse_response_name[256];
+	// Underruns as of the last time the playback telemetry was saved
+	u32 saved_underrun_count;
+	
 	u64 time_of_last_input;
 	bool shuffle_enabled;
 	bool show_search_results;
@@ -103,7 +124,10 @@ static LPDIRECT3DDEVICE9 g_d3d_device;
 static D3DPRESENT_PARAMETERS g_present_params;
 
 static void show_gui(u32 width, u32 height);
-static void on_track_end();
+static void on_track_end(u32 track_serial);
+static void on_track_change(float previous_length, u32 track_serial);
+static void handle_track_end();
+static void handle_track_change(u32 previous_length_ms);
 
 IMGUI_IMPL_API LRESULT ImGui_ImplWin32_WndProcHandler(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam);
 static LRESULT WINAPI window_proc(HWND hwnd, UINT msg, WPARAM wparam, LPARAM lparam);
@@ -137,32 +161,23 @@ static void shuffle_queue(u32 min_index = 0) {
 	G.queue_next_position = 0;
 }
 
-static int get_track_index_in_queue(u32 id) {
-	const Large_Auto_Array<u32> *ids = &G.queue.ids;
-	const u32 count = ids->count;
-	
-	for (int i = 0; i < count; ++i) {
-		if (id == ids->elements[i]) {
-			return i;
-		}
-	}
-	
-	return -1;
-}
-
 // Returns the index of the first queued track
-static u32 queue_tracks(const Track_Array *tracks, u32 array_offset = 0, u32 array_count = UINT32_MAX) {
-	const u32 count = MIN(tracks->count, array_count);
+static u32 queue_tracks(const Track_Array *tracks) {
+	const u32 count = tracks->count;
 	const u32 shuffle_start = G.queue.info.count;
-	Track_Info *out;
-	u32 *out_id;
+	Track_Id_Set queued = {};
 	G.queue_next_position = 0;
 	
-	for (u32 i = array_offset; i < (count+array_offset); ++i) {
-		if (get_track_index_in_queue(tracks->ids.elements[i]) != -1) continue;
+	queued.reserve(G.queue.count + count);
+	for (u32 i = 0; i < G.queue.count; ++i) queued.add(G.queue.ids.elements[i]);
+	
+	for (u32 i = 0; i < count; ++i) {
+		if (!queued.add(tracks->ids.elements[i])) continue;
 		G.queue.add(tracks->ids.elements[i], &tracks->info.elements[i]);
 	}
 	
+	queued.free();
+	
 	if (G.shuffle_enabled) shuffle_queue(shuffle_start);
 	
 	return shuffle_start;
@@ -171,14 +186,34 @@ static u32 queue_tracks(const Track_Array *tracks, u32 array_offset = 0, u32 arr
 static void clear_queue() {
 	log_debug("Clearing playback queue\n");
 	G.queue.reset();
+	if (G.selection.track_list == TRACK_LIST_QUEUE) G.selection.rows.clear();
+}
+
+static void record_current_track_play(bool reached_end) {
+	if (!G.history_track_id) return;
+	
+	float length = get_playback_length();
+	float position = reached_end ? length : get_playback_position();
+	// Moving on before halfway through counts as a skip
+	bool skipped = !reached_end && (position < length * 0.5f);
+	
+	record_play(G.history_track_id, (u32)(position * 1000.f), skipped);
+	G.history_track_id = 0;
 }
 
 static bool play_track(const Track_Info *track) {
 	wchar_t path[512];
+	record_current_track_play(false);
 	get_track_full_path_from_info(track, path, ARRAY_LENGTH(path));
 	G.current_track_id = get_track_id(track);
 	G.current_track_info = *track;
-	return open_track(path);
+	
+	if (!open_track(path)) return false;
+	G.history_track_id = G.current_track_id;
+	// Opening a track forgets what was to come after it
+	G.next_track_position = -1;
+	G.next_track_id = 0;
+	return true;
 }
 
 static bool move_queue_to_position(u32 position) {
@@ -212,6 +247,45 @@ static void next_track() {
 	} while (!play_track(track));
 }
 
+// Saves the telemetry each time there are new underruns, so there is something to look at
+// afterwards even if nobody had the window open when they happened
+static void save_telemetry_after_underruns() {
+	Playback_Latency latency;
+	get_playback_latency(&latency);
+	
+	if (latency.underrun_count != G.saved_underrun_count) {
+		G.saved_underrun_count = latency.underrun_count;
+		save_playback_telemetry(PLAYBACK_TELEMETRY_PATH);
+	}
+}
+
+// Tell the player what comes after the current track so it can go straight on to it
+static void update_next_track() {
+	s32 position = G.queue_next_position;
+	u32 id = 0;
+	
+	// Same as next_track()
+	if (position >= (s32)G.queue.info.count) position = 0;
+	
+	if (!G.current_track_id || !G.queue.info.count) position = -1;
+	else id = G.queue.ids.elements[position];
+	
+	if ((position == G.next_track_position) && (id == G.next_track_id)) return;
+	
+	G.next_track_position = position;
+	G.next_track_id = id;
+	
+	if (position < 0) {
+		set_next_track(NULL);
+		return;
+	}
+	
+	wchar_t path[512];
+	G.next_track_info = G.queue.info.elements[position];
+	get_track_full_path_from_info(&G.next_track_info, path, ARRAY_LENGTH(path));
+	set_next_track(path);
+}
+
 static void queue_track_and_play(const Track_Info *track) {
 	// Check if the track is already in the queue
 	const u32 track_id = get_track_id(track);
@@ -272,7 +346,14 @@ int main(int argc, char *argv[])
 	log_error("Error logging is ON\n");
 	
 	CoInitializeEx(NULL, COINITBASE_MULTITHREADED);
-	start_playback_stream(&on_track_end);
+	G.next_track_position = -1;
+	
+	// Whenever the device allows it, tracks play at their own rate and integers are only dithered
+	// once the audio has been changed
+	Output_Config output_config = {};
+	output_config.match_track_rate = true;
+	output_config.dither = true;
+	start_playback_stream(&on_track_end, &on_track_change, &output_config);
 	
 	if (load_library()) 
 		switch_main_view(VIEW_TRACK_LIST);
@@ -280,6 +361,7 @@ int main(int argc, char *argv[])
 		switch_main_view(VIEW_SETUP);
 	
 	load_playlists(&G.playlists);
+	load_history();
 	
 	WNDCLASSEX wndclass = {};
 	wndclass.cbSize = sizeof(wndclass);
@@ -292,6 +374,7 @@ int main(int argc, char *argv[])
 	HWND hwnd = CreateWindow("verata_window_class", "Verata", WS_OVERLAPPEDWINDOW, 
 							 100, 100, 1280, 720, 
 							 NULL, NULL, wndclass.hInstance, NULL);
+	g_window.hwnd = hwnd;
 	
 	// Register hotkeys
 	RegisterHotKey(hwnd, HOTKEY_PREVIOUS_TRACK, MOD_CONTROL|MOD_SHIFT|MOD_ALT, VK_LEFT);
@@ -351,6 +434,9 @@ int main(int argc, char *argv[])
 			reset_d3d_device();
 		}
 		
+		update_next_track();
+		save_telemetry_after_underruns();
+		
 		ImGui_ImplDX9_NewFrame();
 		ImGui_ImplWin32_NewFrame();
 		ImGui::NewFrame();
@@ -380,6 +466,10 @@ int main(int argc, char *argv[])
 		}
 	}
 	
+	record_current_track_play(false);
+	compact_history();
+	save_playback_telemetry(PLAYBACK_TELEMETRY_PATH);
+	
 	ImGui_ImplDX9_Shutdown();
 	ImGui_ImplWin32_Shutdown();
 	ImGui::DestroyContext();
@@ -389,31 +479,84 @@ int main(int argc, char *argv[])
 	return 0;
 }
 
-static void new_playlist() {
+static void new_playlist(bool is_smart = false) {
 	Playlist *playlist = G.playlists.push();
 	memset(playlist, 0, sizeof(*playlist));
+	playlist->is_smart = is_smart;
 	G.naming_playlist = true;
+	G.smart_query_playlist = NULL;
 }
 
 static void select_single_track(u32 index) {
-	G.selection.type = SELECTION_TYPE_SINGLE;
-	G.selection.single = index;
+	G.selection.rows.clear();
+	G.selection.rows.add(index);
+	G.selection.anchor = index;
 	G.selection.track_list = G.viewing_track_list;
 }
 
-static void select_range_of_tracks(s32 start, s32 end) {
+// Ctrl+Click
+static void toggle_track_selection(u32 index) {
+	if (G.selection.track_list != G.viewing_track_list) {
+		G.selection.rows.clear();
+		G.selection.track_list = G.viewing_track_list;
+	}
+	
+	G.selection.rows.toggle(index);
+	G.selection.anchor = index;
+}
+
+// Shift+Click. Selects from the anchor row to the given row
+static void select_range_of_tracks(u32 index) {
+	u32 start = G.selection.anchor;
+	u32 end = index;
+	
+	if (G.selection.track_list != G.viewing_track_list) start = index;
+	
 	if (start > end) {
-		s32 temp = end;
+		u32 temp = end;
 		end = start;
 		start = temp;
 	}
 	
-	G.selection.type = SELECTION_TYPE_RANGE;
-	G.selection.range.start = start;
-	G.selection.range.end = end;
+	G.selection.rows.clear();
+	G.selection.rows.add_range(start, end);
 	G.selection.track_list = G.viewing_track_list;
 }
 
+static void select_all_matching_tracks(const Track_Array *tracks) {
+	const u32 count = tracks->count;
+	G.selection.rows.clear();
+	G.selection.track_list = G.viewing_track_list;
+	
+	if (!G.track_filter[0]) {
+		if (count) G.selection.rows.add_range(0, count - 1);
+		return;
+	}
+	
+	// Add consecutive matches as ranges so they're stored as runs
+	u32 run_start = UINT32_MAX;
+	for (u32 i = 0; i < count; ++i) {
+		if (track_meets_filter(&tracks->info.elements[i], G.track_filter, UINT32_MAX)) {
+			if (run_start == UINT32_MAX) run_start = i;
+		}
+		else if (run_start != UINT32_MAX) {
+			G.selection.rows.add_range(run_start, i - 1);
+			run_start = UINT32_MAX;
+		}
+	}
+	
+	if (run_start != UINT32_MAX) G.selection.rows.add_range(run_start, count - 1);
+}
+
+static void invert_track_selection(const Track_Array *tracks) {
+	if (G.selection.track_list != G.viewing_track_list) {
+		G.selection.rows.clear();
+		G.selection.track_list = G.viewing_track_list;
+	}
+	
+	G.selection.rows.invert(tracks->count);
+}
+
 static Track_Array *get_track_list(enum Track_List_ID list) {
 	switch (list) {
 		case TRACK_LIST_LIBRARY:
@@ -440,66 +583,104 @@ static Track_Array *get_selected_track_list() {
 }
 
 static u32 get_lowest_selection_index() {
-	switch (G.selection.type) {
-		case SELECTION_TYPE_SINGLE:
-		return G.selection.single;
-		case SELECTION_TYPE_RANGE:
-		return G.selection.range.start;
-		default:
-		return 0;
-	}
+	u32 index = G.selection.rows.first();
+	return index != UINT32_MAX ? index : 0;
 }
 
 static bool track_is_selected(u32 index) {
 	if (G.viewing_track_list != G.selection.track_list) return false;
-	
-	switch (G.selection.type) {
-		case SELECTION_TYPE_SINGLE:
-		return index == G.selection.single;
-		
-		case SELECTION_TYPE_RANGE:
-		return (index >= G.selection.range.start) && (index <= G.selection.range.end);
-		
-		default: return false;
+	return G.selection.rows.contains(index);
+}
+
+// Copy the selected rows of a track list, in list order
+static void get_selected_tracks(const Track_Array *tracks, Track_Array *out) {
+	const Selection_Set *rows = &G.selection.rows;
+	for (u32 row = rows->first(); row < tracks->count; row = rows->next(row + 1)) {
+		out->add(tracks->ids.elements[row], &tracks->info.elements[row]);
 	}
 }
 
 static u32 add_selection_to_queue() {
 	Track_Array *tracks = get_selected_track_list();
+	Track_Array selected = {};
+	u32 ret;
 	if (!tracks) return 0;
 	
-	switch (G.selection.type) {
-		case SELECTION_TYPE_SINGLE:
-		return queue_tracks(tracks, G.selection.single, 1);
-		case SELECTION_TYPE_RANGE:
-		return queue_tracks(tracks, G.selection.range.start, 
-					 (G.selection.range.end - G.selection.range.start) + 1);
+	get_selected_tracks(tracks, &selected);
+	ret = queue_tracks(&selected);
+	selected.free();
+	
+	return ret;
+}
+
+// Check the selected FLAC files against their MD5 signatures. Decodes every file in full, so this blocks for a while.
+static void verify_selection() {
+	Track_Array *tracks = get_selected_track_list();
+	Track_Array selected = {};
+	u32 checked = 0, failed = 0;
+	if (!tracks) return;
+	
+	get_selected_tracks(tracks, &selected);
+	
+	for (u32 i = 0; i < selected.count; ++i) {
+		wchar_t path[512];
+		get_track_full_path_from_info(&selected.info.elements[i], path, ARRAY_LENGTH(path));
+		if (find_codec_from_file_name(path) != CODEC_FLAC) continue;
+		checked++;
+		if (!verify_flac(path)) failed++;
 	}
 	
-	return 0;
+	selected.free();
+	
+	if (!checked) user_warning("Only FLAC files can be verified");
+	else if (failed) user_warning("%u of %u FLAC files failed verification. See the log for details.", failed, checked);
+	else user_message("All %u FLAC files passed verification", checked);
 }
 
 static void add_selection_to_playlist() {
 	Track_Array *tracks = get_selected_track_list();
 	Playlist *playlist = get_selected_playlist();
-	if (!playlist || !tracks) return;
+	Track_Array selected = {};
+	// Smart playlist membership only comes from the query
+	if (!playlist || !tracks || playlist->is_smart) return;
 	
-	switch (G.selection.type) {
-		case SELECTION_TYPE_SINGLE: {
-			playlist->add_track(&tracks->info.elements[G.selection.single]);
-			break;
+	get_selected_tracks(tracks, &selected);
+	playlist->add_tracks(&selected);
+	selected.free();
+	
+	playlist->save_to_file();
+}
+
+static void remove_selection_from_track_list(Track_Array *tracks) {
+	const Selection_Set *rows = &G.selection.rows;
+	
+	if (G.selection.track_list == TRACK_LIST_PLAYLIST) {
+		Playlist *playlist = get_selected_playlist();
+		Track_Id_Set ids = {};
+		
+		for (u32 row = rows->first(); row < tracks->count; row = rows->next(row + 1)) {
+			ids.add(tracks->ids.elements[row]);
 		}
-		case SELECTION_TYPE_RANGE: {
-			const u32 count = (G.selection.range.end - G.selection.range.start) + 1;
-			for (u32 i = 0; i < count; ++i) {
-				playlist->add_track(&tracks->info.elements[i + G.selection.range.start]);
-			}
-			
-			break;
+		
+		if (playlist) playlist->remove_ids(&ids);
+		ids.free();
+	}
+	else {
+		// Compact in place so the list keeps its order
+		u32 out = 0;
+		for (u32 i = 0; i < tracks->count; ++i) {
+			if (rows->contains(i)) continue;
+			tracks->ids.elements[out] = tracks->ids.elements[i];
+			tracks->info.elements[out] = tracks->info.elements[i];
+			out++;
 		}
+		
+		tracks->ids.count = out;
+		tracks->info.count = out;
+		tracks->count = out;
 	}
 	
-	playlist->save_to_file();
+	G.selection.rows.clear();
 }
 
 // @TODO: Custom bindable hotkeys
@@ -517,6 +698,14 @@ static void handle_hotkeys() {
 		else if (ImGui::IsKeyPressed(ImGuiKey_Q)) {
 			add_selection_to_queue();
 		}
+		else if (!io.WantTextInput && ImGui::IsKeyPressed(ImGuiKey_A)) {
+			const Track_Array *tracks = get_track_list(G.viewing_track_list);
+			if (tracks) select_all_matching_tracks(tracks);
+		}
+		else if (!io.WantTextInput && ImGui::IsKeyPressed(ImGuiKey_I)) {
+			const Track_Array *tracks = get_track_list(G.viewing_track_list);
+			if (tracks) invert_track_selection(tracks);
+		}
 	}
 	else if (mod == (ImGuiMod_Ctrl|ImGuiMod_Shift)) {
 		if (ImGui::IsKeyPressed(ImGuiKey_Q)) {
@@ -526,7 +715,7 @@ static void handle_hotkeys() {
 			new_playlist();
 		}
 	}
-	
+
 }
 
 // Returns the number of tracks shown in the list
@@ -567,6 +756,33 @@ static u32 show_track_list(Track_Array *tracks) {
 		if (ImGui::Button("Play")) {
 			play_playlist(G.selected_playlist_index);
 		}
+		
+		Playlist *playlist = get_selected_playlist();
+		if (playlist && playlist->is_smart) {
+			if (G.smart_query_playlist != playlist) {
+				G.smart_query_playlist = playlist;
+				strcpy(G.smart_query_input, playlist->query.text);
+			}
+			
+			if (ImGui::InputTextWithHint("##smart_query", "Query, e.g. artist:\"the beatles\" -title:live album=help", 
+										 G.smart_query_input, sizeof(G.smart_query_input), 
+										 ImGuiInputTextFlags_EnterReturnsTrue)) {
+				if (compile_track_query(G.smart_query_input, &playlist->query)) {
+					evaluate_smart_playlists(playlist, 1);
+					rebind_playlists(playlist, 1, NULL);
+					playlist->save_to_file();
+					G.selection.rows.clear();
+				}
+				else {
+					user_warning("Invalid smart playlist query");
+				}
+			}
+			
+			if (playlist->query.invalid) {
+				ImGui::SameLine();
+				ImGui::TextUnformatted("Invalid query, so no tracks match");
+			}
+		}
 	}
 	
 	if (ImGui::BeginTable("##track_table", 3, table_flags)) {
@@ -613,7 +829,9 @@ static u32 show_track_list(Track_Array *tracks) {
 									  ImGuiSelectableFlags_SpanAllColumns)) {
 				// Only allow range selection when there is no track filter
 				if (!G.track_filter[0] && ImGui::IsKeyDown(ImGuiMod_Shift))
-					select_range_of_tracks(get_lowest_selection_index(), i);
+					select_range_of_tracks(i);
+				else if (ImGui::IsKeyDown(ImGuiMod_Ctrl))
+					toggle_track_selection(i);
 				else select_single_track(i);
 			}
 			
@@ -628,7 +846,7 @@ static u32 show_track_list(Track_Array *tracks) {
 			
 			// Don't update for this item if it isn't visible
 			if (!ImGui::IsItemVisible()) continue;
-
+			
 			if (ImGui::IsItemClicked(ImGuiMouseButton_Middle) || 
 				(ImGui::IsItemClicked(ImGuiMouseButton_Left) && ImGui::IsMouseDoubleClicked(ImGuiMouseButton_Left))) {
 				queue_track_and_play(&tracks->info.elements[i]);
@@ -651,34 +869,25 @@ static u32 show_track_list(Track_Array *tracks) {
 					add_selection_to_queue();
 				}
 				
+				if (ImGui::MenuItem("Verify integrity")) {
+					verify_selection();
+				}
+				
 				if ((G.viewing_track_list != TRACK_LIST_PLAYLIST) && ImGui::MenuItem("Add to playlist")) {
 					//Playlist *playlist = get_selected_playlist();
 					add_selection_to_playlist();
 				}
 				
 				// Remove selected tracks from list
-				if ((G.viewing_track_list != TRACK_LIST_LIBRARY) && ImGui::MenuItem("Remove")) {
-					switch (G.selection.type) {
-						case SELECTION_TYPE_RANGE:
-						if (G.viewing_track_list != TRACK_LIST_PLAYLIST)
-							tracks->remove_range(G.selection.range.start, G.selection.range.end);
-						else
-							G.playlists.elements[G.selected_playlist_index].remove_range(G.selection.range.start,
-																						 G.selection.range.end);
-						break;
-						case SELECTION_TYPE_SINGLE:
-						if (G.viewing_track_list != TRACK_LIST_PLAYLIST)
-							tracks->remove(G.selection.single);
-						else
-							G.playlists.elements[G.selected_playlist_index].remove(G.selection.single);
-						break;
-					}
-					
-					
+				bool is_smart_playlist = (G.viewing_track_list == TRACK_LIST_PLAYLIST) && 
+					get_selected_playlist() && get_selected_playlist()->is_smart;
+				
+				if ((G.viewing_track_list != TRACK_LIST_LIBRARY) && !is_smart_playlist && ImGui::MenuItem("Remove")) {
+					remove_selection_from_track_list(tracks);
 				}
 				ImGui::EndPopup();
 			}
-			
+		
 		}
 		
 		ImGui::EndTable();
@@ -758,7 +967,7 @@ static void show_setup_view() {
 		
 		file_dialog->Release();
 	}
-
+	
 	ImGui::TextUnformatted("This path will be scanned for music. Scanning may take a few minutes for large libraries.");
 	ImGui::TextUnformatted("You can rescan your library at any time by going to File -> Rescan library.");
 	ImGui::TextUnformatted("You can change your library library at any time by going to File -> Change library path.");
@@ -788,6 +997,10 @@ static void show_hotkeys_view() {
 	ImGui::TextUnformatted("Ctrl+Shift+N: New playlist");
 	ImGui::TextUnformatted("Ctrl+Shift+Q: Clear queue");
 	ImGui::TextUnformatted("Ctrl+S: Shuffle");
+	ImGui::TextUnformatted("Ctrl+A: Select all tracks matching the search");
+	ImGui::TextUnformatted("Ctrl+I: Invert selection");
+	ImGui::TextUnformatted("Ctrl+Click: Add or remove a track from the selection");
+	ImGui::TextUnformatted("Shift+Click: Select a range of tracks");
 	ImGui::TextUnformatted("Middle Mouse Click: Play track/playlist");
 	ImGui::TextUnformatted("Enter: Play first selected track/playlist");
 	if (ImGui::Button("Ok") || (ImGui::IsWindowFocused() && ImGui::IsKeyPressed(ImGuiKey_Escape))) {
@@ -872,9 +1085,13 @@ static void show_library_scan_view() {
 			return;
 		}
 		
-		for (u32 i = 0; i < G.playlists.count; ++i) {
-			G.playlists.elements[i].update_tracks();
-		}
+		const Large_Auto_Array<u32> *changed = get_changed_track_ids();
+		update_smart_playlists(G.playlists.elements, G.playlists.count, changed->elements, changed->count);
+		
+		Playlist_Rebind_Report report;
+		rebind_playlists(G.playlists.elements, G.playlists.count, &report);
+		log_info("Rebound playlists after scan: %u tracks missing, %u reappeared (%u playlists changed)\n",
+				 report.missing, report.reappeared, report.playlists_changed);
 		
 		switch_main_view(VIEW_TRACK_LIST);
 	}
@@ -883,6 +1100,242 @@ static void show_library_scan_view() {
 	}
 }
 
+static void show_statistics_view() {
+	static Play_Stats most_played[100];
+	static u32 most_played_count;
+	static Track_Array not_played;
+	static u64 last_event_count = UINT64_MAX;
+	
+	// Only requery when something new has been played
+	if (last_event_count != get_history_event_count()) {
+		last_event_count = get_history_event_count();
+		most_played_count = get_most_played_tracks(ARRAY_LENGTH(most_played), most_played);
+		get_tracks_not_played_since((u32)time(NULL) - 365*24*60*60, &not_played);
+	}
+	
+	ImGui::Text("%llu plays recorded", last_event_count);
+	ImGui::Text("%u tracks not played in the last year", not_played.count);
+	
+	ImGui::SameLine();
+	if (ImGui::Button("Queue these tracks")) {
+		clear_queue();
+		move_queue_to_position(queue_tracks(&not_played));
+	}
+	
+	if (ImGui::Button("Back")) {
+		switch_main_view(VIEW_TRACK_LIST);
+	}
+	
+	ImGui::Separator();
+	ImGui::TextUnformatted("Most played");
+	
+	if (ImGui::BeginTable("##most_played", 5, ImGuiTableFlags_RowBg|ImGuiTableFlags_ScrollY)) {
+		ImGui::TableSetupColumn("Artist");
+		ImGui::TableSetupColumn("Title");
+		ImGui::TableSetupColumn("Plays");
+		ImGui::TableSetupColumn("Skips");
+		ImGui::TableSetupColumn("Last played");
+		ImGui::TableHeadersRow();
+		
+		for (u32 i = 0; i < most_played_count; ++i) {
+			const Play_Stats *stats = &most_played[i];
+			const Track_Info *track = lookup_track(stats->id);
+			char last_played[32];
+			time_t last_played_time = stats->last_played;
+			
+			// Tracks that have left the library still have history
+			if (!track) continue;
+			
+			strftime(last_played, sizeof(last_played), "%Y-%m-%d", localtime(&last_played_time));
+			
+			ImGui::TableNextRow();
+			ImGui::TableNextColumn();
+			ImGui::TextUnformatted(get_library_string(track->artist));
+			ImGui::TableNextColumn();
+			ImGui::TextUnformatted(get_library_string(track->title));
+			ImGui::TableNextColumn();
+			ImGui::Text("%u", stats->play_count);
+			ImGui::TableNextColumn();
+			ImGui::Text("%u", stats->skip_count);
+			ImGui::TableNextColumn();
+			ImGui::TextUnformatted(last_played);
+		}
+		
+		ImGui::EndTable();
+	}
+}
+
+static bool show_impulse_response_file_dialog(wchar_t *out, u32 out_max) {
+	static const COMDLG_FILTERSPEC filters[] = {
+		{L"Impulse responses (*.wav, *.flac)", L"*.wav;*.flac"},
+	};
+	IFileOpenDialog *file_dialog;
+	IShellItem *item;
+	bool ok = false;
+	
+	if (FAILED(CoCreateInstance(CLSID_FileOpenDialog, NULL, CLSCTX_ALL, IID_IFileOpenDialog, (void**)&file_dialog))) {
+		return false;
+	}
+	
+	file_dialog->SetFileTypes(ARRAY_LENGTH(filters), filters);
+	
+	if (SUCCEEDED(file_dialog->Show(NULL)) && SUCCEEDED(file_dialog->GetResult(&item))) {
+		LPWSTR file_name;
+		if (SUCCEEDED(item->GetDisplayName(SIGDN_FILESYSPATH, &file_name))) {
+			wcsncpy(out, file_name, out_max - 1);
+			out[out_max - 1] = 0;
+			CoTaskMemFree(file_name);
+			ok = true;
+		}
+		item->Release();
+	}
+	
+	file_dialog->Release();
+	return ok;
+}
+
+static void show_equalizer_view() {
+	Dsp_Settings settings;
+	bool changed = false;
+	get_dsp_settings(&settings);
+	
+	if (ImGui::Button("Back")) {
+		switch_main_view(VIEW_TRACK_LIST);
+	}
+	
+	ImGui::SameLine();
+	if (ImGui::Button("Reset")) {
+		// Volume lives in the control panel
+		float volume = settings.volume;
+		get_default_dsp_settings(&settings);
+		settings.volume = volume;
+		changed = true;
+	}
+	
+	ImGui::SeparatorText("Equalizer");
+	changed |= ImGui::Checkbox("Enabled##eq", &settings.eq_enabled);
+	ImGui::SetNextItemWidth(200.f);
+	changed |= ImGui::SliderFloat("Preamp", &settings.preamp_db, -12.f, 12.f, "%.1f dB");
+	
+	for (u32 i = 0; i < settings.band_count; ++i) {
+		Eq_Band *band = &settings.bands[i];
+		char label[16];
+		
+		if (band->frequency >= 1000.f) snprintf(label, sizeof(label), "%gk", band->frequency / 1000.f);
+		else snprintf(label, sizeof(label), "%g", band->frequency);
+		
+		if (i) ImGui::SameLine();
+		ImGui::PushID(i);
+		ImGui::BeginGroup();
+		changed |= ImGui::VSliderFloat("##gain", ImVec2(28.f, 160.f), &band->gain_db, -12.f, 12.f, "");
+		if (ImGui::IsItemHovered()) ImGui::SetTooltip("%s %.1f dB", label, band->gain_db);
+		ImGui::TextUnformatted(label);
+		ImGui::EndGroup();
+		ImGui::PopID();
+	}
+	
+	ImGui::SeparatorText("Room correction");
+	changed |= ImGui::Checkbox("Enabled##convolution", &settings.convolution_enabled);
+	ImGui::SameLine();
+	if (ImGui::Button("Load impulse response...")) {
+		wchar_t path[512];
+		if (show_impulse_response_file_dialog(path, ARRAY_LENGTH(path))) {
+			if (set_convolution_file(path)) {
+				const wchar_t *name = wcsrchr(path, L'\\');
+				utf16_to_utf8(name ? name + 1 : path, G.impulse_response_name, sizeof(G.impulse_response_name));
+				settings.convolution_enabled = true;
+				changed = true;
+			}
+			else {
+				user_warning("Failed to load the impulse response. See the log for details.");
+			}
+		}
+	}
+	
+	if (G.impulse_response_name[0]) {
+		ImGui::SameLine();
+		if (ImGui::Button("Remove")) {
+			set_convolution_file(NULL);
+			G.impulse_response_name[0] = 0;
+		}
+		ImGui::SameLine();
+		ImGui::TextUnformatted(G.impulse_response_name);
+	}
+	
+	ImGui::SeparatorText("Limiter");
+	changed |= ImGui::Checkbox("Enabled##limiter", &settings.limiter_enabled);
+	ImGui::SetNextItemWidth(200.f);
+	changed |= ImGui::SliderFloat("Ceiling", &settings.limiter_threshold_db, -12.f, 0.f, "%.1f dB");
+	
+	Playback_Output output;
+	get_playback_output(&output);
+	ImGui::SeparatorText("Output");
+	ImGui::Text("%u Hz, %s, %u bits%s", output.sample_rate, get_output_sample_type_name(output.sample_type), output.bits,
+				output.bit_perfect ? ", bit-perfect" : output.resampling ? ", resampled" : "");
+	
+	if (changed) set_dsp_settings(&settings);
+}
+
+static void show_telemetry_row(const char *name, const Telemetry_Histogram *histogram) {
+	ImGui::TableNextRow();
+	ImGui::TableNextColumn();
+	ImGui::TextUnformatted(name);
+	ImGui::TableNextColumn();
+	ImGui::Text("%u", histogram->count);
+	ImGui::TableNextColumn();
+	ImGui::Text("%.1f", histogram->get_mean_us());
+	ImGui::TableNextColumn();
+	ImGui::Text("%u", histogram->get_percentile_us(0.5f));
+	ImGui::TableNextColumn();
+	ImGui::Text("%u", histogram->get_percentile_us(0.99f));
+	ImGui::TableNextColumn();
+	ImGui::Text("%u", histogram->max_us);
+}
+
+static void show_diagnostics_view() {
+	Playback_Telemetry telemetry;
+	Playback_Latency latency;
+	get_playback_telemetry(&telemetry);
+	get_playback_latency(&latency);
+	
+	if (ImGui::Button("Back")) {
+		switch_main_view(VIEW_TRACK_LIST);
+	}
+	
+	ImGui::SameLine();
+	if (ImGui::Button("Save to file")) {
+		if (!save_playback_telemetry(PLAYBACK_TELEMETRY_PATH)) {
+			user_warning("Failed to save the playback telemetry. See the log for details.");
+		}
+	}
+	
+	ImGui::SeparatorText("Audio path");
+	ImGui::Text("%u underruns, %u late wakeups in %.0fs", telemetry.underrun_count, telemetry.late_wakeup_count, telemetry.uptime);
+	ImGui::Text("Device: %.1f ms queued, %.1f ms at the lowest, %.0f ms kept queued of %.0f ms", telemetry.device_ms,
+				telemetry.device_low_ms, latency.target_ms, telemetry.device_buffer_ms);
+	ImGui::Text("Ring: %.1f ms decoded ahead, %.1f ms at the lowest, of %.0f ms", telemetry.ring_ms, telemetry.ring_low_ms,
+				telemetry.ring_capacity_ms);
+	
+	ImGui::SeparatorText("Timings");
+	if (ImGui::BeginTable("##telemetry", 6, ImGuiTableFlags_RowBg)) {
+		ImGui::TableSetupColumn("Microseconds");
+		ImGui::TableSetupColumn("Count");
+		ImGui::TableSetupColumn("Mean");
+		ImGui::TableSetupColumn("Median");
+		ImGui::TableSetupColumn("99%");
+		ImGui::TableSetupColumn("Max");
+		ImGui::TableHeadersRow();
+		
+		show_telemetry_row("Decode", &telemetry.decode);
+		show_telemetry_row("Resample", &telemetry.resample);
+		show_telemetry_row("DSP", &telemetry.dsp);
+		show_telemetry_row("Refill", &telemetry.refill);
+		show_telemetry_row("Wakeup interval", &telemetry.wakeup_interval);
+		
+		ImGui::EndTable();
+	}
+}
+
 static void delete_and_free_playlist(u32 index) {
 	Playlist *playlist = &G.playlists.elements[index];
 	
@@ -893,6 +1346,98 @@ static void delete_and_free_playlist(u32 index) {
 	delete_playlist(playlist);
 	playlist->free();
 	G.playlists.remove(index);
+	G.smart_query_playlist = NULL;
+}
+
+static bool playlist_name_exists(const char *name, u32 ignore_index) {
+	for (u32 i = 0; i < G.playlists.count; ++i) {
+		if (i != ignore_index && !strcmp(G.playlists.elements[i].name, name)) return true;
+	}
+	return false;
+}
+
+static bool show_playlist_file_dialog(bool save, wchar_t *out, u32 out_max) {
+	static const COMDLG_FILTERSPEC filters[] = {
+		{L"Playlists (*.m3u8, *.m3u, *.pls)", L"*.m3u8;*.m3u;*.pls"},
+		{L"M3U8 playlist (*.m3u8)", L"*.m3u8"},
+		{L"M3U playlist (*.m3u)", L"*.m3u"},
+		{L"PLS playlist (*.pls)", L"*.pls"},
+	};
+	IFileDialog *file_dialog;
+	IShellItem *item;
+	bool ok = false;
+	
+	if (FAILED(CoCreateInstance(save ? CLSID_FileSaveDialog : CLSID_FileOpenDialog, NULL, CLSCTX_ALL, 
+								save ? IID_IFileSaveDialog : IID_IFileOpenDialog, (void**)&file_dialog))) {
+		return false;
+	}
+	
+	// Saving needs a specific format so skip the combined filter
+	if (save) {
+		file_dialog->SetFileTypes(ARRAY_LENGTH(filters) - 1, &filters[1]);
+		file_dialog->SetDefaultExtension(L"m3u8");
+	}
+	else {
+		file_dialog->SetFileTypes(ARRAY_LENGTH(filters), filters);
+	}
+	
+	if (SUCCEEDED(file_dialog->Show(NULL)) && SUCCEEDED(file_dialog->GetResult(&item))) {
+		LPWSTR file_name;
+		if (SUCCEEDED(item->GetDisplayName(SIGDN_FILESYSPATH, &file_name))) {
+			wcsncpy(out, file_name, out_max - 1);
+			out[out_max - 1] = 0;
+			CoTaskMemFree(file_name);
+			ok = true;
+		}
+		item->Release();
+	}
+	
+	file_dialog->Release();
+	return ok;
+}
+
+static void import_playlist_from_file() {
+	wchar_t path[512];
+	Playlist_Import_Report report;
+	
+	// The playlist being named is always the last one
+	if (G.naming_playlist || !show_playlist_file_dialog(false, path, ARRAY_LENGTH(path))) return;
+	
+	Playlist *playlist = G.playlists.push();
+	memset(playlist, 0, sizeof(*playlist));
+	
+	if (!import_playlist(path, playlist, &report)) {
+		playlist->free();
+		G.playlists.count--;
+		user_warning("Failed to import playlist");
+		return;
+	}
+	
+	// Make the name unique
+	char base_name[sizeof(playlist->name) - 8];
+	strncpy(base_name, playlist->name, sizeof(base_name) - 1);
+	base_name[sizeof(base_name) - 1] = 0;
+	for (u32 n = 2; playlist_name_exists(playlist->name, G.playlists.count - 1); ++n) {
+		snprintf(playlist->name, sizeof(playlist->name), "%s (%u)", base_name, n);
+	}
+	
+	playlist->save_to_file();
+	G.selected_playlist_index = G.playlists.count - 1;
+	
+	if (report.unresolved) {
+		user_warning("%u of %u playlist entries were not found in the library", report.unresolved, report.entries);
+	}
+}
+
+static void export_selected_playlist() {
+	Playlist *playlist = get_selected_playlist();
+	wchar_t path[512];
+	
+	if (!playlist || !show_playlist_file_dialog(true, path, ARRAY_LENGTH(path))) return;
+	
+	if (!export_playlist(playlist, path)) {
+		user_warning("Failed to export playlist");
+	}
 }
 
 static void show_gui(u32 window_width, u32 window_height) {
@@ -915,6 +1460,15 @@ static void show_gui(u32 window_width, u32 window_height) {
 			if (ImGui::MenuItem("New playlist")) {
 				new_playlist();
 			}
+			if (ImGui::MenuItem("New smart playlist")) {
+				new_playlist(true);
+			}
+			if (ImGui::MenuItem("Import playlist...")) {
+				import_playlist_from_file();
+			}
+			if (ImGui::MenuItem("Export playlist...", NULL, false, get_selected_playlist() != NULL)) {
+				export_selected_playlist();
+			}
 			if (ImGui::MenuItem("Rescan library")) {
 				clear_queue();
 				switch_main_view(VIEW_LIBRARY_SCAN);
@@ -944,6 +1498,25 @@ static void show_gui(u32 window_width, u32 window_height) {
 					G.is_light_mode = true;
 				}
 			}
+			if (ImGui::MenuItem("Play statistics")) {
+				switch_main_view(VIEW_STATISTICS);
+			}
+			if (ImGui::MenuItem("Equalizer")) {
+				switch_main_view(VIEW_EQUALIZER);
+			}
+			if (ImGui::MenuItem("Diagnostics")) {
+				switch_main_view(VIEW_DIAGNOSTICS);
+			}
+			if (ImGui::BeginMenu("Resampling quality")) {
+				Resampler_Quality current_quality = get_resampler_quality();
+				for (u32 i = 0; i < RESAMPLER_QUALITY_COUNT; ++i) {
+					Resampler_Quality quality = (Resampler_Quality)i;
+					if (ImGui::MenuItem(get_resampler_quality_name(quality), NULL, quality == current_quality)) {
+						set_resampler_quality(quality);
+					}
+				}
+				ImGui::EndMenu();
+			}
 			ImGui::EndMenu();
 		}
 		
@@ -976,7 +1549,7 @@ static void show_gui(u32 window_width, u32 window_height) {
 				Playlist *playlist = get_selected_playlist();
 				const Track_Info *track_info = lookup_track(G.current_track_id);
 				
-				if (playlist && track_info) {
+				if (playlist && !playlist->is_smart && track_info) {
 					playlist->add_track(track_info);
 					playlist->save_to_file();
 				}
@@ -989,6 +1562,8 @@ static void show_gui(u32 window_width, u32 window_height) {
 		// @TODO: Remember volume
 		static float volume_slider = 1.f;
 		ImVec2 button_size = ImVec2(12.f, 14.f);
+		Playback_Snapshot playback;
+		get_playback_snapshot(&playback);
 		
 		// @TODO: These buttons are terrible. Make them look nice
 		ImGui::Selectable(u8"\xf074", &G.shuffle_enabled, 0, button_size);
@@ -1001,7 +1576,7 @@ static void show_gui(u32 window_width, u32 window_height) {
 		}
 		
 		ImGui::SameLine();
-		if (ImGui::Selectable(track_is_playing() ? u8"\xf04c" : u8"\xf04b", false, 0, button_size)) {
+		if (ImGui::Selectable((playback.state == PLAYER_STATE_PLAYING) ? u8"\xf04c" : u8"\xf04b", false, 0, button_size)) {
 			toggle_playback();
 		}
 		
@@ -1021,7 +1596,7 @@ static void show_gui(u32 window_width, u32 window_height) {
 					get_library_string(G.current_track_info.title));
 		
 		ImGui::SetNextItemWidth(layout_width - 16.f);
-		if (ImGui::SliderFloat("##seek_slider", &G.seek_target, 0, get_playback_length(), "%.2f")) {
+		if (ImGui::SliderFloat("##seek_slider", &G.seek_target, 0, playback.length, "%.2f")) {
 			G.seeking = true;
 		}
 		
@@ -1031,7 +1606,7 @@ static void show_gui(u32 window_width, u32 window_height) {
 		}
 		
 		if (!G.seeking) {
-			G.seek_target = get_playback_position();
+			G.seek_target = playback.position;
 		}
 	}
 	ImGui::End();
@@ -1147,6 +1722,15 @@ static void show_gui(u32 window_width, u32 window_height) {
 			case VIEW_LIBRARY_SCAN:
 			show_library_scan_view();
 			break;
+			case VIEW_STATISTICS:
+			show_statistics_view();
+			break;
+			case VIEW_EQUALIZER:
+			show_equalizer_view();
+			break;
+			case VIEW_DIAGNOSTICS:
+			show_diagnostics_view();
+			break;
 		}
 	}	
 	ImGui::End();
@@ -1163,11 +1747,20 @@ static void show_gui(u32 window_width, u32 window_height) {
 		ImGui::Text("%u tracks", displayed_track_count);
 	}
 	ImGui::End();
-	
+
 }
 
 
 static LRESULT WINAPI window_proc(HWND hwnd, UINT msg, WPARAM wparam, LPARAM lparam) {
+	// Not input, so these don't wake the window up
+	if (msg == WM_PLAYER_TRACK_END || msg == WM_PLAYER_TRACK_CHANGE) {
+		// Stale if a track has been opened since, which already moved the queue on
+		if ((u32)wparam != get_track_serial()) return 0;
+		if (msg == WM_PLAYER_TRACK_END) handle_track_end();
+		else handle_track_change((u32)lparam);
+		return 0;
+	}
+	
 	if (ImGui_ImplWin32_WndProcHandler(hwnd, msg, wparam, lparam))
 		return true;
 	
@@ -1205,21 +1798,31 @@ static LRESULT WINAPI window_proc(HWND hwnd, UINT msg, WPARAM wparam, LPARAM lpa
 	return DefWindowProc(hwnd, msg, wparam, lparam);
 }
 
-static void on_track_end() {
-	log_debug("End of playback\n");
-	next_track();
+static void on_track_end(u32 track_serial) {
+	PostMessage(g_window.hwnd, WM_PLAYER_TRACK_END, track_serial, 0);
 }
 
-u32 utf8_to_utf16(const char *in, wchar_t *out, u32 max_out) {
-	int ret = MultiByteToWideChar(CP_UTF8, 0, in, -1, out, max_out) - 1;
-	if (ret == -1) return 0;
-	return (u32)ret;
+static void on_track_change(float previous_length, u32 track_serial) {
+	PostMessage(g_window.hwnd, WM_PLAYER_TRACK_CHANGE, track_serial, (LPARAM)(previous_length * 1000.f));
 }
 
-u32 utf16_to_utf8(const wchar_t *in, char *out, u32 max_out) {
-	int ret = WideCharToMultiByte(CP_UTF8, 0, in, -1, out, max_out, NULL, NULL) - 1;
-	if (ret == -1) return 0;
-	return (u32)ret;
+static void handle_track_end() {
+	log_debug("End of playback\n");
+	record_current_track_play(true);
+	next_track();
+}
+
+// The player has gone on to the track from update_next_track() by itself
+static void handle_track_change(u32 previous_length_ms) {
+	log_debug("Carried on to the next track\n");
+	if (G.history_track_id) record_play(G.history_track_id, previous_length_ms, false);
+	
+	G.current_track_id = G.next_track_id;
+	G.current_track_info = G.next_track_info;
+	G.history_track_id = G.next_track_id;
+	G.queue_next_position = G.next_track_position + 1;
+	G.next_track_position = -1;
+	G.next_track_id = 0;
 }
 
 void *system_allocate(u32 size) {
@@ -1272,33 +1875,11 @@ bool track_meets_filter(const Track_Info *track, const char *query, u32 tag_mask
 	
 	return false;
 }
-	
-bool path_exists(const char *path) {
-	DWORD file_attr = GetFileAttributesA(path);
-	return file_attr != INVALID_FILE_ATTRIBUTES;
-}
-
-bool path_exists_w(const wchar_t *path) {
-	DWORD file_attr = GetFileAttributesW(path);
-	return file_attr != INVALID_FILE_ATTRIBUTES;
-}
-
-u64 time_get_tick() {
-	LARGE_INTEGER ret;
-	QueryPerformanceCounter(&ret);
-	return ret.QuadPart;
-}
-
-float time_ticks_to_milliseconds(u64 ticks) {
-	LARGE_INTEGER frequency;
-	QueryPerformanceFrequency(&frequency);
-	return ((double)ticks / (double)frequency.QuadPart) * 1000.f;
-}
 
 static void show_formatted_message_box(UINT type, const char *title, const char *message, va_list args) {
 	char formatted[4096];
 	vsnprintf(formatted, sizeof(formatted), message, args);
-	MessageBox(NULL, message, title, type);
+	MessageBox(NULL, formatted, title, type);
 }
 
 void fatal_error(const char *message, ...) {
@@ -1314,4 +1895,11 @@ void user_warning(const char *message, ...) {
 	va_start(args, message);
 	show_formatted_message_box(MB_OK|MB_ICONWARNING, "[Verata] Warning", message, args);
 	va_end(args);
+}
+
+void user_message(const char *message, ...) {
+	va_list args;
+	va_start(args, message);
+	show_formatted_message_box(MB_OK|MB_ICONINFORMATION, "[Verata]", message, args);
+	va_end(args);
 }
\ No newline at end of file
@@ -77,7 +77,7 @@ void Large_Auto_Array<T>::remove_range(u32 start, u32 end) {
 	this->count -= range;
 }
 
-template Large_Auto_Array<Track_Info>;
-template Large_Auto_Array<u32>;
-template Large_Auto_Array<char>;
-template Large_Auto_Array<Playlist>;
+template struct Large_Auto_Array<Track_Info>;
+template struct Large_Auto_Array<u32>;
+template struct Large_Auto_Array<char>;
+template struct Large_Auto_Array<Playlist>;
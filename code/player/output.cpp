@@ -0,0 +1,208 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "output.h"
+#include "platform.h"
+#include <stdlib.h>
+#include <string.h>
+
+const u32 g_output_rates[OUTPUT_RATE_COUNT] = {32000, 44100, 48000, 88200, 96000, 176400, 192000, 352800, 384000};
+
+#ifdef _WIN32
+static const Output_Functions g_wasapi_functions = {
+	&open_wasapi, &start_wasapi, &stop_wasapi, &get_queued_frames_wasapi, &wait_wasapi, &get_buffer_wasapi,
+	&release_buffer_wasapi, &set_volume_wasapi, &get_volume_wasapi, &close_wasapi,
+};
+#endif
+
+#ifdef __linux__
+static const Output_Functions g_alsa_functions = {
+	&open_alsa, &start_alsa, &stop_alsa, &get_queued_frames_alsa, NULL, &get_buffer_alsa,
+	&release_buffer_alsa, &set_volume_alsa, &get_volume_alsa, &close_alsa,
+};
+#endif
+
+static const Output_Functions g_null_functions = {
+	&open_null, &start_null, &stop_null, &get_queued_frames_null, NULL, &get_buffer_null,
+	&release_buffer_null, &set_volume_null, &get_volume_null, &close_null,
+};
+
+static const char *g_backend_names[OUTPUT_BACKEND_COUNT] = {"default", "wasapi", "alsa", "null"};
+static const char *g_sample_type_names[OUTPUT_SAMPLE_TYPE_COUNT] = {"default", "f32", "s16", "s24", "s32"};
+
+const Output_Functions *get_output_functions(enum Output_Backend backend) {
+	switch (backend) {
+		case OUTPUT_BACKEND_DEFAULT: return get_output_functions(get_default_output_backend());
+#ifdef _WIN32
+		case OUTPUT_BACKEND_WASAPI: return &g_wasapi_functions;
+#endif
+#ifdef __linux__
+		case OUTPUT_BACKEND_ALSA: return &g_alsa_functions;
+#endif
+		case OUTPUT_BACKEND_NULL: return &g_null_functions;
+		default: return NULL;
+	}
+}
+
+enum Output_Backend get_default_output_backend() {
+#if defined(_WIN32)
+	return OUTPUT_BACKEND_WASAPI;
+#elif defined(__linux__)
+	return OUTPUT_BACKEND_ALSA;
+#else
+	return OUTPUT_BACKEND_NULL;
+#endif
+}
+
+const char *get_output_backend_name(enum Output_Backend backend) {
+	if (backend >= OUTPUT_BACKEND_COUNT) return "unknown";
+	return g_backend_names[backend];
+}
+
+bool find_output_backend(const char *name, enum Output_Backend *backend) {
+	for (u32 i = 0; i < OUTPUT_BACKEND_COUNT; ++i) {
+		if (!_strnicmp(name, g_backend_names[i], 16)) {
+			*backend = (enum Output_Backend)i;
+			return true;
+		}
+	}
+	
+	return false;
+}
+
+const char *get_output_sample_type_name(enum Output_Sample_Type type) {
+	if (type >= OUTPUT_SAMPLE_TYPE_COUNT) return "unknown";
+	return g_sample_type_names[type];
+}
+
+u32 get_output_sample_size(enum Output_Sample_Type type) {
+	switch (type) {
+		case OUTPUT_SAMPLE_S16: return 2;
+		case OUTPUT_SAMPLE_S24: return 3;
+		default: return 4;
+	}
+}
+
+bool find_output_sample_type(const char *name, enum Output_Sample_Type *type) {
+	for (u32 i = 0; i < OUTPUT_SAMPLE_TYPE_COUNT; ++i) {
+		if (!_strnicmp(name, g_sample_type_names[i], 16)) {
+			*type = (enum Output_Sample_Type)i;
+			return true;
+		}
+	}
+	
+	return false;
+}
+
+u32 get_output_rate_bit(u32 sample_rate) {
+	for (u32 i = 0; i < OUTPUT_RATE_COUNT; ++i) {
+		if (g_output_rates[i] == sample_rate) return 1 << i;
+	}
+	
+	return 0;
+}
+
+bool Output_Device::open(const Output_Config *config) {
+	DEBUG_ASSERT(!this->device);
+	
+	this->backend = config->backend == OUTPUT_BACKEND_DEFAULT ? get_default_output_backend() : config->backend;
+	this->functions = get_output_functions(this->backend);
+	
+	if (!this->functions) {
+		log_error("The %s output isn't available on this platform\n", get_output_backend_name(this->backend));
+		return false;
+	}
+	
+	this->format = {};
+	this->device = this->functions->open_func(config, &this->format);
+	if (!this->device) return false;
+	
+	if (this->format.sample_type != OUTPUT_SAMPLE_F32) {
+		this->conversion_buffer = (float*)malloc(this->format.buffer_frames * 2 * sizeof(float));
+	}
+	
+	this->dither.init((u32)time_get_tick());
+	log_info("Output format: %uHz %s (%u bits)\n", this->format.sample_rate,
+			 get_output_sample_type_name(this->format.sample_type), this->format.bits);
+	return true;
+}
+
+void Output_Device::start() {
+	this->functions->start_func(this->device);
+}
+
+void Output_Device::stop() {
+	this->functions->stop_func(this->device);
+}
+
+u32 Output_Device::get_queued_frames() {
+	return this->functions->get_queued_frames_func(this->device);
+}
+
+u32 Output_Device::get_writable_frames() {
+	u32 queued = this->get_queued_frames();
+	return queued < this->format.buffer_frames ? this->format.buffer_frames - queued : 0;
+}
+
+bool Output_Device::wait(void *interrupt_event, u32 timeout_ms) {
+	if (this->format.event_driven) return this->functions->wait_func(this->device, interrupt_event, timeout_ms);
+	return wait_for_event(interrupt_event, timeout_ms);
+}
+
+float *Output_Device::get_buffer(u32 frame_count) {
+	this->device_buffer = this->functions->get_buffer_func(this->device, frame_count);
+	if (!this->device_buffer) return NULL;
+	return this->conversion_buffer ? this->conversion_buffer : (float*)this->device_buffer;
+}
+
+void Output_Device::release_buffer(u32 frame_count, bool silent, bool dither) {
+	const u32 count = frame_count * 2;
+	PCM_Dither *pcm_dither = dither ? &this->dither : NULL;
+	
+	if (!silent) {
+		switch (this->format.sample_type) {
+			case OUTPUT_SAMPLE_S16: pcm_f32_to_s16(this->conversion_buffer, (s16*)this->device_buffer, count, pcm_dither); break;
+			case OUTPUT_SAMPLE_S24: pcm_f32_to_s24(this->conversion_buffer, (u8*)this->device_buffer, count, pcm_dither); break;
+			case OUTPUT_SAMPLE_S32: {
+				pcm_f32_to_s32(this->conversion_buffer, (s32*)this->device_buffer, count, this->format.bits, pcm_dither);
+				break;
+			}
+			default: break;
+		}
+	}
+	
+	this->functions->release_buffer_func(this->device, frame_count, silent);
+}
+
+void Output_Device::write_silence(u32 frame_count) {
+	if (!frame_count || !this->get_buffer(frame_count)) return;
+	this->release_buffer(frame_count, true, false);
+}
+
+void Output_Device::set_volume(float volume) {
+	if (this->device) this->functions->set_volume_func(this->device, volume);
+}
+
+float Output_Device::get_volume() {
+	return this->device ? this->functions->get_volume_func(this->device) : 1.f;
+}
+
+void Output_Device::close() {
+	if (!this->device) return;
+	this->functions->close_func(this->device);
+	this->device = NULL;
+	free(this->conversion_buffer);
+	this->conversion_buffer = NULL;
+}
@@ -0,0 +1,223 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include "common.h"
+#include "pcm.h"
+#include <stddef.h>
+
+// Where the player sends its audio. Every backend takes interleaved stereo at the rate and in the sample
+// type it settles on when it is opened, and keeps all of its state in the device it returns from open.
+// The player always works in floats, and Output_Device converts them for devices that take integers.
+// A device is only used by the audio thread, apart from the volume, which can be set from anywhere.
+
+enum Output_Backend {
+	// Whatever this platform normally uses
+	OUTPUT_BACKEND_DEFAULT,
+	OUTPUT_BACKEND_WASAPI,
+	// Also reaches PulseAudio and PipeWire through their ALSA plugins
+	OUTPUT_BACKEND_ALSA,
+	// No hardware. Optionally writes what it gets to a WAV file.
+	OUTPUT_BACKEND_NULL,
+	OUTPUT_BACKEND_COUNT,
+};
+
+enum Output_Clock {
+	// The null device plays at the sample rate, like hardware would
+	OUTPUT_CLOCK_REAL,
+	// The null device plays everything as soon as it gets it
+	OUTPUT_CLOCK_VIRTUAL,
+};
+
+enum Output_Sample_Type {
+	// Whatever suits the device best
+	OUTPUT_SAMPLE_DEFAULT,
+	OUTPUT_SAMPLE_F32,
+	OUTPUT_SAMPLE_S16,
+	// Packed, 3 bytes per sample
+	OUTPUT_SAMPLE_S24,
+	// Can have fewer significant bits, at the top
+	OUTPUT_SAMPLE_S32,
+	OUTPUT_SAMPLE_TYPE_COUNT,
+};
+
+// The rates a device is asked about when it opens, for Output_Format::native_rates
+#define OUTPUT_RATE_COUNT 9
+extern const u32 g_output_rates[OUTPUT_RATE_COUNT];
+
+// The most the player can ever queue in the device
+#define OUTPUT_DEFAULT_BUFFER_MS 500
+// How much the player starts off queueing. It is raised after underruns, up to the buffer size.
+#define OUTPUT_DEFAULT_TARGET_LATENCY_MS 40
+#define OUTPUT_DEFAULT_SAMPLE_RATE 48000
+
+struct Output_Config {
+	enum Output_Backend backend;
+	// Size of the device buffer. Devices can round this.
+	u32 buffer_duration_ms;
+	// How much of it to keep filled. 0 for OUTPUT_DEFAULT_TARGET_LATENCY_MS.
+	u32 target_latency_ms;
+	// 0 lets the device pick. Shared-mode WASAPI always uses the mix rate.
+	u32 sample_rate;
+	// What to ask the device for first. Devices that can't take it use the nearest they can.
+	enum Output_Sample_Type sample_type;
+	// WASAPI only. Takes the device for ourselves, which is the only way it plays anything but the mix format.
+	bool exclusive;
+	// TPDF dither integers when the player has changed the audio
+	bool dither;
+	// Read by the player. Reopens the device at each track's own rate when it can play it, instead of resampling.
+	bool match_track_rate;
+	// Null device only. NULL to throw the audio away.
+	const wchar_t *file_path;
+	enum Output_Clock clock;
+	// ALSA only. NULL for "default".
+	const char *device_name;
+};
+
+struct Output_Format {
+	u32 sample_rate;
+	enum Output_Sample_Type sample_type;
+	// Significant bits of each sample. Floats count as 24, which is as many as they hold exactly.
+	u32 bits;
+	// Bit i is set if the device could be opened at g_output_rates[i] and play it as it is
+	u32 native_rates;
+	// wait() comes back when the device wants audio rather than only on the timeout
+	bool event_driven;
+	// Size of the device buffer
+	u32 buffer_frames;
+	// How often the device takes audio from its buffer. Nothing less than this can be kept queued safely.
+	u32 period_frames;
+};
+
+// Return the new device, or NULL on failure. Needs to write the format to the given pointer.
+// The device starts stopped.
+typedef void *Output_Open_Function(const Output_Config *config, Output_Format *format);
+typedef void Output_Start_Function(void *device);
+// Stop and drop everything that is queued
+typedef void Output_Stop_Function(void *device);
+// Frames written that haven't been played yet
+typedef u32 Output_Get_Queued_Frames_Function(void *device);
+// Sleep until the device wants more audio, interrupt_event (from create_event()) is signalled, or the timeout
+// passes. Returns true if it was interrupted. Backends that can't signal leave this NULL, and it is only
+// called on devices that set event_driven. Otherwise the caller sleeps on the interrupt event for as long
+// as the queued audio lasts.
+typedef bool Output_Wait_Function(void *device, void *interrupt_event, u32 timeout_ms);
+// Get somewhere to write frame_count frames of the device's sample type. frame_count must fit in what
+// isn't queued.
+typedef void *Output_Get_Buffer_Function(void *device, u32 frame_count);
+// Queue what was written to the last buffer. If silent, the buffer is ignored and silence is queued.
+typedef void Output_Release_Buffer_Function(void *device, u32 frame_count, bool silent);
+typedef void Output_Set_Volume_Function(void *device, float volume);
+typedef float Output_Get_Volume_Function(void *device);
+// Frees the device
+typedef void Output_Close_Function(void *device);
+
+struct Output_Functions {
+	Output_Open_Function *open_func;
+	Output_Start_Function *start_func;
+	Output_Stop_Function *stop_func;
+	Output_Get_Queued_Frames_Function *get_queued_frames_func;
+	// Can be NULL
+	Output_Wait_Function *wait_func;
+	Output_Get_Buffer_Function *get_buffer_func;
+	Output_Release_Buffer_Function *release_buffer_func;
+	Output_Set_Volume_Function *set_volume_func;
+	Output_Get_Volume_Function *get_volume_func;
+	Output_Close_Function *close_func;
+};
+
+// An open device of any backend. Zero initialized means closed.
+struct Output_Device {
+	const Output_Functions *functions;
+	void *device;
+	enum Output_Backend backend;
+	Output_Format format;
+	
+	// Where the player writes floats for a device that takes integers, a whole device buffer long
+	float *conversion_buffer;
+	// The device's own buffer, from the last get_buffer()
+	void *device_buffer;
+	PCM_Dither dither;
+	
+	bool open(const Output_Config *config);
+	void start();
+	void stop();
+	u32 get_queued_frames();
+	// Device buffer space that can be written right now
+	u32 get_writable_frames();
+	// Returns true if interrupt_event was signalled
+	bool wait(void *interrupt_event, u32 timeout_ms);
+	bool is_event_driven() const {return this->format.event_driven;}
+	// Always floats
+	float *get_buffer(u32 frame_count);
+	// Integers are dithered if dither is set. Leave it off for audio that is already exact at format.bits.
+	void release_buffer(u32 frame_count, bool silent, bool dither);
+	void write_silence(u32 frame_count);
+	// 0 to 1
+	void set_volume(float volume);
+	float get_volume();
+	// Safe to call on a closed device
+	void close();
+	bool is_open() const {return this->device != NULL;}
+};
+
+// NULL if the backend isn't built on this platform
+const Output_Functions *get_output_functions(enum Output_Backend backend);
+// Resolves OUTPUT_BACKEND_DEFAULT
+enum Output_Backend get_default_output_backend();
+const char *get_output_backend_name(enum Output_Backend backend);
+// Parses a backend name as given by get_output_backend_name(). Returns false if there is no such backend.
+bool find_output_backend(const char *name, enum Output_Backend *backend);
+const char *get_output_sample_type_name(enum Output_Sample_Type type);
+// Bytes in one sample of one channel
+u32 get_output_sample_size(enum Output_Sample_Type type);
+bool find_output_sample_type(const char *name, enum Output_Sample_Type *type);
+// The bit for a rate in Output_Format::native_rates, or 0 if it isn't one of g_output_rates
+u32 get_output_rate_bit(u32 sample_rate);
+
+void *open_wasapi(const Output_Config *config, Output_Format *format);
+void start_wasapi(void *device);
+void stop_wasapi(void *device);
+u32 get_queued_frames_wasapi(void *device);
+bool wait_wasapi(void *device, void *interrupt_event, u32 timeout_ms);
+void *get_buffer_wasapi(void *device, u32 frame_count);
+void release_buffer_wasapi(void *device, u32 frame_count, bool silent);
+void set_volume_wasapi(void *device, float volume);
+float get_volume_wasapi(void *device);
+void close_wasapi(void *device);
+
+void *open_alsa(const Output_Config *config, Output_Format *format);
+void start_alsa(void *device);
+void stop_alsa(void *device);
+u32 get_queued_frames_alsa(void *device);
+void *get_buffer_alsa(void *device, u32 frame_count);
+void release_buffer_alsa(void *device, u32 frame_count, bool silent);
+void set_volume_alsa(void *device, float volume);
+float get_volume_alsa(void *device);
+void close_alsa(void *device);
+
+void *open_null(const Output_Config *config, Output_Format *format);
+void start_null(void *device);
+void stop_null(void *device);
+u32 get_queued_frames_null(void *device);
+void *get_buffer_null(void *device, u32 frame_count);
+void release_buffer_null(void *device, u32 frame_count, bool silent);
+void set_volume_null(void *device, float volume);
+float get_volume_null(void *device);
+void close_null(void *device);
+
+#endif //OUTPUT_H
@@ -0,0 +1,217 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+// ALSA playback. The "default" device goes through PulseAudio or PipeWire when they are running,
+// so this covers desktop Linux as well as bare ALSA. Frames are written with snd_pcm_writei from a buffer
+// of our own. Floats are asked for first, and hw: devices that don't take them get integers. Through
+// the plug layer every rate and format is accepted and converted, so only hw: devices say which rates
+// they really play.
+#ifdef __linux__
+#include "../output.h"
+#include <alsa/asoundlib.h>
+#include <atomic>
+#include <stdlib.h>
+#include <string.h>
+
+struct ALSA_Device {
+	snd_pcm_t *pcm;
+	u32 buffer_frames;
+	enum Output_Sample_Type sample_type;
+	u32 frame_size;
+	u8 *buffer;
+	std::atomic<float> volume;
+};
+
+static snd_pcm_format_t get_alsa_format(enum Output_Sample_Type type) {
+	switch (type) {
+		case OUTPUT_SAMPLE_S16: return SND_PCM_FORMAT_S16_LE;
+		case OUTPUT_SAMPLE_S24: return SND_PCM_FORMAT_S24_3LE;
+		case OUTPUT_SAMPLE_S32: return SND_PCM_FORMAT_S32_LE;
+		default: return SND_PCM_FORMAT_FLOAT_LE;
+	}
+}
+
+// The one asked for, or the first of the rest the device takes, best first
+static enum Output_Sample_Type pick_sample_type(snd_pcm_t *pcm, snd_pcm_hw_params_t *hw_params, enum Output_Sample_Type wanted) {
+	static const enum Output_Sample_Type types[] = {OUTPUT_SAMPLE_F32, OUTPUT_SAMPLE_S32, OUTPUT_SAMPLE_S24, OUTPUT_SAMPLE_S16};
+	
+	if (wanted != OUTPUT_SAMPLE_DEFAULT && !snd_pcm_hw_params_test_format(pcm, hw_params, get_alsa_format(wanted))) {
+		return wanted;
+	}
+	
+	for (u32 i = 0; i < ARRAY_LENGTH(types); ++i) {
+		if (!snd_pcm_hw_params_test_format(pcm, hw_params, get_alsa_format(types[i]))) return types[i];
+	}
+	
+	return OUTPUT_SAMPLE_F32;
+}
+
+// Gets the device going again after an underrun. Returns false if it can't.
+static bool recover(ALSA_Device *device, int error) {
+	error = snd_pcm_recover(device->pcm, error, 1);
+	if (error < 0) {
+		log_error("ALSA: %s\n", snd_strerror(error));
+		return false;
+	}
+	return true;
+}
+
+void *open_alsa(const Output_Config *config, Output_Format *format) {
+	ALSA_Device *device = (ALSA_Device*)calloc(1, sizeof(ALSA_Device));
+	const char *device_name = config->device_name ? config->device_name : "default";
+	unsigned int sample_rate = config->sample_rate ? config->sample_rate : OUTPUT_DEFAULT_SAMPLE_RATE;
+	unsigned int buffer_time = (config->buffer_duration_ms ? config->buffer_duration_ms : OUTPUT_DEFAULT_BUFFER_MS) * 1000;
+	// Short periods so the player can keep little queued. The buffer only needs to be big enough to grow into.
+	unsigned int period_time = MIN(buffer_time / 4, 10000u);
+	snd_pcm_hw_params_t *hw_params;
+	snd_pcm_sw_params_t *sw_params;
+	snd_pcm_uframes_t buffer_size = 0;
+	snd_pcm_uframes_t period_size = 0;
+	u32 native_rates = 0;
+	int bits = 0;
+	int error;
+	
+	device->volume.store(1.f);
+	
+	error = snd_pcm_open(&device->pcm, device_name, SND_PCM_STREAM_PLAYBACK, 0);
+	if (error < 0) {
+		log_error("Failed to open ALSA device \"%s\": %s\n", device_name, snd_strerror(error));
+		free(device);
+		return NULL;
+	}
+	
+	snd_pcm_hw_params_alloca(&hw_params);
+	snd_pcm_hw_params_any(device->pcm, hw_params);
+	error = snd_pcm_hw_params_set_access(device->pcm, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED);
+	if (error >= 0) {
+		device->sample_type = pick_sample_type(device->pcm, hw_params, config->sample_type);
+		error = snd_pcm_hw_params_set_format(device->pcm, hw_params, get_alsa_format(device->sample_type));
+	}
+	if (error >= 0) error = snd_pcm_hw_params_set_channels(device->pcm, hw_params, 2);
+	
+	for (u32 i = 0; error >= 0 && i < OUTPUT_RATE_COUNT; ++i) {
+		if (!snd_pcm_hw_params_test_rate(device->pcm, hw_params, g_output_rates[i], 0)) native_rates |= 1 << i;
+	}
+	
+	if (error >= 0) error = snd_pcm_hw_params_set_rate_near(device->pcm, hw_params, &sample_rate, NULL);
+	if (error >= 0) error = snd_pcm_hw_params_set_buffer_time_near(device->pcm, hw_params, &buffer_time, NULL);
+	if (error >= 0) error = snd_pcm_hw_params_set_period_time_near(device->pcm, hw_params, &period_time, NULL);
+	if (error >= 0) error = snd_pcm_hw_params(device->pcm, hw_params);
+	if (error >= 0) error = snd_pcm_hw_params_get_buffer_size(hw_params, &buffer_size);
+	if (error >= 0) error = snd_pcm_hw_params_get_period_size(hw_params, &period_size, NULL);
+	
+	if (error < 0) {
+		log_error("Failed to set up ALSA device \"%s\" for stereo %s: %s\n", device_name,
+				  get_output_sample_type_name(device->sample_type), snd_strerror(error));
+		close_alsa(device);
+		return NULL;
+	}
+	
+	// Integers can have fewer significant bits than they take up, like 24 in 32
+	if (device->sample_type != OUTPUT_SAMPLE_F32) bits = snd_pcm_hw_params_get_sbits(hw_params);
+	if (bits <= 0) bits = device->sample_type == OUTPUT_SAMPLE_S16 ? 16 : device->sample_type == OUTPUT_SAMPLE_S32 ? 32 : 24;
+	
+	// Start playing as soon as anything is written, so start() and stop() don't need to wait for a full buffer
+	snd_pcm_sw_params_alloca(&sw_params);
+	snd_pcm_sw_params_current(device->pcm, sw_params);
+	snd_pcm_sw_params_set_start_threshold(device->pcm, sw_params, 1);
+	snd_pcm_sw_params(device->pcm, sw_params);
+	
+	device->buffer_frames = (u32)buffer_size;
+	device->frame_size = get_output_sample_size(device->sample_type) * 2;
+	device->buffer = (u8*)malloc(device->buffer_frames * device->frame_size);
+	
+	log_info("ALSA device \"%s\": %uHz, %u frame buffer, %u frame period\n", device_name, sample_rate,
+			 device->buffer_frames, (u32)period_size);
+	format->sample_rate = sample_rate;
+	format->sample_type = device->sample_type;
+	format->bits = (u32)bits;
+	format->native_rates = native_rates;
+	format->buffer_frames = device->buffer_frames;
+	format->period_frames = (u32)period_size;
+	return device;
+}
+
+void start_alsa(void *device_ptr) {
+	// Starts on the first write
+}
+
+void stop_alsa(void *device_ptr) {
+	ALSA_Device *device = (ALSA_Device*)device_ptr;
+	snd_pcm_drop(device->pcm);
+	snd_pcm_prepare(device->pcm);
+}
+
+u32 get_queued_frames_alsa(void *device_ptr) {
+	ALSA_Device *device = (ALSA_Device*)device_ptr;
+	snd_pcm_sframes_t available = snd_pcm_avail_update(device->pcm);
+	
+	if (available < 0) {
+		// Underrun. Everything that was queued has been played.
+		recover(device, (int)available);
+		return 0;
+	}
+	
+	return available < device->buffer_frames ? device->buffer_frames - (u32)available : 0;
+}
+
+void *get_buffer_alsa(void *device_ptr, u32 frame_count) {
+	ALSA_Device *device = (ALSA_Device*)device_ptr;
+	if (frame_count > device->buffer_frames) return NULL;
+	return device->buffer;
+}
+
+void release_buffer_alsa(void *device_ptr, u32 frame_count, bool silent) {
+	ALSA_Device *device = (ALSA_Device*)device_ptr;
+	float volume = device->volume.load(std::memory_order_relaxed);
+	const u8 *frames = device->buffer;
+	
+	if (silent) snd_pcm_format_set_silence(get_alsa_format(device->sample_type), device->buffer, frame_count * 2);
+	// Only floats are scaled. The player does its volume in the DSP chain, and integers are left exact.
+	else if (volume != 1.f && device->sample_type == OUTPUT_SAMPLE_F32) {
+		float *samples = (float*)device->buffer;
+		for (u32 i = 0; i < frame_count * 2; ++i) samples[i] *= volume;
+	}
+	
+	while (frame_count) {
+		snd_pcm_sframes_t written = snd_pcm_writei(device->pcm, frames, frame_count);
+		
+		if (written < 0) {
+			if (!recover(device, (int)written)) return;
+			continue;
+		}
+		
+		frames += written * device->frame_size;
+		frame_count -= (u32)written;
+	}
+}
+
+void set_volume_alsa(void *device_ptr, float volume) {
+	ALSA_Device *device = (ALSA_Device*)device_ptr;
+	device->volume.store(volume);
+}
+
+float get_volume_alsa(void *device_ptr) {
+	ALSA_Device *device = (ALSA_Device*)device_ptr;
+	return device->volume.load();
+}
+
+void close_alsa(void *device_ptr) {
+	ALSA_Device *device = (ALSA_Device*)device_ptr;
+	if (device->pcm) snd_pcm_close(device->pcm);
+	free(device->buffer);
+	free(device);
+}
+#endif
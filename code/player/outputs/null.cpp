@@ -0,0 +1,178 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+// A device with no hardware behind it, for running the player headless. On the real clock it plays
+// frames at the sample rate from when they were queued, so the player sees the same buffer levels
+// it would with a sound card. On the virtual clock everything plays the moment it is queued.
+// What it plays can be written to a WAV file, in any of the sample types.
+#include "../output.h"
+#include "../platform.h"
+#include <atomic>
+#include <stdlib.h>
+#include <string.h>
+
+struct Null_Device {
+	Output_Clock clock;
+	u32 sample_rate;
+	u32 buffer_frames;
+	enum Output_Sample_Type sample_type;
+	u32 frame_size;
+	u8 *buffer;
+	std::atomic<float> volume;
+	FILE *file;
+	u64 file_frames;
+	
+	bool started;
+	// Frames queued since the clock was last restarted
+	u64 written_frames;
+	// Tick the clock was restarted at. It restarts whenever it runs dry, like a device after an underrun.
+	u64 start_tick;
+};
+
+static void write_wav_header(FILE *file, u32 sample_rate, enum Output_Sample_Type sample_type, u64 frame_count) {
+	const u32 frame_size = get_output_sample_size(sample_type) * 2;
+	const u32 tag = sample_type == OUTPUT_SAMPLE_F32 ? 3 : 1;
+	u32 data_size = (u32)MIN(frame_count * frame_size, 0xffffffffull - 36);
+	u32 header[11] = {
+		0x46464952, 36 + data_size, 0x45564157,            // "RIFF" size "WAVE"
+		0x20746d66, 16, tag | (2 << 16),                   // "fmt " 16, float or PCM, channels
+		sample_rate, sample_rate * frame_size,
+		frame_size | ((frame_size / 2 * 8) << 16),
+		0x61746164, data_size,                             // "data" size
+	};
+	
+	fwrite(header, sizeof(header), 1, file);
+}
+
+// Frames played since the clock was restarted
+static u64 get_played_frames(Null_Device *device) {
+	if (device->clock == OUTPUT_CLOCK_VIRTUAL) return device->written_frames;
+	if (!device->started) return 0;
+	
+	float elapsed_ms = time_ticks_to_milliseconds(time_get_tick() - device->start_tick);
+	u64 played = (u64)((double)elapsed_ms * device->sample_rate / 1000.0);
+	return MIN(played, device->written_frames);
+}
+
+static void restart_clock(Null_Device *device) {
+	device->written_frames = 0;
+	device->start_tick = time_get_tick();
+}
+
+void *open_null(const Output_Config *config, Output_Format *format) {
+	Null_Device *device = (Null_Device*)calloc(1, sizeof(Null_Device));
+	u32 buffer_duration_ms = config->buffer_duration_ms ? config->buffer_duration_ms : OUTPUT_DEFAULT_BUFFER_MS;
+	
+	device->clock = config->clock;
+	device->sample_rate = config->sample_rate ? config->sample_rate : OUTPUT_DEFAULT_SAMPLE_RATE;
+	device->buffer_frames = MAX((u32)(((u64)device->sample_rate * buffer_duration_ms) / 1000), 1);
+	device->sample_type = config->sample_type == OUTPUT_SAMPLE_DEFAULT ? OUTPUT_SAMPLE_F32 : config->sample_type;
+	device->frame_size = get_output_sample_size(device->sample_type) * 2;
+	device->buffer = (u8*)malloc(device->buffer_frames * device->frame_size);
+	device->volume.store(1.f);
+	
+	if (config->file_path) {
+		device->file = _wfopen(config->file_path, L"wb");
+		if (!device->file) {
+			log_error("Failed to open \"%ls\" for the null output\n", config->file_path);
+			close_null(device);
+			return NULL;
+		}
+		// Filled in properly when the device is closed
+		write_wav_header(device->file, device->sample_rate, device->sample_type, 0);
+	}
+	
+	log_info("Null output: %uHz, %u frame buffer, %s clock\n", device->sample_rate, device->buffer_frames,
+			 device->clock == OUTPUT_CLOCK_VIRTUAL ? "virtual" : "real");
+	
+	format->sample_rate = device->sample_rate;
+	format->sample_type = device->sample_type;
+	format->bits = device->sample_type == OUTPUT_SAMPLE_S16 ? 16 : device->sample_type == OUTPUT_SAMPLE_S32 ? 32 : 24;
+	// Any rate, unless it is writing a file, which can only have one
+	format->native_rates = device->file ? get_output_rate_bit(device->sample_rate) : (1 << OUTPUT_RATE_COUNT) - 1;
+	format->buffer_frames = device->buffer_frames;
+	// Like a typical shared-mode engine
+	format->period_frames = MIN(device->sample_rate / 100, device->buffer_frames);
+	return device;
+}
+
+void start_null(void *device_ptr) {
+	Null_Device *device = (Null_Device*)device_ptr;
+	device->started = true;
+	restart_clock(device);
+}
+
+void stop_null(void *device_ptr) {
+	Null_Device *device = (Null_Device*)device_ptr;
+	device->started = false;
+	device->written_frames = 0;
+}
+
+u32 get_queued_frames_null(void *device_ptr) {
+	Null_Device *device = (Null_Device*)device_ptr;
+	u32 queued = (u32)(device->written_frames - get_played_frames(device));
+	
+	// Ran dry, so the next frame starts playing when it arrives
+	if (device->started && !queued) restart_clock(device);
+	return queued;
+}
+
+void *get_buffer_null(void *device_ptr, u32 frame_count) {
+	Null_Device *device = (Null_Device*)device_ptr;
+	if (frame_count > device->buffer_frames) return NULL;
+	return device->buffer;
+}
+
+void release_buffer_null(void *device_ptr, u32 frame_count, bool silent) {
+	Null_Device *device = (Null_Device*)device_ptr;
+	float volume = device->volume.load(std::memory_order_relaxed);
+	
+	if (device->file) {
+		if (silent) memset(device->buffer, 0, frame_count * device->frame_size);
+		// Only floats are scaled. The player does its volume in the DSP chain, and integers are left exact.
+		else if (volume != 1.f && device->sample_type == OUTPUT_SAMPLE_F32) {
+			float *samples = (float*)device->buffer;
+			for (u32 i = 0; i < frame_count * 2; ++i) samples[i] *= volume;
+		}
+		
+		fwrite(device->buffer, device->frame_size, frame_count, device->file);
+		device->file_frames += frame_count;
+	}
+	
+	device->written_frames += frame_count;
+}
+
+void set_volume_null(void *device_ptr, float volume) {
+	Null_Device *device = (Null_Device*)device_ptr;
+	device->volume.store(volume);
+}
+
+float get_volume_null(void *device_ptr) {
+	Null_Device *device = (Null_Device*)device_ptr;
+	return device->volume.load();
+}
+
+void close_null(void *device_ptr) {
+	Null_Device *device = (Null_Device*)device_ptr;
+	
+	if (device->file) {
+		fseek(device->file, 0, SEEK_SET);
+		write_wav_header(device->file, device->sample_rate, device->sample_type, device->file_frames);
+		fclose(device->file);
+	}
+	
+	free(device->buffer);
+	free(device);
+}
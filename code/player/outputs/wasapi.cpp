@@ -0,0 +1,314 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+// WASAPI on the default endpoint. In shared mode audio goes out at the mix format, which is float, so
+// frames are written straight into the endpoint buffer. The stream is event driven: the engine signals
+// once per device period, which lets the player keep only a few periods queued.
+//
+// In exclusive mode the device is asked for each format in turn, integers first since that is what
+// the hardware takes, and plays at any rate it supports. Event-driven exclusive streams have to be
+// given a whole buffer every period, which doesn't fit how the player keeps the queue topped up, so
+// exclusive streams are timed instead. If the device can't be had exclusively, shared mode is used.
+#ifdef _WIN32
+#include "../output.h"
+#include <windows.h>
+#include <mmdeviceapi.h>
+#include <audioclient.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const CLSID g_device_enumerator_clsid = __uuidof(MMDeviceEnumerator);
+static const IID g_device_enumerator_iid = __uuidof(IMMDeviceEnumerator);
+static const IID g_audio_render_client_iid = __uuidof(IAudioRenderClient);
+static const IID g_audio_stream_volume_iid = __uuidof(IAudioStreamVolume);
+
+struct WASAPI_Device {
+	IMMDeviceEnumerator *device_enumerator;
+	IMMDevice *device;
+	IAudioClient *audio_client;
+	IAudioRenderClient *render_client;
+	IAudioStreamVolume *volume_controller;
+	// Signalled by the engine each period. Shared mode only.
+	HANDLE event;
+	u32 buffer_frames;
+};
+
+struct WASAPI_Format {
+	enum Output_Sample_Type type;
+	u32 bits;
+};
+
+// Best first
+static const WASAPI_Format g_exclusive_formats[] = {
+	{OUTPUT_SAMPLE_S32, 32}, {OUTPUT_SAMPLE_S32, 24}, {OUTPUT_SAMPLE_S24, 24}, {OUTPUT_SAMPLE_F32, 24}, {OUTPUT_SAMPLE_S16, 16},
+};
+
+static void make_wave_format(const WASAPI_Format *format, u32 sample_rate, WAVEFORMATEXTENSIBLE *out) {
+	const u32 sample_size = get_output_sample_size(format->type);
+	// KSDATAFORMAT_SUBTYPE_PCM or _IEEE_FLOAT, without needing ksmedia.h for them
+	const GUID sub_format = {format->type == OUTPUT_SAMPLE_F32 ? 3u : 1u, 0x0000, 0x0010, {0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71}};
+	
+	memset(out, 0, sizeof(WAVEFORMATEXTENSIBLE));
+	out->Format.wFormatTag = WAVE_FORMAT_EXTENSIBLE;
+	out->Format.nChannels = 2;
+	out->Format.nSamplesPerSec = sample_rate;
+	out->Format.wBitsPerSample = (WORD)(sample_size * 8);
+	out->Format.nBlockAlign = (WORD)(sample_size * 2);
+	out->Format.nAvgBytesPerSec = sample_rate * sample_size * 2;
+	out->Format.cbSize = sizeof(WAVEFORMATEXTENSIBLE) - sizeof(WAVEFORMATEX);
+	out->Samples.wValidBitsPerSample = (WORD)(format->type == OUTPUT_SAMPLE_F32 ? 32 : format->bits);
+	// Front left and right
+	out->dwChannelMask = 0x3;
+	out->SubFormat = sub_format;
+}
+
+static bool is_exclusive_format_supported(IAudioClient *audio_client, const WASAPI_Format *format, u32 sample_rate) {
+	WAVEFORMATEXTENSIBLE wave_format;
+	make_wave_format(format, sample_rate, &wave_format);
+	return audio_client->IsFormatSupported(AUDCLNT_SHAREMODE_EXCLUSIVE, (WAVEFORMATEX*)&wave_format, NULL) == S_OK;
+}
+
+// The type asked for if the device takes it at this rate, or else the best one it does
+static bool find_exclusive_format(IAudioClient *audio_client, enum Output_Sample_Type wanted, u32 sample_rate, 
+								  WASAPI_Format *out) {
+	for (u32 pass = 0; pass < 2; ++pass) {
+		for (u32 i = 0; i < ARRAY_LENGTH(g_exclusive_formats); ++i) {
+			const WASAPI_Format *format = &g_exclusive_formats[i];
+			if (pass == 0 && format->type != wanted) continue;
+			
+			if (is_exclusive_format_supported(audio_client, format, sample_rate)) {
+				*out = *format;
+				return true;
+			}
+		}
+	}
+	
+	return false;
+}
+
+// Needs a fresh audio client, since a failed Initialize can't be tried again on the same one
+static HRESULT initialize_exclusive(WASAPI_Device *device, const WASAPI_Format *format, u32 sample_rate, u32 buffer_ms) {
+	WAVEFORMATEXTENSIBLE wave_format;
+	// Timed exclusive streams can't be given more than 2 seconds
+	REFERENCE_TIME buffer_duration = (REFERENCE_TIME)MIN(buffer_ms, 2000) * 10000;
+	
+	make_wave_format(format, sample_rate, &wave_format);
+	HRESULT result = device->audio_client->Initialize(AUDCLNT_SHAREMODE_EXCLUSIVE, 0, buffer_duration, 0,
+													  (WAVEFORMATEX*)&wave_format, NULL);
+	
+	if (result == AUDCLNT_E_BUFFER_SIZE_NOT_ALIGNED) {
+		// Ask again for the size the device would have rounded to
+		UINT32 aligned_frames = 0;
+		device->audio_client->GetBufferSize(&aligned_frames);
+		device->audio_client->Release();
+		device->audio_client = NULL;
+		
+		buffer_duration = (REFERENCE_TIME)((10000000.0 * aligned_frames) / sample_rate + 0.5);
+		result = device->device->Activate(__uuidof(IAudioClient), CLSCTX_ALL, NULL, (void**)&device->audio_client);
+		if (SUCCEEDED(result)) {
+			result = device->audio_client->Initialize(AUDCLNT_SHAREMODE_EXCLUSIVE, 0, buffer_duration, 0,
+													  (WAVEFORMATEX*)&wave_format, NULL);
+		}
+	}
+	
+	return result;
+}
+
+void *open_wasapi(const Output_Config *config, Output_Format *format) {
+	WASAPI_Device *device = (WASAPI_Device*)calloc(1, sizeof(WASAPI_Device));
+	WAVEFORMATEX *mix_format = NULL;
+	bool format_is_float = false;
+	bool exclusive = false;
+	HRESULT result;
+	
+	// The device is used from the thread that opens it, which can be one COM hasn't seen yet
+	CoInitializeEx(NULL, COINIT_MULTITHREADED);
+	result = CoCreateInstance(g_device_enumerator_clsid, NULL, CLSCTX_ALL, g_device_enumerator_iid,
+							  (void**)&device->device_enumerator);
+	if (SUCCEEDED(result)) result = device->device_enumerator->GetDefaultAudioEndpoint(eRender, eConsole, &device->device);
+	if (SUCCEEDED(result)) result = device->device->Activate(__uuidof(IAudioClient), CLSCTX_ALL, NULL, (void**)&device->audio_client);
+	if (SUCCEEDED(result)) result = device->audio_client->GetMixFormat(&mix_format);
+	
+	if (FAILED(result)) {
+		log_error("Failed to get the default audio endpoint (0x%x)\n", (u32)result);
+		close_wasapi(device);
+		return NULL;
+	}
+	
+	if (config->exclusive) {
+		u32 sample_rate = config->sample_rate ? config->sample_rate : mix_format->nSamplesPerSec;
+		WASAPI_Format exclusive_format;
+		
+		// Back to the mix rate if the device doesn't do the one asked for
+		exclusive = find_exclusive_format(device->audio_client, config->sample_type, sample_rate, &exclusive_format);
+		if (!exclusive && sample_rate != mix_format->nSamplesPerSec) {
+			sample_rate = mix_format->nSamplesPerSec;
+			exclusive = find_exclusive_format(device->audio_client, config->sample_type, sample_rate, &exclusive_format);
+		}
+		
+		if (exclusive) {
+			for (u32 i = 0; i < OUTPUT_RATE_COUNT; ++i) {
+				if (is_exclusive_format_supported(device->audio_client, &exclusive_format, g_output_rates[i])) {
+					format->native_rates |= 1 << i;
+				}
+			}
+			
+			result = initialize_exclusive(device, &exclusive_format, sample_rate, config->buffer_duration_ms);
+			exclusive = SUCCEEDED(result);
+		}
+		
+		if (exclusive) {
+			format->sample_rate = sample_rate;
+			format->sample_type = exclusive_format.type;
+			format->bits = exclusive_format.bits;
+		}
+		else {
+			// Likely another program has it. Shared mode needs a client that hasn't been initialized.
+			log_warning("Couldn't open the endpoint in exclusive mode (0x%x), sharing it\n", (u32)result);
+			format->native_rates = 0;
+			if (device->audio_client) device->audio_client->Release();
+			device->audio_client = NULL;
+			result = device->device->Activate(__uuidof(IAudioClient), CLSCTX_ALL, NULL, (void**)&device->audio_client);
+			
+			if (FAILED(result)) {
+				log_error("Failed to get the audio client back (0x%x)\n", (u32)result);
+				CoTaskMemFree(mix_format);
+				close_wasapi(device);
+				return NULL;
+			}
+		}
+	}
+	
+	if (!exclusive) {
+		if (mix_format->cbSize >= 22) {
+			WAVEFORMATEXTENSIBLE *mix_format_ex = (WAVEFORMATEXTENSIBLE*)mix_format;
+			GUID sub_format = mix_format_ex->SubFormat;
+			format_is_float = sub_format.Data1 == 3;
+		}
+		
+		if (!format_is_float || mix_format->nChannels != 2) {
+			log_error("The endpoint mix format isn't stereo float\n");
+			CoTaskMemFree(mix_format);
+			close_wasapi(device);
+			return NULL;
+		}
+		
+		format->sample_rate = mix_format->nSamplesPerSec;
+		format->sample_type = OUTPUT_SAMPLE_F32;
+		format->bits = 24;
+		// The engine resamples everything else to the mix rate
+		format->native_rates = get_output_rate_bit(format->sample_rate);
+		format->event_driven = true;
+		
+		// In 100ns units
+		REFERENCE_TIME buffer_duration = (REFERENCE_TIME)config->buffer_duration_ms * 10000;
+		result = device->audio_client->Initialize(AUDCLNT_SHAREMODE_SHARED, AUDCLNT_STREAMFLAGS_EVENTCALLBACK,
+												  buffer_duration, 0, mix_format, NULL);
+		
+		if (SUCCEEDED(result)) {
+			device->event = CreateEvent(NULL, FALSE, FALSE, NULL);
+			result = device->audio_client->SetEventHandle(device->event);
+		}
+	}
+	
+	CoTaskMemFree(mix_format);
+	log_info("Endpoint sample rate: %dHz, %s mode\n", format->sample_rate, exclusive ? "exclusive" : "shared");
+	
+	REFERENCE_TIME device_period = 0;
+	if (SUCCEEDED(result)) result = device->audio_client->GetDevicePeriod(&device_period, NULL);
+	if (SUCCEEDED(result)) result = device->audio_client->GetBufferSize(&device->buffer_frames);
+	if (SUCCEEDED(result)) result = device->audio_client->GetService(g_audio_render_client_iid, (void**)&device->render_client);
+	
+	// Exclusive streams don't have to have a volume of their own
+	if (SUCCEEDED(result)) {
+		HRESULT volume_result = device->audio_client->GetService(g_audio_stream_volume_iid, (void**)&device->volume_controller);
+		if (!exclusive) result = volume_result;
+	}
+	
+	if (FAILED(result)) {
+		log_error("Failed to initialize the audio client (0x%x)\n", (u32)result);
+		close_wasapi(device);
+		return NULL;
+	}
+	
+	format->buffer_frames = device->buffer_frames;
+	format->period_frames = (u32)((device_period * format->sample_rate + 9999999) / 10000000);
+	log_info("Endpoint buffer: %u frames, %u frame period\n", format->buffer_frames, format->period_frames);
+	return device;
+}
+
+void start_wasapi(void *device_ptr) {
+	WASAPI_Device *device = (WASAPI_Device*)device_ptr;
+	device->audio_client->Start();
+}
+
+void stop_wasapi(void *device_ptr) {
+	WASAPI_Device *device = (WASAPI_Device*)device_ptr;
+	device->audio_client->Stop();
+	device->audio_client->Reset();
+}
+
+u32 get_queued_frames_wasapi(void *device_ptr) {
+	WASAPI_Device *device = (WASAPI_Device*)device_ptr;
+	UINT32 padding = 0;
+	device->audio_client->GetCurrentPadding(&padding);
+	return padding;
+}
+
+bool wait_wasapi(void *device_ptr, void *interrupt_event, u32 timeout_ms) {
+	WASAPI_Device *device = (WASAPI_Device*)device_ptr;
+	// The interrupt comes first so it wins when both are signalled
+	HANDLE events[2] = {(HANDLE)interrupt_event, device->event};
+	DWORD result = WaitForMultipleObjects(2, events, FALSE, timeout_ms);
+	return result == WAIT_OBJECT_0;
+}
+
+void *get_buffer_wasapi(void *device_ptr, u32 frame_count) {
+	WASAPI_Device *device = (WASAPI_Device*)device_ptr;
+	BYTE *buffer = NULL;
+	if (FAILED(device->render_client->GetBuffer(frame_count, &buffer))) return NULL;
+	return buffer;
+}
+
+void release_buffer_wasapi(void *device_ptr, u32 frame_count, bool silent) {
+	WASAPI_Device *device = (WASAPI_Device*)device_ptr;
+	device->render_client->ReleaseBuffer(frame_count, silent ? AUDCLNT_BUFFERFLAGS_SILENT : 0);
+}
+
+void set_volume_wasapi(void *device_ptr, float volume) {
+	WASAPI_Device *device = (WASAPI_Device*)device_ptr;
+	float volumes[2] = {volume, volume};
+	if (device->volume_controller) device->volume_controller->SetAllVolumes(2, volumes);
+}
+
+float get_volume_wasapi(void *device_ptr) {
+	WASAPI_Device *device = (WASAPI_Device*)device_ptr;
+	float ret = 1.f;
+	if (device->volume_controller) device->volume_controller->GetChannelVolume(0, &ret);
+	return ret;
+}
+
+void close_wasapi(void *device_ptr) {
+	WASAPI_Device *device = (WASAPI_Device*)device_ptr;
+	if (device->audio_client) device->audio_client->Stop();
+	if (device->volume_controller) device->volume_controller->Release();
+	if (device->render_client) device->render_client->Release();
+	if (device->audio_client) device->audio_client->Release();
+	if (device->device) device->device->Release();
+	if (device->device_enumerator) device->device_enumerator->Release();
+	if (device->event) CloseHandle(device->event);
+	free(device);
+}
+#endif
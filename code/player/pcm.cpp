@@ -0,0 +1,641 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "pcm.h"
+#include "cpu.h"
+#include <math.h>
+
+#if defined(CPU_X86)
+#include <immintrin.h>
+#elif defined(CPU_ARM64)
+#include <arm_neon.h>
+#endif
+
+#define S16_SCALE (1.f / 32768.f)
+// 24-bit samples are moved to the top of 32 bits, which sign extends them
+#define S32_SCALE (1.f / 2147483648.f)
+// The largest float under 2^31, since 2^31 itself doesn't fit
+#define S32_MAX_FLOAT 2147483520.f
+// Dither is two 16-bit uniform values added up, scaled to 2 LSB wide and centred
+#define DITHER_SCALE (1.f / 65536.f)
+#define DITHER_OFFSET (65535.f / 65536.f)
+
+struct PCM_Kernels {
+	const char *name;
+	void (*s16_to_f32)(const s16 *in, float *out, u32 count);
+	void (*s24_to_f32)(const u8 *in, float *out, u32 count);
+	void (*s32_to_f32)(const s32 *in, float *out, u32 count);
+	void (*scale_f32)(const float *in, float *out, u32 count, float scale);
+	void (*planar_s32_to_f32)(const s32 *left, const s32 *right, float *out, u32 frame_count, float scale);
+	// dither is the PCM_Dither state, or NULL
+	void (*f32_to_s16)(const float *in, s16 *out, u32 count, u32 *dither);
+	void (*f32_to_s32)(const float *in, s32 *out, u32 count, u32 bits, u32 *dither);
+};
+
+// Sample i always uses lane i % PCM_DITHER_LANES, and each lane is a xorshift generator, so the
+// kernels all add the same noise
+static inline u32 next_random(u32 *state) {
+	u32 x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+static inline float get_dither_scalar(u32 *state) {
+	u32 x = next_random(state);
+	return (float)((x & 0xffff) + (x >> 16)) * DITHER_SCALE - DITHER_OFFSET;
+}
+
+// The largest value an integer of this many bits can take, as a float it converts back from exactly
+static inline float get_max_float(u32 bits) {
+	return bits == 32 ? S32_MAX_FLOAT : (float)((1u << (bits - 1)) - 1);
+}
+
+// The SIMD kernels finish off whatever doesn't fill a vector with these
+static void s16_to_f32_scalar(const s16 *in, float *out, u32 count) {
+	for (u32 i = 0; i < count; ++i) out[i] = in[i] * S16_SCALE;
+}
+
+static void s24_to_f32_scalar(const u8 *in, float *out, u32 count) {
+	for (u32 i = 0; i < count; ++i, in += 3) {
+		s32 sample = (s32)(((u32)in[0] << 8) | ((u32)in[1] << 16) | ((u32)in[2] << 24));
+		out[i] = sample * S32_SCALE;
+	}
+}
+
+static void s32_to_f32_scalar(const s32 *in, float *out, u32 count) {
+	for (u32 i = 0; i < count; ++i) out[i] = in[i] * S32_SCALE;
+}
+
+static void scale_f32_scalar(const float *in, float *out, u32 count, float scale) {
+	for (u32 i = 0; i < count; ++i) out[i] = in[i] * scale;
+}
+
+static void planar_s32_to_f32_scalar(const s32 *left, const s32 *right, float *out, u32 frame_count, float scale) {
+	for (u32 i = 0; i < frame_count; ++i) {
+		out[i*2+0] = left[i] * scale;
+		out[i*2+1] = right[i] * scale;
+	}
+}
+
+// Rounding is to the nearest even, the same as the SIMD conversions
+static void f32_to_s16_scalar(const float *in, s16 *out, u32 count, u32 *dither) {
+	for (u32 i = 0; i < count; ++i) {
+		float x = in[i] * 32768.f;
+		if (dither) x += get_dither_scalar(&dither[i % PCM_DITHER_LANES]);
+		x = MIN(MAX(x, -32768.f), 32767.f);
+		out[i] = (s16)lrintf(x);
+	}
+}
+
+static void f32_to_s32_scalar(const float *in, s32 *out, u32 count, u32 bits, u32 *dither) {
+	const float scale = (float)(1ull << (bits - 1));
+	const float max = get_max_float(bits);
+	const u32 shift = 32 - bits;
+	
+	for (u32 i = 0; i < count; ++i) {
+		float x = in[i] * scale;
+		if (dither) x += get_dither_scalar(&dither[i % PCM_DITHER_LANES]);
+		x = MIN(MAX(x, -scale), max);
+		out[i] = (s32)((u32)lrintf(x) << shift);
+	}
+}
+
+static const PCM_Kernels g_scalar_kernels = {
+	"scalar", &s16_to_f32_scalar, &s24_to_f32_scalar, &s32_to_f32_scalar, &scale_f32_scalar, &planar_s32_to_f32_scalar,
+	&f32_to_s16_scalar, &f32_to_s32_scalar,
+};
+
+#if defined(CPU_X86)
+static void s16_to_f32_sse2(const s16 *in, float *out, u32 count) {
+	const __m128 scale = _mm_set1_ps(S16_SCALE);
+	u32 i = 0;
+	
+	for (; i + 8 <= count; i += 8) {
+		__m128i x = _mm_loadu_si128((const __m128i*)&in[i]);
+		// Sign extend by putting each sample in the top half of a lane and shifting it back down
+		__m128i low = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+		__m128i high = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+		_mm_storeu_ps(&out[i+0], _mm_mul_ps(_mm_cvtepi32_ps(low), scale));
+		_mm_storeu_ps(&out[i+4], _mm_mul_ps(_mm_cvtepi32_ps(high), scale));
+	}
+	
+	s16_to_f32_scalar(&in[i], &out[i], count - i);
+}
+
+static void s32_to_f32_sse2(const s32 *in, float *out, u32 count) {
+	const __m128 scale = _mm_set1_ps(S32_SCALE);
+	u32 i = 0;
+	
+	for (; i + 8 <= count; i += 8) {
+		__m128i a = _mm_loadu_si128((const __m128i*)&in[i+0]);
+		__m128i b = _mm_loadu_si128((const __m128i*)&in[i+4]);
+		_mm_storeu_ps(&out[i+0], _mm_mul_ps(_mm_cvtepi32_ps(a), scale));
+		_mm_storeu_ps(&out[i+4], _mm_mul_ps(_mm_cvtepi32_ps(b), scale));
+	}
+	
+	s32_to_f32_scalar(&in[i], &out[i], count - i);
+}
+
+static void scale_f32_sse2(const float *in, float *out, u32 count, float scale) {
+	const __m128 scale4 = _mm_set1_ps(scale);
+	u32 i = 0;
+	
+	for (; i + 8 <= count; i += 8) {
+		__m128 a = _mm_loadu_ps(&in[i+0]);
+		__m128 b = _mm_loadu_ps(&in[i+4]);
+		_mm_storeu_ps(&out[i+0], _mm_mul_ps(a, scale4));
+		_mm_storeu_ps(&out[i+4], _mm_mul_ps(b, scale4));
+	}
+	
+	scale_f32_scalar(&in[i], &out[i], count - i, scale);
+}
+
+static void planar_s32_to_f32_sse2(const s32 *left, const s32 *right, float *out, u32 frame_count, float scale) {
+	const __m128 scale4 = _mm_set1_ps(scale);
+	u32 i = 0;
+	
+	for (; i + 4 <= frame_count; i += 4) {
+		__m128 l = _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)&left[i])), scale4);
+		__m128 r = _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)&right[i])), scale4);
+		_mm_storeu_ps(&out[i*2+0], _mm_unpacklo_ps(l, r));
+		_mm_storeu_ps(&out[i*2+4], _mm_unpackhi_ps(l, r));
+	}
+	
+	planar_s32_to_f32_scalar(&left[i], &right[i], &out[i*2], frame_count - i, scale);
+}
+
+// Four lanes of the generator at a time
+static inline __m128 get_dither_sse2(__m128i *state) {
+	__m128i x = *state;
+	x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+	x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+	x = _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+	*state = x;
+	
+	__m128i sum = _mm_add_epi32(_mm_and_si128(x, _mm_set1_epi32(0xffff)), _mm_srli_epi32(x, 16));
+	return _mm_sub_ps(_mm_mul_ps(_mm_cvtepi32_ps(sum), _mm_set1_ps(DITHER_SCALE)), _mm_set1_ps(DITHER_OFFSET));
+}
+
+// Scaled, dithered and clamped, but not shifted up
+static inline __m128i quantize_sse2(const float *in, __m128 scale, __m128 min, __m128 max, __m128i *dither) {
+	__m128 x = _mm_mul_ps(_mm_loadu_ps(in), scale);
+	if (dither) x = _mm_add_ps(x, get_dither_sse2(dither));
+	return _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(x, min), max));
+}
+
+static void f32_to_s16_sse2(const float *in, s16 *out, u32 count, u32 *dither) {
+	const __m128 scale = _mm_set1_ps(32768.f);
+	const __m128 min = _mm_set1_ps(-32768.f);
+	const __m128 max = _mm_set1_ps(32767.f);
+	__m128i state[2] = {_mm_setzero_si128(), _mm_setzero_si128()};
+	u32 i = 0;
+	
+	if (dither) {
+		state[0] = _mm_loadu_si128((const __m128i*)&dither[0]);
+		state[1] = _mm_loadu_si128((const __m128i*)&dither[4]);
+	}
+	
+	for (; i + 8 <= count; i += 8) {
+		__m128i a = quantize_sse2(&in[i+0], scale, min, max, dither ? &state[0] : NULL);
+		__m128i b = quantize_sse2(&in[i+4], scale, min, max, dither ? &state[1] : NULL);
+		_mm_storeu_si128((__m128i*)&out[i], _mm_packs_epi32(a, b));
+	}
+	
+	if (dither) {
+		_mm_storeu_si128((__m128i*)&dither[0], state[0]);
+		_mm_storeu_si128((__m128i*)&dither[4], state[1]);
+	}
+	
+	f32_to_s16_scalar(&in[i], &out[i], count - i, dither);
+}
+
+static void f32_to_s32_sse2(const float *in, s32 *out, u32 count, u32 bits, u32 *dither) {
+	const float scale1 = (float)(1ull << (bits - 1));
+	const __m128 scale = _mm_set1_ps(scale1);
+	const __m128 min = _mm_set1_ps(-scale1);
+	const __m128 max = _mm_set1_ps(get_max_float(bits));
+	const __m128i shift = _mm_cvtsi32_si128(32 - bits);
+	__m128i state[2] = {_mm_setzero_si128(), _mm_setzero_si128()};
+	u32 i = 0;
+	
+	if (dither) {
+		state[0] = _mm_loadu_si128((const __m128i*)&dither[0]);
+		state[1] = _mm_loadu_si128((const __m128i*)&dither[4]);
+	}
+	
+	for (; i + 8 <= count; i += 8) {
+		__m128i a = quantize_sse2(&in[i+0], scale, min, max, dither ? &state[0] : NULL);
+		__m128i b = quantize_sse2(&in[i+4], scale, min, max, dither ? &state[1] : NULL);
+		_mm_storeu_si128((__m128i*)&out[i+0], _mm_sll_epi32(a, shift));
+		_mm_storeu_si128((__m128i*)&out[i+4], _mm_sll_epi32(b, shift));
+	}
+	
+	if (dither) {
+		_mm_storeu_si128((__m128i*)&dither[0], state[0]);
+		_mm_storeu_si128((__m128i*)&dither[4], state[1]);
+	}
+	
+	f32_to_s32_scalar(&in[i], &out[i], count - i, bits, dither);
+}
+
+TARGET_SSE41 static void s24_to_f32_sse41(const u8 *in, float *out, u32 count) {
+	// Each 3 byte sample goes to the top of a 32-bit lane
+	const __m128i shuffle = _mm_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+	const __m128 scale = _mm_set1_ps(S32_SCALE);
+	u32 i = 0;
+	
+	// Loads are 16 bytes for 12 bytes of samples, so stop before reading past the end
+	for (; i + 6 <= count; i += 4) {
+		__m128i x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)&in[i*3]), shuffle);
+		_mm_storeu_ps(&out[i], _mm_mul_ps(_mm_cvtepi32_ps(x), scale));
+	}
+	
+	s24_to_f32_scalar(&in[i*3], &out[i], count - i);
+}
+
+TARGET_AVX2 static void s16_to_f32_avx2(const s16 *in, float *out, u32 count) {
+	const __m256 scale = _mm256_set1_ps(S16_SCALE);
+	u32 i = 0;
+	
+	for (; i + 16 <= count; i += 16) {
+		__m256i a = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)&in[i+0]));
+		__m256i b = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)&in[i+8]));
+		_mm256_storeu_ps(&out[i+0], _mm256_mul_ps(_mm256_cvtepi32_ps(a), scale));
+		_mm256_storeu_ps(&out[i+8], _mm256_mul_ps(_mm256_cvtepi32_ps(b), scale));
+	}
+	
+	s16_to_f32_scalar(&in[i], &out[i], count - i);
+}
+
+TARGET_AVX2 static void s24_to_f32_avx2(const u8 *in, float *out, u32 count) {
+	// Shuffles stay within each 128-bit half, so each half gets its own 12 bytes
+	const __m256i shuffle = _mm256_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11,
+											 -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+	const __m256 scale = _mm256_set1_ps(S32_SCALE);
+	u32 i = 0;
+	
+	// The second load reads 4 bytes past the 24 that are used
+	for (; i + 10 <= count; i += 8) {
+		__m128i low = _mm_loadu_si128((const __m128i*)&in[i*3 + 0]);
+		__m128i high = _mm_loadu_si128((const __m128i*)&in[i*3 + 12]);
+		__m256i x = _mm256_inserti128_si256(_mm256_castsi128_si256(low), high, 1);
+		x = _mm256_shuffle_epi8(x, shuffle);
+		_mm256_storeu_ps(&out[i], _mm256_mul_ps(_mm256_cvtepi32_ps(x), scale));
+	}
+	
+	s24_to_f32_scalar(&in[i*3], &out[i], count - i);
+}
+
+TARGET_AVX2 static void s32_to_f32_avx2(const s32 *in, float *out, u32 count) {
+	const __m256 scale = _mm256_set1_ps(S32_SCALE);
+	u32 i = 0;
+	
+	for (; i + 16 <= count; i += 16) {
+		__m256i a = _mm256_loadu_si256((const __m256i*)&in[i+0]);
+		__m256i b = _mm256_loadu_si256((const __m256i*)&in[i+8]);
+		_mm256_storeu_ps(&out[i+0], _mm256_mul_ps(_mm256_cvtepi32_ps(a), scale));
+		_mm256_storeu_ps(&out[i+8], _mm256_mul_ps(_mm256_cvtepi32_ps(b), scale));
+	}
+	
+	s32_to_f32_scalar(&in[i], &out[i], count - i);
+}
+
+TARGET_AVX2 static void scale_f32_avx2(const float *in, float *out, u32 count, float scale) {
+	const __m256 scale8 = _mm256_set1_ps(scale);
+	u32 i = 0;
+	
+	for (; i + 16 <= count; i += 16) {
+		__m256 a = _mm256_loadu_ps(&in[i+0]);
+		__m256 b = _mm256_loadu_ps(&in[i+8]);
+		_mm256_storeu_ps(&out[i+0], _mm256_mul_ps(a, scale8));
+		_mm256_storeu_ps(&out[i+8], _mm256_mul_ps(b, scale8));
+	}
+	
+	scale_f32_scalar(&in[i], &out[i], count - i, scale);
+}
+
+TARGET_AVX2 static void planar_s32_to_f32_avx2(const s32 *left, const s32 *right, float *out, u32 frame_count, float scale) {
+	const __m256 scale8 = _mm256_set1_ps(scale);
+	u32 i = 0;
+	
+	for (; i + 8 <= frame_count; i += 8) {
+		__m256 l = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*)&left[i])), scale8);
+		__m256 r = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*)&right[i])), scale8);
+		// Unpacking works per 128-bit half: L0 R0 L1 R1 | L4 R4 L5 R5 and L2 R2 L3 R3 | L6 R6 L7 R7
+		__m256 low = _mm256_unpacklo_ps(l, r);
+		__m256 high = _mm256_unpackhi_ps(l, r);
+		_mm256_storeu_ps(&out[i*2+0], _mm256_permute2f128_ps(low, high, 0x20));
+		_mm256_storeu_ps(&out[i*2+8], _mm256_permute2f128_ps(low, high, 0x31));
+	}
+	
+	planar_s32_to_f32_scalar(&left[i], &right[i], &out[i*2], frame_count - i, scale);
+}
+
+TARGET_AVX2 static inline __m256 get_dither_avx2(__m256i *state) {
+	__m256i x = *state;
+	x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 13));
+	x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 17));
+	x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 5));
+	*state = x;
+	
+	__m256i sum = _mm256_add_epi32(_mm256_and_si256(x, _mm256_set1_epi32(0xffff)), _mm256_srli_epi32(x, 16));
+	return _mm256_sub_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(sum), _mm256_set1_ps(DITHER_SCALE)), _mm256_set1_ps(DITHER_OFFSET));
+}
+
+TARGET_AVX2 static inline __m256i quantize_avx2(const float *in, __m256 scale, __m256 min, __m256 max, __m256i *dither) {
+	__m256 x = _mm256_mul_ps(_mm256_loadu_ps(in), scale);
+	if (dither) x = _mm256_add_ps(x, get_dither_avx2(dither));
+	return _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(x, min), max));
+}
+
+TARGET_AVX2 static void f32_to_s16_avx2(const float *in, s16 *out, u32 count, u32 *dither) {
+	const __m256 scale = _mm256_set1_ps(32768.f);
+	const __m256 min = _mm256_set1_ps(-32768.f);
+	const __m256 max = _mm256_set1_ps(32767.f);
+	__m256i state = _mm256_setzero_si256();
+	u32 i = 0;
+	
+	if (dither) state = _mm256_loadu_si256((const __m256i*)dither);
+	
+	for (; i + 16 <= count; i += 16) {
+		__m256i a = quantize_avx2(&in[i+0], scale, min, max, dither ? &state : NULL);
+		__m256i b = quantize_avx2(&in[i+8], scale, min, max, dither ? &state : NULL);
+		// Packing works per 128-bit half, which leaves the quarters in the order 0 2 1 3
+		__m256i packed = _mm256_packs_epi32(a, b);
+		_mm256_storeu_si256((__m256i*)&out[i], _mm256_permute4x64_epi64(packed, 0xd8));
+	}
+	
+	if (dither) _mm256_storeu_si256((__m256i*)dither, state);
+	
+	f32_to_s16_scalar(&in[i], &out[i], count - i, dither);
+}
+
+TARGET_AVX2 static void f32_to_s32_avx2(const float *in, s32 *out, u32 count, u32 bits, u32 *dither) {
+	const float scale1 = (float)(1ull << (bits - 1));
+	const __m256 scale = _mm256_set1_ps(scale1);
+	const __m256 min = _mm256_set1_ps(-scale1);
+	const __m256 max = _mm256_set1_ps(get_max_float(bits));
+	const __m128i shift = _mm_cvtsi32_si128(32 - bits);
+	__m256i state = _mm256_setzero_si256();
+	u32 i = 0;
+	
+	if (dither) state = _mm256_loadu_si256((const __m256i*)dither);
+	
+	for (; i + 8 <= count; i += 8) {
+		__m256i x = quantize_avx2(&in[i], scale, min, max, dither ? &state : NULL);
+		_mm256_storeu_si256((__m256i*)&out[i], _mm256_sll_epi32(x, shift));
+	}
+	
+	if (dither) _mm256_storeu_si256((__m256i*)dither, state);
+	
+	f32_to_s32_scalar(&in[i], &out[i], count - i, bits, dither);
+}
+
+static const PCM_Kernels g_sse2_kernels = {
+	"SSE2", &s16_to_f32_sse2, &s24_to_f32_scalar, &s32_to_f32_sse2, &scale_f32_sse2, &planar_s32_to_f32_sse2,
+	&f32_to_s16_sse2, &f32_to_s32_sse2,
+};
+
+static const PCM_Kernels g_sse41_kernels = {
+	"SSE4.1", &s16_to_f32_sse2, &s24_to_f32_sse41, &s32_to_f32_sse2, &scale_f32_sse2, &planar_s32_to_f32_sse2,
+	&f32_to_s16_sse2, &f32_to_s32_sse2,
+};
+
+static const PCM_Kernels g_avx2_kernels = {
+	"AVX2", &s16_to_f32_avx2, &s24_to_f32_avx2, &s32_to_f32_avx2, &scale_f32_avx2, &planar_s32_to_f32_avx2,
+	&f32_to_s16_avx2, &f32_to_s32_avx2,
+};
+#endif
+
+#if defined(CPU_ARM64)
+static void s16_to_f32_neon(const s16 *in, float *out, u32 count) {
+	u32 i = 0;
+	
+	for (; i + 8 <= count; i += 8) {
+		int16x8_t x = vld1q_s16(&in[i]);
+		vst1q_f32(&out[i+0], vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(x))), S16_SCALE));
+		vst1q_f32(&out[i+4], vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(x))), S16_SCALE));
+	}
+	
+	s16_to_f32_scalar(&in[i], &out[i], count - i);
+}
+
+static void s24_to_f32_neon(const u8 *in, float *out, u32 count) {
+	u32 i = 0;
+	
+	for (; i + 8 <= count; i += 8) {
+		// Splits 8 samples into their low, middle and high bytes
+		uint8x8x3_t bytes = vld3_u8(&in[i*3]);
+		uint16x8_t high = vorrq_u16(vshll_n_u8(bytes.val[2], 8), vmovl_u8(bytes.val[1]));
+		uint16x8_t low = vshll_n_u8(bytes.val[0], 8);
+		uint32x4_t a = vorrq_u32(vshll_n_u16(vget_low_u16(high), 16), vmovl_u16(vget_low_u16(low)));
+		uint32x4_t b = vorrq_u32(vshll_n_u16(vget_high_u16(high), 16), vmovl_u16(vget_high_u16(low)));
+		vst1q_f32(&out[i+0], vmulq_n_f32(vcvtq_f32_s32(vreinterpretq_s32_u32(a)), S32_SCALE));
+		vst1q_f32(&out[i+4], vmulq_n_f32(vcvtq_f32_s32(vreinterpretq_s32_u32(b)), S32_SCALE));
+	}
+	
+	s24_to_f32_scalar(&in[i*3], &out[i], count - i);
+}
+
+static void s32_to_f32_neon(const s32 *in, float *out, u32 count) {
+	u32 i = 0;
+	
+	for (; i + 8 <= count; i += 8) {
+		vst1q_f32(&out[i+0], vmulq_n_f32(vcvtq_f32_s32(vld1q_s32(&in[i+0])), S32_SCALE));
+		vst1q_f32(&out[i+4], vmulq_n_f32(vcvtq_f32_s32(vld1q_s32(&in[i+4])), S32_SCALE));
+	}
+	
+	s32_to_f32_scalar(&in[i], &out[i], count - i);
+}
+
+static void scale_f32_neon(const float *in, float *out, u32 count, float scale) {
+	u32 i = 0;
+	
+	for (; i + 8 <= count; i += 8) {
+		vst1q_f32(&out[i+0], vmulq_n_f32(vld1q_f32(&in[i+0]), scale));
+		vst1q_f32(&out[i+4], vmulq_n_f32(vld1q_f32(&in[i+4]), scale));
+	}
+	
+	scale_f32_scalar(&in[i], &out[i], count - i, scale);
+}
+
+static void planar_s32_to_f32_neon(const s32 *left, const s32 *right, float *out, u32 frame_count, float scale) {
+	u32 i = 0;
+	
+	for (; i + 4 <= frame_count; i += 4) {
+		float32x4x2_t frames;
+		frames.val[0] = vmulq_n_f32(vcvtq_f32_s32(vld1q_s32(&left[i])), scale);
+		frames.val[1] = vmulq_n_f32(vcvtq_f32_s32(vld1q_s32(&right[i])), scale);
+		// Interleaves on the way out
+		vst2q_f32(&out[i*2], frames);
+	}
+	
+	planar_s32_to_f32_scalar(&left[i], &right[i], &out[i*2], frame_count - i, scale);
+}
+
+static inline float32x4_t get_dither_neon(uint32x4_t *state) {
+	uint32x4_t x = *state;
+	x = veorq_u32(x, vshlq_n_u32(x, 13));
+	x = veorq_u32(x, vshrq_n_u32(x, 17));
+	x = veorq_u32(x, vshlq_n_u32(x, 5));
+	*state = x;
+	
+	uint32x4_t sum = vaddq_u32(vandq_u32(x, vdupq_n_u32(0xffff)), vshrq_n_u32(x, 16));
+	return vsubq_f32(vmulq_n_f32(vcvtq_f32_u32(sum), DITHER_SCALE), vdupq_n_f32(DITHER_OFFSET));
+}
+
+static inline int32x4_t quantize_neon(const float *in, float scale, float32x4_t min, float32x4_t max, uint32x4_t *dither) {
+	float32x4_t x = vmulq_n_f32(vld1q_f32(in), scale);
+	if (dither) x = vaddq_f32(x, get_dither_neon(dither));
+	return vcvtnq_s32_f32(vminq_f32(vmaxq_f32(x, min), max));
+}
+
+static void f32_to_s16_neon(const float *in, s16 *out, u32 count, u32 *dither) {
+	const float32x4_t min = vdupq_n_f32(-32768.f);
+	const float32x4_t max = vdupq_n_f32(32767.f);
+	uint32x4_t state[2] = {vdupq_n_u32(0), vdupq_n_u32(0)};
+	u32 i = 0;
+	
+	if (dither) {
+		state[0] = vld1q_u32(&dither[0]);
+		state[1] = vld1q_u32(&dither[4]);
+	}
+	
+	for (; i + 8 <= count; i += 8) {
+		int32x4_t a = quantize_neon(&in[i+0], 32768.f, min, max, dither ? &state[0] : NULL);
+		int32x4_t b = quantize_neon(&in[i+4], 32768.f, min, max, dither ? &state[1] : NULL);
+		vst1q_s16(&out[i], vcombine_s16(vqmovn_s32(a), vqmovn_s32(b)));
+	}
+	
+	if (dither) {
+		vst1q_u32(&dither[0], state[0]);
+		vst1q_u32(&dither[4], state[1]);
+	}
+	
+	f32_to_s16_scalar(&in[i], &out[i], count - i, dither);
+}
+
+static void f32_to_s32_neon(const float *in, s32 *out, u32 count, u32 bits, u32 *dither) {
+	const float scale = (float)(1ull << (bits - 1));
+	const float32x4_t min = vdupq_n_f32(-scale);
+	const float32x4_t max = vdupq_n_f32(get_max_float(bits));
+	const int32x4_t shift = vdupq_n_s32((s32)(32 - bits));
+	uint32x4_t state[2] = {vdupq_n_u32(0), vdupq_n_u32(0)};
+	u32 i = 0;
+	
+	if (dither) {
+		state[0] = vld1q_u32(&dither[0]);
+		state[1] = vld1q_u32(&dither[4]);
+	}
+	
+	for (; i + 8 <= count; i += 8) {
+		int32x4_t a = quantize_neon(&in[i+0], scale, min, max, dither ? &state[0] : NULL);
+		int32x4_t b = quantize_neon(&in[i+4], scale, min, max, dither ? &state[1] : NULL);
+		vst1q_s32(&out[i+0], vshlq_s32(a, shift));
+		vst1q_s32(&out[i+4], vshlq_s32(b, shift));
+	}
+	
+	if (dither) {
+		vst1q_u32(&dither[0], state[0]);
+		vst1q_u32(&dither[4], state[1]);
+	}
+	
+	f32_to_s32_scalar(&in[i], &out[i], count - i, bits, dither);
+}
+
+static const PCM_Kernels g_neon_kernels = {
+	"NEON", &s16_to_f32_neon, &s24_to_f32_neon, &s32_to_f32_neon, &scale_f32_neon, &planar_s32_to_f32_neon,
+	&f32_to_s16_neon, &f32_to_s32_neon,
+};
+#endif
+
+// Cheap enough to do per call, and it follows override_cpu_features() for the benchmarks
+static const PCM_Kernels *get_pcm_kernels() {
+	u32 features = get_cpu_features();
+
+#if defined(CPU_X86)
+	if (features & CPU_FEATURE_AVX2) return &g_avx2_kernels;
+	if (features & CPU_FEATURE_SSE41) return &g_sse41_kernels;
+	if (features & CPU_FEATURE_SSE2) return &g_sse2_kernels;
+#elif defined(CPU_ARM64)
+	if (features & CPU_FEATURE_NEON) return &g_neon_kernels;
+#endif
+	
+	return &g_scalar_kernels;
+}
+
+void pcm_s16_to_f32(const s16 *in, float *out, u32 count) {
+	get_pcm_kernels()->s16_to_f32(in, out, count);
+}
+
+void pcm_s24_to_f32(const u8 *in, float *out, u32 count) {
+	get_pcm_kernels()->s24_to_f32(in, out, count);
+}
+
+void pcm_s32_to_f32(const s32 *in, float *out, u32 count) {
+	get_pcm_kernels()->s32_to_f32(in, out, count);
+}
+
+void pcm_scale_f32(const float *in, float *out, u32 count, float scale) {
+	get_pcm_kernels()->scale_f32(in, out, count, scale);
+}
+
+void pcm_planar_s32_to_f32(const s32 *left, const s32 *right, float *out, u32 frame_count, u32 bits_per_sample) {
+	DEBUG_ASSERT(bits_per_sample >= 1 && bits_per_sample <= 32);
+	float scale = 1.f / (float)(1ull << (bits_per_sample - 1));
+	get_pcm_kernels()->planar_s32_to_f32(left, right, out, frame_count, scale);
+}
+
+void PCM_Dither::init(u32 seed) {
+	for (u32 i = 0; i < PCM_DITHER_LANES; ++i) {
+		seed = seed * 1664525 + 1013904223;
+		// xorshift never leaves 0
+		this->state[i] = seed ? seed : 1;
+	}
+}
+
+void pcm_f32_to_s16(const float *in, s16 *out, u32 count, PCM_Dither *dither) {
+	get_pcm_kernels()->f32_to_s16(in, out, count, dither ? dither->state : NULL);
+}
+
+void pcm_f32_to_s24(const float *in, u8 *out, u32 count, PCM_Dither *dither) {
+	const PCM_Kernels *kernels = get_pcm_kernels();
+	// Converted to 24 in 32 a block at a time, then packed. The block is a whole number of dither lanes.
+	s32 block[256];
+	
+	for (u32 i = 0; i < count; i += ARRAY_LENGTH(block)) {
+		u32 block_count = MIN(count - i, ARRAY_LENGTH(block));
+		kernels->f32_to_s32(&in[i], block, block_count, 24, dither ? dither->state : NULL);
+		
+		for (u32 j = 0; j < block_count; ++j) {
+			u32 sample = (u32)block[j];
+			out[(i+j)*3+0] = (u8)(sample >> 8);
+			out[(i+j)*3+1] = (u8)(sample >> 16);
+			out[(i+j)*3+2] = (u8)(sample >> 24);
+		}
+	}
+}
+
+void pcm_f32_to_s32(const float *in, s32 *out, u32 count, u32 bits, PCM_Dither *dither) {
+	DEBUG_ASSERT(bits >= 2 && bits <= 32);
+	get_pcm_kernels()->f32_to_s32(in, out, count, bits, dither ? dither->state : NULL);
+}
+
+const char *get_pcm_kernel_name() {
+	return get_pcm_kernels()->name;
+}
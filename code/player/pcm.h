@@ -0,0 +1,56 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#ifndef PCM_H
+#define PCM_H
+
+#include "common.h"
+
+// Conversion from what decoders read to the floats the player works in, and from those to what devices
+// take. An integer of n bits is scaled by 1/2^(n-1), so full scale negative maps to exactly -1. Each call
+// uses the fastest kernel the CPU supports. Counts are in samples unless they say frames.
+
+void pcm_s16_to_f32(const s16 *in, float *out, u32 count);
+// Packed little endian, 3 bytes per sample
+void pcm_s24_to_f32(const u8 *in, float *out, u32 count);
+void pcm_s32_to_f32(const s32 *in, float *out, u32 count);
+// in and out can be the same
+void pcm_scale_f32(const float *in, float *out, u32 count, float scale);
+// Two channels of integers holding bits_per_sample bits each, as libFLAC gives them, to interleaved 
+// stereo. Pass the same channel twice for mono.
+void pcm_planar_s32_to_f32(const s32 *left, const s32 *right, float *out, u32 frame_count, u32 bits_per_sample);
+
+// One random generator for each lane of the widest kernel, so every kernel dithers alike
+#define PCM_DITHER_LANES 8
+
+struct PCM_Dither {
+	u32 state[PCM_DITHER_LANES];
+	
+	void init(u32 seed);
+};
+
+// Back to integers, for devices that take them. Samples are scaled by 2^(bits-1), rounded to the nearest
+// and clamped, which makes these the exact inverse of the conversions above. With dither, triangular
+// noise of up to 1 LSB either way is added before rounding. NULL leaves it out.
+void pcm_f32_to_s16(const float *in, s16 *out, u32 count, PCM_Dither *dither);
+// Packed little endian, 3 bytes per sample
+void pcm_f32_to_s24(const float *in, u8 *out, u32 count, PCM_Dither *dither);
+// bits is how many are significant. They go at the top and the rest are zero, so 24 gives 24 in 32.
+void pcm_f32_to_s32(const float *in, s32 *out, u32 count, u32 bits, PCM_Dither *dither);
+
+// Name of the kernels the next call will use
+const char *get_pcm_kernel_name();
+
+#endif //PCM_H
@@ -0,0 +1,404 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "pipeline.h"
+#include <math.h>
+#include <samplerate.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+static int get_sample_rate_converter_type(Resampler_Quality quality) {
+	switch (quality) {
+		case RESAMPLER_QUALITY_LOW: return SRC_SINC_FASTEST;
+		case RESAMPLER_QUALITY_MEDIUM: return SRC_SINC_MEDIUM_QUALITY;
+		default: return SRC_SINC_BEST_QUALITY;
+	}
+}
+
+void Playback_Pipeline::init(const PCM_Format *output_format, u32 ring_frames, float buffer_duration) {
+	int error;
+	
+	this->output_format = *output_format;
+	this->buffer_duration = buffer_duration;
+	this->end_index.store(UINT64_MAX);
+	this->splice_index.store(UINT64_MAX);
+	this->resampler_quality.store(RESAMPLER_QUALITY_HIGH);
+	this->sample_rate_converter_type = SRC_SINC_BEST_QUALITY;
+	this->sample_rate_converter = src_new(SRC_SINC_BEST_QUALITY, 2, &error);
+	this->ring.init(ring_frames, 2);
+	this->ring_sample_rate.store(output_format->sample_rate);
+}
+
+void Playback_Pipeline::restart() {
+	// Before the flush, so nothing at the new rate gets into the ring ahead of it
+	this->ring_sample_rate.store(this->output_format.sample_rate);
+	this->ring_source_bits.store(this->file_loaded.load() ? this->get_source_bits(&this->format) : 0);
+	this->ring.flush();
+	this->end_index.store(UINT64_MAX);
+	this->track_ended.store(false);
+	this->splice_index.store(UINT64_MAX);
+	this->track_changed.store(false);
+	this->pending_frames = 0;
+	this->decoded_sample = this->file_loaded.load() ? this->decoder.get_sample() : 0;
+	this->end_of_input = false;
+	this->draining = false;
+	this->format_change_pending = false;
+	this->decoder_finished = false;
+	if (this->use_native_resampler) this->resampler.reset();
+	else src_reset((SRC_STATE*)this->sample_rate_converter);
+}
+
+void Playback_Pipeline::close() {
+	this->decoder.close();
+	this->previous_decoder.close();
+	this->file_loaded = false;
+	this->restart();
+}
+
+bool Playback_Pipeline::open(const wchar_t *path) {
+	if (this->file_loaded.load()) this->close();
+	
+	this->codec = find_codec_from_file_name(path);
+	if (!this->decoder.open(path, this->buffer_duration, &this->format)) return false;
+	
+	this->file_loaded = true;
+	wcsncpy(this->path, path, ARRAY_LENGTH(this->path) - 1);
+	if (this->choose_output_rate) {
+		this->output_format.sample_rate = this->choose_output_rate(this->format.sample_rate, this->output_format.sample_rate);
+	}
+	// The caller says what comes after this one
+	this->next_path[0] = 0;
+	
+	this->restart();
+	this->prepare_buffers();
+	// Get something into the ring so the device doesn't start on silence
+	this->produce();
+	return true;
+}
+
+void Playback_Pipeline::set_next(const wchar_t *path) {
+	if (path) wcsncpy(this->next_path, path, ARRAY_LENGTH(this->next_path) - 1);
+	else this->next_path[0] = 0;
+}
+
+void Playback_Pipeline::seek(u64 sample) {
+	if (!this->file_loaded.load()) return;
+	
+	// The decoder can already be on the next track while the end of this one plays
+	if (this->splice_index.load() != UINT64_MAX || this->format_change_pending) {
+		this->return_to_audible_track();
+	}
+	
+	this->decoder.seek(sample);
+	this->restart();
+	this->produce();
+}
+
+void Playback_Pipeline::set_output_rate(u32 sample_rate, u64 sample) {
+	if (!this->file_loaded.load()) {
+		this->output_format.sample_rate = sample_rate;
+		this->restart();
+		return;
+	}
+	
+	if (this->splice_index.load() != UINT64_MAX || this->format_change_pending) {
+		this->return_to_audible_track();
+	}
+	
+	this->output_format.sample_rate = sample_rate;
+	this->prepare_buffers();
+	this->decoder.seek(sample);
+	this->restart();
+	this->produce();
+}
+
+u32 Playback_Pipeline::get_source_bits(const PCM_Format *format) {
+	if (format->sample_rate != this->output_format.sample_rate) return 0;
+	
+	switch (format->sample_type) {
+		case PCM_TYPE_S16: return 16;
+		case PCM_TYPE_S24: return 24;
+		case PCM_TYPE_S32: return 32;
+		default: return 0;
+	}
+}
+
+void Playback_Pipeline::prepare_buffers() {
+	const u32 input_rate = this->format.sample_rate;
+	const u32 output_rate = this->output_format.sample_rate;
+	u32 chunk_frames = (input_rate * PIPELINE_DECODE_CHUNK_MS) / 1000;
+	// Plus some slack for the converter's rounding
+	u32 resample_frames = (u32)ceil((double)chunk_frames * output_rate / input_rate) + 64;
+	
+	if (chunk_frames > this->decode_chunk_frames) {
+		::free(this->decode_buffer);
+		this->decode_buffer = (float*)malloc(chunk_frames * 2 * sizeof(float));
+	}
+	
+	if (resample_frames > this->resample_buffer_frames) {
+		::free(this->resample_buffer);
+		this->resample_buffer = (float*)malloc(resample_frames * 2 * sizeof(float));
+		this->resample_buffer_frames = resample_frames;
+	}
+	
+	this->decode_chunk_frames = chunk_frames;
+	
+	if (input_rate == output_rate) {
+		this->use_native_resampler = false;
+		return;
+	}
+	
+	Resampler_Quality quality = this->resampler_quality.load();
+	this->use_native_resampler = this->resampler.init(input_rate, output_rate, quality);
+	
+	if (this->use_native_resampler) {
+		log_debug("Resampling %u -> %u (%s, %s)\n", input_rate, output_rate,
+				  get_resampler_quality_name(quality), get_resampler_kernel_name());
+		return;
+	}
+	
+	int converter_type = get_sample_rate_converter_type(quality);
+	if (converter_type != this->sample_rate_converter_type) {
+		int error;
+		src_delete((SRC_STATE*)this->sample_rate_converter);
+		this->sample_rate_converter = src_new(converter_type, 2, &error);
+		this->sample_rate_converter_type = converter_type;
+	}
+	
+	log_debug("Resampling %u -> %u with libsamplerate (%s)\n", input_rate, output_rate, src_get_name(converter_type));
+	src_reset((SRC_STATE*)this->sample_rate_converter);
+	src_set_ratio((SRC_STATE*)this->sample_rate_converter, (double)output_rate / input_rate);
+}
+
+bool Playback_Pipeline::splice_is_pending() {
+	return this->splice_index.load() != UINT64_MAX || this->track_changed.load();
+}
+
+bool Playback_Pipeline::open_next_track(PCM_Format *format) {
+	Decoder next = {};
+	
+	if (!next.open(this->next_path, this->buffer_duration, format)) {
+		log_warning("Failed to open \"%ls\" ahead of time\n", this->next_path);
+		this->next_path[0] = 0;
+		return false;
+	}
+	
+	// The device has to be reopened for it, which can't be done without a gap
+	const u32 output_rate = this->output_format.sample_rate;
+	if (this->choose_output_rate && this->choose_output_rate(format->sample_rate, output_rate) != output_rate) {
+		log_info("\"%ls\" plays at %uHz, so it starts after this track ends\n", this->next_path, format->sample_rate);
+		next.close();
+		this->next_path[0] = 0;
+		return false;
+	}
+	
+	this->previous_decoder.close();
+	this->previous_decoder = this->decoder;
+	this->decoder = next;
+	
+	wcscpy(this->previous_path, this->path);
+	wcscpy(this->path, this->next_path);
+	this->next_path[0] = 0;
+	return true;
+}
+
+void Playback_Pipeline::begin_spliced_track(const PCM_Format *format, u64 start_index) {
+	this->previous_format = this->format;
+	this->previous_codec = this->codec;
+	this->format = *format;
+	this->codec = this->decoder.codec;
+	this->decoded_sample = this->decoder.get_sample();
+	this->end_of_input = false;
+	this->draining = false;
+	// Both before the splice index, which tells the consumer which one applies
+	this->previous_source_bits.store(this->ring_source_bits.load());
+	this->ring_source_bits.store(this->get_source_bits(format));
+	this->splice_index.store(start_index);
+	log_info("Continuing with: %ls\n", this->path);
+}
+
+void Playback_Pipeline::return_to_audible_track() {
+	// The format is only swapped once the next track is going into the ring
+	if (this->splice_index.load() != UINT64_MAX) {
+		this->format = this->previous_format;
+		this->codec = this->previous_codec;
+	}
+	
+	this->decoder.close();
+	this->decoder = this->previous_decoder;
+	this->previous_decoder = {};
+	
+	// It gets spliced on again when this one ends
+	wcscpy(this->next_path, this->path);
+	wcscpy(this->path, this->previous_path);
+	
+	this->prepare_buffers();
+}
+
+void Playback_Pipeline::decode_into_pending() {
+	u32 num_input_frames = this->decode_chunk_frames - this->pending_frames;
+	u64 start_tick = time_get_tick();
+	u32 decoded = this->decoder.decode(num_input_frames, &this->decode_buffer[this->pending_frames * 2]);
+	
+	this->decode_ticks += time_get_tick() - start_tick;
+	this->pending_frames += decoded;
+	this->decoded_sample = this->decoder.get_sample();
+	this->end_of_input = decoded < num_input_frames;
+}
+
+bool Playback_Pipeline::produce() {
+	const u32 input_rate = this->format.sample_rate;
+	const u32 output_rate = this->output_format.sample_rate;
+	const bool needs_sample_rate_conversion = input_rate != output_rate;
+	
+	this->decode_ticks = 0;
+	this->resample_ticks = 0;
+	if (!this->file_loaded.load(std::memory_order_relaxed) || this->decoder_finished) return false;
+	
+	u32 max_output_frames = needs_sample_rate_conversion ? this->resample_buffer_frames : this->decode_chunk_frames;
+	if (this->ring.get_free_frames() < max_output_frames) return false;
+	
+	if (!this->end_of_input) this->decode_into_pending();
+	
+	// Splice the next track on before the resampler sees the end of this one
+	if (this->end_of_input && !this->draining && !this->format_change_pending && this->next_path[0]) {
+		PCM_Format format;
+		
+		// Only one splice can wait to be heard at a time. Try again once the last one has been.
+		if (this->splice_is_pending()) return false;
+		
+		SUSPEND_REALTIME_SECTION();
+		
+		// Roughly where the new track comes out of the resampler
+		u64 start_index = this->ring.write_index.load() +
+			(u64)((double)this->pending_frames * output_rate / input_rate);
+		
+		if (this->open_next_track(&format)) {
+			if (format.sample_rate == input_rate) {
+				this->begin_spliced_track(&format, start_index);
+				this->decode_into_pending();
+			}
+			else {
+				// The resampler has to be drained and set up again for the new rate first
+				this->next_format = format;
+				this->format_change_pending = true;
+			}
+		}
+		
+		RESUME_REALTIME_SECTION();
+	}
+	
+	u32 output_frames_generated;
+	u64 resample_start_tick = time_get_tick();
+	this->draining = this->end_of_input;
+	
+	// Convert sample rate if needed
+	if (needs_sample_rate_conversion && this->use_native_resampler) {
+		u32 input_frames_used;
+		this->resampler.process(this->decode_buffer, this->pending_frames,
+								this->resample_buffer, this->resample_buffer_frames, this->end_of_input,
+								&input_frames_used, &output_frames_generated);
+		
+		this->pending_frames -= input_frames_used;
+		memmove(this->decode_buffer, &this->decode_buffer[input_frames_used * 2],
+				this->pending_frames * 2 * sizeof(float));
+		
+		this->ring.write(this->resample_buffer, output_frames_generated);
+	}
+	else if (needs_sample_rate_conversion) {
+		SRC_DATA data = {};
+		data.data_in = this->decode_buffer;
+		data.input_frames = this->pending_frames;
+		data.data_out = this->resample_buffer;
+		data.output_frames = this->resample_buffer_frames;
+		data.src_ratio = (double)output_rate / input_rate;
+		data.end_of_input = this->end_of_input;
+		
+		src_process((SRC_STATE*)this->sample_rate_converter, &data);
+		
+		// Keep the input the converter didn't use for the next chunk
+		this->pending_frames -= data.input_frames_used;
+		memmove(this->decode_buffer, &this->decode_buffer[data.input_frames_used * 2],
+				this->pending_frames * 2 * sizeof(float));
+		
+		output_frames_generated = data.output_frames_gen;
+		this->ring.write(this->resample_buffer, output_frames_generated);
+	}
+	else {
+		output_frames_generated = this->pending_frames;
+		this->ring.write(this->decode_buffer, this->pending_frames);
+		this->pending_frames = 0;
+	}
+	
+	// Along with getting it into the ring
+	if (needs_sample_rate_conversion) this->resample_ticks = time_get_tick() - resample_start_tick;
+	
+	// Everything the decoder gave is in the ring, including the tail of the resampler
+	if (this->end_of_input && !this->pending_frames && !output_frames_generated) {
+		if (this->format_change_pending) {
+			SUSPEND_REALTIME_SECTION();
+			this->format_change_pending = false;
+			this->begin_spliced_track(&this->next_format, this->ring.write_index.load());
+			this->prepare_buffers();
+			RESUME_REALTIME_SECTION();
+		}
+		else {
+			this->decoder_finished = true;
+			this->end_index.store(this->ring.write_index.load());
+		}
+	}
+	
+	return true;
+}
+
+void Playback_Pipeline::close_previous_track() {
+	this->previous_decoder.close();
+}
+
+u32 Playback_Pipeline::read(float *out, u32 max_frames) {
+	u32 read = this->ring.read(out, max_frames);
+	
+	u64 end_index = this->end_index.load();
+	if (end_index != UINT64_MAX && this->ring.read_index.load() >= end_index &&
+		this->end_index.compare_exchange_strong(end_index, UINT64_MAX)) {
+		this->track_ended.store(true);
+	}
+	
+	// Flag the change first so the producer never sees neither
+	u64 splice_index = this->splice_index.load();
+	if (splice_index != UINT64_MAX && this->ring.read_index.load() >= splice_index) {
+		this->track_changed.store(true);
+		if (!this->splice_index.compare_exchange_strong(splice_index, UINT64_MAX)) {
+			this->track_changed.store(false);
+		}
+	}
+	
+	return read;
+}
+
+void Playback_Pipeline::free() {
+	this->close();
+	this->ring.free();
+	this->resampler.free();
+	src_delete((SRC_STATE*)this->sample_rate_converter);
+	::free(this->decode_buffer);
+	::free(this->resample_buffer);
+	this->sample_rate_converter = NULL;
+	this->decode_buffer = NULL;
+	this->resample_buffer = NULL;
+	this->decode_chunk_frames = 0;
+	this->resample_buffer_frames = 0;
+}
@@ -0,0 +1,176 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "common.h"
+#include "audio_ring.h"
+#include "decoders.h"
+#include "resampler.h"
+#include <atomic>
+
+// Steady-state playback must not touch the heap. Builds with PLAYER_REALTIME_CHECKS count every
+// allocation made inside a real-time section, which realtime_check.cpp does with the Windows debug CRT's
+// hook or by wrapping glibc's malloc. Windows debug builds always have it.
+#if defined(_DEBUG) && defined(_WIN32) && !defined(PLAYER_REALTIME_CHECKS)
+#define PLAYER_REALTIME_CHECKS
+#endif
+
+#if defined(PLAYER_REALTIME_CHECKS)
+extern thread_local bool t_in_realtime_section;
+
+// Returns false if allocations can't be counted in this build, like with the release CRT
+bool install_realtime_allocation_hook();
+// Allocations made inside real-time sections by any thread so far
+u32 get_realtime_allocation_count();
+
+#define BEGIN_REALTIME_SECTION() (t_in_realtime_section = true)
+#define END_REALTIME_SECTION() (t_in_realtime_section = false)
+// Moving on to the next track opens files, which is allowed to allocate once per track
+#define SUSPEND_REALTIME_SECTION() bool resume_realtime_section = t_in_realtime_section; t_in_realtime_section = false
+#define RESUME_REALTIME_SECTION() (t_in_realtime_section = resume_realtime_section)
+#else
+#define BEGIN_REALTIME_SECTION()
+#define END_REALTIME_SECTION()
+#define SUSPEND_REALTIME_SECTION()
+#define RESUME_REALTIME_SECTION()
+#endif
+
+// Decode this much at a time. Opus wants 120ms to be sure of getting whole packets.
+#define PIPELINE_DECODE_CHUNK_MS 120
+
+// Picks the rate to play a track at input_rate, given the rate the pipeline is at now
+typedef u32 Pipeline_Rate_Function(u32 input_rate, u32 output_rate);
+
+// Everything between the decoders and the device: decoding, gapless splicing onto the next track and
+// resampling to the output rate, into a ring of output frames. The player runs one on its producer
+// thread and the device reads the ring. The offline renderer runs the same one on a virtual clock.
+//
+// The producer side (everything but read()) must only be used by one thread at a time.
+// read() is the consumer side and can run on another thread at the same time.
+struct Playback_Pipeline {
+	PCM_Format format;
+	PCM_Format output_format;
+	enum Codec codec;
+	float buffer_duration;
+	
+	Decoder decoder;
+	// The track before a splice, kept open until it has been heard so seeking back into it doesn't reopen it
+	Decoder previous_decoder;
+	
+	// libsamplerate, for ratios the built-in resampler can't do
+	void *sample_rate_converter;
+	int sample_rate_converter_type;
+	Resampler resampler;
+	bool use_native_resampler;
+	// Takes effect from the next track
+	std::atomic<Resampler_Quality> resampler_quality;
+	
+	// Output-rate frames ready for the device
+	Audio_Ring ring;
+	// Asked about each track that is opened, and can move output_format to the track's own rate. Tracks
+	// that would need another rate aren't spliced on, so the one before ends normally. NULL keeps the
+	// rate init() was given.
+	Pipeline_Rate_Function *choose_output_rate;
+	// Rate of what is going into the ring. The consumer must not play anything at another rate.
+	std::atomic<u32> ring_sample_rate;
+	// Bits of the integers the ring holds exactly, so the consumer knows dither would add nothing.
+	// 0 if the audio was resampled or decoded to floats.
+	std::atomic<u32> ring_source_bits;
+	// The same for the track before a splice, while it is still audible
+	std::atomic<u32> previous_source_bits;
+	// Write index of the ring at the end of the track, UINT64_MAX until the decoder finishes
+	std::atomic<u64> end_index;
+	// Set by read() when it passes end_index
+	std::atomic<bool> track_ended;
+	// Ring index a spliced track starts at, UINT64_MAX if there's no splice waiting to be heard
+	std::atomic<u64> splice_index;
+	// Set by read() when it passes splice_index
+	std::atomic<bool> track_changed;
+	std::atomic<bool> file_loaded;
+	
+	// File the decoder has open
+	wchar_t path[512];
+	// Track to carry straight on to when this one ends, empty if none
+	wchar_t next_path[512];
+	// The track before a splice, which stays audible until read() reaches splice_index
+	wchar_t previous_path[512];
+	PCM_Format previous_format;
+	enum Codec previous_codec;
+	
+	float *decode_buffer;
+	float *resample_buffer;
+	u32 decode_chunk_frames;
+	u32 resample_buffer_frames;
+	// Decoded frames the resampler hasn't consumed yet
+	u32 pending_frames;
+	// Decoder position after the last decode
+	u64 decoded_sample;
+	// The decoder ran dry
+	bool end_of_input;
+	// The resampler has been told there is no more input, so nothing can be spliced on any more
+	bool draining;
+	// The next track is open but has a different rate, so it waits for the resampler to drain
+	bool format_change_pending;
+	PCM_Format next_format;
+	bool decoder_finished;
+	// time_get_tick() ticks the last produce() spent in the decoder and in the resampler
+	u64 decode_ticks;
+	u64 resample_ticks;
+	
+	// ring_frames is rounded up to a power of two
+	void init(const PCM_Format *output_format, u32 ring_frames, float buffer_duration);
+	// Close the current track and start on this one. Fills the first chunk.
+	bool open(const wchar_t *path);
+	// Track to splice on to the end of the current one, or NULL for none
+	void set_next(const wchar_t *path);
+	// Seek the audible track to a sample and throw away everything decoded ahead of it
+	void seek(u64 sample);
+	// Produce at another rate from now on, starting again from a sample of the audible track
+	void set_output_rate(u32 sample_rate, u64 sample);
+	void close();
+	// Drop everything decoded ahead of the device
+	void restart();
+	// Decode one chunk, resample it and push it into the ring. At the end of a track the next one carries
+	// on from the exact frame the last one stopped at. Returns false if nothing could be produced.
+	bool produce();
+	// Once read() has set track_changed, the track before the splice can go
+	void close_previous_track();
+	// True until the last splice has been heard and handled
+	bool splice_is_pending();
+	
+	// Consumer side. Copies up to max_frames from the ring and flags the end of a track or
+	// a splice once it has been read past. Returns the number of frames copied. Call it with
+	// max_frames 0 when the ring looks empty, so flushed frames are skipped and the flags still update.
+	u32 read(float *out, u32 max_frames);
+	
+	void free();
+	
+	// Size the decode and resample buffers and pick a resampler for the current track
+	void prepare_buffers();
+	// For ring_source_bits
+	u32 get_source_bits(const PCM_Format *format);
+	// Open the next track next to the current one without touching what is already in the ring
+	bool open_next_track(PCM_Format *format);
+	// Start producing from the next track. What is in the ring before start_index still belongs to the old one.
+	void begin_spliced_track(const PCM_Format *format, u64 start_index);
+	// Go back to the track that is audible after the decoder has moved on to the next one
+	void return_to_audible_track();
+	// Decode into PCM after whatever the converter left over last time
+	void decode_into_pending();
+};
+
+#endif //PIPELINE_H
@@ -0,0 +1,75 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#ifndef PLATFORM_H
+#define PLATFORM_H
+
+#include "common.h"
+#include <stdio.h>
+
+// The OS services the decoders and the playback engine need, so they can also be built for headless
+// tools on other platforms. The UI only runs on Windows. Implemented in platform_win32.cpp and
+// platform_posix.cpp.
+
+// Map a whole file read-only. Returns NULL if it can't be opened or is empty.
+const u8 *map_file(const wchar_t *path, u64 *size);
+void unmap_file(const u8 *view, u64 size);
+// Start reading a range of a mapping in the background. Only a hint.
+void prefetch_mapped_range(const void *address, u64 size);
+
+typedef void Thread_Entry(void *user_data);
+// NULL on failure
+void *create_thread(Thread_Entry *entry, void *user_data);
+// Waits for the thread to exit and frees it
+void join_thread(void *thread);
+// For threads that keep the device fed. Only a hint, it can need privileges the process doesn't have.
+void raise_thread_priority(void *thread);
+u32 get_processor_count();
+
+#define PLATFORM_WAIT_FOREVER UINT32_MAX
+
+// Auto-reset event. A signal with nobody waiting wakes the next wait, and signals don't add up.
+void *create_event();
+void signal_event(void *event);
+// Returns false if the timeout passed without a signal
+bool wait_for_event(void *event, u32 timeout_ms);
+void destroy_event(void *event);
+
+void *create_mutex();
+void lock_mutex(void *mutex);
+void unlock_mutex(void *mutex);
+void destroy_mutex(void *mutex);
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <strings.h>
+#include <wchar.h>
+
+// The CRT names the decoders use, for everything that isn't Windows
+FILE *_wfopen(const wchar_t *path, const wchar_t *mode);
+#define _fseeki64 fseeko
+#define _ftelli64 ftello
+#define _fileno fileno
+#define _fstat64 fstat
+#define _stat64 stat
+#define _wcsicmp wcscasecmp
+#define _strnicmp strncasecmp
+#define _mkdir(path) mkdir(path, 0755)
+#endif
+
+#endif //PLATFORM_H
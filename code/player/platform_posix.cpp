@@ -0,0 +1,309 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+// For the headless tools. wchar_t is UTF-32 here, so the "utf16" conversions are between
+// UTF-8 and whole code points. There are no message boxes, so user messages go to the log.
+#ifndef _WIN32
+#include "platform.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+u32 utf8_to_utf16(const char *in, wchar_t *out, u32 max_out) {
+	const u8 *c = (const u8*)in;
+	u32 length = 0;
+	
+	if (!max_out) return 0;
+	
+	while (*c && length + 1 < max_out) {
+		u32 code_point;
+		u32 continuation_bytes;
+		
+		if (*c < 0x80) code_point = *c, continuation_bytes = 0;
+		else if ((*c & 0xe0) == 0xc0) code_point = *c & 0x1f, continuation_bytes = 1;
+		else if ((*c & 0xf0) == 0xe0) code_point = *c & 0x0f, continuation_bytes = 2;
+		else if ((*c & 0xf8) == 0xf0) code_point = *c & 0x07, continuation_bytes = 3;
+		else return 0;
+		
+		c++;
+		for (u32 i = 0; i < continuation_bytes; ++i, ++c) {
+			if ((*c & 0xc0) != 0x80) return 0;
+			code_point = (code_point << 6) | (*c & 0x3f);
+		}
+		
+		out[length++] = (wchar_t)code_point;
+	}
+	
+	out[length] = 0;
+	return length;
+}
+
+u32 utf16_to_utf8(const wchar_t *in, char *out, u32 max_out) {
+	u32 length = 0;
+	
+	if (!max_out) return 0;
+	
+	for (; *in; ++in) {
+		u32 code_point = (u32)*in;
+		u8 bytes[4];
+		u32 count;
+		
+		if (code_point < 0x80) {
+			bytes[0] = (u8)code_point;
+			count = 1;
+		}
+		else if (code_point < 0x800) {
+			bytes[0] = (u8)(0xc0 | (code_point >> 6));
+			bytes[1] = (u8)(0x80 | (code_point & 0x3f));
+			count = 2;
+		}
+		else if (code_point < 0x10000) {
+			bytes[0] = (u8)(0xe0 | (code_point >> 12));
+			bytes[1] = (u8)(0x80 | ((code_point >> 6) & 0x3f));
+			bytes[2] = (u8)(0x80 | (code_point & 0x3f));
+			count = 3;
+		}
+		else {
+			bytes[0] = (u8)(0xf0 | (code_point >> 18));
+			bytes[1] = (u8)(0x80 | ((code_point >> 12) & 0x3f));
+			bytes[2] = (u8)(0x80 | ((code_point >> 6) & 0x3f));
+			bytes[3] = (u8)(0x80 | (code_point & 0x3f));
+			count = 4;
+		}
+		
+		// Like WideCharToMultiByte, don't write a partial string
+		if (length + count + 1 > max_out) return 0;
+		for (u32 i = 0; i < count; ++i) out[length++] = (char)bytes[i];
+	}
+	
+	out[length] = 0;
+	return length;
+}
+
+FILE *_wfopen(const wchar_t *path, const wchar_t *mode) {
+	char path_u8[1024];
+	char mode_u8[16];
+	
+	if (!utf16_to_utf8(path, path_u8, sizeof(path_u8)) || !utf16_to_utf8(mode, mode_u8, sizeof(mode_u8))) return NULL;
+	return fopen(path_u8, mode_u8);
+}
+
+const u8 *map_file(const wchar_t *path, u64 *size) {
+	char path_u8[1024];
+	struct stat file_info;
+	void *view = MAP_FAILED;
+	
+	*size = 0;
+	if (!utf16_to_utf8(path, path_u8, sizeof(path_u8))) return NULL;
+	
+	int file = open(path_u8, O_RDONLY);
+	if (file < 0) return NULL;
+	
+	if (!fstat(file, &file_info) && file_info.st_size > 0) {
+		*size = file_info.st_size;
+		view = mmap(NULL, (size_t)*size, PROT_READ, MAP_PRIVATE, file, 0);
+	}
+	
+	// The mapping keeps the file open
+	close(file);
+	if (view == MAP_FAILED) return NULL;
+	
+	madvise(view, (size_t)*size, MADV_SEQUENTIAL);
+	return (const u8*)view;
+}
+
+void unmap_file(const u8 *view, u64 size) {
+	munmap((void*)view, (size_t)size);
+}
+
+void prefetch_mapped_range(const void *address, u64 size) {
+	// madvise wants a page aligned start
+	uintptr_t page_size = (uintptr_t)sysconf(_SC_PAGESIZE);
+	uintptr_t start = (uintptr_t)address & ~(page_size - 1);
+	madvise((void*)start, (size_t)((uintptr_t)address + size - start), MADV_WILLNEED);
+}
+
+struct Posix_Thread {
+	pthread_t thread;
+	Thread_Entry *entry;
+	void *user_data;
+};
+
+static void *posix_thread_entry(void *user_data) {
+	Posix_Thread *thread = (Posix_Thread*)user_data;
+	thread->entry(thread->user_data);
+	return NULL;
+}
+
+void *create_thread(Thread_Entry *entry, void *user_data) {
+	Posix_Thread *thread = (Posix_Thread*)malloc(sizeof(Posix_Thread));
+	thread->entry = entry;
+	thread->user_data = user_data;
+	
+	if (pthread_create(&thread->thread, NULL, &posix_thread_entry, thread)) {
+		free(thread);
+		return NULL;
+	}
+	
+	return thread;
+}
+
+void join_thread(void *thread) {
+	Posix_Thread *posix_thread = (Posix_Thread*)thread;
+	pthread_join(posix_thread->thread, NULL);
+	free(posix_thread);
+}
+
+void raise_thread_priority(void *thread) {
+	// Real-time scheduling needs privileges desktop processes rarely have, and the default is good enough
+	// for the headless tools
+}
+
+u32 get_processor_count() {
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? (u32)count : 1;
+}
+
+struct Posix_Event {
+	pthread_mutex_t mutex;
+	pthread_cond_t condition;
+	bool signalled;
+};
+
+void *create_event() {
+	Posix_Event *event = (Posix_Event*)malloc(sizeof(Posix_Event));
+	pthread_condattr_t attributes;
+	
+	pthread_mutex_init(&event->mutex, NULL);
+	// Timeouts are measured on the same clock as time_get_tick(), so changing the wall clock doesn't affect them
+	pthread_condattr_init(&attributes);
+	pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+	pthread_cond_init(&event->condition, &attributes);
+	pthread_condattr_destroy(&attributes);
+	event->signalled = false;
+	return event;
+}
+
+void signal_event(void *event_ptr) {
+	Posix_Event *event = (Posix_Event*)event_ptr;
+	pthread_mutex_lock(&event->mutex);
+	event->signalled = true;
+	pthread_cond_signal(&event->condition);
+	pthread_mutex_unlock(&event->mutex);
+}
+
+bool wait_for_event(void *event_ptr, u32 timeout_ms) {
+	Posix_Event *event = (Posix_Event*)event_ptr;
+	struct timespec deadline;
+	int error = 0;
+	
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+	
+	pthread_mutex_lock(&event->mutex);
+	while (!event->signalled && !error) {
+		if (timeout_ms == PLATFORM_WAIT_FOREVER) pthread_cond_wait(&event->condition, &event->mutex);
+		else error = pthread_cond_timedwait(&event->condition, &event->mutex, &deadline);
+	}
+	
+	bool signalled = event->signalled;
+	event->signalled = false;
+	pthread_mutex_unlock(&event->mutex);
+	return signalled;
+}
+
+void destroy_event(void *event_ptr) {
+	Posix_Event *event = (Posix_Event*)event_ptr;
+	pthread_cond_destroy(&event->condition);
+	pthread_mutex_destroy(&event->mutex);
+	free(event);
+}
+
+void *create_mutex() {
+	pthread_mutex_t *mutex = (pthread_mutex_t*)malloc(sizeof(pthread_mutex_t));
+	pthread_mutex_init(mutex, NULL);
+	return mutex;
+}
+
+void lock_mutex(void *mutex) {
+	pthread_mutex_lock((pthread_mutex_t*)mutex);
+}
+
+void unlock_mutex(void *mutex) {
+	pthread_mutex_unlock((pthread_mutex_t*)mutex);
+}
+
+void destroy_mutex(void *mutex) {
+	pthread_mutex_destroy((pthread_mutex_t*)mutex);
+	free(mutex);
+}
+
+bool path_exists(const char *path) {
+	return access(path, F_OK) == 0;
+}
+
+bool path_exists_w(const wchar_t *path) {
+	char path_u8[1024];
+	return utf16_to_utf8(path, path_u8, sizeof(path_u8)) && path_exists(path_u8);
+}
+
+// Ticks are nanoseconds
+u64 time_get_tick() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (u64)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+float time_ticks_to_milliseconds(u64 ticks) {
+	return (float)((double)ticks / 1e6);
+}
+
+void fatal_error(const char *message, ...) {
+	char formatted[4096];
+	va_list args;
+	va_start(args, message);
+	vsnprintf(formatted, sizeof(formatted), message, args);
+	va_end(args);
+	log_error("%s\n", formatted);
+	exit(1);
+}
+
+void user_warning(const char *message, ...) {
+	char formatted[4096];
+	va_list args;
+	va_start(args, message);
+	vsnprintf(formatted, sizeof(formatted), message, args);
+	va_end(args);
+	log_warning("%s\n", formatted);
+}
+
+void user_message(const char *message, ...) {
+	char formatted[4096];
+	va_list args;
+	va_start(args, message);
+	vsnprintf(formatted, sizeof(formatted), message, args);
+	va_end(args);
+	log_info("%s\n", formatted);
+}
+#endif
@@ -0,0 +1,167 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include "platform.h"
+#include <stdlib.h>
+#include <windows.h>
+
+const u8 *map_file(const wchar_t *path, u64 *size) {
+	HANDLE file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE) return NULL;
+	
+	LARGE_INTEGER file_size;
+	HANDLE mapping = NULL;
+	const u8 *view = NULL;
+	
+	if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0) {
+		mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	}
+	
+	// The view keeps the mapping and the file open
+	if (mapping) {
+		view = (const u8*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		CloseHandle(mapping);
+	}
+	
+	CloseHandle(file);
+	*size = file_size.QuadPart;
+	return view;
+}
+
+void unmap_file(const u8 *view, u64 size) {
+	UnmapViewOfFile(view);
+}
+
+void prefetch_mapped_range(const void *address, u64 size) {
+	WIN32_MEMORY_RANGE_ENTRY range;
+	range.VirtualAddress = (void*)address;
+	range.NumberOfBytes = (SIZE_T)size;
+	// The pages are faulted in anyway if this fails
+	PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+}
+
+struct Win32_Thread {
+	HANDLE handle;
+	Thread_Entry *entry;
+	void *user_data;
+};
+
+static DWORD WINAPI win32_thread_entry(LPVOID user_data) {
+	Win32_Thread *thread = (Win32_Thread*)user_data;
+	thread->entry(thread->user_data);
+	return 0;
+}
+
+void *create_thread(Thread_Entry *entry, void *user_data) {
+	Win32_Thread *thread = (Win32_Thread*)malloc(sizeof(Win32_Thread));
+	thread->entry = entry;
+	thread->user_data = user_data;
+	thread->handle = CreateThread(NULL, 0, &win32_thread_entry, thread, 0, NULL);
+	
+	if (!thread->handle) {
+		free(thread);
+		return NULL;
+	}
+	
+	return thread;
+}
+
+void join_thread(void *thread) {
+	Win32_Thread *win32_thread = (Win32_Thread*)thread;
+	WaitForSingleObject(win32_thread->handle, INFINITE);
+	CloseHandle(win32_thread->handle);
+	free(win32_thread);
+}
+
+void raise_thread_priority(void *thread) {
+	Win32_Thread *win32_thread = (Win32_Thread*)thread;
+	SetThreadPriority(win32_thread->handle, THREAD_PRIORITY_ABOVE_NORMAL);
+}
+
+u32 get_processor_count() {
+	SYSTEM_INFO system_info;
+	GetSystemInfo(&system_info);
+	return system_info.dwNumberOfProcessors;
+}
+
+void *create_event() {
+	return CreateEvent(NULL, FALSE, FALSE, NULL);
+}
+
+void signal_event(void *event) {
+	SetEvent((HANDLE)event);
+}
+
+bool wait_for_event(void *event, u32 timeout_ms) {
+	// PLATFORM_WAIT_FOREVER is INFINITE
+	return WaitForSingleObject((HANDLE)event, timeout_ms) == WAIT_OBJECT_0;
+}
+
+void destroy_event(void *event) {
+	CloseHandle((HANDLE)event);
+}
+
+void *create_mutex() {
+	return CreateMutex(NULL, FALSE, NULL);
+}
+
+void lock_mutex(void *mutex) {
+	WaitForSingleObject((HANDLE)mutex, INFINITE);
+}
+
+void unlock_mutex(void *mutex) {
+	ReleaseMutex((HANDLE)mutex);
+}
+
+void destroy_mutex(void *mutex) {
+	CloseHandle((HANDLE)mutex);
+}
+
+u32 utf8_to_utf16(const char *in, wchar_t *out, u32 max_out) {
+	int ret = MultiByteToWideChar(CP_UTF8, 0, in, -1, out, max_out) - 1;
+	if (ret == -1) return 0;
+	return (u32)ret;
+}
+
+u32 utf16_to_utf8(const wchar_t *in, char *out, u32 max_out) {
+	int ret = WideCharToMultiByte(CP_UTF8, 0, in, -1, out, max_out, NULL, NULL) - 1;
+	if (ret == -1) return 0;
+	return (u32)ret;
+}
+
+bool path_exists(const char *path) {
+	DWORD file_attr = GetFileAttributesA(path);
+	return file_attr != INVALID_FILE_ATTRIBUTES;
+}
+
+bool path_exists_w(const wchar_t *path) {
+	DWORD file_attr = GetFileAttributesW(path);
+	return file_attr != INVALID_FILE_ATTRIBUTES;
+}
+
+u64 time_get_tick() {
+	LARGE_INTEGER ret;
+	QueryPerformanceCounter(&ret);
+	return ret.QuadPart;
+}
+
+float time_ticks_to_milliseconds(u64 ticks) {
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+	return ((double)ticks / (double)frequency.QuadPart) * 1000.f;
+}
+#endif
@@ -14,51 +14,147 @@
    limitations under the License.
 */
 #include "player.h"
-#include <windows.h>
-#include <mmdeviceapi.h>
-#include <audioclient.h>
+#include "output.h"
+#include "platform.h"
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <samplerate.h>
 #include <math.h>
 #include <string.h>
-#include <opus/opusfile.h>
-#include <FLAC/stream_decoder.h>
-#include "decoders.h"
+#include <wchar.h>
+#include "pipeline.h"
+#include "dsp.h"
 
-const CLSID g_device_enumerator_clsid = __uuidof(MMDeviceEnumerator);
-const IID g_device_enumerator_iid = __uuidof(IMMDeviceEnumerator);
-const IID g_audio_client_iid = __uuidof(IAudioClient);
-const IID g_audio_render_client_iid = __uuidof(IAudioRenderClient);
-const IID g_audio_stream_volume_iid = __uuidof(IAudioStreamVolume);
+// Decoded audio is buffered this far ahead of the device, at least
+#define PLAYER_RING_MIN_DURATION_MS 250
+// Never keep less than this many device periods queued
+#define PLAYER_MIN_LATENCY_PERIODS 2
 
-static IAudioStreamVolume *g_volume_controller;
+// Steady-state playback must not touch the heap. With PLAYER_REALTIME_CHECKS every allocation made
+// by the producer or audio thread while they are streaming is counted and reported.
+#if defined(PLAYER_REALTIME_CHECKS)
+static void check_realtime_allocations() {
+	static u32 reported_count;
+	u32 count = get_realtime_allocation_count();
+	if (count != reported_count) {
+		log_warning("%u heap allocations on the real-time audio path\n", count - reported_count);
+		reported_count = count;
+	}
+}
+
+#else
+#define check_realtime_allocations()
+#endif
 
 static struct {
-	HANDLE mutex;
-	enum Player_State state;
-	enum Codec codec;
-	void *sample_rate_converter;
+	void *mutex;
+	// Written from the UI thread, read by the audio thread
+	std::atomic<Player_State> state;
 	Player_End_Callback *end_callback;
+	Player_Track_Change_Callback *track_change_callback;
+	// Goes up with every open_track(), with the stream locked
+	std::atomic<u32> track_serial;
 	
 	// Signal to interrupt audio thread sleep and reset the audio clock
-	HANDLE interrupt_semaphore;
-	HANDLE ready_semaphore;
-	HANDLE audio_thread;
-	
-	PCM_Format format;
-	float buffer_duration;
-	
-	IMMDevice *device;
-	IMMDeviceEnumerator *device_enumerator;
-	IAudioClient *audio_client;
-	IAudioRenderClient *render_client;
-	
-	bool file_loaded;
+	void *interrupt_event;
+	void *ready_event;
+	void *audio_thread;
+	// Decodes and resamples into the ring ahead of the audio thread
+	void *producer_thread;
+	void *producer_wake_event;
+	
+	Output_Config output_config;
+	// Opened by the audio thread, which is the only one that uses it
+	Output_Device output;
+	// Written by the UI thread, picked up by the audio thread before each refill
+	Dsp_Settings_Exchange dsp_settings;
+	// Belongs to the audio thread
+	Dsp_Chain dsp;
+	// Built by the UI thread for the audio thread to pick up. g_no_convolver asks it to drop the one it has.
+	std::atomic<Convolver*> new_convolver;
+	// Dropped by the audio thread for the producer to free, since freeing one can take a while
+	std::atomic<Convolver*> old_convolver;
+	// Dropped by a device reopen while the producer still had the last one to free. Belongs to the audio
+	// thread, which hands it over as soon as old_convolver is free.
+	Convolver *retired_convolver;
+	// Held while a convolver is built, so the last file asked for always wins
+	void *convolution_mutex;
+	// What the convolver was last built from, to build it again when the rate changes. Empty for none.
+	wchar_t convolution_path[512];
+	// Builds the convolver again at the device's rate when signalled
+	void *convolution_thread;
+	void *convolution_event;
+	
+	// Rates the device can play as they are, less any it then failed to open at
+	std::atomic<u32> native_rates;
+	// The fastest rate the ring has room for
+	u32 max_sample_rate;
+	// The device couldn't be opened at the rate the ring is at, so the producer has to start again at
+	// this one. 0 when there's nothing to do.
+	std::atomic<u32> fallback_sample_rate;
+	// The open device's format, for other threads
+	std::atomic<u32> output_sample_rate;
+	std::atomic<u32> output_sample_type;
+	std::atomic<u32> output_bits;
+	std::atomic<u32> output_buffer_frames;
+	// What went to the device last was exactly what the file holds
+	std::atomic<bool> bit_perfect;
+	
+	// Frames the audio thread keeps queued in the device. Starts at the target latency and only
+	// grows, after an underrun.
+	std::atomic<u32> latency_frames;
+	std::atomic<u32> underrun_count;
+	// When the last seek, skip, pause or resume was asked for
+	std::atomic<u64> interrupt_tick;
+	// How long the audio thread took to get the result of the last one to the device
+	std::atomic<u32> interrupt_latency_us;
+	std::atomic<u32> interrupt_count;
 } g_stream;
 
-static Decoder g_decoder;
+// Only touched with the stream locked, apart from the consumer side which belongs to the audio thread
+static Playback_Pipeline g_pipeline;
+
+static Convolver g_no_convolver;
+
+// Everything the UI polls, published with a sequence lock by whoever holds the stream lock.
+// Readers never block and never hold up decoding or the device.
+static struct {
+	std::atomic<u32> sequence;
+	std::atomic<u32> codec;
+	std::atomic<u32> sample_rate;
+	std::atomic<u32> output_sample_rate;
+	// Decoder position after the last chunk sent to the ring
+	std::atomic<u64> decoded_sample;
+	std::atomic<u64> total_samples;
+	// Decoded frames the resampler was still holding
+	std::atomic<u32> pending_frames;
+	// Ring write index at the time decoded_sample was taken
+	std::atomic<u64> ring_write_index;
+	// The track before a splice, until the audio thread reaches splice_index
+	std::atomic<u64> splice_index;
+	std::atomic<u32> previous_codec;
+	std::atomic<u32> previous_sample_rate;
+	std::atomic<u64> previous_total_samples;
+	std::atomic<bool> file_loaded;
+} g_published;
+
+// Updated as the threads go, without locks. Each one has a single writer.
+static struct {
+	u64 start_tick;
+	// Producer thread
+	Telemetry_Recorder decode;
+	Telemetry_Recorder resample;
+	// Audio thread
+	Telemetry_Recorder dsp;
+	Telemetry_Recorder refill;
+	Telemetry_Recorder wakeup_interval;
+	std::atomic<u32> late_wakeup_count;
+	// Negative until measured
+	std::atomic<float> ring_ms;
+	std::atomic<float> ring_low_ms;
+	std::atomic<float> device_ms;
+	std::atomic<float> device_low_ms;
+} g_telemetry;
 
 static inline const char *get_codec_name(enum Codec codec) {
 	static const char *opus = "OPUS";
@@ -76,206 +172,626 @@ static inline const char *get_codec_name(enum Codec codec) {
 	}
 }
 
-static inline bool get_decoder_functions(enum Codec codec) {
-	switch (codec) {
-		
-		case CODEC_FLAC:
-		g_decoder.open_func = &open_flac;
-		g_decoder.decode_func = &decode_flac;
-		g_decoder.get_sample_func = &get_sample_flac;
-		g_decoder.seek_func = &seek_flac;
-		g_decoder.close_func = &close_flac;
-		break;
-		
-		case CODEC_MP3:
-		g_decoder.open_func = &open_mp3;
-		g_decoder.decode_func = &decode_mp3;
-		g_decoder.get_sample_func = &get_sample_mp3;
-		g_decoder.seek_func = &seek_mp3;
-		g_decoder.close_func = &close_mp3;
-		break;
-		
-		case CODEC_OPUS:
-		g_decoder.open_func = &open_opus;
-		g_decoder.decode_func = &decode_opus;
-		g_decoder.get_sample_func = &get_sample_opus;
-		g_decoder.seek_func = &seek_opus;
-		g_decoder.close_func = &close_opus;
-		break;
+static inline bool is_file_loaded() {
+	return g_pipeline.file_loaded.load(std::memory_order_relaxed);
+}
+
+static inline void lock_stream() {
+	lock_mutex(g_stream.mutex);
+}
+
+static inline void unlock_stream() {
+	unlock_mutex(g_stream.mutex);
+}
+
+// Needs the stream locked, which makes this the only writer
+static void publish_stream_state() {
+	const std::memory_order relaxed = std::memory_order_relaxed;
+	u32 sequence = g_published.sequence.load(relaxed);
+	bool loaded = is_file_loaded();
+	
+	// Odd while writing
+	g_published.sequence.store(sequence + 1, relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	
+	g_published.codec.store(g_pipeline.codec, relaxed);
+	g_published.sample_rate.store(g_pipeline.format.sample_rate, relaxed);
+	g_published.output_sample_rate.store(g_pipeline.output_format.sample_rate, relaxed);
+	g_published.decoded_sample.store(loaded ? g_pipeline.decoded_sample : 0, relaxed);
+	g_published.total_samples.store(loaded ? g_pipeline.format.total_samples : 0, relaxed);
+	g_published.pending_frames.store(g_pipeline.pending_frames, relaxed);
+	g_published.ring_write_index.store(g_pipeline.ring.write_index.load(relaxed), relaxed);
+	g_published.splice_index.store(g_pipeline.splice_index.load(relaxed), relaxed);
+	g_published.previous_codec.store(g_pipeline.previous_codec, relaxed);
+	g_published.previous_sample_rate.store(g_pipeline.previous_format.sample_rate, relaxed);
+	g_published.previous_total_samples.store(g_pipeline.previous_format.total_samples, relaxed);
+	g_published.file_loaded.store(loaded, relaxed);
+	
+	g_published.sequence.store(sequence + 2, std::memory_order_release);
+}
+
+void get_playback_snapshot(Playback_Snapshot *out) {
+	const std::memory_order relaxed = std::memory_order_relaxed;
+	u32 sequence;
+	u32 sample_rate, output_sample_rate, pending_frames, codec;
+	u64 decoded_sample, total_samples, ring_write_index;
+	u64 splice_index, previous_total_samples;
+	u32 previous_codec, previous_sample_rate;
+	bool loaded;
+	
+	do {
+		sequence = g_published.sequence.load(std::memory_order_acquire);
+		if (sequence & 1) continue;
 		
-		case CODEC_WAV:
-		g_decoder.open_func = &open_wav;
-		g_decoder.decode_func = &decode_wav;
-		g_decoder.get_sample_func = &get_sample_wav;
-		g_decoder.seek_func = &seek_wav;
-		g_decoder.close_func = &close_wav;
-		break;
+		codec = g_published.codec.load(relaxed);
+		sample_rate = g_published.sample_rate.load(relaxed);
+		output_sample_rate = g_published.output_sample_rate.load(relaxed);
+		decoded_sample = g_published.decoded_sample.load(relaxed);
+		total_samples = g_published.total_samples.load(relaxed);
+		pending_frames = g_published.pending_frames.load(relaxed);
+		ring_write_index = g_published.ring_write_index.load(relaxed);
+		splice_index = g_published.splice_index.load(relaxed);
+		previous_codec = g_published.previous_codec.load(relaxed);
+		previous_sample_rate = g_published.previous_sample_rate.load(relaxed);
+		previous_total_samples = g_published.previous_total_samples.load(relaxed);
+		loaded = g_published.file_loaded.load(relaxed);
 		
-		default: return false;
+		std::atomic_thread_fence(std::memory_order_acquire);
+	} while ((sequence & 1) || (sequence != g_published.sequence.load(relaxed)));
+	
+	out->state = g_stream.state.load(relaxed);
+	out->codec = (enum Codec)codec;
+	out->file_loaded = loaded;
+	out->position = 0.f;
+	out->length = 0.f;
+	
+	if (!loaded || !sample_rate) return;
+	
+	// Whatever was written to the ring up to the snapshot and not read yet still has to be heard
+	u64 read_index = MAX(g_pipeline.ring.read_index.load(std::memory_order_acquire), 
+						 g_pipeline.ring.discard_index.load(std::memory_order_acquire));
+	u64 buffered_frames = ring_write_index > read_index ? ring_write_index - read_index : 0;
+	
+	// The decoder has moved on to the next track, but the end of the last one is still playing
+	if (splice_index != UINT64_MAX && read_index < splice_index && previous_sample_rate && output_sample_rate) {
+		out->codec = (enum Codec)previous_codec;
+		out->length = (float)previous_total_samples / (float)previous_sample_rate / 2.f;
+		out->position = MAX(out->length - (splice_index - read_index) / (float)output_sample_rate, 0.f);
+		return;
 	}
 	
-	return true;
+	float position = decoded_sample / (float)sample_rate / 2.f;
+	position -= pending_frames / (float)sample_rate;
+	if (output_sample_rate) position -= buffered_frames / (float)output_sample_rate;
+	
+	out->position = MAX(position, 0.f);
+	out->length = (float)total_samples / (float)sample_rate / 2.f;
 }
 
-static inline bool is_file_loaded() {
-	return g_stream.file_loaded;
+// request_tick is when whatever needs the reset was asked for, so its latency includes getting the first chunk ready
+static inline void reset_audio_clock(u64 request_tick) {
+	g_stream.interrupt_tick.store(request_tick);
+	signal_event(g_stream.interrupt_event);
 }
 
-static inline void reset_audio_clock() {
-	ReleaseSemaphore(g_stream.interrupt_semaphore, 1, NULL);
+static inline void wake_producer() {
+	signal_event(g_stream.producer_wake_event);
 }
 
-enum Codec find_codec_from_file_name(const wchar_t *path) {
-	wchar_t *extension = wcsrchr((wchar_t*)path, '.');
-	
-	if (!extension) {
-		return CODEC_NONE;
-	}
-	else if (!wcscmp(extension, L".mp3")) {
-		return CODEC_MP3;
-	}
-	else if (!wcscmp(extension, L".opus") || !wcscmp(extension, L".ogg")) {
-		return CODEC_OPUS;
+static void free_convolver(Convolver *convolver) {
+	if (!convolver || convolver == &g_no_convolver) return;
+	convolver->free();
+	free(convolver);
+}
+
+// Swaps in whatever set_convolution_file() left. The old one can only be handed back once the
+// producer has freed the one before it, so until then the new one waits.
+static void take_new_convolver() {
+	if (g_stream.retired_convolver && !g_stream.old_convolver.load(std::memory_order_acquire)) {
+		g_stream.old_convolver.store(g_stream.retired_convolver, std::memory_order_release);
+		g_stream.retired_convolver = NULL;
+		wake_producer();
 	}
-	else if (!wcscmp(extension, L".wav")) {
-		return CODEC_WAV;
+	
+	if (!g_stream.new_convolver.load(std::memory_order_relaxed) || g_stream.old_convolver.load(std::memory_order_acquire)) return;
+	
+	Convolver *convolver = g_stream.new_convolver.exchange(NULL, std::memory_order_acq_rel);
+	if (!convolver) return;
+	
+	// Built for the rate the device was at before it was reopened
+	if (convolver != &g_no_convolver && convolver->sample_rate != g_stream.dsp.sample_rate) {
+		g_stream.old_convolver.store(convolver, std::memory_order_release);
+		wake_producer();
+		signal_event(g_stream.convolution_event);
+		return;
 	}
-	else if (!wcscmp(extension, L".flac")) {
-		return CODEC_FLAC;
+	
+	Convolver *old = g_stream.dsp.set_convolver(convolver == &g_no_convolver ? NULL : convolver);
+	if (old) {
+		g_stream.old_convolver.store(old, std::memory_order_release);
+		wake_producer();
 	}
-	else {
-		return CODEC_NONE;
-	}	
 }
 
-bool stream_to_buffer(const PCM_Format *output_format, int num_frames, float *output_buffer);
-
 static void close_stream_source() {
-	g_decoder.close_func();
-	g_stream.file_loaded = false;
+	g_pipeline.close();
+	publish_stream_state();
 }
 
+// The threads are still running when this is called at exit, so only the track is closed
 static void clean_up() {
-	CloseHandle(g_stream.interrupt_semaphore);
-	CloseHandle(g_stream.mutex);
-	if (g_stream.audio_client) g_stream.audio_client->Release();
-	if (g_stream.render_client) g_stream.render_client->Release();
-	if (g_stream.device) g_stream.device->Release();
-	if (g_stream.device_enumerator) g_stream.device_enumerator->Release();
+	lock_stream();
 	if (is_file_loaded()) close_stream_source();
-	if (g_volume_controller) g_volume_controller->Release();
-}
-
-DWORD audio_thread_entry(LPVOID user_data) {
-	WAVEFORMATEX *mix_format = NULL;
-	u32 num_buffer_frames;
-	u8 *output_buffer;
-	DWORD flags = 0;
-	PCM_Format pcm_format;
-	bool format_is_float;
-	
-	CoCreateInstance(g_device_enumerator_clsid, NULL, 
-					 CLSCTX_ALL, g_device_enumerator_iid, (void**)&g_stream.device_enumerator);
-	g_stream.device_enumerator->GetDefaultAudioEndpoint(eRender, eConsole, &g_stream.device);
-	g_stream.device->Activate(__uuidof(g_stream.audio_client), CLSCTX_ALL, NULL, (void**)&g_stream.audio_client);
-	g_stream.audio_client->GetMixFormat(&mix_format);
-	
-	if (mix_format->cbSize >= 22) {
-		WAVEFORMATEXTENSIBLE *mix_format_ex = (WAVEFORMATEXTENSIBLE*)mix_format;
-		GUID sub_format = mix_format_ex->SubFormat;
-		format_is_float = sub_format.Data1 == 3;
+	unlock_stream();
+}
+
+static inline u32 ticks_to_us(u64 ticks) {
+	return (u32)(time_ticks_to_milliseconds(ticks) * 1000.f);
+}
+
+// Needs the stream locked. Only called by the producer, which makes it the only writer of its telemetry.
+static bool produce_audio_chunk() {
+	if (!g_pipeline.produce()) return false;
+	if (g_pipeline.decode_ticks) g_telemetry.decode.add(ticks_to_us(g_pipeline.decode_ticks));
+	if (g_pipeline.resample_ticks) g_telemetry.resample.add(ticks_to_us(g_pipeline.resample_ticks));
+	publish_stream_state();
+	return true;
+}
+
+// Seconds into the audible track to a sample of it
+static u64 get_audible_sample(float seconds) {
+	u32 sample_rate = g_pipeline.splice_index.load() != UINT64_MAX ?
+		g_pipeline.previous_format.sample_rate : g_pipeline.format.sample_rate;
+	return (u64)(sample_rate * seconds) * 2;
+}
+
+// The audio thread only counts underruns, since logging can block on the console right when it is
+// already late. The producer reports them.
+static void report_underruns() {
+	static u32 reported_count;
+	u32 count = g_stream.underrun_count.load();
+	u32 sample_rate = g_stream.output_sample_rate.load();
+	
+	if (count != reported_count && sample_rate) {
+		log_warning("Audio underrun %u, now keeping %llums queued\n", count, 
+					(g_stream.latency_frames.load() * 1000ull) / sample_rate);
+		reported_count = count;
 	}
+}
+
+static void producer_thread_entry(void *user_data) {
+	// At the fastest rate, which makes it the shortest the ring can last
+	const u64 ring_duration_ms = ((u64)g_pipeline.ring.capacity * 1000) / g_stream.max_sample_rate;
+	const u32 wait_ms = (u32)MAX(ring_duration_ms / 4, 1);
 	
-	log_info("Endpoint sample rate: %dHz\n", mix_format->nSamplesPerSec);
+	while (1) {
+		wait_for_event(g_stream.producer_wake_event, wait_ms);
+		
+		Convolver *old_convolver = g_stream.old_convolver.load(std::memory_order_acquire);
+		if (old_convolver) {
+			free_convolver(old_convolver);
+			g_stream.old_convolver.store(NULL, std::memory_order_release);
+		}
+		
+		// The audio thread couldn't get the device to the ring's rate. Start again at the rate it is at,
+		// from what was heard last.
+		u32 fallback_sample_rate = g_stream.fallback_sample_rate.load();
+		if (fallback_sample_rate) {
+			float position = get_playback_position();
+			lock_stream();
+			g_pipeline.set_output_rate(fallback_sample_rate, is_file_loaded() ? get_audible_sample(position) : 0);
+			publish_stream_state();
+			unlock_stream();
+			g_stream.fallback_sample_rate.store(0);
+		}
+		
+		// The audio thread can't call these itself since it would block on opening the next track. Taken
+		// with the stream locked so the serial is the one the events belong to.
+		if (g_pipeline.track_changed.load() || g_pipeline.track_ended.load()) {
+			float previous_length = 0.f;
+			
+			lock_stream();
+			bool track_changed = g_pipeline.track_changed.exchange(false);
+			bool track_ended = g_pipeline.track_ended.exchange(false);
+			u32 track_serial = g_stream.track_serial.load();
+			if (track_changed) {
+				const PCM_Format *previous = &g_pipeline.previous_format;
+				g_pipeline.close_previous_track();
+				previous_length = previous->sample_rate ? previous->total_samples / (float)previous->sample_rate / 2.f : 0.f;
+			}
+			unlock_stream();
+			
+			if (track_changed && g_stream.track_change_callback) g_stream.track_change_callback(previous_length, track_serial);
+			if (track_ended && g_stream.end_callback) g_stream.end_callback(track_serial);
+		}
+		
+		// Lock per chunk so opening and seeking never wait on a full refill
+		bool produced;
+		do {
+			lock_stream();
+			BEGIN_REALTIME_SECTION();
+			produced = produce_audio_chunk();
+			END_REALTIME_SECTION();
+			unlock_stream();
+		} while (produced);
+		
+		check_realtime_allocations();
+		report_underruns();
+	}
+}
+
+static inline u32 frames_to_ms(u64 frames, u32 sample_rate) {
+	return (u32)((frames * 1000) / sample_rate);
+}
+
+// Pipeline_Rate_Function. Tracks play at their own rate when the device can take it as it is and the
+// ring has room for it. Anything else is resampled to whatever the device is at already.
+static u32 choose_output_rate(u32 input_rate, u32 output_rate) {
+	if (!g_stream.output_config.match_track_rate || input_rate > g_stream.max_sample_rate) return output_rate;
+	return (g_stream.native_rates.load() & get_output_rate_bit(input_rate)) ? input_rate : output_rate;
+}
+
+// Needs convolution_mutex locked. NULL drops the convolver.
+static bool load_convolver(const wchar_t *path) {
+	Convolver *convolver = &g_no_convolver;
 	
-	DEBUG_ASSERT(format_is_float);
+	if (path) {
+		Impulse_Response impulse_response = {};
+		if (!load_impulse_response(path, g_stream.output_sample_rate.load(), &impulse_response)) return false;
+		
+		convolver = (Convolver*)calloc(1, sizeof(Convolver));
+		bool ok = convolver->init(&impulse_response);
+		impulse_response.free();
+		
+		if (!ok) {
+			free(convolver);
+			return false;
+		}
+	}
 	
-	pcm_format.sample_rate = mix_format->nSamplesPerSec;
-	pcm_format.sample_type = PCM_TYPE_F32;
-	pcm_format.sample_size = 4;
+	// Whatever the audio thread didn't get round to taking is out of date
+	free_convolver(g_stream.new_convolver.exchange(convolver, std::memory_order_acq_rel));
+	return true;
+}
+
+// Loading an impulse response takes far too long for the audio thread, and would hold up decoding
+static void convolution_thread_entry(void *user_data) {
+	while (1) {
+		wait_for_event(g_stream.convolution_event, PLATFORM_WAIT_FOREVER);
+		
+		lock_mutex(g_stream.convolution_mutex);
+		if (g_stream.convolution_path[0]) load_convolver(g_stream.convolution_path);
+		unlock_mutex(g_stream.convolution_mutex);
+	}
+}
+
+static void publish_output_format() {
+	const Output_Format *format = &g_stream.output.format;
+	g_stream.output_sample_type.store(format->sample_type);
+	g_stream.output_bits.store(format->bits);
+	g_stream.output_buffer_frames.store(format->buffer_frames);
+	g_stream.output_sample_rate.store(format->sample_rate);
+}
+
+// Keeps the player running, silently, rather than taking the whole program down
+static void open_output(u32 sample_rate) {
+	Output_Config config = g_stream.output_config;
+	config.sample_rate = sample_rate;
+	
+	if (!g_stream.output.open(&config)) {
+		log_error("Failed to open the %s output, using the null output\n", get_output_backend_name(config.backend));
+		config.backend = OUTPUT_BACKEND_NULL;
+		config.file_path = NULL;
+		USER_ASSERT(g_stream.output.open(&config), "Failed to open an audio output");
+	}
 	
-	g_stream.audio_client->Initialize(AUDCLNT_SHAREMODE_SHARED, 0, (u64)1e7, 0, mix_format, NULL);
-	g_stream.audio_client->GetBufferSize(&num_buffer_frames);
-	g_stream.audio_client->GetService(g_audio_render_client_iid, (void**)&g_stream.render_client);
-	g_stream.audio_client->GetService(g_audio_stream_volume_iid, (void**)&g_volume_controller);
+	publish_output_format();
+}
+
+// The producer has moved on to a track at another rate. Everything that depends on the rate starts over.
+static void change_output_rate(u32 sample_rate) {
+	Output_Device *output = &g_stream.output;
+	const u32 previous_rate = output->format.sample_rate;
+	Output_Config config = g_stream.output_config;
+	config.sample_rate = sample_rate;
+	
+	log_info("Reopening the device at %uHz\n", sample_rate);
+	output->close();
+	if (output->open(&config)) publish_output_format();
+	else open_output(previous_rate);
+	
+	if (output->format.sample_rate != sample_rate) {
+		log_warning("The device can't be opened at %uHz, resampling to %uHz\n", sample_rate, output->format.sample_rate);
+		g_stream.native_rates.fetch_and(~get_output_rate_bit(sample_rate));
+		g_stream.fallback_sample_rate.store(output->format.sample_rate);
+		wake_producer();
+	}
+	
+	// The filters, ramps and lookahead are all in frames
+	Dsp_Settings settings = g_stream.dsp.settings;
+	Convolver *convolver = g_stream.dsp.set_convolver(NULL);
+	g_stream.dsp.free();
+	g_stream.dsp.init(output->format.sample_rate, &settings);
+	
+	// Freed by the producer, like any other the audio thread drops. One that is waiting to be taken is
+	// built again when take_new_convolver() turns it down.
+	if (convolver) {
+		if (!g_stream.old_convolver.load(std::memory_order_acquire)) {
+			g_stream.old_convolver.store(convolver, std::memory_order_release);
+			wake_producer();
+		}
+		else {
+			g_stream.retired_convolver = convolver;
+		}
+		signal_event(g_stream.convolution_event);
+	}
+}
+
+// How much the audio thread keeps queued in the open device
+struct Device_Queue {
+	u32 buffer_frames;
+	u32 period_frames;
+	u32 min_latency_frames;
+	u32 latency_frames;
+	bool is_virtual;
+};
+
+static void init_device_queue(Device_Queue *queue, u32 latency_ms) {
+	const Output_Format *format = &g_stream.output.format;
+	u32 latency_frames = (u32)(((u64)format->sample_rate * latency_ms) / 1000);
+	
+	// A device on a virtual clock plays everything the moment it gets it, so it can't run dry and
+	// there's nothing to gain from keeping it short
+	queue->is_virtual = g_stream.output.backend == OUTPUT_BACKEND_NULL && g_stream.output_config.clock == OUTPUT_CLOCK_VIRTUAL;
+	queue->buffer_frames = format->buffer_frames;
+	queue->period_frames = MAX(format->period_frames, 1);
+	queue->min_latency_frames = MIN(queue->period_frames * PLAYER_MIN_LATENCY_PERIODS, queue->buffer_frames);
+	queue->latency_frames = queue->is_virtual ? queue->buffer_frames : 
+		MIN(MAX(latency_frames, queue->min_latency_frames), queue->buffer_frames);
+	g_stream.latency_frames.store(queue->latency_frames);
+	
+	log_info("Buffer duration: %ums, target latency: %ums, %s\n", frames_to_ms(queue->buffer_frames, format->sample_rate),
+			 frames_to_ms(queue->latency_frames, format->sample_rate), g_stream.output.is_event_driven() ? "event driven" : "timed");
+}
+
+static void audio_thread_entry(void *user_data) {
+	Output_Device *output = &g_stream.output;
+	PCM_Format pcm_format = {};
+	Device_Queue queue;
 	
-	ReleaseSemaphore(g_stream.ready_semaphore, 1, NULL);
-	g_stream.render_client->GetBuffer(num_buffer_frames, &output_buffer);
-	g_stream.render_client->ReleaseBuffer(num_buffer_frames, 0);
+	open_output(g_stream.output_config.sample_rate);
+	init_device_queue(&queue, g_stream.output_config.target_latency_ms);
 	
-	const DWORD buffer_duration_ms = (mix_format->nSamplesPerSec*1000) / num_buffer_frames;
-	log_info("Buffer duration: %dms\n", buffer_duration_ms);
-	g_stream.buffer_duration = buffer_duration_ms;
+	u32 sample_rate = output->format.sample_rate;
+	pcm_format.sample_rate = sample_rate;
+	pcm_format.sample_type = PCM_TYPE_F32;
+	pcm_format.sample_size = 4;
 	
-	CoTaskMemFree(mix_format);
+	// The ring has to have room for the fastest rate a track can make the device go to
+	g_stream.native_rates.store(output->format.native_rates);
+	g_stream.max_sample_rate = sample_rate;
+	for (u32 i = 0; g_stream.output_config.match_track_rate && i < OUTPUT_RATE_COUNT; ++i) {
+		if (output->format.native_rates & (1 << i)) g_stream.max_sample_rate = MAX(g_stream.max_sample_rate, g_output_rates[i]);
+	}
 	
-	g_stream.audio_client->Start();
+	// Decoding stays well ahead of the device, so a slow chunk never reaches the speakers even with a
+	// short device queue, and the queue can grow into the whole device buffer
+	const u32 buffer_duration_ms = frames_to_ms(queue.buffer_frames, sample_rate);
+	const u32 ring_duration_ms = MAX(PLAYER_RING_MIN_DURATION_MS, buffer_duration_ms * 2);
+	g_pipeline.choose_output_rate = &choose_output_rate;
+	g_pipeline.init(&pcm_format, (u32)(((u64)g_stream.max_sample_rate * ring_duration_ms) / 1000), (float)buffer_duration_ms);
+	
+	const Dsp_Settings *dsp_settings;
+	g_stream.dsp_settings.read(&dsp_settings);
+	g_stream.dsp.init(sample_rate, dsp_settings);
+	
+	signal_event(g_stream.ready_event);
+	output->write_silence(queue.latency_frames);
+	output->start();
+	
+	u32 wait_ms = MAX(frames_to_ms(queue.latency_frames, sample_rate) / 2, 1);
+	// Audio from the ring has been queued since the device was last reset, so running dry is an underrun
+	bool device_has_audio = false;
+	// A seek, skip, pause or resume hasn't reached the device yet
+	bool interrupt_pending = false;
+	u64 last_wakeup_tick = 0;
+	// How long the audio queued at the last refill lasts, or 0 if there wasn't any to run out
+	float last_queued_ms = 0.f;
 	
 	while (1) {
 		u32 frame_padding;
 		u32 available_frames = 0;
+		u32 frame_count = 0;
+		bool playing;
 		
 		// If the sleep is interrupted, we need to reset the audio clock
-		if (WaitForSingleObject(g_stream.interrupt_semaphore, buffer_duration_ms / 2) != WAIT_TIMEOUT) {
-			g_stream.audio_client->Stop();
-			g_stream.audio_client->Reset();
-			g_stream.audio_client->Start();
+		if (output->wait(g_stream.interrupt_event, wait_ms)) {
+			output->stop();
+			output->start();
+			g_stream.dsp.reset();
+			device_has_audio = false;
+			interrupt_pending = true;
+			last_queued_ms = 0.f;
 		}
 		
-		g_stream.audio_client->GetCurrentPadding(&frame_padding);
-		available_frames = num_buffer_frames - frame_padding;
+		// The producer has moved on to a track at another rate. Unless the device has already failed to
+		// open at it and the producer is starting again at the old one.
+		const u32 ring_sample_rate = g_pipeline.ring_sample_rate.load(std::memory_order_acquire);
+		if (ring_sample_rate != sample_rate && !g_stream.fallback_sample_rate.load()) {
+			const u32 latency_ms = frames_to_ms(queue.latency_frames, sample_rate);
+			change_output_rate(ring_sample_rate);
+			init_device_queue(&queue, latency_ms);
+			sample_rate = output->format.sample_rate;
+			
+			output->write_silence(queue.latency_frames);
+			output->start();
+			device_has_audio = false;
+			last_queued_ms = 0.f;
+		}
 		
-		// Need this to make sure the buffer is at least 120ms for opus decoding.
-		if (g_stream.codec == CODEC_OPUS) while (available_frames < (2 * 120 * (48000/1000))) {
-			g_stream.audio_client->GetCurrentPadding(&frame_padding);
-			available_frames = num_buffer_frames - frame_padding;
+		const u64 wakeup_tick = time_get_tick();
+		if (last_wakeup_tick) {
+			float interval_ms = time_ticks_to_milliseconds(wakeup_tick - last_wakeup_tick);
+			g_telemetry.wakeup_interval.add((u32)(interval_ms * 1000.f));
+			if (interval_ms > last_queued_ms * 0.75f && last_queued_ms > 0.f) {
+				g_telemetry.late_wakeup_count.fetch_add(1, std::memory_order_relaxed);
+			}
 		}
+		last_wakeup_tick = wakeup_tick;
+		
+		BEGIN_REALTIME_SECTION();
+		
+		if (g_stream.dsp_settings.read(&dsp_settings)) g_stream.dsp.apply_settings(dsp_settings);
+		take_new_convolver();
 		
-		g_stream.render_client->GetBuffer(available_frames, &output_buffer);
+		frame_padding = output->get_queued_frames();
+		// Nothing in the ring can be played until the device is at its rate
+		playing = is_file_loaded() && g_stream.state.load(std::memory_order_relaxed) == PLAYER_STATE_PLAYING &&
+			g_pipeline.ring_sample_rate.load(std::memory_order_acquire) == sample_rate;
 		
-		if (stream_to_buffer(&pcm_format, available_frames, (float*)output_buffer)) {
-			if (g_stream.end_callback) g_stream.end_callback();
+		// The device ran dry with audio waiting for it, so we woke up too late. Keep more queued from now on.
+		// An empty ring is the end of the queue or the decoder falling behind, neither of which this fixes.
+		if (playing && device_has_audio && !frame_padding && !queue.is_virtual && g_pipeline.ring.get_fill()) {
+			if (queue.latency_frames < queue.buffer_frames) {
+				queue.latency_frames = MIN(queue.latency_frames + MAX(queue.latency_frames / 2, queue.period_frames), queue.buffer_frames);
+				g_stream.latency_frames.store(queue.latency_frames);
+			}
+			// After latency_frames, so the producer's report has the new one
+			g_stream.underrun_count.fetch_add(1);
 		}
 		
-		g_stream.render_client->ReleaseBuffer(available_frames, 0);
+		// Lows only count while audio is flowing. The ring runs dry at the end of every track.
+		const float ring_ms = (g_pipeline.ring.get_fill() * 1000.f) / sample_rate;
+		const float device_ms = (frame_padding * 1000.f) / sample_rate;
+		g_telemetry.ring_ms.store(ring_ms, std::memory_order_relaxed);
+		g_telemetry.device_ms.store(device_ms, std::memory_order_relaxed);
+		if (playing && device_has_audio && !queue.is_virtual) {
+			float ring_low_ms = g_telemetry.ring_low_ms.load(std::memory_order_relaxed);
+			float device_low_ms = g_telemetry.device_low_ms.load(std::memory_order_relaxed);
+			bool at_end = g_pipeline.end_index.load(std::memory_order_relaxed) != UINT64_MAX;
+			
+			if (!at_end && (ring_ms < ring_low_ms || ring_low_ms < 0.f)) g_telemetry.ring_low_ms.store(ring_ms, std::memory_order_relaxed);
+			if (device_ms < device_low_ms || device_low_ms < 0.f) g_telemetry.device_low_ms.store(device_ms, std::memory_order_relaxed);
+		}
+		
+		available_frames = queue.latency_frames - MIN(frame_padding, queue.latency_frames);
+		
+		// If we aren't playing, fill the device with silence
+		if (!playing) {
+			frame_count = available_frames;
+			output->write_silence(frame_count);
+			device_has_audio = false;
+		}
+		else {
+			// Only hand over what has been decoded. The rest is filled next time around.
+			frame_count = MIN(available_frames, g_pipeline.ring.get_fill());
+			float *output_buffer = frame_count ? output->get_buffer(frame_count) : NULL;
+			
+			if (output_buffer) {
+				u32 read = g_pipeline.read(output_buffer, frame_count);
+				// Only happens if the ring was flushed while we were reading
+				if (read < frame_count) memset(&output_buffer[read * 2], 0, (frame_count - read) * 2 * sizeof(float));
+				
+				u64 dsp_start_tick = time_get_tick();
+				g_stream.dsp.process(output_buffer, frame_count);
+				g_telemetry.dsp.add(ticks_to_us(time_get_tick() - dsp_start_tick));
+				
+				// Integers the device holds exactly, untouched since the file, would only get noise from dither
+				const bool spliced = g_pipeline.splice_index.load(std::memory_order_relaxed) != UINT64_MAX;
+				u32 source_bits = spliced ? g_pipeline.previous_source_bits.load(std::memory_order_relaxed) :
+					g_pipeline.ring_source_bits.load(std::memory_order_relaxed);
+				bool exact = source_bits && source_bits <= output->format.bits && g_stream.dsp.is_bypassed();
+				
+				output->release_buffer(frame_count, false, g_stream.output_config.dither && !exact);
+				g_stream.bit_perfect.store(exact, std::memory_order_relaxed);
+				device_has_audio = true;
+			}
+			else {
+				// Skips anything flushed by a seek and still notices the end of a track
+				frame_count = 0;
+				g_pipeline.read(NULL, 0);
+			}
+			
+			// Most wakeups only move a period or two, so leave the producer be until there's room for real work
+			if (g_pipeline.ring.get_fill() <= g_pipeline.ring.capacity - g_pipeline.ring.capacity / 4) wake_producer();
+		}
+		
+		// Paused silence counts too, since that is what was asked for
+		if (interrupt_pending && (frame_count || !playing)) {
+			u64 elapsed = time_get_tick() - g_stream.interrupt_tick.load();
+			g_stream.interrupt_latency_us.store((u32)(time_ticks_to_milliseconds(elapsed) * 1000.f));
+			g_stream.interrupt_count.fetch_add(1);
+			interrupt_pending = false;
+		}
+		
+		// A device on a virtual clock plays it all at once, so it never runs out
+		last_queued_ms = device_has_audio && !queue.is_virtual ? ((frame_padding + frame_count) * 1000.f) / sample_rate : 0.f;
+		g_telemetry.refill.add(ticks_to_us(time_get_tick() - wakeup_tick));
+		
+		END_REALTIME_SECTION();
+		
+		if (output->is_event_driven()) {
+			// The device wakes us each period. This only matters if it stops signalling.
+			wait_ms = MAX(frames_to_ms(queue.latency_frames, sample_rate), 10);
+		}
+		else {
+			// Come back when half of what the device has queued is played. Asked again rather than added up,
+			// since a device on a virtual clock has played it all already.
+			u32 queued_ms = frames_to_ms(output->get_queued_frames(), sample_rate);
+			wait_ms = MIN(MAX(queued_ms / 2, 1), MAX(frames_to_ms(queue.latency_frames, sample_rate) / 2, 1));
+		}
 	}
-	
-	g_stream.audio_client->Stop();
-	if (!format_is_float) free(output_buffer);
-	
-	return 0;
 }
 
-void start_playback_stream(Player_End_Callback *end_callback) {
-	int error;
-	g_stream.mutex = CreateMutex(NULL, FALSE, NULL);
+void start_playback_stream(Player_End_Callback *end_callback, Player_Track_Change_Callback *track_change_callback, 
+						   const Output_Config *output_config) {
+	g_stream.mutex = create_mutex();
 	g_stream.end_callback = end_callback;
-	g_stream.interrupt_semaphore = CreateSemaphore(NULL, 0, 1, NULL);
-	g_stream.ready_semaphore = CreateSemaphore(NULL, 0, 1, NULL);
-	g_stream.sample_rate_converter = src_new(SRC_SINC_BEST_QUALITY, 2, &error);
-	g_stream.audio_thread = CreateThread(NULL, 256<<10, &audio_thread_entry, NULL, 0, NULL);
+	g_stream.track_change_callback = track_change_callback;
+	g_stream.interrupt_event = create_event();
+	g_stream.ready_event = create_event();
+	g_stream.producer_wake_event = create_event();
+	g_stream.convolution_mutex = create_mutex();
+	g_stream.convolution_event = create_event();
+	
+	if (output_config) g_stream.output_config = *output_config;
+	if (!g_stream.output_config.buffer_duration_ms) g_stream.output_config.buffer_duration_ms = OUTPUT_DEFAULT_BUFFER_MS;
+	if (!g_stream.output_config.target_latency_ms) g_stream.output_config.target_latency_ms = OUTPUT_DEFAULT_TARGET_LATENCY_MS;
+	
+	Dsp_Settings dsp_settings;
+	get_default_dsp_settings(&dsp_settings);
+	g_stream.dsp_settings.init(&dsp_settings);
+	
+	g_telemetry.start_tick = time_get_tick();
+	g_telemetry.ring_ms.store(-1.f);
+	g_telemetry.ring_low_ms.store(-1.f);
+	g_telemetry.device_ms.store(-1.f);
+	g_telemetry.device_low_ms.store(-1.f);
+
+#if defined(PLAYER_REALTIME_CHECKS)
+	if (!install_realtime_allocation_hook()) log_warning("Real-time allocations can't be counted in this build\n");
+#endif
+	g_stream.audio_thread = create_thread(&audio_thread_entry, NULL);
+	
+	wait_for_event(g_stream.ready_event, PLATFORM_WAIT_FOREVER);
+	destroy_event(g_stream.ready_event);
+	
+	g_stream.producer_thread = create_thread(&producer_thread_entry, NULL);
+	raise_thread_priority(g_stream.producer_thread);
+	g_stream.convolution_thread = create_thread(&convolution_thread_entry, NULL);
 	
-	WaitForSingleObject(g_stream.ready_semaphore, INFINITE);
-	CloseHandle(g_stream.ready_semaphore);
 	atexit(clean_up);
 }
 
-static inline void lock_stream() {
-	WaitForSingleObject(g_stream.mutex, INFINITE);
-}
-
-static inline void unlock_stream() {
-	ReleaseMutex(g_stream.mutex);
-}
-
 bool open_track(const wchar_t *path) {
+	u64 request_tick = time_get_tick();
 	lock_stream();
+	g_stream.track_serial.fetch_add(1);
 	if (is_file_loaded()) {
 		close_stream_source();
 	}
 	
 	enum Codec codec = find_codec_from_file_name(path);
-	g_stream.codec = codec;
 	
 	if (!get_decoder_functions(codec)) {
 		unlock_stream();
@@ -283,140 +799,208 @@ bool open_track(const wchar_t *path) {
 		return false;
 	}
 	
-	if (!g_decoder.open_func(path, g_stream.buffer_duration, &g_stream.format)) {
+	if (!g_pipeline.open(path)) {
 		unlock_stream();
 		return false;
 	}
 	
-	g_stream.file_loaded = true;
 	log_info("Now playing: %ls\n", path);
 	g_stream.state = PLAYER_STATE_PLAYING;
+	publish_stream_state();
+	
 	unlock_stream();
-	reset_audio_clock();
+	reset_audio_clock(request_tick);
+	wake_producer();
 	return true;
 }
 
+u32 get_track_serial() {
+	return g_stream.track_serial.load();
+}
+
+void set_next_track(const wchar_t *path) {
+	lock_stream();
+	g_pipeline.set_next(path);
+	unlock_stream();
+	
+	// The producer might be waiting at the end of a track for this
+	wake_producer();
+}
+
 bool track_is_playing() {
 	return g_stream.state == PLAYER_STATE_PLAYING;
 }
 
 void pause_playback() {
 	g_stream.state = PLAYER_STATE_PAUSED;
-	reset_audio_clock();
+	reset_audio_clock(time_get_tick());
 }
 
 void resume_playback() {
 	g_stream.state = PLAYER_STATE_PLAYING;
-	reset_audio_clock();
+	reset_audio_clock(time_get_tick());
 }
 
 int toggle_playback() {
-	int ret = g_stream.state;
-	if (g_stream.state == PLAYER_STATE_PLAYING) {
-		g_stream.state = PLAYER_STATE_PAUSED;
+	int ret = g_stream.state.load();
+	if (ret == PLAYER_STATE_PLAYING) {
 		pause_playback();
 	}
-	else if (g_stream.state == PLAYER_STATE_PAUSED) {
-		g_stream.state = PLAYER_STATE_PLAYING;
+	else if (ret == PLAYER_STATE_PAUSED) {
 		resume_playback();
 	}
 	return ret;
 }
 
+void set_resampler_quality(Resampler_Quality quality) {
+	g_pipeline.resampler_quality.store(quality);
+}
+
+Resampler_Quality get_resampler_quality() {
+	return g_pipeline.resampler_quality.load();
+}
+
 void set_playback_volume(float volume) {
 	DEBUG_ASSERT(volume <= 1.f);
-	float volumes[2] = {volume, volume};
-	g_volume_controller->SetAllVolumes(2, volumes);
+	Dsp_Settings settings = g_stream.dsp_settings.latest;
+	settings.volume = volume;
+	g_stream.dsp_settings.write(&settings);
 }
 
 float get_playback_volume() {
-	float ret;
-	g_volume_controller->GetChannelVolume(0, &ret);
-	return ret;
+	return g_stream.dsp_settings.latest.volume;
 }
 
-bool stream_to_buffer(const PCM_Format *output_format, int num_frames, float *output_buffer) {
-	lock_stream();
-	// If we aren't playing, zero the output buffer
-	if (!is_file_loaded() || g_stream.state != PLAYER_STATE_PLAYING) {
-		memset(output_buffer, 0, num_frames * 2 * sizeof(float));
-		unlock_stream();
-		return false;
-	}
-	
-	float *decode_buffer;
-	int num_input_frames;
-	const float sample_rate_ratio = (float)output_format->sample_rate / (float)g_stream.format.sample_rate;
-	bool needs_sample_rate_conversion = g_stream.format.sample_rate != output_format->sample_rate;
-	bool end_of_file = false;
-	
-	if (needs_sample_rate_conversion) {
-		num_input_frames = ceil(num_frames / sample_rate_ratio);
-		decode_buffer = (float*)malloc(sizeof(float) * num_input_frames * 2);
-	}
-	else {
-		num_input_frames = num_frames;
-		decode_buffer = output_buffer;
-	}
-	
-	// Decode into PCM
-	if (!g_decoder.decode_func(num_input_frames, decode_buffer)) {
-		unlock_stream();
-		return true;
-	}
-	
-	if (g_decoder.get_sample_func() >= g_stream.format.total_samples) {
-		unlock_stream();
-		return true;
-	}
+void set_dsp_settings(const Dsp_Settings *settings) {
+	g_stream.dsp_settings.write(settings);
+}
+
+void get_dsp_settings(Dsp_Settings *out) {
+	*out = g_stream.dsp_settings.latest;
+}
+
+bool set_convolution_file(const wchar_t *path) {
+	lock_mutex(g_stream.convolution_mutex);
+	bool ok = load_convolver(path);
 	
-	// Convert sample rate if needed
-	if (needs_sample_rate_conversion) {
-		SRC_STATE *converter = (SRC_STATE*)g_stream.sample_rate_converter;
-		SRC_DATA data = {};
-		data.input_frames = num_input_frames;
-		data.data_in = decode_buffer;
-		data.src_ratio = sample_rate_ratio;
-		data.output_frames = num_frames;
-		data.data_out = output_buffer;
-		
-		src_set_ratio(converter, sample_rate_ratio);
-		src_process(converter, &data);
-		
-		free(decode_buffer);
-	}
+	if (ok && path) wcsncpy(g_stream.convolution_path, path, ARRAY_LENGTH(g_stream.convolution_path) - 1);
+	else if (ok) g_stream.convolution_path[0] = 0;
 	
-	unlock_stream();
-	return end_of_file;
+	unlock_mutex(g_stream.convolution_mutex);
+	return ok;
 }
 
 void seek_playback_to_seconds(float seconds) {
+	u64 request_tick = time_get_tick();
 	lock_stream();
-	if (!is_file_loaded()) return;
+	if (!is_file_loaded()) {
+		unlock_stream();
+		return;
+	}
 	
-	u64 sample = (u64)(g_stream.format.sample_rate * seconds) * 2;
-	g_decoder.seek_func(sample);
+	// Seeks the audible track, which can be the one before a splice
+	g_pipeline.seek(get_audible_sample(seconds));
+	publish_stream_state();
+	unlock_stream();
 	
 	// Reset the audio stream so we instantly skip to the new position
-	reset_audio_clock();
-	unlock_stream();
+	reset_audio_clock(request_tick);
+	wake_producer();
 }
 
 float get_playback_length() {
-	if (!is_file_loaded()) return 0.f;
-	if (g_stream.format.sample_rate) return (float)g_stream.format.total_samples / (float)g_stream.format.sample_rate / 2.f;
-	else return 0.f;
+	Playback_Snapshot snapshot;
+	get_playback_snapshot(&snapshot);
+	return snapshot.length;
 }
 
 float get_playback_position() {
-	float ret = 0.f;
-	u32 sample;
-	if (!is_file_loaded()) return 0.f;
-	
-	lock_stream();
-	sample = g_decoder.get_sample_func();
-	unlock_stream();
-	
-	return sample / (float)g_stream.format.sample_rate / 2.f;
+	Playback_Snapshot snapshot;
+	get_playback_snapshot(&snapshot);
+	return snapshot.position;
+}
+
+float get_playback_buffered_ms() {
+	u32 sample_rate = g_pipeline.ring_sample_rate.load();
+	if (!sample_rate) return 0.f;
+	return (g_pipeline.ring.get_fill() * 1000.f) / (float)sample_rate;
 }
 
+void get_playback_latency(Playback_Latency *out) {
+	u32 sample_rate = g_stream.output_sample_rate.load();
+	out->target_ms = sample_rate ? (g_stream.latency_frames.load() * 1000.f) / sample_rate : 0.f;
+	out->device_buffer_ms = sample_rate ? (g_stream.output_buffer_frames.load() * 1000.f) / sample_rate : 0.f;
+	out->underrun_count = g_stream.underrun_count.load();
+	out->interrupt_ms = g_stream.interrupt_latency_us.load() / 1000.f;
+	out->interrupt_count = g_stream.interrupt_count.load();
+}
+
+void get_playback_output(Playback_Output *out) {
+	u32 track_sample_rate = g_published.sample_rate.load(std::memory_order_relaxed);
+	out->sample_rate = g_stream.output_sample_rate.load();
+	out->sample_type = (enum Output_Sample_Type)g_stream.output_sample_type.load();
+	out->bits = g_stream.output_bits.load();
+	out->resampling = track_sample_rate && track_sample_rate != out->sample_rate;
+	out->bit_perfect = g_stream.bit_perfect.load(std::memory_order_relaxed) && !out->resampling;
+}
+
+void get_playback_telemetry(Playback_Telemetry *out) {
+	const std::memory_order relaxed = std::memory_order_relaxed;
+	u32 sample_rate = g_stream.output_sample_rate.load();
+	
+	g_telemetry.decode.read(&out->decode);
+	g_telemetry.resample.read(&out->resample);
+	g_telemetry.dsp.read(&out->dsp);
+	g_telemetry.refill.read(&out->refill);
+	g_telemetry.wakeup_interval.read(&out->wakeup_interval);
+	out->underrun_count = g_stream.underrun_count.load(relaxed);
+	out->late_wakeup_count = g_telemetry.late_wakeup_count.load(relaxed);
+	out->ring_ms = g_telemetry.ring_ms.load(relaxed);
+	out->ring_low_ms = g_telemetry.ring_low_ms.load(relaxed);
+	out->device_ms = g_telemetry.device_ms.load(relaxed);
+	out->device_low_ms = g_telemetry.device_low_ms.load(relaxed);
+	out->ring_capacity_ms = sample_rate ? (g_pipeline.ring.capacity * 1000.f) / sample_rate : 0.f;
+	out->device_buffer_ms = sample_rate ? (g_stream.output_buffer_frames.load() * 1000.f) / sample_rate : 0.f;
+	out->uptime = time_ticks_to_milliseconds(time_get_tick() - g_telemetry.start_tick) / 1000.f;
+}
+
+bool save_playback_telemetry(const wchar_t *path) {
+	Playback_Telemetry telemetry;
+	Playback_Output output;
+	Playback_Latency latency;
+	FILE *file = _wfopen(path, L"w");
+	
+	if (!file) {
+		log_error("Failed to write the playback telemetry to \"%ls\"\n", path);
+		return false;
+	}
+	
+	get_playback_telemetry(&telemetry);
+	get_playback_output(&output);
+	get_playback_latency(&latency);
+	
+	fprintf(file, "Playback telemetry after %.1fs\n", telemetry.uptime);
+	fprintf(file, "Output: %uHz %s (%u bits), %.0fms device buffer, %.0fms ring\n", output.sample_rate, 
+			get_output_sample_type_name(output.sample_type), output.bits, telemetry.device_buffer_ms, telemetry.ring_capacity_ms);
+	fprintf(file, "Underruns: %u, late wakeups: %u, %.0fms kept queued\n", telemetry.underrun_count, 
+			telemetry.late_wakeup_count, latency.target_ms);
+	fprintf(file, "Ring: %.1fms decoded ahead, %.1fms at the lowest\n", telemetry.ring_ms, telemetry.ring_low_ms);
+	fprintf(file, "Device: %.1fms queued, %.1fms at the lowest\n", telemetry.device_ms, telemetry.device_low_ms);
+	
+	fprintf(file, "\n%-16s %10s %10s %10s %10s %10s\n", "Microseconds", "count", "mean", "median", "99%", "max");
+	write_telemetry_summary(file, "Decode", &telemetry.decode);
+	write_telemetry_summary(file, "Resample", &telemetry.resample);
+	write_telemetry_summary(file, "DSP", &telemetry.dsp);
+	write_telemetry_summary(file, "Refill", &telemetry.refill);
+	write_telemetry_summary(file, "Wakeup interval", &telemetry.wakeup_interval);
+	
+	fprintf(file, "\nBuckets, from under 2us up in powers of two\n");
+	write_telemetry_buckets(file, "Decode", &telemetry.decode);
+	write_telemetry_buckets(file, "Resample", &telemetry.resample);
+	write_telemetry_buckets(file, "DSP", &telemetry.dsp);
+	write_telemetry_buckets(file, "Refill", &telemetry.refill);
+	write_telemetry_buckets(file, "Wakeup interval", &telemetry.wakeup_interval);
+	
+	fclose(file);
+	return true;
+}
@@ -17,6 +17,10 @@
 #define PLAYER_H
 
 #include "common.h"
+#include "resampler.h"
+#include "output.h"
+#include "dsp.h"
+#include "telemetry.h"
 
 enum Player_State {
 	PLAYER_STATE_STOPPED,
@@ -24,16 +28,119 @@ enum Player_State {
 	PLAYER_STATE_PAUSED,
 };
 
-typedef void Player_End_Callback();
+// The callbacks are called on the player's producer thread, which keeps the device fed, so they must not
+// block. Hand the event to the thread that owns the queue and deal with it there. track_serial is what
+// get_track_serial() was when the event happened.
+typedef void Player_End_Callback(u32 track_serial);
+// Called when playback carries on into the track given to set_next_track() without stopping
+typedef void Player_Track_Change_Callback(float previous_length, u32 track_serial);
 
-void start_playback_stream(Player_End_Callback *end);
+// Consistent view of the playback state. Taking one never blocks.
+struct Playback_Snapshot {
+	enum Player_State state;
+	enum Codec codec;
+	// Seconds, of what is audible rather than what has been decoded
+	float position;
+	float length;
+	bool file_loaded;
+};
+
+// How far ahead of the speakers the audio thread runs
+struct Playback_Latency {
+	// What is kept queued in the device. Starts at the configured target and grows after underruns.
+	float target_ms;
+	// The most it can grow to
+	float device_buffer_ms;
+	// Times the device ran dry with decoded audio waiting
+	u32 underrun_count;
+	// From the last seek, skip, pause or resume to its first audio reaching the device
+	float interrupt_ms;
+	// Goes up each time interrupt_ms is measured
+	u32 interrupt_count;
+};
+
+// What the device is playing, and whether it is what the file holds
+struct Playback_Output {
+	u32 sample_rate;
+	enum Output_Sample_Type sample_type;
+	u32 bits;
+	// The audible track is at another rate
+	bool resampling;
+	// Nothing has been done to the audio on the way: no resampling, DSP or dither
+	bool bit_perfect;
+};
+
+// Where the time goes on the audio path, and how close the device came to running dry, since the stream
+// started. For finding out why playback glitched.
+struct Playback_Telemetry {
+	// Producer thread, for each chunk
+	Telemetry_Histogram decode;
+	// Only chunks that were resampled
+	Telemetry_Histogram resample;
+	// Audio thread, for each refill of the device
+	Telemetry_Histogram dsp;
+	// All of it, from waking up to going back to sleep
+	Telemetry_Histogram refill;
+	// From one wakeup to the next
+	Telemetry_Histogram wakeup_interval;
+	u32 underrun_count;
+	// Wakeups with less than a quarter of what was queued at the last one still to play
+	u32 late_wakeup_count;
+	// Milliseconds decoded ahead in the ring at the last refill, and the least there has been while a
+	// track played, short of its end. Negative until measured.
+	float ring_ms;
+	float ring_low_ms;
+	float ring_capacity_ms;
+	// Milliseconds queued in the device when the audio thread last woke, and the least there has been
+	// while playing. Negative until measured.
+	float device_ms;
+	float device_low_ms;
+	float device_buffer_ms;
+	// Seconds since the stream started
+	float uptime;
+};
+
+// NULL output_config plays to the platform's usual device. Blocks until the device is open.
+void start_playback_stream(Player_End_Callback *end, Player_Track_Change_Callback *track_change, 
+						   const Output_Config *output_config);
 bool open_track(const wchar_t *file_path);
+// Goes up with every open_track(). An event from a callback with an older serial is about a track that
+// has been replaced since.
+u32 get_track_serial();
+// Track to splice on to the end of the current one without a gap, or NULL for none. 
+// Cleared by open_track(). With match_track_rate, a track the device has to be reopened for isn't
+// spliced on, and the current one ends as if there was no next track.
+void set_next_track(const wchar_t *file_path);
 int toggle_playback();
 void seek_playback_to_seconds(float seconds);
 void seek_playback_to_sample(u32 sample);
 float get_playback_position();
+void get_playback_snapshot(Playback_Snapshot *out);
 float get_playback_length();
+// Milliseconds of decoded audio waiting to be sent to the device
+float get_playback_buffered_ms();
+// Safe from any thread once the stream has started
+void get_playback_latency(Playback_Latency *out);
+// Safe from any thread once the stream has started
+void get_playback_output(Playback_Output *out);
+// Never blocks the audio path. Safe from any thread once the stream has started.
+void get_playback_telemetry(Playback_Telemetry *out);
+// Writes the telemetry out as text. Returns false if the file can't be written.
+bool save_playback_telemetry(const wchar_t *path);
+// Used when the device rate differs from the track's. Takes effect from the next track.
+void set_resampler_quality(enum Resampler_Quality quality);
+enum Resampler_Quality get_resampler_quality();
+// Volume and the DSP settings are applied in software, smoothly, within the device queue.
+// Only set them from one thread, normally the UI's.
 void set_playback_volume(float volume);
+float get_playback_volume();
+// Volume is part of these
+void set_dsp_settings(const Dsp_Settings *settings);
+// What was set last, which might not be audible yet
+void get_dsp_settings(Dsp_Settings *out);
+// Loads an impulse response for the convolution stage, resampled to the output rate, or drops the one
+// in use if path is NULL. Takes as long as loading the file does. Heard while convolution_enabled is set.
+bool set_convolution_file(const wchar_t *path);
 void resume_playback();
 void pause_playback();
 bool track_is_playing();
@@ -21,6 +21,8 @@
 #include <xxhash.h>
 #include <windows.h>
 
+// Version 1 is a list of track IDs. Version 2 is a smart playlist: the header is followed by
+// the query text and no track IDs.
 struct Playlist_Header {
 	u32 magic;
 	u32 version;
@@ -28,18 +30,107 @@ struct Playlist_Header {
 	char name[64];
 };
 
-void Playlist::update_tracks() {
-	const u32 count = this->track_ids.count;
-	this->tracks.reset();
+// Re-resolve the playlist view against the library. The ID list itself is never modified here,
+// so nothing needs to be written back to disk.
+static void rebind_playlist(Playlist *playlist, Playlist_Rebind_Report *report) {
+	const Track_Array *library = get_library_track_info();
+	const u32 count = playlist->track_ids.count;
+	u32 missing = 0;
+	u32 reappeared = 0;
+	Track_Id_Set old_ids = {};
+	
+	// Remember which IDs resolved last time so we can tell which tracks went missing or came back
+	old_ids.reserve(playlist->tracks.count);
+	for (u32 i = 0; i < playlist->tracks.count; ++i) old_ids.add(playlist->tracks.ids.elements[i]);
+	playlist->tracks.reset();
 	
 	for (u32 i = 0; i < count; ++i) {
-		const Track_Info *in = lookup_track(this->track_ids.elements[i]);
-		if (in) {
-			this->tracks.add_from_info(in);
+		u32 id = playlist->track_ids.elements[i];
+		u32 index = lookup_track_index(id);
+		bool was_resolved = old_ids.contains(id);
+		
+		if (index != UINT32_MAX) {
+			playlist->tracks.add(id, &library->info.elements[index]);
+			if (!was_resolved) reappeared++;
+		}
+		else if (was_resolved) {
+			missing++;
 		}
 	}
 	
-	this->save_to_file();
+	old_ids.free();
+	
+	report->missing += missing;
+	report->reappeared += reappeared;
+	if (missing || reappeared) report->playlists_changed++;
+}
+
+void Playlist::update_tracks() {
+	Playlist_Rebind_Report report = {};
+	rebind_playlist(this, &report);
+}
+
+struct Rebind_Job {
+	Playlist *playlists;
+	u32 count;
+	volatile LONG next;
+};
+
+struct Rebind_Worker {
+	Rebind_Job *job;
+	Playlist_Rebind_Report report;
+};
+
+static DWORD WINAPI rebind_worker_entry(LPVOID user_data) {
+	Rebind_Worker *worker = (Rebind_Worker*)user_data;
+	Rebind_Job *job = worker->job;
+	
+	while (1) {
+		u32 index = (u32)InterlockedIncrement(&job->next) - 1;
+		if (index >= job->count) break;
+		rebind_playlist(&job->playlists[index], &worker->report);
+	}
+	
+	return 0;
+}
+
+void rebind_playlists(Playlist *playlists, u32 count, Playlist_Rebind_Report *report) {
+	Rebind_Worker workers[16] = {};
+	HANDLE threads[16];
+	Rebind_Job job = {};
+	SYSTEM_INFO system_info;
+	u64 start_time = time_get_tick();
+	u32 thread_count;
+	
+	GetSystemInfo(&system_info);
+	thread_count = MIN(MIN(system_info.dwNumberOfProcessors, ARRAY_LENGTH(workers)), count);
+	
+	job.playlists = playlists;
+	job.count = count;
+	
+	// The calling thread does a share of the work as well
+	for (u32 i = 0; i < thread_count; ++i) {
+		workers[i].job = &job;
+		if (i) threads[i] = CreateThread(NULL, 0, &rebind_worker_entry, &workers[i], 0, NULL);
+	}
+	
+	if (thread_count) rebind_worker_entry(&workers[0]);
+	
+	for (u32 i = 1; i < thread_count; ++i) {
+		WaitForSingleObject(threads[i], INFINITE);
+		CloseHandle(threads[i]);
+	}
+	
+	if (report) {
+		memset(report, 0, sizeof(*report));
+		for (u32 i = 0; i < thread_count; ++i) {
+			report->missing += workers[i].report.missing;
+			report->reappeared += workers[i].report.reappeared;
+			report->playlists_changed += workers[i].report.playlists_changed;
+		}
+	}
+	
+	log_debug("Rebound %u playlists in %.2fms\n", count, time_ticks_to_milliseconds(time_get_tick() - start_time));
 }
 
 bool Playlist::has_track(u32 id) {
@@ -64,6 +155,46 @@ void Playlist::add_track(const Track_Info *track) {
 	}
 }
 
+void Playlist::add_tracks(const Track_Array *tracks) {
+	Track_Id_Set existing = {};
+	existing.reserve(this->track_ids.count + tracks->count);
+	for (u32 i = 0; i < this->track_ids.count; ++i) existing.add(this->track_ids.elements[i]);
+	
+	for (u32 i = 0; i < tracks->count; ++i) {
+		u32 id = tracks->ids.elements[i];
+		if (existing.add(id)) {
+			this->track_ids.push_value(id);
+			this->tracks.add(id, &tracks->info.elements[i]);
+		}
+	}
+	
+	existing.free();
+}
+
+void Playlist::remove_ids(const Track_Id_Set *ids) {
+	u32 out = 0;
+	
+	// Compact in place so the playlist keeps its order
+	for (u32 i = 0; i < this->track_ids.count; ++i) {
+		u32 id = this->track_ids.elements[i];
+		if (!ids->contains(id)) this->track_ids.elements[out++] = id;
+	}
+	this->track_ids.count = out;
+	
+	out = 0;
+	for (u32 i = 0; i < this->tracks.count; ++i) {
+		if (ids->contains(this->tracks.ids.elements[i])) continue;
+		this->tracks.ids.elements[out] = this->tracks.ids.elements[i];
+		this->tracks.info.elements[out] = this->tracks.info.elements[i];
+		out++;
+	}
+	this->tracks.ids.count = out;
+	this->tracks.info.count = out;
+	this->tracks.count = out;
+	
+	this->save_to_file();
+}
+
 u32 Playlist::get_id() {
 	return XXH32(this->name, strlen(this->name), 0);
 }
@@ -89,11 +220,12 @@ void Playlist::save_to_file() {
 	if (!out) return;
 	
 	header.magic = *(u32*)"PLYL";
-	header.version = 1;
-	header.track_count = this->track_ids.count;
+	header.version = this->is_smart ? 2 : 1;
+	header.track_count = this->is_smart ? 0 : this->track_ids.count;
 	strcpy(header.name, this->name);
 	
 	fwrite(&header, sizeof(header), 1, out);
+	if (this->is_smart) fwrite(this->query.text, sizeof(this->query.text), 1, out);
 	fwrite(this->track_ids.elements, 4, header.track_count, out);
 	
 	fclose(out);
@@ -154,10 +286,20 @@ void load_playlists(Large_Auto_Array<Playlist> *out) {
 			
 			strncpy(playlist->name, header.name, 64);
 			
+			if (header.version == 2) {
+				char query[sizeof(playlist->query.text)] = {};
+				fread(query, sizeof(query), 1, in);
+				query[sizeof(query)-1] = 0;
+				playlist->is_smart = true;
+				if (!load_track_query(query, &playlist->query)) {
+					log_warning("Smart playlist %s has an invalid query. It will be empty until the query is fixed.\n", 
+								header.name);
+				}
+			}
+			
 			ids = playlist->track_ids.push_n(header.track_count);
 			fread(ids, sizeof(u32), header.track_count, in);
 			
-			playlist->update_tracks();
 			log_debug("Load playlist %s\n", playlist->name);
 			
 			fclose(in);
@@ -165,11 +307,89 @@ void load_playlists(Large_Auto_Array<Playlist> *out) {
 		
 		memset(&path_buffer[base_path_length], 0, strlen(find_data.cFileName));
 	}
+	
+	evaluate_smart_playlists(out->elements, out->count);
+	rebind_playlists(out->elements, out->count, NULL);
 }
 
 void Playlist::free() {
 	this->track_ids.free();
 	this->tracks.free();
+	this->smart_members.free();
+}
+
+void evaluate_smart_playlists(Playlist *playlists, u32 count) {
+	Playlist *smart[64];
+	u32 smart_count = 0;
+	const Track_Array *library = get_library_track_info();
+	u64 start_time = time_get_tick();
+	
+	for (u32 i = 0; i < count; ++i) {
+		if (!playlists[i].is_smart) continue;
+		
+		// Evaluate in batches so every track is only visited once per batch of playlists
+		if (smart_count == ARRAY_LENGTH(smart)) {
+			evaluate_smart_playlists(&playlists[i], count - i);
+			break;
+		}
+		
+		Playlist *playlist = &playlists[i];
+		playlist->track_ids.reset();
+		playlist->smart_members.reset();
+		smart[smart_count++] = playlist;
+	}
+	
+	if (!smart_count) return;
+	
+	for (u32 t = 0; t < library->count; ++t) {
+		const Track_Info *track = &library->info.elements[t];
+		u32 id = library->ids.elements[t];
+		
+		for (u32 p = 0; p < smart_count; ++p) {
+			if (track_matches_query(&smart[p]->query, track) && smart[p]->smart_members.add(id)) {
+				smart[p]->track_ids.push_value(id);
+			}
+		}
+	}
+	
+	log_debug("Evaluated %u smart playlists over %u tracks in %.2fms\n", smart_count, library->count,
+			  time_ticks_to_milliseconds(time_get_tick() - start_time));
+}
+
+void update_smart_playlists(Playlist *playlists, u32 count, const u32 *changed_ids, u32 changed_count) {
+	for (u32 i = 0; i < count; ++i) {
+		Playlist *playlist = &playlists[i];
+		Track_Id_Set removed = {};
+		if (!playlist->is_smart) continue;
+		
+		for (u32 c = 0; c < changed_count; ++c) {
+			u32 id = changed_ids[c];
+			const Track_Info *track = lookup_track(id);
+			bool is_member = playlist->smart_members.contains(id);
+			bool matches = track && track_matches_query(&playlist->query, track);
+			
+			if (matches && !is_member) {
+				playlist->smart_members.add(id);
+				playlist->track_ids.push_value(id);
+			}
+			else if (!matches && is_member) {
+				playlist->smart_members.remove(id);
+				removed.add(id);
+			}
+		}
+		
+		// Compact once for all removals
+		if (removed.count) {
+			u32 out = 0;
+			for (u32 t = 0; t < playlist->track_ids.count; ++t) {
+				u32 id = playlist->track_ids.elements[t];
+				if (!removed.contains(id)) playlist->track_ids.elements[out++] = id;
+			}
+			playlist->track_ids.count = out;
+		}
+		
+		removed.free();
+	}
 }
 
 void delete_playlist(Playlist *playlist) {
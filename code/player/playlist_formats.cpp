@@ -0,0 +1,336 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#define WIN32_LEAN_AND_MEAN
+#include "common.h"
+#include "library.h"
+#include <stdio.h>
+#include <string.h>
+#include <wchar.h>
+#include <windows.h>
+
+// M3U, M3U8 and PLS import and export. Files are streamed line by line and every entry is
+// resolved through the library path index, so the cost is linear in the file size.
+
+#define PLAYLIST_IO_BUFFER_SIZE (64<<10)
+
+enum Playlist_Format {
+	PLAYLIST_FORMAT_NONE,
+	PLAYLIST_FORMAT_M3U,
+	PLAYLIST_FORMAT_M3U8,
+	PLAYLIST_FORMAT_PLS,
+};
+
+static Playlist_Format get_playlist_format(const wchar_t *path) {
+	const wchar_t *extension = wcsrchr(path, L'.');
+
+	if (!extension) return PLAYLIST_FORMAT_NONE;
+	if (!_wcsicmp(extension, L".m3u")) return PLAYLIST_FORMAT_M3U;
+	if (!_wcsicmp(extension, L".m3u8")) return PLAYLIST_FORMAT_M3U8;
+	if (!_wcsicmp(extension, L".pls")) return PLAYLIST_FORMAT_PLS;
+	return PLAYLIST_FORMAT_NONE;
+}
+
+static bool is_valid_utf8(const char *s) {
+	const u8 *c = (const u8*)s;
+	while (*c) {
+		u32 continuation_bytes;
+		if (*c < 0x80) continuation_bytes = 0;
+		else if ((*c & 0xe0) == 0xc0) continuation_bytes = 1;
+		else if ((*c & 0xf0) == 0xe0) continuation_bytes = 2;
+		else if ((*c & 0xf8) == 0xf0) continuation_bytes = 3;
+		else return false;
+
+		c++;
+		for (u32 i = 0; i < continuation_bytes; ++i, ++c) {
+			if ((*c & 0xc0) != 0x80) return false;
+		}
+	}
+	return true;
+}
+
+static inline bool is_path_separator(char c) {
+	return c == '\\' || c == '/';
+}
+
+static inline int hex_digit_value(char c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+// Decode a file:// URL into a path in place
+static void decode_file_url(char *url) {
+	const char *in = url + strlen("file://");
+	char *out = url;
+
+	if (!_strnicmp(in, "localhost/", 10)) in += 9;
+	// file:///C:/... has an extra slash before the drive letter
+	if (in[0] == '/' && in[1] && in[2] == ':') in++;
+
+	for (; *in; ++in) {
+		int high, low;
+		if (in[0] == '%' && (high = hex_digit_value(in[1])) >= 0 && (low = hex_digit_value(in[2])) >= 0) {
+			*out++ = (char)((high << 4) | low);
+			in += 2;
+		}
+		else {
+			*out++ = *in;
+		}
+	}
+	*out = 0;
+}
+
+// Collapse "." and ".." segments and use backslashes throughout
+static void canonicalize_path(const char *in, char *out, u32 out_max) {
+	u32 root = 0;
+	u32 length = 0;
+
+	// Keep drive letters and UNC prefixes intact
+	if (in[0] && in[1] == ':') {
+		out[length++] = in[0];
+		out[length++] = ':';
+		in += 2;
+	}
+	else if (is_path_separator(in[0]) && is_path_separator(in[1])) {
+		out[length++] = '\\';
+		in += 1;
+	}
+
+	if (is_path_separator(in[0])) {
+		out[length++] = '\\';
+		in++;
+	}
+
+	root = length;
+
+	while (*in) {
+		const char *segment = in;
+		while (*in && !is_path_separator(*in)) in++;
+		u32 segment_length = in - segment;
+		if (*in) in++;
+
+		if (!segment_length || (segment_length == 1 && segment[0] == '.')) continue;
+
+		if (segment_length == 2 && segment[0] == '.' && segment[1] == '.') {
+			// Drop the last segment and its separator
+			if (length > root) length--;
+			while (length > root && out[length-1] != '\\') length--;
+			continue;
+		}
+
+		if (length + segment_length + 2 >= out_max) break;
+		memcpy(&out[length], segment, segment_length);
+		length += segment_length;
+		out[length++] = '\\';
+	}
+
+	if (length > root && out[length-1] == '\\') length--;
+	out[length] = 0;
+}
+
+// Turn a playlist entry into a full path. Entries that are relative are relative to the playlist file.
+static bool resolve_playlist_entry(const char *directory, char *entry, char *out, u32 out_max) {
+	char joined[1024];
+
+	if (!_strnicmp(entry, "file://", 7)) {
+		decode_file_url(entry);
+	}
+	else if (strstr(entry, "://")) {
+		// Streams and other URLs can't be in the library
+		return false;
+	}
+
+	bool is_absolute = (entry[0] && entry[1] == ':') || is_path_separator(entry[0]);
+
+	if (is_absolute) snprintf(joined, sizeof(joined), "%s", entry);
+	else snprintf(joined, sizeof(joined), "%s%s", directory, entry);
+
+	canonicalize_path(joined, out, out_max);
+	return true;
+}
+
+static void trim_line(char *line) {
+	u32 length = strlen(line);
+	while (length && (line[length-1] == '\n' || line[length-1] == '\r' ||
+					  line[length-1] == ' ' || line[length-1] == '\t')) {
+		line[--length] = 0;
+	}
+}
+
+bool import_playlist(const wchar_t *path, Playlist *playlist, Playlist_Import_Report *report) {
+	Playlist_Format format = get_playlist_format(path);
+	const Track_Array *library = get_library_track_info();
+	char directory[512];
+	char line[2048];
+	char converted[2048];
+	char resolved[1024];
+	Track_Id_Set ids = {};
+	u64 start_time = time_get_tick();
+	bool first_line = true;
+
+	memset(report, 0, sizeof(*report));
+
+	if (format == PLAYLIST_FORMAT_NONE) {
+		log_error("Unrecognized playlist format \"%ls\"\n", path);
+		return false;
+	}
+
+	FILE *in = _wfopen(path, L"rb");
+	if (!in) {
+		log_error("Failed to open playlist \"%ls\"\n", path);
+		return false;
+	}
+
+	setvbuf(in, NULL, _IOFBF, PLAYLIST_IO_BUFFER_SIZE);
+
+	// Directory of the playlist file, with a trailing separator
+	{
+		utf16_to_utf8(path, directory, sizeof(directory));
+		char *last_separator = strrchr(directory, '\\');
+		char *last_slash = strrchr(directory, '/');
+		if (last_slash > last_separator) last_separator = last_slash;
+		if (last_separator) last_separator[1] = 0;
+		else directory[0] = 0;
+	}
+
+	// Name the playlist after the file
+	{
+		const wchar_t *file_name = wcsrchr(path, L'\\');
+		file_name = file_name ? file_name + 1 : path;
+		utf16_to_utf8(file_name, playlist->name, sizeof(playlist->name));
+		char *extension = strrchr(playlist->name, '.');
+		if (extension) *extension = 0;
+	}
+
+	while (fgets(line, sizeof(line), in)) {
+		u32 length = strlen(line);
+
+		// Skip the rest of lines that don't fit in the buffer
+		if (length == sizeof(line) - 1 && line[length-1] != '\n') {
+			int c;
+			while ((c = fgetc(in)) != EOF && c != '\n');
+			report->entries++;
+			report->unresolved++;
+			continue;
+		}
+
+		trim_line(line);
+		char *entry = line;
+
+		if (first_line) {
+			if (!memcmp(entry, "\xef\xbb\xbf", 3)) entry += 3;
+			first_line = false;
+		}
+
+		if (format == PLAYLIST_FORMAT_PLS) {
+			// Only "FileN=path" lines matter
+			if (_strnicmp(entry, "File", 4)) continue;
+			char *equals = strchr(entry, '=');
+			if (!equals) continue;
+			entry = equals + 1;
+		}
+		else if (entry[0] == '#') {
+			continue;
+		}
+
+		while (*entry == ' ' || *entry == '\t') entry++;
+		if (!entry[0]) continue;
+
+		report->entries++;
+
+		// .m3u files are usually in the system code page
+		if (format != PLAYLIST_FORMAT_M3U8 && !is_valid_utf8(entry)) {
+			wchar_t wide[2048];
+			MultiByteToWideChar(CP_ACP, 0, entry, -1, wide, ARRAY_LENGTH(wide));
+			utf16_to_utf8(wide, converted, sizeof(converted));
+			entry = converted;
+		}
+
+		u32 index = UINT32_MAX;
+		if (resolve_playlist_entry(directory, entry, resolved, sizeof(resolved))) {
+			index = lookup_track_index_by_path(resolved);
+		}
+
+		if (index == UINT32_MAX) {
+			report->unresolved++;
+			continue;
+		}
+
+		u32 id = library->ids.elements[index];
+		if (!ids.add(id)) {
+			report->duplicates++;
+			continue;
+		}
+
+		playlist->track_ids.push_value(id);
+		playlist->tracks.add(id, &library->info.elements[index]);
+		report->resolved++;
+	}
+
+	fclose(in);
+	ids.free();
+
+	log_info("Imported %u of %u entries from \"%ls\" in %.2fms\n", report->resolved, report->entries, path,
+			 time_ticks_to_milliseconds(time_get_tick() - start_time));
+	return true;
+}
+
+bool export_playlist(const Playlist *playlist, const wchar_t *path) {
+	Playlist_Format format = get_playlist_format(path);
+	const Track_Array *tracks = &playlist->tracks;
+	char base_path[512];
+
+	if (format == PLAYLIST_FORMAT_NONE) {
+		log_error("Unrecognized playlist format \"%ls\"\n", path);
+		return false;
+	}
+
+	FILE *out = _wfopen(path, L"wb");
+	if (!out) {
+		log_error("Failed to open \"%ls\" for writing\n", path);
+		return false;
+	}
+
+	setvbuf(out, NULL, _IOFBF, PLAYLIST_IO_BUFFER_SIZE);
+	utf16_to_utf8(get_library_base_path(), base_path, sizeof(base_path));
+
+	// Everything is written as UTF-8, which is what current players expect for .m3u as well
+	if (format == PLAYLIST_FORMAT_PLS) fputs("[playlist]\n", out);
+	else fputs("#EXTM3U\n", out);
+
+	for (u32 i = 0; i < tracks->count; ++i) {
+		const Track_Info *info = &tracks->info.elements[i];
+		const char *artist = get_library_string(info->artist);
+		const char *title = get_library_string(info->title);
+		const char *relative_path = get_library_string(info->relative_file_path);
+		const char *separator = artist[0] ? " - " : "";
+
+		if (format == PLAYLIST_FORMAT_PLS) {
+			fprintf(out, "File%u=%s%s\nTitle%u=%s%s%s\nLength%u=-1\n",
+					i+1, base_path, relative_path, i+1, artist, separator, title, i+1);
+		}
+		else {
+			fprintf(out, "#EXTINF:-1,%s%s%s\n%s%s\n", artist, separator, title, base_path, relative_path);
+		}
+	}
+
+	if (format == PLAYLIST_FORMAT_PLS) fprintf(out, "NumberOfEntries=%u\nVersion=2\n", tracks->count);
+
+	fclose(out);
+	log_info("Exported %u tracks to \"%ls\"\n", tracks->count, path);
+	return true;
+}
@@ -0,0 +1,164 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "common.h"
+#include "library.h"
+#include <string.h>
+#include <ctype.h>
+
+static const struct {
+	const char *name;
+	Query_Field field;
+} g_query_fields[] = {
+	{"artist", QUERY_FIELD_ARTIST},
+	{"title", QUERY_FIELD_TITLE},
+	{"album", QUERY_FIELD_ALBUM},
+	{"path", QUERY_FIELD_PATH},
+};
+
+static inline char lower(char c) {
+	return (char)tolower((unsigned char)c);
+}
+
+static bool starts_with_field_name(const char *c, const char *name) {
+	for (; *name; ++name, ++c) {
+		if (lower(*c) != *name) return false;
+	}
+	return true;
+}
+
+// Parse "field:" or "field=" at the start of a term. Returns the number of characters consumed.
+static u32 parse_field_prefix(const char *c, Query_Term *term) {
+	for (u32 i = 0; i < ARRAY_LENGTH(g_query_fields); ++i) {
+		u32 length = strlen(g_query_fields[i].name);
+		if (starts_with_field_name(c, g_query_fields[i].name) && (c[length] == ':' || c[length] == '=')) {
+			term->field = g_query_fields[i].field;
+			term->exact = c[length] == '=';
+			return length + 1;
+		}
+	}
+
+	term->field = QUERY_FIELD_ANY;
+	return 0;
+}
+
+bool compile_track_query(const char *text, Track_Query *out) {
+	Track_Query query = {};
+	const char *c = text;
+
+	if (strlen(text) >= sizeof(query.text)) {
+		log_warning("Query is too long\n");
+		return false;
+	}
+
+	strcpy(query.text, text);
+
+	while (1) {
+		while (*c == ' ' || *c == '\t') c++;
+		if (!*c) break;
+
+		if (query.term_count == QUERY_MAX_TERMS) {
+			log_warning("Query has too many terms (max %u)\n", QUERY_MAX_TERMS);
+			return false;
+		}
+
+		Query_Term *term = &query.terms[query.term_count];
+
+		if (*c == '-') {
+			term->negate = true;
+			c++;
+		}
+
+		c += parse_field_prefix(c, term);
+
+		bool quoted = *c == '"';
+		if (quoted) c++;
+
+		while (*c && (quoted ? (*c != '"') : (*c != ' ' && *c != '\t'))) {
+			if (term->needle_length == sizeof(term->needle) - 1) {
+				log_warning("Query term is too long\n");
+				return false;
+			}
+			term->needle[term->needle_length++] = lower(*c);
+			c++;
+		}
+
+		if (quoted && *c == '"') c++;
+
+		if (!term->needle_length) {
+			log_warning("Query term has no value\n");
+			return false;
+		}
+
+		query.term_count++;
+	}
+
+	*out = query;
+	return true;
+}
+
+static bool string_matches_term(const char *haystack, const Query_Term *term) {
+	const char *needle = term->needle;
+
+	if (term->exact) {
+		for (; *haystack && *needle; ++haystack, ++needle) {
+			if (lower(*haystack) != *needle) return false;
+		}
+		return !*haystack && !*needle;
+	}
+
+	for (; *haystack; ++haystack) {
+		u32 i = 0;
+		while (needle[i] && haystack[i] && lower(haystack[i]) == needle[i]) i++;
+		if (!needle[i]) return true;
+		if (!haystack[i]) return false;
+	}
+
+	return false;
+}
+
+static bool track_matches_term(const Track_Info *track, const Query_Term *term) {
+	switch (term->field) {
+		case QUERY_FIELD_ARTIST: return string_matches_term(get_library_string(track->artist), term);
+		case QUERY_FIELD_TITLE: return string_matches_term(get_library_string(track->title), term);
+		case QUERY_FIELD_ALBUM: return string_matches_term(get_library_string(track->album), term);
+		case QUERY_FIELD_PATH: return string_matches_term(get_library_string(track->relative_file_path), term);
+		default: {
+			return string_matches_term(get_library_string(track->artist), term) ||
+				string_matches_term(get_library_string(track->title), term) ||
+				string_matches_term(get_library_string(track->relative_file_path), term);
+		}
+	}
+}
+
+bool load_track_query(const char *text, Track_Query *out) {
+	if (compile_track_query(text, out)) return true;
+
+	memset(out, 0, sizeof(*out));
+	strncpy(out->text, text, sizeof(out->text) - 1);
+	out->invalid = true;
+	return false;
+}
+
+bool track_matches_query(const Track_Query *query, const Track_Info *track) {
+	if (query->invalid || !query->term_count) return false;
+
+	for (u32 i = 0; i < query->term_count; ++i) {
+		const Query_Term *term = &query->terms[i];
+		if (track_matches_term(track, term) == term->negate) return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,85 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "pipeline.h"
+
+#if defined(PLAYER_REALTIME_CHECKS)
+thread_local bool t_in_realtime_section;
+static std::atomic<u32> g_realtime_allocation_count;
+
+#if defined(_WIN32) && defined(_DEBUG)
+#include <crtdbg.h>
+
+static int realtime_allocation_hook(int type, void *data, size_t size, int block_type, long request,
+									const unsigned char *file, int line) {
+	if (t_in_realtime_section && (type == _HOOK_ALLOC || type == _HOOK_REALLOC)) {
+		g_realtime_allocation_count.fetch_add(1, std::memory_order_relaxed);
+	}
+	return TRUE;
+}
+
+bool install_realtime_allocation_hook() {
+	_CrtSetAllocHook(&realtime_allocation_hook);
+	return true;
+}
+
+#elif defined(__GLIBC__)
+// Everything, operator new included, ends up in these
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *address, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+
+static inline void count_realtime_allocation() {
+	if (t_in_realtime_section) g_realtime_allocation_count.fetch_add(1, std::memory_order_relaxed);
+}
+
+void *malloc(size_t size) {
+	count_realtime_allocation();
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+	count_realtime_allocation();
+	return __libc_calloc(count, size);
+}
+
+void *realloc(void *address, size_t size) {
+	count_realtime_allocation();
+	return __libc_realloc(address, size);
+}
+
+int posix_memalign(void **out, size_t alignment, size_t size) {
+	count_realtime_allocation();
+	*out = __libc_memalign(alignment, size);
+	return *out ? 0 : 12; // ENOMEM
+}
+}
+
+bool install_realtime_allocation_hook() {
+	return true;
+}
+
+#else
+bool install_realtime_allocation_hook() {
+	return false;
+}
+#endif
+
+u32 get_realtime_allocation_count() {
+	return g_realtime_allocation_count.load(std::memory_order_relaxed);
+}
+#endif
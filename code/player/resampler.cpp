@@ -0,0 +1,353 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "resampler.h"
+#include "cpu.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(CPU_X86)
+#include <immintrin.h>
+#elif defined(CPU_ARM64)
+#include <arm_neon.h>
+#endif
+
+#define RESAMPLER_MAX_CACHED_BANKS 32
+
+static const struct {
+	const char *name;
+	// Multiple of 8 for the SIMD loops
+	u32 taps;
+	// Kaiser window shape. Stopband attenuation is about beta/0.1102 + 8.7 dB.
+	double beta;
+} g_resampler_qualities[RESAMPLER_QUALITY_COUNT] = {
+	{"Low", 24, 5.65},
+	{"Medium", 48, 7.86},
+	{"High", 128, 10.06},
+};
+
+static Resampler_Bank g_bank_cache[RESAMPLER_MAX_CACHED_BANKS];
+static u32 g_cached_bank_count;
+
+static u32 gcd(u32 a, u32 b) {
+	while (b) {
+		u32 t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+static double bessel_i0(double x) {
+	double sum = 1.0, term = 1.0;
+	double half_x = x * 0.5;
+	for (u32 k = 1; k < 64; ++k) {
+		term *= (half_x / k) * (half_x / k);
+		sum += term;
+		if (term < sum * 1e-12) break;
+	}
+	return sum;
+}
+
+// Downsampling narrows the passband, so the filter has to get longer to keep the same 
+// transition band relative to the output rate
+static u32 get_tap_count(u32 phases, u32 step, Resampler_Quality quality) {
+	u32 taps = g_resampler_qualities[quality].taps;
+	if (step > phases) taps = (u32)(((u64)taps * step / phases + 7) & ~7ull);
+	return taps;
+}
+
+static void create_bank(u32 phases, u32 step, Resampler_Quality quality, Resampler_Bank *bank) {
+	const u32 taps = get_tap_count(phases, step, quality);
+	const double beta = g_resampler_qualities[quality].beta;
+	const double half_length = taps / 2;
+	const double attenuation = beta / 0.1102 + 8.7;
+	// Put the end of the transition band at the lower of the two Nyquist frequencies
+	const double transition = 2.0 * (attenuation - 7.95) / (14.36 * g_resampler_qualities[quality].taps);
+	const double cutoff = (1.0 - transition * 0.5) * MIN(1.0, (double)phases / (double)step);
+	const double i0_beta = bessel_i0(beta);
+	const double pi = 3.14159265358979323846;
+	double *taps_buffer = (double*)malloc(taps * sizeof(double));
+	
+	bank->phases = phases;
+	bank->step = step;
+	bank->taps = taps;
+	bank->quality = quality;
+	bank->coefficients = (float*)malloc(phases * taps * 2 * sizeof(float));
+	
+	for (u32 phase = 0; phase < phases; ++phase) {
+		double sum = 0.0;
+		
+		for (u32 i = 0; i < taps; ++i) {
+			// Distance in input frames from the output position
+			double x = (double)i - (half_length - 1.0) - (double)phase / (double)phases;
+			double w = x / half_length;
+			double window = (fabs(w) <= 1.0) ? bessel_i0(beta * sqrt(1.0 - w*w)) / i0_beta : 0.0;
+			double sinc = (x == 0.0) ? 1.0 : sin(pi * cutoff * x) / (pi * cutoff * x);
+			
+			taps_buffer[i] = cutoff * sinc * window;
+			sum += taps_buffer[i];
+		}
+		
+		// Unity gain at DC for every phase
+		float *coefficients = &bank->coefficients[phase * taps * 2];
+		for (u32 i = 0; i < taps; ++i) {
+			coefficients[i*2+0] = (float)(taps_buffer[i] / sum);
+			coefficients[i*2+1] = (float)(taps_buffer[i] / sum);
+		}
+	}
+	
+	free(taps_buffer);
+}
+
+static void kernel_scalar(const float *frames, const float *coefficients, u32 taps, float *out) {
+	float left = 0.f, right = 0.f;
+	for (u32 i = 0; i < taps*2; i += 2) {
+		left += frames[i+0] * coefficients[i+0];
+		right += frames[i+1] * coefficients[i+1];
+	}
+	out[0] = left;
+	out[1] = right;
+}
+
+#if defined(CPU_X86)
+static void kernel_sse(const float *frames, const float *coefficients, u32 taps, float *out) {
+	__m128 sum0 = _mm_setzero_ps();
+	__m128 sum1 = _mm_setzero_ps();
+	
+	for (u32 i = 0; i < taps*2; i += 8) {
+		sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(&frames[i+0]), _mm_loadu_ps(&coefficients[i+0])));
+		sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(&frames[i+4]), _mm_loadu_ps(&coefficients[i+4])));
+	}
+	
+	// L R L R -> L+L R+R
+	__m128 sum = _mm_add_ps(sum0, sum1);
+	sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+	_mm_storel_pi((__m64*)out, sum);
+}
+
+TARGET_AVX2 static void kernel_avx2(const float *frames, const float *coefficients, u32 taps, float *out) {
+	__m256 sum0 = _mm256_setzero_ps();
+	__m256 sum1 = _mm256_setzero_ps();
+	u32 i = 0;
+	
+	for (; i + 16 <= taps*2; i += 16) {
+		sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(&frames[i+0]), _mm256_loadu_ps(&coefficients[i+0]), sum0);
+		sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(&frames[i+8]), _mm256_loadu_ps(&coefficients[i+8]), sum1);
+	}
+	
+	if (i < taps*2) {
+		sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(&frames[i]), _mm256_loadu_ps(&coefficients[i]), sum0);
+	}
+	
+	__m256 sum8 = _mm256_add_ps(sum0, sum1);
+	__m128 sum = _mm_add_ps(_mm256_castps256_ps128(sum8), _mm256_extractf128_ps(sum8, 1));
+	sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+	_mm_storel_pi((__m64*)out, sum);
+}
+#endif
+
+#if defined(CPU_ARM64)
+static void kernel_neon(const float *frames, const float *coefficients, u32 taps, float *out) {
+	float32x4_t sum0 = vdupq_n_f32(0.f);
+	float32x4_t sum1 = vdupq_n_f32(0.f);
+	
+	for (u32 i = 0; i < taps*2; i += 8) {
+		sum0 = vfmaq_f32(sum0, vld1q_f32(&frames[i+0]), vld1q_f32(&coefficients[i+0]));
+		sum1 = vfmaq_f32(sum1, vld1q_f32(&frames[i+4]), vld1q_f32(&coefficients[i+4]));
+	}
+	
+	float32x4_t sum = vaddq_f32(sum0, sum1);
+	vst1_f32(out, vadd_f32(vget_low_f32(sum), vget_high_f32(sum)));
+}
+#endif
+
+static Resampler_Kernel *pick_kernel(const char **name) {
+	u32 features = get_cpu_features();
+	
+#if defined(CPU_X86)
+	if ((features & CPU_FEATURE_AVX2) && (features & CPU_FEATURE_FMA)) {
+		*name = "AVX2";
+		return &kernel_avx2;
+	}
+	if (features & CPU_FEATURE_SSE2) {
+		*name = "SSE";
+		return &kernel_sse;
+	}
+#elif defined(CPU_ARM64)
+	if (features & CPU_FEATURE_NEON) {
+		*name = "NEON";
+		return &kernel_neon;
+	}
+#endif
+	
+	*name = "scalar";
+	return &kernel_scalar;
+}
+
+const char *get_resampler_kernel_name() {
+	const char *name;
+	pick_kernel(&name);
+	return name;
+}
+
+static bool reduce_rates(u32 input_rate, u32 output_rate, u32 *phases, u32 *step) {
+	if (!input_rate || !output_rate) return false;
+	
+	u32 divisor = gcd(input_rate, output_rate);
+	*phases = output_rate / divisor;
+	*step = input_rate / divisor;
+	
+	// The filter has to move less than its own length per output
+	return (*phases <= RESAMPLER_MAX_PHASES) && (*step <= *phases * 8);
+}
+
+bool resampler_supports_rates(u32 input_rate, u32 output_rate) {
+	u32 phases, step;
+	return reduce_rates(input_rate, output_rate, &phases, &step);
+}
+
+const char *get_resampler_quality_name(Resampler_Quality quality) {
+	return g_resampler_qualities[quality].name;
+}
+
+// Not thread safe. The player only creates resamplers with the stream locked.
+static const Resampler_Bank *get_bank(u32 phases, u32 step, Resampler_Quality quality, bool *owned) {
+	for (u32 i = 0; i < g_cached_bank_count; ++i) {
+		const Resampler_Bank *bank = &g_bank_cache[i];
+		if (bank->phases == phases && bank->step == step && bank->quality == quality) {
+			*owned = false;
+			return bank;
+		}
+	}
+	
+	if (g_cached_bank_count < RESAMPLER_MAX_CACHED_BANKS) {
+		Resampler_Bank *bank = &g_bank_cache[g_cached_bank_count++];
+		create_bank(phases, step, quality, bank);
+		*owned = false;
+		return bank;
+	}
+	
+	Resampler_Bank *bank = (Resampler_Bank*)malloc(sizeof(Resampler_Bank));
+	create_bank(phases, step, quality, bank);
+	*owned = true;
+	return bank;
+}
+
+static void free_owned_bank(Resampler *resampler) {
+	if (resampler->owns_bank) {
+		::free(resampler->bank->coefficients);
+		::free((void*)resampler->bank);
+	}
+	resampler->bank = NULL;
+	resampler->owns_bank = false;
+}
+
+bool Resampler::init(u32 input_rate, u32 output_rate, Resampler_Quality quality) {
+	u32 phases, step;
+	const char *kernel_name;
+	
+	if (!reduce_rates(input_rate, output_rate, &phases, &step)) return false;
+	
+	bool same_bank = this->bank && this->bank->phases == phases && 
+		this->bank->step == step && this->bank->quality == quality;
+	
+	if (!same_bank) {
+		free_owned_bank(this);
+		this->bank = get_bank(phases, step, quality, &this->owns_bank);
+	}
+	
+	u32 capacity = this->bank->taps + RESAMPLER_BLOCK_FRAMES;
+	if (capacity > this->buffer_capacity) {
+		::free(this->buffer);
+		this->buffer = (float*)malloc(capacity * 2 * sizeof(float));
+		this->buffer_capacity = capacity;
+	}
+	
+	this->kernel = pick_kernel(&kernel_name);
+	this->reset();
+	return true;
+}
+
+void Resampler::reset() {
+	// Half a filter of silence lines the first output up with the first input frame
+	this->buffered_frames = this->bank->taps / 2 - 1;
+	memset(this->buffer, 0, this->buffered_frames * 2 * sizeof(float));
+	this->position = 0;
+	this->phase = 0;
+	this->flushed = false;
+}
+
+void Resampler::process(const float *input, u32 input_frames, float *output, u32 max_output_frames, 
+						bool end_of_input, u32 *input_frames_used, u32 *output_frames_generated) {
+	const u32 taps = this->bank->taps;
+	const u32 phases = this->bank->phases;
+	const u32 step = this->bank->step;
+	const float *coefficients = this->bank->coefficients;
+	u32 used = 0;
+	u32 generated = 0;
+	
+	while (1) {
+		while ((generated < max_output_frames) && (this->position + taps <= this->buffered_frames)) {
+			this->kernel(&this->buffer[this->position * 2], &coefficients[this->phase * taps * 2], taps, 
+						 &output[generated * 2]);
+			generated++;
+			
+			this->phase += step;
+			this->position += this->phase / phases;
+			this->phase %= phases;
+		}
+		
+		if (generated == max_output_frames) break;
+		
+		// Drop frames that are behind the filter
+		if (this->position) {
+			u32 remaining = this->buffered_frames - this->position;
+			memmove(this->buffer, &this->buffer[this->position * 2], remaining * 2 * sizeof(float));
+			this->buffered_frames = remaining;
+			this->position = 0;
+		}
+		
+		u32 count = MIN(this->buffer_capacity - this->buffered_frames, input_frames - used);
+		if (count) {
+			memcpy(&this->buffer[this->buffered_frames * 2], &input[used * 2], count * 2 * sizeof(float));
+			this->buffered_frames += count;
+			used += count;
+			continue;
+		}
+		
+		if (end_of_input && (used == input_frames) && !this->flushed) {
+			// Push the last input frames through the middle of the filter
+			u32 padding = taps / 2;
+			memset(&this->buffer[this->buffered_frames * 2], 0, padding * 2 * sizeof(float));
+			this->buffered_frames += padding;
+			this->flushed = true;
+			continue;
+		}
+		
+		break;
+	}
+	
+	*input_frames_used = used;
+	*output_frames_generated = generated;
+}
+
+void Resampler::free() {
+	free_owned_bank(this);
+	::free(this->buffer);
+	this->buffer = NULL;
+	this->buffer_capacity = 0;
+}
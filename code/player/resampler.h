@@ -0,0 +1,77 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#ifndef RESAMPLER_H
+#define RESAMPLER_H
+
+#include "common.h"
+
+// Ratios have to reduce to at most this many phases
+#define RESAMPLER_MAX_PHASES 1024
+// Input is copied into the resampler this many frames at a time
+#define RESAMPLER_BLOCK_FRAMES 1024
+
+enum Resampler_Quality {
+	RESAMPLER_QUALITY_LOW,
+	RESAMPLER_QUALITY_MEDIUM,
+	RESAMPLER_QUALITY_HIGH,
+	RESAMPLER_QUALITY_COUNT,
+};
+
+// Kaiser-windowed sinc filter split into one set of taps per output phase
+struct Resampler_Bank {
+	// Output rate / input rate reduced to phases / step
+	u32 phases;
+	u32 step;
+	u32 taps;
+	enum Resampler_Quality quality;
+	// phases * taps pairs. Each coefficient is stored twice so stereo frames can be used as is.
+	float *coefficients;
+};
+
+typedef void Resampler_Kernel(const float *frames, const float *coefficients, u32 taps, float *out);
+
+// Polyphase sample rate converter for interleaved stereo floats
+struct Resampler {
+	const Resampler_Bank *bank;
+	Resampler_Kernel *kernel;
+	// History followed by new input
+	float *buffer;
+	u32 buffer_capacity;
+	u32 buffered_frames;
+	// First frame under the filter for the next output
+	u32 position;
+	u32 phase;
+	bool flushed;
+	// Banks that didn't fit in the cache belong to the resampler
+	bool owns_bank;
+	
+	// Returns false if the ratio isn't supported. Calling again reuses what it can.
+	bool init(u32 input_rate, u32 output_rate, enum Resampler_Quality quality);
+	// Forget all input, as if just initialized
+	void reset();
+	// Works like src_process(). Consumes input until the output is full. Pass end_of_input with
+	// the last of the input to get the tail out of the filter.
+	void process(const float *input, u32 input_frames, float *output, u32 max_output_frames, bool end_of_input,
+				 u32 *input_frames_used, u32 *output_frames_generated);
+	void free();
+};
+
+bool resampler_supports_rates(u32 input_rate, u32 output_rate);
+const char *get_resampler_quality_name(enum Resampler_Quality quality);
+// Name of the inner loop the next init() will pick
+const char *get_resampler_kernel_name();
+
+#endif //RESAMPLER_H
@@ -0,0 +1,418 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "selection.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#define CHUNK_MASK (SELECTION_CHUNK_BITS - 1)
+
+static inline u32 count_bits(u64 word) {
+#ifdef _MSC_VER
+	return (u32)__popcnt64(word);
+#else
+	return (u32)__builtin_popcountll(word);
+#endif
+}
+
+static inline u32 lowest_bit(u64 word) {
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward64(&index, word);
+	return index;
+#else
+	return (u32)__builtin_ctzll(word);
+#endif
+}
+
+static void free_chunk_storage(Selection_Chunk *chunk) {
+	if (chunk->type == SELECTION_CHUNK_RUNS) ::free(chunk->runs);
+	else if (chunk->type == SELECTION_CHUNK_DENSE) ::free(chunk->words);
+	chunk->runs = NULL;
+	chunk->run_count = 0;
+}
+
+static void set_chunk_empty(Selection_Chunk *chunk) {
+	free_chunk_storage(chunk);
+	chunk->type = SELECTION_CHUNK_EMPTY;
+	chunk->count = 0;
+}
+
+static void set_chunk_full(Selection_Chunk *chunk) {
+	free_chunk_storage(chunk);
+	chunk->type = SELECTION_CHUNK_FULL;
+	chunk->count = SELECTION_CHUNK_BITS;
+}
+
+static void set_chunk_runs(Selection_Chunk *chunk, const Selection_Run *runs, u32 run_count) {
+	u32 count = 0;
+	for (u32 i = 0; i < run_count; ++i) count += (runs[i].last - runs[i].first) + 1;
+
+	if (!count) {
+		set_chunk_empty(chunk);
+		return;
+	}
+
+	if (count == SELECTION_CHUNK_BITS) {
+		set_chunk_full(chunk);
+		return;
+	}
+
+	if (chunk->type != SELECTION_CHUNK_RUNS) {
+		free_chunk_storage(chunk);
+		chunk->runs = (Selection_Run*)malloc(SELECTION_MAX_RUNS * sizeof(Selection_Run));
+		chunk->type = SELECTION_CHUNK_RUNS;
+	}
+
+	memcpy(chunk->runs, runs, run_count * sizeof(Selection_Run));
+	chunk->run_count = run_count;
+	chunk->count = count;
+}
+
+static void set_word_range(u64 *words, u32 first, u32 last, bool value) {
+	u32 first_word = first >> 6;
+	u32 last_word = last >> 6;
+
+	for (u32 w = first_word; w <= last_word; ++w) {
+		u64 mask = ~0ull;
+		if (w == first_word) mask &= ~0ull << (first & 63);
+		if (w == last_word) mask &= ~0ull >> (63 - (last & 63));
+
+		if (value) words[w] |= mask;
+		else words[w] &= ~mask;
+	}
+}
+
+static u32 count_dense_bits(const u64 *words) {
+	u32 count = 0;
+	for (u32 i = 0; i < SELECTION_CHUNK_WORDS; ++i) count += count_bits(words[i]);
+	return count;
+}
+
+static void convert_chunk_to_dense(Selection_Chunk *chunk) {
+	if (chunk->type == SELECTION_CHUNK_DENSE) return;
+
+	u64 *words = (u64*)calloc(SELECTION_CHUNK_WORDS, sizeof(u64));
+
+	if (chunk->type == SELECTION_CHUNK_FULL) {
+		memset(words, 0xff, SELECTION_CHUNK_WORDS * sizeof(u64));
+	}
+	else if (chunk->type == SELECTION_CHUNK_RUNS) {
+		for (u32 i = 0; i < chunk->run_count; ++i) {
+			set_word_range(words, chunk->runs[i].first, chunk->runs[i].last, true);
+		}
+	}
+
+	u32 count = chunk->count;
+	free_chunk_storage(chunk);
+	chunk->type = SELECTION_CHUNK_DENSE;
+	chunk->words = words;
+	chunk->count = count;
+}
+
+// Collapse a dense chunk that became empty or full
+static void normalize_dense_chunk(Selection_Chunk *chunk) {
+	chunk->count = count_dense_bits(chunk->words);
+	if (chunk->count == 0) set_chunk_empty(chunk);
+	else if (chunk->count == SELECTION_CHUNK_BITS) set_chunk_full(chunk);
+}
+
+static bool chunk_contains(const Selection_Chunk *chunk, u32 bit) {
+	switch (chunk->type) {
+		case SELECTION_CHUNK_FULL: return true;
+		case SELECTION_CHUNK_DENSE: return (chunk->words[bit >> 6] >> (bit & 63)) & 1;
+		case SELECTION_CHUNK_RUNS: {
+			s32 low = 0;
+			s32 high = (s32)chunk->run_count - 1;
+			while (low <= high) {
+				s32 mid = (low + high) / 2;
+				const Selection_Run *run = &chunk->runs[mid];
+				if (bit < run->first) high = mid - 1;
+				else if (bit > run->last) low = mid + 1;
+				else return true;
+			}
+			return false;
+		}
+		default: return false;
+	}
+}
+
+static void chunk_add_range(Selection_Chunk *chunk, u32 first, u32 last) {
+	switch (chunk->type) {
+		case SELECTION_CHUNK_FULL: return;
+
+		case SELECTION_CHUNK_EMPTY: {
+			Selection_Run run = {(u16)first, (u16)last};
+			set_chunk_runs(chunk, &run, 1);
+			return;
+		}
+
+		case SELECTION_CHUNK_RUNS: {
+			Selection_Run out[SELECTION_MAX_RUNS + 2];
+			const Selection_Run *runs = chunk->runs;
+			const u32 run_count = chunk->run_count;
+			u32 n = 0;
+			u32 i = 0;
+
+			// Runs entirely before the new range and not touching it
+			while (i < run_count && (u32)runs[i].last + 1 < first) out[n++] = runs[i++];
+
+			// Merge every run that overlaps or touches the new range
+			u32 merged_first = first;
+			u32 merged_last = last;
+			while (i < run_count && runs[i].first <= last + 1) {
+				merged_first = MIN(merged_first, runs[i].first);
+				merged_last = MAX(merged_last, runs[i].last);
+				i++;
+			}
+			out[n].first = (u16)merged_first;
+			out[n].last = (u16)merged_last;
+			n++;
+
+			if (n + (run_count - i) <= SELECTION_MAX_RUNS) {
+				while (i < run_count) out[n++] = runs[i++];
+				set_chunk_runs(chunk, out, n);
+				return;
+			}
+
+			convert_chunk_to_dense(chunk);
+			[[fallthrough]];
+		}
+
+		case SELECTION_CHUNK_DENSE: {
+			set_word_range(chunk->words, first, last, true);
+			normalize_dense_chunk(chunk);
+			return;
+		}
+	}
+}
+
+static void chunk_remove_range(Selection_Chunk *chunk, u32 first, u32 last) {
+	switch (chunk->type) {
+		case SELECTION_CHUNK_EMPTY: return;
+
+		case SELECTION_CHUNK_FULL:
+		case SELECTION_CHUNK_RUNS: {
+			Selection_Run full = {0, (u16)CHUNK_MASK};
+			Selection_Run out[SELECTION_MAX_RUNS + 2];
+			const Selection_Run *runs = chunk->type == SELECTION_CHUNK_FULL ? &full : chunk->runs;
+			const u32 run_count = chunk->type == SELECTION_CHUNK_FULL ? 1 : chunk->run_count;
+			u32 n = 0;
+
+			for (u32 i = 0; i < run_count; ++i) {
+				if (runs[i].last < first || runs[i].first > last) {
+					out[n++] = runs[i];
+					continue;
+				}
+
+				if (runs[i].first < first) {
+					out[n].first = runs[i].first;
+					out[n].last = (u16)(first - 1);
+					n++;
+				}
+
+				if (runs[i].last > last) {
+					out[n].first = (u16)(last + 1);
+					out[n].last = runs[i].last;
+					n++;
+				}
+			}
+
+			if (n <= SELECTION_MAX_RUNS) {
+				set_chunk_runs(chunk, out, n);
+				return;
+			}
+
+			convert_chunk_to_dense(chunk);
+			[[fallthrough]];
+		}
+
+		case SELECTION_CHUNK_DENSE: {
+			set_word_range(chunk->words, first, last, false);
+			normalize_dense_chunk(chunk);
+			return;
+		}
+	}
+}
+
+static void reserve_chunks(Selection_Set *set, u32 chunk_count) {
+	if (chunk_count <= set->chunk_count) return;
+
+	set->chunks = (Selection_Chunk*)realloc(set->chunks, chunk_count * sizeof(Selection_Chunk));
+	memset(&set->chunks[set->chunk_count], 0, (chunk_count - set->chunk_count) * sizeof(Selection_Chunk));
+	set->chunk_count = chunk_count;
+}
+
+bool Selection_Set::contains(u32 row) const {
+	u32 chunk = row >> SELECTION_CHUNK_SHIFT;
+	if (chunk >= this->chunk_count) return false;
+	return chunk_contains(&this->chunks[chunk], row & CHUNK_MASK);
+}
+
+void Selection_Set::add_range(u32 first, u32 last) {
+	if (first > last) return;
+
+	reserve_chunks(this, (last >> SELECTION_CHUNK_SHIFT) + 1);
+
+	for (u32 c = first >> SELECTION_CHUNK_SHIFT; c <= (last >> SELECTION_CHUNK_SHIFT); ++c) {
+		Selection_Chunk *chunk = &this->chunks[c];
+		u32 chunk_start = c << SELECTION_CHUNK_SHIFT;
+		u32 local_first = MAX(first, chunk_start) - chunk_start;
+		u32 local_last = MIN(last, chunk_start + CHUNK_MASK) - chunk_start;
+
+		this->count -= chunk->count;
+		if (local_first == 0 && local_last == CHUNK_MASK) set_chunk_full(chunk);
+		else chunk_add_range(chunk, local_first, local_last);
+		this->count += chunk->count;
+	}
+}
+
+void Selection_Set::add(u32 row) {
+	this->add_range(row, row);
+}
+
+void Selection_Set::remove(u32 row) {
+	u32 c = row >> SELECTION_CHUNK_SHIFT;
+	if (c >= this->chunk_count) return;
+
+	Selection_Chunk *chunk = &this->chunks[c];
+	this->count -= chunk->count;
+	chunk_remove_range(chunk, row & CHUNK_MASK, row & CHUNK_MASK);
+	this->count += chunk->count;
+}
+
+void Selection_Set::toggle(u32 row) {
+	if (this->contains(row)) this->remove(row);
+	else this->add(row);
+}
+
+void Selection_Set::invert(u32 row_count) {
+	if (!row_count) return;
+
+	const u32 needed_chunks = ((row_count - 1) >> SELECTION_CHUNK_SHIFT) + 1;
+	reserve_chunks(this, needed_chunks);
+
+	for (u32 c = 0; c < needed_chunks; ++c) {
+		Selection_Chunk *chunk = &this->chunks[c];
+		u32 limit = MIN(row_count - (c << SELECTION_CHUNK_SHIFT), (u32)SELECTION_CHUNK_BITS);
+
+		this->count -= chunk->count;
+
+		switch (chunk->type) {
+			case SELECTION_CHUNK_EMPTY:
+			if (limit == SELECTION_CHUNK_BITS) set_chunk_full(chunk);
+			else chunk_add_range(chunk, 0, limit - 1);
+			break;
+
+			case SELECTION_CHUNK_FULL:
+			if (limit == SELECTION_CHUNK_BITS) set_chunk_empty(chunk);
+			else chunk_remove_range(chunk, 0, limit - 1);
+			break;
+
+			case SELECTION_CHUNK_RUNS: {
+				// The complement of n sorted runs is at most n+1 runs
+				Selection_Run out[SELECTION_MAX_RUNS + 1];
+				u32 n = 0;
+				u32 position = 0;
+
+				for (u32 i = 0; i < chunk->run_count && chunk->runs[i].first < limit; ++i) {
+					if (chunk->runs[i].first > position) {
+						out[n].first = (u16)position;
+						out[n].last = chunk->runs[i].first - 1;
+						n++;
+					}
+					position = chunk->runs[i].last + 1;
+				}
+
+				if (position < limit) {
+					out[n].first = (u16)position;
+					out[n].last = (u16)(limit - 1);
+					n++;
+				}
+
+				if (n <= SELECTION_MAX_RUNS) {
+					set_chunk_runs(chunk, out, n);
+					break;
+				}
+
+				convert_chunk_to_dense(chunk);
+				[[fallthrough]];
+			}
+
+			case SELECTION_CHUNK_DENSE: {
+				for (u32 w = 0; w < SELECTION_CHUNK_WORDS; ++w) chunk->words[w] = ~chunk->words[w];
+				if (limit < SELECTION_CHUNK_BITS) set_word_range(chunk->words, limit, CHUNK_MASK, false);
+				normalize_dense_chunk(chunk);
+				break;
+			}
+		}
+
+		this->count += chunk->count;
+	}
+}
+
+u32 Selection_Set::next(u32 row) const {
+	u32 c = row >> SELECTION_CHUNK_SHIFT;
+	u32 bit = row & CHUNK_MASK;
+
+	for (; c < this->chunk_count; ++c, bit = 0) {
+		const Selection_Chunk *chunk = &this->chunks[c];
+		const u32 base = c << SELECTION_CHUNK_SHIFT;
+
+		switch (chunk->type) {
+			case SELECTION_CHUNK_FULL:
+			return base + bit;
+
+			case SELECTION_CHUNK_RUNS:
+			for (u32 i = 0; i < chunk->run_count; ++i) {
+				if (chunk->runs[i].last >= bit) return base + MAX(bit, (u32)chunk->runs[i].first);
+			}
+			break;
+
+			case SELECTION_CHUNK_DENSE: {
+				u32 w = bit >> 6;
+				u64 word = chunk->words[w] & (~0ull << (bit & 63));
+				while (1) {
+					if (word) return base + (w << 6) + lowest_bit(word);
+					if (++w == SELECTION_CHUNK_WORDS) break;
+					word = chunk->words[w];
+				}
+				break;
+			}
+		}
+	}
+
+	return UINT32_MAX;
+}
+
+u32 Selection_Set::first() const {
+	return this->next(0);
+}
+
+void Selection_Set::clear() {
+	for (u32 i = 0; i < this->chunk_count; ++i) set_chunk_empty(&this->chunks[i]);
+	this->count = 0;
+}
+
+void Selection_Set::free() {
+	this->clear();
+	::free(this->chunks);
+	this->chunks = NULL;
+	this->chunk_count = 0;
+}
@@ -0,0 +1,74 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#ifndef SELECTION_H
+#define SELECTION_H
+
+#include "common.h"
+
+#define SELECTION_CHUNK_SHIFT 16
+#define SELECTION_CHUNK_BITS (1<<SELECTION_CHUNK_SHIFT)
+#define SELECTION_CHUNK_WORDS (SELECTION_CHUNK_BITS / 64)
+// Past this many runs a chunk is converted to a dense bitmap
+#define SELECTION_MAX_RUNS 64
+
+enum Selection_Chunk_Type {
+	SELECTION_CHUNK_EMPTY,
+	SELECTION_CHUNK_FULL,
+	SELECTION_CHUNK_RUNS,
+	SELECTION_CHUNK_DENSE,
+};
+
+// Inclusive range of rows within a chunk
+struct Selection_Run {
+	u16 first;
+	u16 last;
+};
+
+struct Selection_Chunk {
+	u8 type;
+	u16 run_count;
+	// Number of selected rows in the chunk
+	u32 count;
+	union {
+		Selection_Run *runs;
+		u64 *words;
+	};
+};
+
+// Set of selected row indices. Rows are grouped into chunks of 65536 which are stored
+// as nothing (empty/full), a short sorted run list, or a dense bitmap, whichever is smaller.
+struct Selection_Set {
+	Selection_Chunk *chunks;
+	u32 chunk_count;
+	u32 count;
+
+	bool contains(u32 row) const;
+	void add(u32 row);
+	void remove(u32 row);
+	void toggle(u32 row);
+	// Inclusive range
+	void add_range(u32 first, u32 last);
+	// Flip every row in [0, row_count)
+	void invert(u32 row_count);
+	// Returns the lowest selected row, or UINT32_MAX
+	u32 first() const;
+	// Returns the lowest selected row >= row, or UINT32_MAX
+	u32 next(u32 row) const;
+	void clear();
+	void free();
+};
+
+#endif //SELECTION_H
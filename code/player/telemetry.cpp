@@ -0,0 +1,76 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "telemetry.h"
+
+static u32 get_bucket(u32 us) {
+	u32 bucket = 0;
+	while (us >= 2 && bucket < TELEMETRY_HISTOGRAM_BUCKETS - 1) {
+		us >>= 1;
+		++bucket;
+	}
+	return bucket;
+}
+
+float Telemetry_Histogram::get_mean_us() const {
+	return this->count ? (float)((double)this->total_us / this->count) : 0.f;
+}
+
+u32 Telemetry_Histogram::get_percentile_us(float fraction) const {
+	u64 total = 0;
+	for (u32 i = 0; i < TELEMETRY_HISTOGRAM_BUCKETS; ++i) total += this->buckets[i];
+	if (!total) return 0;
+	
+	// Counted from the buckets rather than count, which can be a duration ahead of them
+	u64 wanted = (u64)(total * fraction + 0.5);
+	u64 seen = 0;
+	for (u32 i = 0; i < TELEMETRY_HISTOGRAM_BUCKETS - 1; ++i) {
+		seen += this->buckets[i];
+		if (seen >= wanted) return MIN(2u << i, this->max_us);
+	}
+	
+	return this->max_us;
+}
+
+// Plain loads and stores rather than read-modify-writes, since nobody else writes
+void Telemetry_Recorder::add(u32 us) {
+	const std::memory_order relaxed = std::memory_order_relaxed;
+	std::atomic<u32> *bucket = &this->buckets[get_bucket(us)];
+	
+	bucket->store(bucket->load(relaxed) + 1, relaxed);
+	this->total_us.store(this->total_us.load(relaxed) + us, relaxed);
+	if (us > this->max_us.load(relaxed)) this->max_us.store(us, relaxed);
+	this->count.store(this->count.load(relaxed) + 1, relaxed);
+}
+
+void Telemetry_Recorder::read(Telemetry_Histogram *out) const {
+	const std::memory_order relaxed = std::memory_order_relaxed;
+	
+	for (u32 i = 0; i < TELEMETRY_HISTOGRAM_BUCKETS; ++i) out->buckets[i] = this->buckets[i].load(relaxed);
+	out->count = this->count.load(relaxed);
+	out->total_us = this->total_us.load(relaxed);
+	out->max_us = this->max_us.load(relaxed);
+}
+
+void write_telemetry_summary(FILE *file, const char *name, const Telemetry_Histogram *histogram) {
+	fprintf(file, "%-16s %10u %10.1f %10u %10u %10u\n", name, histogram->count, histogram->get_mean_us(),
+			histogram->get_percentile_us(0.5f), histogram->get_percentile_us(0.99f), histogram->max_us);
+}
+
+void write_telemetry_buckets(FILE *file, const char *name, const Telemetry_Histogram *histogram) {
+	fprintf(file, "%-16s", name);
+	for (u32 i = 0; i < TELEMETRY_HISTOGRAM_BUCKETS; ++i) fprintf(file, " %u", histogram->buckets[i]);
+	fprintf(file, "\n");
+}
@@ -0,0 +1,59 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include "common.h"
+#include <atomic>
+#include <stdio.h>
+
+// Histograms of how long things take on the audio path. The thread doing the work adds to a recorder
+// without locking or waiting, and any other thread can read a copy at any time. The copy can be a
+// few durations behind, but never blocks the writer.
+
+// Bucket 0 is under 2us and bucket i is 2^i to 2^(i+1)us. The last one also takes everything longer,
+// from about half a second up.
+#define TELEMETRY_HISTOGRAM_BUCKETS 20
+
+struct Telemetry_Histogram {
+	u32 buckets[TELEMETRY_HISTOGRAM_BUCKETS];
+	u32 count;
+	u64 total_us;
+	u32 max_us;
+	
+	float get_mean_us() const;
+	// The top of the bucket that holds this fraction of the durations, like 0.99 for the 99th percentile.
+	// 0 if there are none.
+	u32 get_percentile_us(float fraction) const;
+};
+
+// Only one thread may add to each
+struct Telemetry_Recorder {
+	std::atomic<u32> buckets[TELEMETRY_HISTOGRAM_BUCKETS];
+	std::atomic<u32> count;
+	std::atomic<u64> total_us;
+	std::atomic<u32> max_us;
+	
+	void add(u32 us);
+	void read(Telemetry_Histogram *out) const;
+};
+
+// One line of count, mean, median, 99th percentile and maximum
+void write_telemetry_summary(FILE *file, const char *name, const Telemetry_Histogram *histogram);
+// One line with every bucket
+void write_telemetry_buckets(FILE *file, const char *name, const Telemetry_Histogram *histogram);
+
+#endif //TELEMETRY_H
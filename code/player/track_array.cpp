@@ -1,5 +1,7 @@
 #include "common.h"
 #include "library.h"
+#include <stdlib.h>
+#include <string.h>
 
 void Track_Array::add_from_id(u32 id) {
 	const Track_Info *track = lookup_track(id);
@@ -45,3 +47,93 @@ void Track_Array::free() {
 	this->ids.free();
 	this->info.free();
 }
+
+static inline u32 id_set_slot(u32 id, u32 capacity) {
+	// Track IDs are already hashes
+	return id & (capacity - 1);
+}
+
+void Track_Id_Set::reserve(u32 count) {
+	u32 capacity = this->capacity ? this->capacity : 16;
+	// Keep the load factor under 50%
+	while (capacity < count * 2) capacity <<= 1;
+	if (capacity == this->capacity) return;
+	
+	u32 *old_ids = this->ids;
+	u8 *old_used = this->used;
+	u32 old_capacity = this->capacity;
+	
+	// Most sets are small and short lived, so they come from the heap rather than pages of their own
+	this->ids = (u32*)calloc(capacity, sizeof(u32) + 1);
+	this->used = (u8*)&this->ids[capacity];
+	this->capacity = capacity;
+	this->count = 0;
+	
+	for (u32 i = 0; i < old_capacity; ++i) {
+		if (old_used[i]) this->add(old_ids[i]);
+	}
+	
+	::free(old_ids);
+}
+
+bool Track_Id_Set::add(u32 id) {
+	if ((this->count + 1) * 2 > this->capacity) this->reserve(this->count + 1);
+	
+	u32 slot = id_set_slot(id, this->capacity);
+	while (this->used[slot]) {
+		if (this->ids[slot] == id) return false;
+		slot = (slot + 1) & (this->capacity - 1);
+	}
+	
+	this->ids[slot] = id;
+	this->used[slot] = 1;
+	this->count++;
+	return true;
+}
+
+bool Track_Id_Set::contains(u32 id) const {
+	if (!this->capacity) return false;
+	
+	u32 slot = id_set_slot(id, this->capacity);
+	while (this->used[slot]) {
+		if (this->ids[slot] == id) return true;
+		slot = (slot + 1) & (this->capacity - 1);
+	}
+	return false;
+}
+
+void Track_Id_Set::remove(u32 id) {
+	if (!this->capacity) return;
+	
+	const u32 mask = this->capacity - 1;
+	u32 slot = id_set_slot(id, this->capacity);
+	while (this->used[slot] && this->ids[slot] != id) slot = (slot + 1) & mask;
+	if (!this->used[slot]) return;
+	
+	// Backward shift deletion so probe chains stay intact without tombstones
+	u32 next = (slot + 1) & mask;
+	while (this->used[next]) {
+		u32 home = id_set_slot(this->ids[next], this->capacity);
+		if (((next - home) & mask) >= ((next - slot) & mask)) {
+			this->ids[slot] = this->ids[next];
+			slot = next;
+		}
+		next = (next + 1) & mask;
+	}
+	
+	this->used[slot] = 0;
+	this->count--;
+}
+
+void Track_Id_Set::reset() {
+	if (this->capacity) memset(this->used, 0, this->capacity);
+	this->count = 0;
+}
+
+void Track_Id_Set::free() {
+	::free(this->ids);
+	this->ids = NULL;
+	this->used = NULL;
+	this->capacity = 0;
+	this->count = 0;
+}
@@ -0,0 +1,387 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+// Runs each decoder on its own, as fast as it will go, the way the player's producer thread calls it.
+// For every file it reports how many times faster than realtime it decodes, how long single decode
+// calls take, how long seeking to random positions takes, and how often the heap is touched.
+// With no files, a corpus of WAVs and a FLAC is generated. MP3 and Opus files have to be given.
+//
+// Usage: decoder_bench [--chunk-ms N] [--seeks N] [--corpus DIR] [files...]
+#include "../player/common.h"
+#include "../player/decoders.h"
+#include "../player/platform.h"
+#include <FLAC/stream_encoder.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The same as PIPELINE_DECODE_CHUNK_MS
+#define BENCH_DEFAULT_CHUNK_MS 120
+#define BENCH_DEFAULT_SEEKS 200
+#define BENCH_MAX_FILES 64
+#define BENCH_CORPUS_SECONDS 60
+#define BENCH_CORPUS_SAMPLE_RATE 44100
+
+// Counts heap allocations made by the thread that is being measured. glibc's malloc can be wrapped
+// directly; on Windows it takes the debug CRT's hook, like the player's real-time check.
+static thread_local bool t_counting_allocations;
+static u64 g_allocation_count;
+
+#if defined(__GLIBC__)
+#define BENCH_CAN_COUNT_ALLOCATIONS 1
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *address, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+
+void *malloc(size_t size) {
+	if (t_counting_allocations) g_allocation_count++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+	if (t_counting_allocations) g_allocation_count++;
+	return __libc_calloc(count, size);
+}
+
+void *realloc(void *address, size_t size) {
+	if (t_counting_allocations) g_allocation_count++;
+	return __libc_realloc(address, size);
+}
+
+int posix_memalign(void **out, size_t alignment, size_t size) {
+	if (t_counting_allocations) g_allocation_count++;
+	*out = __libc_memalign(alignment, size);
+	return *out ? 0 : 12; // ENOMEM
+}
+}
+#elif defined(_WIN32) && defined(_DEBUG)
+#define BENCH_CAN_COUNT_ALLOCATIONS 1
+#include <crtdbg.h>
+
+static int count_allocation_hook(int type, void *data, size_t size, int block_type, long request,
+								 const unsigned char *file, int line) {
+	if (t_counting_allocations && (type == _HOOK_ALLOC || type == _HOOK_REALLOC)) g_allocation_count++;
+	return 1;
+}
+#else
+#define BENCH_CAN_COUNT_ALLOCATIONS 0
+#endif
+
+static const char *g_codec_names[] = {"none", "mp3", "opus", "wav", "flac"};
+
+struct Latency_Samples {
+	float *milliseconds;
+	u32 count;
+	u32 capacity;
+	
+	void add(float value) {
+		if (this->count == this->capacity) {
+			this->capacity = MAX(this->capacity * 2, 1024u);
+			this->milliseconds = (float*)realloc(this->milliseconds, this->capacity * sizeof(float));
+		}
+		this->milliseconds[this->count++] = value;
+	}
+	
+	// Only valid after sort()
+	float percentile(float p) const {
+		if (!this->count) return 0.f;
+		u32 index = (u32)(p * (this->count - 1) + 0.5f);
+		return this->milliseconds[MIN(index, this->count - 1)];
+	}
+	
+	void sort();
+	void reset() {this->count = 0;}
+	void free() {::free(this->milliseconds); *this = {};}
+};
+
+static int compare_floats(const void *a, const void *b) {
+	float x = *(const float*)a, y = *(const float*)b;
+	return (x > y) - (x < y);
+}
+
+void Latency_Samples::sort() {
+	qsort(this->milliseconds, this->count, sizeof(float), &compare_floats);
+}
+
+struct Bench_Options {
+	u32 chunk_ms;
+	u32 seek_count;
+	const char *corpus_directory;
+};
+
+struct Bench_Result {
+	double open_ms;
+	double decode_seconds;
+	double audio_seconds;
+	u64 decode_calls;
+	u64 decode_allocations;
+	u64 open_allocations;
+	u64 seek_allocations;
+	Latency_Samples call_latency;
+	Latency_Samples seek_latency;
+	// Seeking and then decoding the first chunk, which is what the user waits for
+	Latency_Samples seek_to_audio_latency;
+};
+
+static inline float get_milliseconds_since(u64 start) {
+	return time_ticks_to_milliseconds(time_get_tick() - start);
+}
+
+static inline void begin_counting_allocations() {
+	t_counting_allocations = true;
+}
+
+static inline u64 end_counting_allocations() {
+	t_counting_allocations = false;
+	u64 count = g_allocation_count;
+	g_allocation_count = 0;
+	return count;
+}
+
+// A few partials and some noise, so the lossless encoders can't just collapse it
+static void generate_signal(s32 *samples, u32 frame_count, u32 sample_rate) {
+	const float frequencies[] = {110.f, 440.f, 1375.f, 5210.f};
+	u32 seed = 1;
+	
+	for (u32 i = 0; i < frame_count; ++i) {
+		float t = (float)i / sample_rate;
+		float value = 0.f;
+		
+		for (u32 p = 0; p < ARRAY_LENGTH(frequencies); ++p) value += 0.18f * sinf(6.2831853f * frequencies[p] * t);
+		
+		for (u32 c = 0; c < 2; ++c) {
+			seed = seed * 1664525 + 1013904223;
+			float noise = ((s32)seed >> 8) * (0.02f / 8388608.f);
+			float sample = (c ? value * 0.8f : value) + noise;
+			samples[i*2+c] = (s32)(sample * 8388607.f);
+		}
+	}
+}
+
+static bool write_wav(const char *path, const s32 *samples, u32 frame_count, u32 format_tag, u32 bits) {
+	FILE *file = fopen(path, "wb");
+	if (!file) return false;
+	
+	u32 bytes_per_sample = bits / 8;
+	u32 data_size = frame_count * 2 * bytes_per_sample;
+	u32 header[11] = {
+		0x46464952, 36 + data_size, 0x45564157,            // "RIFF" size "WAVE"
+		0x20746d66, 16, format_tag | (2 << 16),            // "fmt " 16, tag, channels
+		BENCH_CORPUS_SAMPLE_RATE, BENCH_CORPUS_SAMPLE_RATE * 2 * bytes_per_sample,
+		(2 * bytes_per_sample) | (bits << 16),
+		0x61746164, data_size,                             // "data" size
+	};
+	
+	fwrite(header, sizeof(header), 1, file);
+	
+	for (u32 i = 0; i < frame_count * 2; ++i) {
+		if (format_tag == 3) {
+			float value = samples[i] / 8388608.f;
+			fwrite(&value, 4, 1, file);
+		}
+		else {
+			s32 value = (s32)((u32)samples[i] << 8);
+			// The top bytes of the sample, little endian
+			fwrite((u8*)&value + (4 - bytes_per_sample), bytes_per_sample, 1, file);
+		}
+	}
+	
+	fclose(file);
+	return true;
+}
+
+static bool write_flac(const char *path, const s32 *samples, u32 frame_count) {
+	FLAC__StreamEncoder *encoder = FLAC__stream_encoder_new();
+	bool ok = encoder != NULL;
+	
+	if (ok) {
+		FLAC__stream_encoder_set_channels(encoder, 2);
+		FLAC__stream_encoder_set_bits_per_sample(encoder, 24);
+		FLAC__stream_encoder_set_sample_rate(encoder, BENCH_CORPUS_SAMPLE_RATE);
+		FLAC__stream_encoder_set_compression_level(encoder, 5);
+		FLAC__stream_encoder_set_total_samples_estimate(encoder, frame_count);
+		ok = FLAC__stream_encoder_init_file(encoder, path, NULL, NULL) == FLAC__STREAM_ENCODER_INIT_STATUS_OK;
+	}
+	
+	if (ok) ok = FLAC__stream_encoder_process_interleaved(encoder, samples, frame_count);
+	if (ok) ok = FLAC__stream_encoder_finish(encoder);
+	if (encoder) FLAC__stream_encoder_delete(encoder);
+	return ok;
+}
+
+// Returns the number of files written
+static u32 generate_corpus(const char *directory, char paths[][512]) {
+	u32 frame_count = BENCH_CORPUS_SECONDS * BENCH_CORPUS_SAMPLE_RATE;
+	s32 *samples = (s32*)malloc(frame_count * 2 * sizeof(s32));
+	u32 count = 0;
+	
+	_mkdir(directory);
+	generate_signal(samples, frame_count, BENCH_CORPUS_SAMPLE_RATE);
+	printf("Generating %us of audio in %s\n", BENCH_CORPUS_SECONDS, directory);
+	
+	snprintf(paths[count], 512, "%s/s16.wav", directory);
+	if (write_wav(paths[count], samples, frame_count, 1, 16)) count++;
+	snprintf(paths[count], 512, "%s/s24.wav", directory);
+	if (write_wav(paths[count], samples, frame_count, 1, 24)) count++;
+	snprintf(paths[count], 512, "%s/f32.wav", directory);
+	if (write_wav(paths[count], samples, frame_count, 3, 32)) count++;
+	snprintf(paths[count], 512, "%s/s24.flac", directory);
+	if (write_flac(paths[count], samples, frame_count)) count++;
+	else printf("Failed to encode %s\n", paths[count]);
+	
+	free(samples);
+	return count;
+}
+
+static bool bench_file(const wchar_t *path, const Bench_Options *options, Bench_Result *result) {
+	Decoder decoder = {};
+	PCM_Format format;
+	
+	begin_counting_allocations();
+	u64 start = time_get_tick();
+	bool opened = decoder.open(path, (float)options->chunk_ms, &format);
+	result->open_ms = get_milliseconds_since(start);
+	result->open_allocations = end_counting_allocations();
+	
+	if (!opened) return false;
+	
+	u32 chunk_frames = format.sample_rate * options->chunk_ms / 1000;
+	float *buffer = (float*)malloc(chunk_frames * 2 * sizeof(float));
+	u64 total_frames = 0;
+	u64 decode_ticks = 0;
+	
+	// Straight through
+	while (1) {
+		begin_counting_allocations();
+		start = time_get_tick();
+		u32 frame_count = decoder.decode(chunk_frames, buffer);
+		u64 ticks = time_get_tick() - start;
+		result->decode_allocations += end_counting_allocations();
+		
+		result->call_latency.add(time_ticks_to_milliseconds(ticks));
+		result->decode_calls++;
+		decode_ticks += ticks;
+		total_frames += frame_count;
+		if (frame_count < chunk_frames) break;
+	}
+	
+	result->decode_seconds = time_ticks_to_milliseconds(decode_ticks) / 1000.0;
+	result->audio_seconds = (double)total_frames / format.sample_rate;
+	
+	// Random positions, the same ones every run. Positions are interleaved samples.
+	u32 seed = 12345;
+	for (u32 i = 0; i < options->seek_count && total_frames; ++i) {
+		seed = seed * 1664525 + 1013904223;
+		u64 sample = ((u64)seed * total_frames >> 32) * 2;
+		
+		begin_counting_allocations();
+		start = time_get_tick();
+		decoder.seek(sample);
+		float seek_ms = get_milliseconds_since(start);
+		decoder.decode(chunk_frames, buffer);
+		float seek_to_audio_ms = get_milliseconds_since(start);
+		result->seek_allocations += end_counting_allocations();
+		
+		result->seek_latency.add(seek_ms);
+		result->seek_to_audio_latency.add(seek_to_audio_ms);
+	}
+	
+	decoder.close();
+	free(buffer);
+	
+	result->call_latency.sort();
+	result->seek_latency.sort();
+	result->seek_to_audio_latency.sort();
+	return true;
+}
+
+static void print_result(const char *name, Codec codec, const Bench_Options *options, const Bench_Result *result) {
+	const Latency_Samples *calls = &result->call_latency;
+	const Latency_Samples *seeks = &result->seek_latency;
+	const Latency_Samples *seek_to_audio = &result->seek_to_audio_latency;
+	
+	printf("\n%s (%s)\n", name, g_codec_names[codec]);
+	printf("  Open:     %.3fms", result->open_ms);
+	if (BENCH_CAN_COUNT_ALLOCATIONS) printf(", %llu allocations", (unsigned long long)result->open_allocations);
+	printf("\n");
+	printf("  Decode:   %.1fs of audio in %.3fs, %.1fx realtime\n", result->audio_seconds, result->decode_seconds,
+		   result->audio_seconds / MAX(result->decode_seconds, 1e-9));
+	printf("  Calls:    %llu of %ums, p50 %.3fms  p90 %.3fms  p99 %.3fms  p99.9 %.3fms  max %.3fms\n",
+		   (unsigned long long)result->decode_calls, options->chunk_ms, calls->percentile(0.5f), calls->percentile(0.9f),
+		   calls->percentile(0.99f), calls->percentile(0.999f), calls->percentile(1.f));
+	if (BENCH_CAN_COUNT_ALLOCATIONS) {
+		printf("  Heap:     %.3f allocations per decode call\n", (double)result->decode_allocations / result->decode_calls);
+	}
+	if (seeks->count) {
+		printf("  Seek:     %u random, p50 %.3fms  p99 %.3fms  max %.3fms\n", seeks->count, seeks->percentile(0.5f),
+			   seeks->percentile(0.99f), seeks->percentile(1.f));
+		printf("  To audio: p50 %.3fms  p99 %.3fms  max %.3fms", seek_to_audio->percentile(0.5f),
+			   seek_to_audio->percentile(0.99f), seek_to_audio->percentile(1.f));
+		if (BENCH_CAN_COUNT_ALLOCATIONS) printf(", %.2f allocations per seek", (double)result->seek_allocations / seeks->count);
+		printf("\n");
+	}
+}
+
+int main(int argc, char **argv) {
+	Bench_Options options = {BENCH_DEFAULT_CHUNK_MS, BENCH_DEFAULT_SEEKS, "decoder_bench_corpus"};
+	static char paths[BENCH_MAX_FILES][512];
+	u32 path_count = 0;
+	
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--chunk-ms") && i + 1 < argc) options.chunk_ms = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--seeks") && i + 1 < argc) options.seek_count = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--corpus") && i + 1 < argc) options.corpus_directory = argv[++i];
+		else if (argv[i][0] == '-') {
+			printf("Usage: decoder_bench [--chunk-ms N] [--seeks N] [--corpus DIR] [files...]\n");
+			return 1;
+		}
+		else if (path_count < BENCH_MAX_FILES) snprintf(paths[path_count++], 512, "%s", argv[i]);
+	}
+	
+	options.chunk_ms = MAX(options.chunk_ms, 1);
+
+#if defined(_WIN32) && defined(_DEBUG)
+	_CrtSetAllocHook(&count_allocation_hook);
+#endif
+
+	if (!path_count) path_count = generate_corpus(options.corpus_directory, paths);
+	if (!BENCH_CAN_COUNT_ALLOCATIONS) printf("Allocations aren't counted in this build\n");
+	
+	u32 failed_count = 0;
+	for (u32 i = 0; i < path_count; ++i) {
+		wchar_t path[512];
+		Bench_Result result = {};
+		
+		utf8_to_utf16(paths[i], path, ARRAY_LENGTH(path));
+		Codec codec = find_codec_from_file_name(path);
+		
+		if (!get_decoder_functions(codec) || !bench_file(path, &options, &result)) {
+			printf("\n%s: failed to decode\n", paths[i]);
+			failed_count++;
+		}
+		else {
+			print_result(paths[i], codec, &options, &result);
+		}
+		
+		result.call_latency.free();
+		result.seek_latency.free();
+		result.seek_to_audio_latency.free();
+	}
+	
+	return failed_count ? 1 : 0;
+}
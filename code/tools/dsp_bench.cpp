@@ -0,0 +1,307 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+// Measures what the DSP chain costs at each output rate, as a share of one core, and checks that
+// the EQ has the gain it was asked for and the limiter never lets a peak through. Then does the same
+// for the convolver with impulse responses of different lengths, and checks it against convolving
+// directly. Audio goes through in blocks the size of a device refill.
+#include "../player/common.h"
+#include "../player/cpu.h"
+#include "../player/dsp.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#define BENCH_SECONDS 10
+#define BENCH_BLOCK_MS 10
+#define PI 3.14159265358979323846
+
+static const u32 g_sample_rates[] = {44100, 48000, 96000, 192000};
+static const u32 g_convolution_rates[] = {48000, 96000};
+// Taps
+static const u32 g_impulse_lengths[] = {16384, 65536, 131072, 262144};
+
+static double get_seconds() {
+#ifdef _WIN32
+	LARGE_INTEGER counter, frequency;
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+	return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec * 1e-9;
+#endif
+}
+
+// White noise peaking at amplitude
+static float *generate_noise(u32 frame_count, float amplitude) {
+	float *frames = (float*)malloc(frame_count * 2 * sizeof(float));
+	u32 seed = 1;
+	
+	for (u32 i = 0; i < frame_count * 2; ++i) {
+		seed = seed * 1664525 + 1013904223;
+		frames[i] = ((seed >> 8) / (float)(1 << 23) - 1.f) * amplitude;
+	}
+	return frames;
+}
+
+// Every band moved so none of them are skipped
+static void get_eq_settings(Dsp_Settings *settings) {
+	get_default_dsp_settings(settings);
+	settings->eq_enabled = true;
+	for (u32 i = 0; i < settings->band_count; ++i) settings->bands[i].gain_db = (i & 1) ? -3.f : 3.f;
+}
+
+static void get_full_settings(Dsp_Settings *settings) {
+	get_eq_settings(settings);
+	settings->preamp_db = -2.f;
+	settings->limiter_enabled = true;
+	settings->volume = 0.8f;
+}
+
+// Returns the share of one core the chain needs to keep up in real time
+static double run_chain(const Dsp_Settings *settings, u32 sample_rate, const float *input, float *work, u32 frame_count) {
+	const u32 block_frames = (sample_rate * BENCH_BLOCK_MS) / 1000;
+	Dsp_Chain chain = {};
+	
+	chain.init(sample_rate, settings);
+	memcpy(work, input, frame_count * 2 * sizeof(float));
+	
+	double start = get_seconds();
+	for (u32 i = 0; i < frame_count; i += block_frames) {
+		chain.process(&work[i*2], MIN(block_frames, frame_count - i));
+	}
+	double seconds = get_seconds() - start;
+	
+	chain.free();
+	return seconds / ((double)frame_count / sample_rate);
+}
+
+// Decaying noise, like a room
+static void generate_impulse_response(u32 frame_count, Impulse_Response *out) {
+	out->frames = generate_noise(frame_count, 0.5f);
+	out->frame_count = frame_count;
+	for (u32 i = 0; i < frame_count; ++i) {
+		float decay = expf(-4.f * i / frame_count);
+		out->frames[i*2+0] *= decay;
+		out->frames[i*2+1] *= decay;
+	}
+}
+
+// Share of one core for each channel, and the longest any block took in milliseconds
+static double run_convolver(const Impulse_Response *impulse_response, u32 sample_rate, const float *input, float *work,
+							u32 frame_count, double *worst_block_ms) {
+	const u32 block_frames = (sample_rate * BENCH_BLOCK_MS) / 1000;
+	Convolver convolver = {};
+	double worst = 0.0;
+	
+	convolver.init(impulse_response);
+	memcpy(work, input, frame_count * 2 * sizeof(float));
+	
+	double start = get_seconds();
+	for (u32 i = 0; i < frame_count; i += block_frames) {
+		double block_start = get_seconds();
+		convolver.process(&work[i*2], MIN(block_frames, frame_count - i));
+		worst = MAX(worst, get_seconds() - block_start);
+	}
+	double seconds = get_seconds() - start;
+	
+	convolver.free();
+	*worst_block_ms = worst * 1000.0;
+	return seconds / ((double)frame_count / sample_rate) / 2.0;
+}
+
+// Against the sum done the slow way, well into the longest partitions
+static bool check_convolver(u32 impulse_frames) {
+	const u32 frame_count = impulse_frames * 3;
+	float *input = generate_noise(frame_count, 0.5f);
+	float *output = (float*)malloc(frame_count * 2 * sizeof(float));
+	Impulse_Response impulse_response = {};
+	Convolver convolver = {};
+	double worst_error = 0.0, peak = 0.0;
+	
+	generate_impulse_response(impulse_frames, &impulse_response);
+	memcpy(output, input, frame_count * 2 * sizeof(float));
+	convolver.init(&impulse_response);
+	// Odd block sizes so blocks and partitions never line up
+	for (u32 i = 0; i < frame_count; i += 997) convolver.process(&output[i*2], MIN(997, frame_count - i));
+	
+	for (u32 t = CONVOLVER_BLOCK_FRAMES; t < frame_count; t += 101) {
+		const u32 n = t - CONVOLVER_BLOCK_FRAMES;
+		for (u32 c = 0; c < 2; ++c) {
+			double sum = 0.0;
+			for (u32 k = 0; k < impulse_frames && k <= n; ++k) sum += (double)impulse_response.frames[k*2+c] * input[(n-k)*2+c];
+			worst_error = MAX(worst_error, fabs(sum - output[t*2+c]));
+			peak = MAX(peak, fabs(sum));
+		}
+	}
+	
+	double error_db = 20.0 * log10(MAX(worst_error, 1e-30) / peak);
+	bool ok = error_db < -100.0;
+	printf("  Convolver with %u taps: worst error %.1fdB under the peak %s\n", impulse_frames, -error_db, ok ? "ok" : "WRONG");
+	
+	convolver.free();
+	impulse_response.free();
+	free(input);
+	free(output);
+	return ok;
+}
+
+// Gain in dB of one peak band at its own frequency, which should be the band's gain
+static bool check_eq_gain(u32 sample_rate, float frequency, float gain_db) {
+	const u32 frame_count = sample_rate;
+	float *frames = (float*)malloc(frame_count * 2 * sizeof(float));
+	Dsp_Settings settings;
+	Dsp_Chain chain = {};
+	double in_power = 0.0, out_power = 0.0;
+	
+	get_default_dsp_settings(&settings);
+	settings.eq_enabled = true;
+	settings.band_count = 1;
+	settings.bands[0].type = EQ_BAND_PEAK;
+	settings.bands[0].frequency = frequency;
+	settings.bands[0].gain_db = gain_db;
+	
+	for (u32 i = 0; i < frame_count; ++i) {
+		float sample = (float)(0.25 * sin(2.0 * PI * frequency * i / sample_rate));
+		frames[i*2+0] = sample;
+		frames[i*2+1] = sample;
+	}
+	
+	chain.init(sample_rate, &settings);
+	chain.process(frames, frame_count);
+	chain.free();
+	
+	// Skip the first half while the filter settles
+	for (u32 i = frame_count / 2; i < frame_count; ++i) {
+		double sample = 0.25 * sin(2.0 * PI * frequency * i / sample_rate);
+		in_power += sample * sample;
+		out_power += (double)frames[i*2] * frames[i*2];
+	}
+	
+	double measured_db = 10.0 * log10(out_power / in_power);
+	bool ok = fabs(measured_db - gain_db) < 0.1;
+	printf("  %6.0fHz peak at %+5.1fdB, %uHz: measured %+6.2fdB %s\n", frequency, gain_db, sample_rate,
+		   measured_db, ok ? "ok" : "WRONG");
+	free(frames);
+	return ok;
+}
+
+// Noise well over the threshold must come out under it
+static bool check_limiter(u32 sample_rate, float threshold_db) {
+	const u32 frame_count = sample_rate * 2;
+	float *frames = generate_noise(frame_count, 2.f);
+	Dsp_Settings settings;
+	Dsp_Chain chain = {};
+	float peak = 0.f;
+	
+	get_default_dsp_settings(&settings);
+	settings.limiter_enabled = true;
+	settings.limiter_threshold_db = threshold_db;
+	
+	chain.init(sample_rate, &settings);
+	chain.process(frames, frame_count);
+	chain.free();
+	
+	for (u32 i = 0; i < frame_count * 2; ++i) peak = MAX(peak, fabsf(frames[i]));
+	
+	float peak_db = 20.f * log10f(peak);
+	bool ok = peak_db <= threshold_db + 0.001f;
+	printf("  Limiter at %+.1fdB, %uHz: peak %+.3fdB %s\n", threshold_db, sample_rate, peak_db, ok ? "ok" : "WRONG");
+	free(frames);
+	return ok;
+}
+
+int main(int argc, char **argv) {
+	u32 all_features = get_cpu_features();
+	u32 kernel_features[] = {0, all_features};
+	const u32 max_frames = g_sample_rates[ARRAY_LENGTH(g_sample_rates) - 1] * BENCH_SECONDS;
+	float *input = generate_noise(max_frames, 0.5f);
+	float *work = (float*)malloc(max_frames * 2 * sizeof(float));
+	Dsp_Settings eq_settings, full_settings;
+	bool ok = true;
+	
+	get_eq_settings(&eq_settings);
+	get_full_settings(&full_settings);
+	
+	printf("Share of one core to run in real time, %ums blocks\n", BENCH_BLOCK_MS);
+	printf("%-8s %-7s %14s %14s\n", "Rate", "Kernel", "10-band EQ", "Full chain");
+	
+	for (u32 r = 0; r < ARRAY_LENGTH(g_sample_rates); ++r) {
+		const u32 sample_rate = g_sample_rates[r];
+		const char *previous_kernel = NULL;
+		
+		for (u32 k = 0; k < ARRAY_LENGTH(kernel_features); ++k) {
+			override_cpu_features(kernel_features[k]);
+			const char *kernel = get_dsp_kernel_name();
+			if (previous_kernel && !strcmp(kernel, previous_kernel)) continue;
+			previous_kernel = kernel;
+			
+			double eq_share = run_chain(&eq_settings, sample_rate, input, work, sample_rate * BENCH_SECONDS);
+			double full_share = run_chain(&full_settings, sample_rate, input, work, sample_rate * BENCH_SECONDS);
+			printf("%-8u %-7s %13.3f%% %13.3f%%\n", sample_rate, kernel, eq_share * 100.0, full_share * 100.0);
+		}
+	}
+	
+	printf("Convolution, share of one core per channel, and the slowest %ums block\n", BENCH_BLOCK_MS);
+	printf("%-8s %-8s %-7s %12s %12s\n", "Rate", "Taps", "Kernel", "Per channel", "Worst block");
+	
+	for (u32 r = 0; r < ARRAY_LENGTH(g_convolution_rates); ++r) {
+		const u32 sample_rate = g_convolution_rates[r];
+		
+		for (u32 l = 0; l < ARRAY_LENGTH(g_impulse_lengths); ++l) {
+			const char *previous_kernel = NULL;
+			Impulse_Response impulse_response = {};
+			generate_impulse_response(g_impulse_lengths[l], &impulse_response);
+			
+			for (u32 k = 0; k < ARRAY_LENGTH(kernel_features); ++k) {
+				override_cpu_features(kernel_features[k]);
+				const char *kernel = get_fft_kernel_name();
+				if (previous_kernel && !strcmp(kernel, previous_kernel)) continue;
+				previous_kernel = kernel;
+				
+				double worst_block_ms;
+				double share = run_convolver(&impulse_response, sample_rate, input, work, sample_rate * BENCH_SECONDS, &worst_block_ms);
+				printf("%-8u %-8u %-7s %11.3f%% %10.3fms\n", sample_rate, g_impulse_lengths[l], kernel, share * 100.0, worst_block_ms);
+			}
+			
+			impulse_response.free();
+		}
+	}
+	
+	override_cpu_features(all_features);
+	
+	printf("Checks\n");
+	ok &= check_eq_gain(48000, 1000.f, 6.f);
+	ok &= check_eq_gain(48000, 60.f, -9.f);
+	ok &= check_eq_gain(192000, 16000.f, 4.5f);
+	ok &= check_limiter(48000, -1.f);
+	ok &= check_limiter(192000, -6.f);
+	ok &= check_convolver(200);
+	ok &= check_convolver(20000);
+	
+	free(input);
+	free(work);
+	return ok ? 0 : 1;
+}
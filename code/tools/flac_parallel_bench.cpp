@@ -0,0 +1,131 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+// Decodes a FLAC file with the playback decoder, then with the parallel one on 1, 2, 4... threads,
+// and checks that every run produces the same samples.
+// Usage: flac_parallel_bench <file.flac> [max threads]
+#define WIN32_LEAN_AND_MEAN
+#include "../player/common.h"
+#include "../player/decoders.h"
+#include <atomic>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <windows.h>
+
+#define BENCH_DECODE_FRAMES 4096
+
+// Blocks arrive in any order, so the checksum weights each sample by its position and sums them
+struct Bench_Checksum {
+	std::atomic<u64> sum;
+	std::atomic<u64> frame_count;
+};
+
+static double get_seconds() {
+	LARGE_INTEGER counter, frequency;
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+	return (double)counter.QuadPart / (double)frequency.QuadPart;
+}
+
+static u64 checksum_samples(u64 first_frame, u32 frame_count, const float *samples) {
+	u64 sum = 0;
+	for (u32 i = 0; i < frame_count * 2; ++i) {
+		u32 bits;
+		memcpy(&bits, &samples[i], 4);
+		sum += ((u64)bits + 1) * (((first_frame * 2) + i) * 0x9E3779B97F4A7C15ull | 1);
+	}
+	return sum;
+}
+
+static void checksum_block(void *user_data, u64 first_frame, u32 frame_count, const float *samples) {
+	Bench_Checksum *checksum = (Bench_Checksum*)user_data;
+	checksum->sum += checksum_samples(first_frame, frame_count, samples);
+	checksum->frame_count += frame_count;
+}
+
+int wmain(int argc, wchar_t **argv) {
+	if (argc < 2) {
+		printf("Usage: flac_parallel_bench <file.flac> [max threads]\n");
+		return 1;
+	}
+	
+	const wchar_t *path = argv[1];
+	u32 max_threads = argc > 2 ? wcstoul(argv[2], NULL, 10) : 0;
+	
+	if (!max_threads) {
+		SYSTEM_INFO system_info;
+		GetSystemInfo(&system_info);
+		max_threads = system_info.dwNumberOfProcessors;
+	}
+	
+	// The way the player decodes it, for reference
+	PCM_Format format;
+	void *stream = open_flac(path, 0, &format);
+	if (!stream) {
+		printf("Failed to open \"%ls\"\n", path);
+		return 1;
+	}
+	
+	float *buffer = (float*)malloc(BENCH_DECODE_FRAMES * 2 * sizeof(float));
+	u64 reference_sum = 0;
+	u64 reference_frames = 0;
+	double start = get_seconds();
+	
+	while (1) {
+		u32 frame_count = decode_flac(stream, BENCH_DECODE_FRAMES, buffer);
+		reference_sum += checksum_samples(reference_frames, frame_count, buffer);
+		reference_frames += frame_count;
+		if (frame_count < BENCH_DECODE_FRAMES) break;
+	}
+	
+	double sequential_seconds = get_seconds() - start;
+	double duration = (double)reference_frames / format.sample_rate;
+	close_flac(stream);
+	free(buffer);
+	
+	printf("%.1fs of audio, %llu frames\n", duration, reference_frames);
+	printf("%-10s %7s %10s %10s %8s %7s %s\n", "Decoder", "Threads", "Seconds", "x realtime", "Speedup", "Chunks", "Output");
+	printf("%-10s %7u %10.3f %10.1f %8.2f %7s %s\n", "sequential", 1, sequential_seconds, duration / sequential_seconds,
+		   1.0, "-", "reference");
+	
+	for (u32 threads = 1; threads <= max_threads; threads *= 2) {
+		Bench_Checksum checksum;
+		Flac_Parallel_Stats stats;
+		
+		checksum.sum = 0;
+		checksum.frame_count = 0;
+		
+		start = get_seconds();
+		bool ok = decode_flac_parallel(path, threads, &checksum_block, &checksum, &stats);
+		double seconds = get_seconds() - start;
+		
+		if (!ok) {
+			printf("Parallel decoding failed\n");
+			return 1;
+		}
+		
+		bool matches = checksum.sum == reference_sum && checksum.frame_count == reference_frames && !stats.error_count;
+		printf("%-10s %7u %10.3f %10.1f %8.2f %7u %s%s\n", "parallel", stats.thread_count, seconds, duration / seconds,
+			   sequential_seconds / seconds, stats.chunk_count, matches ? "matches" : "DIFFERS",
+			   stats.used_seek_table ? "" : " (no seek table)");
+		
+		// Finish on max_threads when it isn't a power of two
+		if (threads < max_threads && threads * 2 > max_threads) threads = max_threads / 2;
+	}
+	
+	return 0;
+}
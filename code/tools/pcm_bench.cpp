@@ -0,0 +1,282 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+// Measures each PCM conversion kernel this CPU can run and checks it against the scalar one.
+// Blocks are the size a decoder converts at a time, so the data stays in cache and this is
+// the speed of the conversion itself rather than of memory. The conversions to device formats
+// have to match the scalar ones exactly, dither included, and have to give back the integers
+// the decoders started from.
+#include "../player/common.h"
+#include "../player/cpu.h"
+#include "../player/pcm.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+// Odd so every kernel runs its scalar tail too
+#define BENCH_BLOCK_SAMPLES 4093
+#define BENCH_ITERATIONS 20000
+
+enum Bench_Format {
+	BENCH_FORMAT_S16,
+	BENCH_FORMAT_S24,
+	BENCH_FORMAT_S32,
+	BENCH_FORMAT_F32,
+	BENCH_FORMAT_PLANAR_S24,
+	BENCH_FORMAT_COUNT,
+};
+
+static const struct {
+	const char *name;
+	u32 bytes_per_sample;
+} g_bench_formats[BENCH_FORMAT_COUNT] = {
+	{"s16", 2},
+	{"s24", 3},
+	{"s32", 4},
+	{"f32 scale", 4},
+	{"planar s24", 4},
+};
+
+enum Bench_Output {
+	BENCH_OUTPUT_S16,
+	BENCH_OUTPUT_S24,
+	BENCH_OUTPUT_S32,
+	BENCH_OUTPUT_S16_DITHER,
+	BENCH_OUTPUT_S24_DITHER,
+	BENCH_OUTPUT_COUNT,
+};
+
+static const struct {
+	const char *name;
+	u32 bytes_per_sample;
+} g_bench_outputs[BENCH_OUTPUT_COUNT] = {
+	{"s16", 2},
+	{"s24", 3},
+	{"s32", 4},
+	{"s16 dither", 2},
+	{"s24 dither", 3},
+};
+
+struct Bench_Data {
+	s16 s16_samples[BENCH_BLOCK_SAMPLES];
+	u8 s24_samples[BENCH_BLOCK_SAMPLES * 3];
+	s32 s32_samples[BENCH_BLOCK_SAMPLES];
+	float f32_samples[BENCH_BLOCK_SAMPLES];
+	// Low 24 bits, like libFLAC gives them
+	s32 left[BENCH_BLOCK_SAMPLES / 2];
+	s32 right[BENCH_BLOCK_SAMPLES / 2];
+	// What the player hands the device, a little over full scale in places
+	float output_samples[BENCH_BLOCK_SAMPLES];
+};
+
+static double get_seconds() {
+#ifdef _WIN32
+	LARGE_INTEGER counter, frequency;
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+	return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec * 1e-9;
+#endif
+}
+
+static void generate_data(Bench_Data *data) {
+	u32 seed = 1;
+	
+	for (u32 i = 0; i < BENCH_BLOCK_SAMPLES; ++i) {
+		seed = seed * 1664525 + 1013904223;
+		s32 sample = (s32)seed;
+		// Make sure the extremes are in there
+		if (i == 0) sample = INT32_MIN;
+		if (i == 1) sample = INT32_MAX;
+		
+		data->s16_samples[i] = (s16)(sample >> 16);
+		data->s24_samples[i*3+0] = (u8)(sample >> 8);
+		data->s24_samples[i*3+1] = (u8)(sample >> 16);
+		data->s24_samples[i*3+2] = (u8)(sample >> 24);
+		data->s32_samples[i] = sample;
+		data->f32_samples[i] = (float)sample;
+		if (i < BENCH_BLOCK_SAMPLES / 2) data->left[i] = sample >> 8;
+		else if (i - BENCH_BLOCK_SAMPLES / 2 < BENCH_BLOCK_SAMPLES / 2) data->right[i - BENCH_BLOCK_SAMPLES / 2] = sample >> 8;
+		data->output_samples[i] = sample * (1.1f / 2147483648.f);
+	}
+}
+
+static void convert(Bench_Format format, const Bench_Data *data, float *out) {
+	switch (format) {
+		case BENCH_FORMAT_S16: pcm_s16_to_f32(data->s16_samples, out, BENCH_BLOCK_SAMPLES); break;
+		case BENCH_FORMAT_S24: pcm_s24_to_f32(data->s24_samples, out, BENCH_BLOCK_SAMPLES); break;
+		case BENCH_FORMAT_S32: pcm_s32_to_f32(data->s32_samples, out, BENCH_BLOCK_SAMPLES); break;
+		case BENCH_FORMAT_F32: pcm_scale_f32(data->f32_samples, out, BENCH_BLOCK_SAMPLES, 1.f / 2147483648.f); break;
+		case BENCH_FORMAT_PLANAR_S24: pcm_planar_s32_to_f32(data->left, data->right, out, BENCH_BLOCK_SAMPLES / 2, 24); break;
+		default: break;
+	}
+}
+
+static u32 get_sample_count(Bench_Format format) {
+	return format == BENCH_FORMAT_PLANAR_S24 ? (BENCH_BLOCK_SAMPLES / 2) * 2 : BENCH_BLOCK_SAMPLES;
+}
+
+static void convert_to_device(Bench_Output output, const float *in, u8 *out, PCM_Dither *dither) {
+	switch (output) {
+		case BENCH_OUTPUT_S16: pcm_f32_to_s16(in, (s16*)out, BENCH_BLOCK_SAMPLES, NULL); break;
+		case BENCH_OUTPUT_S24: pcm_f32_to_s24(in, out, BENCH_BLOCK_SAMPLES, NULL); break;
+		case BENCH_OUTPUT_S32: pcm_f32_to_s32(in, (s32*)out, BENCH_BLOCK_SAMPLES, 32, NULL); break;
+		case BENCH_OUTPUT_S16_DITHER: pcm_f32_to_s16(in, (s16*)out, BENCH_BLOCK_SAMPLES, dither); break;
+		case BENCH_OUTPUT_S24_DITHER: pcm_f32_to_s24(in, out, BENCH_BLOCK_SAMPLES, dither); break;
+		default: break;
+	}
+}
+
+// Samples that differ from the reference
+static u32 count_mismatches(const u8 *a, const u8 *b, u32 bytes_per_sample) {
+	u32 count = 0;
+	for (u32 i = 0; i < BENCH_BLOCK_SAMPLES; ++i) {
+		count += memcmp(&a[i * bytes_per_sample], &b[i * bytes_per_sample], bytes_per_sample) != 0;
+	}
+	return count;
+}
+
+// Integers to floats and back has to give the same integers, or the output isn't bit exact
+static bool check_round_trip(const Bench_Data *data, u32 kernel_features) {
+	float *samples = (float*)malloc(BENCH_BLOCK_SAMPLES * sizeof(float));
+	s16 *s16_samples = (s16*)malloc(BENCH_BLOCK_SAMPLES * sizeof(s16));
+	u8 *s24_samples = (u8*)malloc(BENCH_BLOCK_SAMPLES * 3);
+	
+	override_cpu_features(kernel_features);
+	pcm_s16_to_f32(data->s16_samples, samples, BENCH_BLOCK_SAMPLES);
+	pcm_f32_to_s16(samples, s16_samples, BENCH_BLOCK_SAMPLES, NULL);
+	u32 s16_mismatches = count_mismatches((const u8*)data->s16_samples, (const u8*)s16_samples, 2);
+	
+	pcm_s24_to_f32(data->s24_samples, samples, BENCH_BLOCK_SAMPLES);
+	pcm_f32_to_s24(samples, s24_samples, BENCH_BLOCK_SAMPLES, NULL);
+	u32 s24_mismatches = count_mismatches(data->s24_samples, s24_samples, 3);
+	
+	bool ok = !s16_mismatches && !s24_mismatches;
+	printf("  Round trip with %s: %u s16 and %u s24 samples changed %s\n", get_pcm_kernel_name(),
+		   s16_mismatches, s24_mismatches, ok ? "ok" : "WRONG");
+	
+	free(samples);
+	free(s16_samples);
+	free(s24_samples);
+	return ok;
+}
+
+int main(int argc, char **argv) {
+	u32 all_features = get_cpu_features();
+	// Every tier a kernel table exists for, scalar first so the others can be checked against it
+	u32 kernel_features[] = {
+		0, 
+		all_features & CPU_FEATURE_SSE2, 
+		all_features & (CPU_FEATURE_SSE2|CPU_FEATURE_SSE41), 
+		all_features,
+	};
+	Bench_Data *data = (Bench_Data*)malloc(sizeof(Bench_Data));
+	float *reference = (float*)malloc(BENCH_BLOCK_SAMPLES * sizeof(float));
+	float *out = (float*)malloc(BENCH_BLOCK_SAMPLES * sizeof(float));
+	
+	generate_data(data);
+	
+	printf("Each kernel converts %u samples %u times\n", BENCH_BLOCK_SAMPLES, BENCH_ITERATIONS);
+	printf("%-11s %-7s %12s %12s %12s\n", "Format", "Kernel", "M samples/s", "GB/s in", "Max error");
+	
+	for (u32 f = 0; f < BENCH_FORMAT_COUNT; ++f) {
+		Bench_Format format = (Bench_Format)f;
+		u32 sample_count = get_sample_count(format);
+		const char *previous_kernel = NULL;
+		
+		override_cpu_features(0);
+		convert(format, data, reference);
+		
+		for (u32 k = 0; k < ARRAY_LENGTH(kernel_features); ++k) {
+			override_cpu_features(kernel_features[k]);
+			const char *kernel = get_pcm_kernel_name();
+			if (previous_kernel && !strcmp(kernel, previous_kernel)) continue;
+			previous_kernel = kernel;
+			
+			memset(out, 0, BENCH_BLOCK_SAMPLES * sizeof(float));
+			double start = get_seconds();
+			for (u32 i = 0; i < BENCH_ITERATIONS; ++i) convert(format, data, out);
+			double seconds = get_seconds() - start;
+			
+			float max_error = 0.f;
+			for (u32 i = 0; i < sample_count; ++i) max_error = MAX(max_error, fabsf(out[i] - reference[i]));
+			
+			double samples = (double)sample_count * BENCH_ITERATIONS;
+			printf("%-11s %-7s %12.0f %12.2f %12g\n", g_bench_formats[f].name, kernel, samples / seconds / 1e6,
+				   samples * g_bench_formats[f].bytes_per_sample / seconds / 1e9, max_error);
+		}
+	}
+	
+	u8 *device_reference = (u8*)malloc(BENCH_BLOCK_SAMPLES * 4);
+	u8 *device_out = (u8*)malloc(BENCH_BLOCK_SAMPLES * 4);
+	PCM_Dither dither;
+	bool ok = true;
+	
+	printf("\n%-11s %-7s %12s %12s %12s\n", "To device", "Kernel", "M samples/s", "GB/s out", "Mismatches");
+	
+	for (u32 o = 0; o < BENCH_OUTPUT_COUNT; ++o) {
+		Bench_Output output = (Bench_Output)o;
+		u32 bytes_per_sample = g_bench_outputs[o].bytes_per_sample;
+		const char *previous_kernel = NULL;
+		
+		override_cpu_features(0);
+		dither.init(1);
+		convert_to_device(output, data->output_samples, device_reference, &dither);
+		
+		for (u32 k = 0; k < ARRAY_LENGTH(kernel_features); ++k) {
+			override_cpu_features(kernel_features[k]);
+			const char *kernel = get_pcm_kernel_name();
+			if (previous_kernel && !strcmp(kernel, previous_kernel)) continue;
+			previous_kernel = kernel;
+			
+			// Same noise as the reference
+			memset(device_out, 0, BENCH_BLOCK_SAMPLES * 4);
+			dither.init(1);
+			convert_to_device(output, data->output_samples, device_out, &dither);
+			u32 mismatches = count_mismatches(device_out, device_reference, bytes_per_sample);
+			ok &= !mismatches;
+			
+			double start = get_seconds();
+			for (u32 i = 0; i < BENCH_ITERATIONS; ++i) convert_to_device(output, data->output_samples, device_out, &dither);
+			double seconds = get_seconds() - start;
+			
+			double samples = (double)BENCH_BLOCK_SAMPLES * BENCH_ITERATIONS;
+			printf("%-11s %-7s %12.0f %12.2f %12u\n", g_bench_outputs[o].name, kernel, samples / seconds / 1e6,
+				   samples * bytes_per_sample / seconds / 1e9, mismatches);
+		}
+	}
+	
+	printf("\nChecks\n");
+	for (u32 k = 0; k < ARRAY_LENGTH(kernel_features); ++k) ok &= check_round_trip(data, kernel_features[k]);
+	
+	override_cpu_features(all_features);
+	free(data);
+	free(reference);
+	free(out);
+	free(device_reference);
+	free(device_out);
+	return ok ? 0 : 1;
+}
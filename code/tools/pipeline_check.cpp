@@ -0,0 +1,283 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+// Checks that the player's pipeline never touches the heap once it is going. Plays a queue of tracks
+// through it the way the player's threads do, one period at a time, with produce() and read() inside a
+// real-time section. Seeks land every so often, and the tracks are spliced on to each other. Opening the
+// next track is the only thing allowed to allocate, as in the player. Exits with 1 if anything else did
+// after the warm-up.
+// With no tracks, WAVs and a FLAC at 44.1kHz and 48kHz are generated, so resampling and the format
+// change at a splice are always taken in.
+//
+// Usage: pipeline_check [--rate HZ] [--seeks N] [--corpus DIR] [tracks...]
+// Needs PLAYER_REALTIME_CHECKS and realtime_check.cpp, which count the allocations.
+#include "../player/common.h"
+#include "../player/pipeline.h"
+#include "../player/platform.h"
+#include <FLAC/stream_encoder.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHECK_MAX_TRACKS 64
+#define CHECK_DEFAULT_RATE 48000
+#define CHECK_DEFAULT_SEEKS 20
+// The same as the player's minimum ring and a typical device period
+#define CHECK_RING_MS 250
+#define CHECK_PERIOD_MS 10
+// Whatever the first track needs to get going is allowed. Half a second of output.
+#define CHECK_WARM_UP_PERIODS 50
+// Periods between seeks
+#define CHECK_SEEK_INTERVAL 37
+// Give up if the pipeline produces nothing for this many periods in a row
+#define CHECK_MAX_EMPTY_PERIODS 1000
+// Long enough for every generated track to see a few seeks
+#define CHECK_CORPUS_SECONDS 10
+// The highest rate in the generated corpus
+#define CHECK_CORPUS_MAX_RATE 48000
+
+#if !defined(PLAYER_REALTIME_CHECKS)
+#error "Build with PLAYER_REALTIME_CHECKS"
+#endif
+
+// A few partials and some noise, the same as decoder_bench's
+static void generate_signal(s32 *samples, u32 frame_count, u32 sample_rate) {
+	const float frequencies[] = {110.f, 440.f, 1375.f, 5210.f};
+	u32 seed = 1;
+	
+	for (u32 i = 0; i < frame_count; ++i) {
+		float t = (float)i / sample_rate;
+		float value = 0.f;
+		
+		for (u32 p = 0; p < ARRAY_LENGTH(frequencies); ++p) value += 0.18f * sinf(6.2831853f * frequencies[p] * t);
+		
+		for (u32 c = 0; c < 2; ++c) {
+			seed = seed * 1664525 + 1013904223;
+			float noise = ((s32)seed >> 8) * (0.02f / 8388608.f);
+			float sample = (c ? value * 0.8f : value) + noise;
+			samples[i*2+c] = (s32)(sample * 8388607.f);
+		}
+	}
+}
+
+static bool write_wav(const char *path, const s32 *samples, u32 frame_count, u32 sample_rate, u32 format_tag, u32 bits) {
+	FILE *file = fopen(path, "wb");
+	if (!file) return false;
+	
+	u32 bytes_per_sample = bits / 8;
+	u32 data_size = frame_count * 2 * bytes_per_sample;
+	u32 header[11] = {
+		0x46464952, 36 + data_size, 0x45564157,            // "RIFF" size "WAVE"
+		0x20746d66, 16, format_tag | (2 << 16),            // "fmt " 16, tag, channels
+		sample_rate, sample_rate * 2 * bytes_per_sample,
+		(2 * bytes_per_sample) | (bits << 16),
+		0x61746164, data_size,                             // "data" size
+	};
+	
+	fwrite(header, sizeof(header), 1, file);
+	
+	for (u32 i = 0; i < frame_count * 2; ++i) {
+		if (format_tag == 3) {
+			float value = samples[i] / 8388608.f;
+			fwrite(&value, 4, 1, file);
+		}
+		else {
+			s32 value = (s32)((u32)samples[i] << 8);
+			// The top bytes of the sample, little endian
+			fwrite((u8*)&value + (4 - bytes_per_sample), bytes_per_sample, 1, file);
+		}
+	}
+	
+	fclose(file);
+	return true;
+}
+
+static bool write_flac(const char *path, const s32 *samples, u32 frame_count, u32 sample_rate) {
+	FLAC__StreamEncoder *encoder = FLAC__stream_encoder_new();
+	bool ok = encoder != NULL;
+	
+	if (ok) {
+		FLAC__stream_encoder_set_channels(encoder, 2);
+		FLAC__stream_encoder_set_bits_per_sample(encoder, 24);
+		FLAC__stream_encoder_set_sample_rate(encoder, sample_rate);
+		FLAC__stream_encoder_set_compression_level(encoder, 5);
+		FLAC__stream_encoder_set_total_samples_estimate(encoder, frame_count);
+		ok = FLAC__stream_encoder_init_file(encoder, path, NULL, NULL) == FLAC__STREAM_ENCODER_INIT_STATUS_OK;
+	}
+	
+	if (ok) ok = FLAC__stream_encoder_process_interleaved(encoder, samples, frame_count);
+	if (ok) ok = FLAC__stream_encoder_finish(encoder);
+	if (encoder) FLAC__stream_encoder_delete(encoder);
+	return ok;
+}
+
+// The rates alternate, so every splice changes the format and one side of it is resampled whatever
+// the output rate is. Returns the number of tracks written.
+static u32 generate_corpus(const char *directory, wchar_t tracks[][512]) {
+	static const struct {
+		const char *name;
+		u32 sample_rate;
+		// 1 for integer WAV, 3 for float WAV, 0 for FLAC
+		u32 format_tag;
+		u32 bits;
+	} specs[] = {
+		{"s16_44100.wav", 44100, 1, 16},
+		{"s24_48000.wav", 48000, 1, 24},
+		{"f32_44100.wav", 44100, 3, 32},
+		{"s24_48000.flac", 48000, 0, 24},
+	};
+	
+	s32 *samples = (s32*)malloc(CHECK_CORPUS_SECONDS * CHECK_CORPUS_MAX_RATE * 2 * sizeof(s32));
+	u32 count = 0;
+	
+	_mkdir(directory);
+	printf("Generating %u tracks of %us in %s\n", (u32)ARRAY_LENGTH(specs), CHECK_CORPUS_SECONDS, directory);
+	
+	for (u32 i = 0; i < ARRAY_LENGTH(specs); ++i) {
+		char path[512];
+		u32 frame_count = CHECK_CORPUS_SECONDS * specs[i].sample_rate;
+		bool written;
+		
+		snprintf(path, sizeof(path), "%s/%s", directory, specs[i].name);
+		generate_signal(samples, frame_count, specs[i].sample_rate);
+		
+		if (specs[i].format_tag) written = write_wav(path, samples, frame_count, specs[i].sample_rate, specs[i].format_tag, specs[i].bits);
+		else written = write_flac(path, samples, frame_count, specs[i].sample_rate);
+		
+		if (written) utf8_to_utf16(path, tracks[count++], 512);
+		else printf("Failed to write %s\n", path);
+	}
+	
+	free(samples);
+	return count;
+}
+
+// Seek the track that can be heard right now, which can be the one before a splice
+static void seek_audible_track(Playback_Pipeline *pipeline, float fraction) {
+	const PCM_Format *format = pipeline->splice_index.load() != UINT64_MAX ? &pipeline->previous_format : &pipeline->format;
+	pipeline->seek((u64)(format->total_samples * fraction) & ~1ull);
+}
+
+int main(int argc, char **argv) {
+	static wchar_t tracks[CHECK_MAX_TRACKS][512];
+	u32 track_count = 0;
+	u32 sample_rate = CHECK_DEFAULT_RATE;
+	u32 seek_count = CHECK_DEFAULT_SEEKS;
+	const char *corpus_directory = "pipeline_check_corpus";
+	bool usage = false;
+	
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--rate") && i + 1 < argc) sample_rate = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--seeks") && i + 1 < argc) seek_count = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--corpus") && i + 1 < argc) corpus_directory = argv[++i];
+		else if (argv[i][0] == '-') {
+			usage = true;
+			break;
+		}
+		else if (track_count < CHECK_MAX_TRACKS) utf8_to_utf16(argv[i], tracks[track_count++], 512);
+	}
+	
+	if (usage || !sample_rate) {
+		printf("Usage: pipeline_check [--rate HZ] [--seeks N] [--corpus DIR] [tracks...]\n");
+		return 1;
+	}
+	
+	if (!install_realtime_allocation_hook()) {
+		printf("Allocations can't be counted in this build\n");
+		return 1;
+	}
+	
+	if (!track_count) track_count = generate_corpus(corpus_directory, tracks);
+	if (!track_count) return 1;
+	
+	PCM_Format output_format = {};
+	output_format.sample_rate = sample_rate;
+	output_format.sample_type = PCM_TYPE_F32;
+	output_format.sample_size = 4;
+	
+	const u32 period_frames = MAX((sample_rate * CHECK_PERIOD_MS) / 1000, 1);
+	float *period = (float*)malloc(period_frames * 2 * sizeof(float));
+	
+	Playback_Pipeline pipeline = {};
+	pipeline.init(&output_format, (sample_rate * CHECK_RING_MS) / 1000, (float)CHECK_PERIOD_MS);
+	
+	if (!pipeline.open(tracks[0])) {
+		log_error("Failed to open \"%ls\"\n", tracks[0]);
+		return 1;
+	}
+	pipeline.set_next(track_count > 1 ? tracks[1] : NULL);
+	
+	u32 current_track = 0;
+	u32 seeks_done = 0;
+	u32 splice_count = 0;
+	u32 empty_periods = 0;
+	u32 playing_allocations = 0, seeking_allocations = 0;
+	u32 seed = 1;
+	bool failed = false;
+	
+	for (u64 period_index = 0; !failed; ++period_index) {
+		const bool warmed_up = period_index >= CHECK_WARM_UP_PERIODS;
+		
+		// The player seeks with the stream locked rather than in a real-time section, but nothing it
+		// does should allocate either, and the chunk after it must not
+		if (warmed_up && seeks_done < seek_count && period_index % CHECK_SEEK_INTERVAL == 0) {
+			u32 count = get_realtime_allocation_count();
+			seed = seed * 1664525 + 1013904223;
+			
+			BEGIN_REALTIME_SECTION();
+			// Anywhere but the last tenth, so it never seeks off the end
+			seek_audible_track(&pipeline, (seed >> 8) / (float)(1 << 24) * 0.9f);
+			while (pipeline.produce());
+			END_REALTIME_SECTION();
+			
+			seeking_allocations += get_realtime_allocation_count() - count;
+			seeks_done++;
+		}
+		
+		u32 count = get_realtime_allocation_count();
+		
+		BEGIN_REALTIME_SECTION();
+		while (pipeline.produce());
+		u32 read = pipeline.read(period, MIN(period_frames, pipeline.ring.get_fill()));
+		END_REALTIME_SECTION();
+		
+		if (warmed_up) playing_allocations += get_realtime_allocation_count() - count;
+		
+		// The player does this on its producer thread outside of the real-time section
+		if (pipeline.track_changed.exchange(false)) {
+			pipeline.close_previous_track();
+			current_track++;
+			splice_count++;
+			pipeline.set_next(current_track + 1 < track_count ? tracks[current_track + 1] : NULL);
+		}
+		
+		if (pipeline.track_ended.exchange(false)) break;
+		
+		empty_periods = read ? 0 : empty_periods + 1;
+		if (empty_periods >= CHECK_MAX_EMPTY_PERIODS) {
+			log_error("The pipeline stopped producing audio\n");
+			failed = true;
+		}
+	}
+	
+	printf("%u tracks, %u splices, %u seeks at %uHz: %u allocations while playing, %u while seeking\n",
+		   current_track + 1, splice_count, seeks_done, sample_rate, playing_allocations, seeking_allocations);
+	
+	pipeline.free();
+	free(period);
+	
+	return failed || playing_allocations || seeking_allocations ? 1 : 0;
+}
@@ -0,0 +1,218 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+// Plays a queue of tracks through the player, threads, device and all, without the UI. With the null
+// output it runs on machines with no sound card, on the real clock or as fast as the player can go.
+//
+// Usage: play [--output default|wasapi|alsa|null] [--device NAME] [--rate HZ] [--buffer-ms N]
+//             [--latency-ms N] [--virtual] [--out FILE] [--seek-test N] [--convolve FILE]
+//             [--format f32|s16|s24|s32] [--exclusive] [--dither] [--native-rate] [--telemetry FILE]
+//             tracks...
+// --out writes what the null output plays to a WAV file, in the --format given.
+// --native-rate reopens the device at each track's rate when it can play it, rather than resampling.
+// --convolve plays through the convolution stage with the impulse response in FILE.
+// --seek-test seeks around the first track N times and reports how long each took to reach the device.
+// --telemetry saves the player's timings, underruns and fill levels to FILE when it finishes.
+#include "../player/common.h"
+#include "../player/player.h"
+#include "../player/platform.h"
+#include <atomic>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PLAY_MAX_TRACKS 64
+// Time between seeks in a seek test
+#define PLAY_SEEK_INTERVAL_MS 200
+
+static struct {
+	wchar_t tracks[PLAY_MAX_TRACKS][512];
+	u32 count;
+	std::atomic<u32> current;
+	void *done_event;
+} g_queue;
+
+// With no UI thread to hand them to, these run on the producer. Opening a track there only eats into
+// what the ring has decoded ahead, which is plenty for a tool.
+static void on_track_end(u32 track_serial) {
+	// Tracks that need the device at another rate aren't spliced on, so they start here
+	u32 next = g_queue.current.load() + 1;
+	if (next < g_queue.count && open_track(g_queue.tracks[next])) {
+		g_queue.current.store(next);
+		set_next_track(next + 1 < g_queue.count ? g_queue.tracks[next + 1] : NULL);
+		printf("Now playing %ls\n", g_queue.tracks[next]);
+		return;
+	}
+	
+	signal_event(g_queue.done_event);
+}
+
+static void on_track_change(float previous_length, u32 track_serial) {
+	u32 current = g_queue.current.fetch_add(1) + 1;
+	set_next_track(current + 1 < g_queue.count ? g_queue.tracks[current + 1] : NULL);
+	printf("Now playing %ls\n", g_queue.tracks[current]);
+}
+
+static void print_usage() {
+	printf("Usage: play [--output default|wasapi|alsa|null] [--device NAME] [--rate HZ] [--buffer-ms N]\n"
+		   "            [--latency-ms N] [--virtual] [--out FILE] [--seek-test N] [--convolve FILE]\n"
+		   "            [--format f32|s16|s24|s32] [--exclusive] [--dither] [--native-rate] [--telemetry FILE]\n"
+		   "            tracks...\n");
+}
+
+// Returns the process exit code
+static int run_seek_test(u32 seek_count) {
+	float length = get_playback_length();
+	float total_ms = 0.f, max_ms = 0.f;
+	u32 measured = 0;
+	u32 seed = 1;
+	// Never signalled, just something to sleep on
+	void *timer_event = create_event();
+	
+	for (u32 i = 0; i < seek_count; ++i) {
+		Playback_Latency latency;
+		get_playback_latency(&latency);
+		u32 count = latency.interrupt_count;
+		
+		// Anywhere but the last second, so it never seeks off the end
+		seed = seed * 1664525 + 1013904223;
+		float position = (seed >> 8) / (float)(1 << 24) * MAX(length - 1.f, 0.f);
+		seek_playback_to_seconds(position);
+		
+		u64 start_tick = time_get_tick();
+		while (time_ticks_to_milliseconds(time_get_tick() - start_tick) < 1000.f) {
+			get_playback_latency(&latency);
+			if (latency.interrupt_count != count) break;
+			wait_for_event(timer_event, 1);
+		}
+		
+		if (latency.interrupt_count == count) {
+			printf("  Seek %u to %.2fs never reached the device\n", i, position);
+			continue;
+		}
+		
+		total_ms += latency.interrupt_ms;
+		max_ms = MAX(max_ms, latency.interrupt_ms);
+		++measured;
+		wait_for_event(timer_event, PLAY_SEEK_INTERVAL_MS);
+	}
+	
+	destroy_event(timer_event);
+	
+	Playback_Latency latency;
+	get_playback_latency(&latency);
+	printf("%u seeks: %.1fms average, %.1fms worst to reach the device. %.0fms queued, %u underruns\n",
+		   measured, measured ? total_ms / measured : 0.f, max_ms, latency.target_ms, latency.underrun_count);
+	return measured == seek_count ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+	Output_Config config = {};
+	static wchar_t out_path[512];
+	static wchar_t impulse_response_path[512];
+	static wchar_t telemetry_path[512];
+	u32 seek_count = 0;
+	int result = 0;
+	
+	config.buffer_duration_ms = OUTPUT_DEFAULT_BUFFER_MS;
+	
+	for (int i = 1; i < argc; ++i) {
+		const char *arg = argv[i];
+		bool has_value = i + 1 < argc;
+		
+		if (!strcmp(arg, "--rate") && has_value) config.sample_rate = atoi(argv[++i]);
+		else if (!strcmp(arg, "--buffer-ms") && has_value) config.buffer_duration_ms = atoi(argv[++i]);
+		else if (!strcmp(arg, "--latency-ms") && has_value) config.target_latency_ms = atoi(argv[++i]);
+		else if (!strcmp(arg, "--seek-test") && has_value) seek_count = atoi(argv[++i]);
+		else if (!strcmp(arg, "--device") && has_value) config.device_name = argv[++i];
+		else if (!strcmp(arg, "--virtual")) config.clock = OUTPUT_CLOCK_VIRTUAL;
+		else if (!strcmp(arg, "--exclusive")) config.exclusive = true;
+		else if (!strcmp(arg, "--dither")) config.dither = true;
+		else if (!strcmp(arg, "--native-rate")) config.match_track_rate = true;
+		else if (!strcmp(arg, "--out") && has_value) {
+			utf8_to_utf16(argv[++i], out_path, ARRAY_LENGTH(out_path));
+			config.file_path = out_path;
+		}
+		else if (!strcmp(arg, "--convolve") && has_value) {
+			utf8_to_utf16(argv[++i], impulse_response_path, ARRAY_LENGTH(impulse_response_path));
+		}
+		else if (!strcmp(arg, "--telemetry") && has_value) {
+			utf8_to_utf16(argv[++i], telemetry_path, ARRAY_LENGTH(telemetry_path));
+		}
+		else if (!strcmp(arg, "--format") && has_value) {
+			if (!find_output_sample_type(argv[++i], &config.sample_type)) {
+				print_usage();
+				return 1;
+			}
+		}
+		else if (!strcmp(arg, "--output") && has_value) {
+			if (!find_output_backend(argv[++i], &config.backend)) {
+				print_usage();
+				return 1;
+			}
+		}
+		else if (arg[0] == '-') {
+			print_usage();
+			return 1;
+		}
+		else if (g_queue.count < PLAY_MAX_TRACKS) {
+			utf8_to_utf16(arg, g_queue.tracks[g_queue.count++], 512);
+		}
+	}
+	
+	if (!g_queue.count || !config.buffer_duration_ms) {
+		print_usage();
+		return 1;
+	}
+	
+	g_queue.done_event = create_event();
+	start_playback_stream(&on_track_end, &on_track_change, &config);
+	
+	if (impulse_response_path[0]) {
+		Dsp_Settings settings;
+		if (!set_convolution_file(impulse_response_path)) return 1;
+		get_dsp_settings(&settings);
+		settings.convolution_enabled = true;
+		set_dsp_settings(&settings);
+	}
+	
+	if (!open_track(g_queue.tracks[0])) return 1;
+	if (g_queue.count > 1) set_next_track(g_queue.tracks[1]);
+	printf("Now playing %ls\n", g_queue.tracks[0]);
+	
+	if (seek_count) result = run_seek_test(seek_count);
+	
+	u64 start_tick = time_get_tick();
+	while (!seek_count && !wait_for_event(g_queue.done_event, 1000)) {
+		Playback_Snapshot snapshot;
+		Playback_Latency latency;
+		Playback_Output output;
+		get_playback_snapshot(&snapshot);
+		get_playback_latency(&latency);
+		get_playback_output(&output);
+		printf("  %7.2fs / %.2fs, %.0fms buffered, %.0fms queued, %u underruns, %uHz %s%s\n", snapshot.position, 
+			   snapshot.length, get_playback_buffered_ms(), latency.target_ms, latency.underrun_count, output.sample_rate,
+			   get_output_sample_type_name(output.sample_type), 
+			   output.bit_perfect ? ", bit-perfect" : output.resampling ? ", resampled" : "");
+	}
+	
+	if (!seek_count) {
+		float seconds = time_ticks_to_milliseconds(time_get_tick() - start_tick) / 1000.f;
+		printf("Finished the queue in %.2fs\n", seconds);
+	}
+	
+	if (telemetry_path[0] && !save_playback_telemetry(telemetry_path)) result = 1;
+	return result;
+}
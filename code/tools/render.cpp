@@ -0,0 +1,389 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+// Plays a queue of tracks through the player's pipeline as fast as it will go, with a virtual device
+// that takes one period of output at a time. Track transitions, seeks and skips happen at the same
+// points in the output every run, so the output is bit-exact from run to run and can be hashed.
+//
+// Usage: render [--rate HZ] [--period-ms N] [--ring-ms N] [--quality low|medium|high]
+//               [--seek AT=TO]... [--skip AT]... [--eq TYPE:HZ:DB[:Q]]... [--preamp DB]
+//               [--limiter DB] [--volume V] [--convolve FILE] [--out FILE] [--hash] tracks...
+// AT is seconds of output, TO is seconds into the track that is playing at that point.
+// TYPE is peak, lowshelf, highshelf, lowpass or highpass. The DSP chain runs on each period the
+// way the player runs it on each refill, and is left out when none of its options are given.
+// --convolve runs the chain's convolution stage with the impulse response in FILE.
+// An --out file ending in .wav gets a float WAV header, anything else is raw interleaved floats.
+#include "../player/common.h"
+#include "../player/pipeline.h"
+#include "../player/dsp.h"
+#include "../player/platform.h"
+#include <xxhash.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RENDER_MAX_TRACKS 64
+#define RENDER_MAX_EVENTS 64
+#define RENDER_DEFAULT_RATE 48000
+#define RENDER_DEFAULT_PERIOD_MS 10
+// The same as the player's minimum
+#define RENDER_DEFAULT_RING_MS 250
+// Give up if the pipeline produces nothing for this many periods in a row
+#define RENDER_MAX_EMPTY_PERIODS 1000
+
+enum Render_Event_Type {
+	RENDER_EVENT_SEEK,
+	RENDER_EVENT_SKIP,
+};
+
+struct Render_Event {
+	Render_Event_Type type;
+	// Seconds of output the event happens at
+	double at;
+	u64 at_frame;
+	// Seconds into the track, for seeks
+	float to;
+};
+
+struct Render_Options {
+	u32 sample_rate;
+	u32 period_ms;
+	u32 ring_ms;
+	Resampler_Quality quality;
+	const char *out_path;
+	bool hash;
+	Render_Event events[RENDER_MAX_EVENTS];
+	u32 event_count;
+	Dsp_Settings dsp;
+	const char *impulse_response_path;
+};
+
+struct Render_Sink {
+	FILE *file;
+	bool is_wav;
+	u64 frame_count;
+	XXH64_state_t *hash;
+	
+	bool open(const char *path, bool hash);
+	void write(const float *frames, u32 count);
+	void close(u32 sample_rate);
+};
+
+static void write_wav_header(FILE *file, u32 sample_rate, u64 frame_count) {
+	u32 data_size = (u32)MIN(frame_count * 2 * sizeof(float), 0xffffffffull - 36);
+	u32 header[11] = {
+		0x46464952, 36 + data_size, 0x45564157,            // "RIFF" size "WAVE"
+		0x20746d66, 16, 3 | (2 << 16),                     // "fmt " 16, float, channels
+		sample_rate, sample_rate * 2 * 4,
+		(2 * 4) | (32 << 16),
+		0x61746164, data_size,                             // "data" size
+	};
+	
+	fwrite(header, sizeof(header), 1, file);
+}
+
+bool Render_Sink::open(const char *path, bool hash) {
+	this->file = NULL;
+	this->frame_count = 0;
+	this->hash = NULL;
+	
+	if (path) {
+		size_t length = strlen(path);
+		this->file = fopen(path, "wb");
+		if (!this->file) return false;
+		this->is_wav = length >= 4 && !_strnicmp(&path[length - 4], ".wav", 4);
+		// Filled in properly once the length is known
+		if (this->is_wav) write_wav_header(this->file, 0, 0);
+	}
+	
+	if (hash) {
+		this->hash = XXH64_createState();
+		XXH64_reset(this->hash, 0);
+	}
+	
+	return true;
+}
+
+void Render_Sink::write(const float *frames, u32 count) {
+	if (this->file) fwrite(frames, sizeof(float) * 2, count, this->file);
+	if (this->hash) XXH64_update(this->hash, frames, count * 2 * sizeof(float));
+	this->frame_count += count;
+}
+
+void Render_Sink::close(u32 sample_rate) {
+	if (this->file) {
+		if (this->is_wav) {
+			fseek(this->file, 0, SEEK_SET);
+			write_wav_header(this->file, sample_rate, this->frame_count);
+		}
+		fclose(this->file);
+	}
+	
+	if (this->hash) XXH64_freeState(this->hash);
+	this->file = NULL;
+	this->hash = NULL;
+}
+
+static int compare_events(const void *a, const void *b) {
+	u64 at_a = ((const Render_Event*)a)->at_frame;
+	u64 at_b = ((const Render_Event*)b)->at_frame;
+	return at_a < at_b ? -1 : at_a > at_b;
+}
+
+static bool parse_quality(const char *name, Resampler_Quality *quality) {
+	for (u32 i = 0; i < RESAMPLER_QUALITY_COUNT; ++i) {
+		if (!_strnicmp(name, get_resampler_quality_name((Resampler_Quality)i), 16)) {
+			*quality = (Resampler_Quality)i;
+			return true;
+		}
+	}
+	
+	return false;
+}
+
+// Seek the track that can be heard right now, which can be the one before a splice
+static void seek_audible_track(Playback_Pipeline *pipeline, float seconds) {
+	u32 sample_rate = pipeline->splice_index.load() != UINT64_MAX ?
+		pipeline->previous_format.sample_rate : pipeline->format.sample_rate;
+	pipeline->seek((u64)(sample_rate * seconds) * 2);
+}
+
+// Open a track from the queue and tell the pipeline what follows it
+static bool play_from(Playback_Pipeline *pipeline, wchar_t tracks[][512], u32 track_count, u32 index) {
+	if (!pipeline->open(tracks[index])) {
+		log_error("Failed to open \"%ls\"\n", tracks[index]);
+		return false;
+	}
+	
+	pipeline->set_next(index + 1 < track_count ? tracks[index + 1] : NULL);
+	return true;
+}
+
+// TYPE:HZ:DB[:Q], where the type is the band type name without spaces
+static bool parse_eq_band(const char *value, Eq_Band *band) {
+	char type[16];
+	float q = 0.707f;
+	
+	if (sscanf(value, "%15[^:]:%f:%f:%f", type, &band->frequency, &band->gain_db, &q) < 3) return false;
+	band->q = q;
+	
+	for (u32 i = 0; i < EQ_BAND_TYPE_COUNT; ++i) {
+		const char *name = get_eq_band_type_name((Eq_Band_Type)i);
+		char compact[16];
+		u32 length = 0;
+		
+		for (const char *c = name; *c && length < sizeof(compact) - 1; ++c) {
+			if (*c != ' ') compact[length++] = *c;
+		}
+		compact[length] = 0;
+		
+		if (!_strnicmp(type, compact, sizeof(compact))) {
+			band->type = (Eq_Band_Type)i;
+			return true;
+		}
+	}
+	
+	return false;
+}
+
+static void print_usage() {
+	printf("Usage: render [--rate HZ] [--period-ms N] [--ring-ms N] [--quality low|medium|high]\n"
+		   "              [--seek AT=TO]... [--skip AT]... [--eq TYPE:HZ:DB[:Q]]... [--preamp DB]\n"
+		   "              [--limiter DB] [--volume V] [--convolve FILE] [--out FILE] [--hash] tracks...\n");
+}
+
+int main(int argc, char **argv) {
+	Render_Options options = {};
+	static wchar_t tracks[RENDER_MAX_TRACKS][512];
+	u32 track_count = 0;
+	
+	options.sample_rate = RENDER_DEFAULT_RATE;
+	options.period_ms = RENDER_DEFAULT_PERIOD_MS;
+	options.ring_ms = RENDER_DEFAULT_RING_MS;
+	options.quality = RESAMPLER_QUALITY_HIGH;
+	get_default_dsp_settings(&options.dsp);
+	options.dsp.band_count = 0;
+	
+	for (int i = 1; i < argc; ++i) {
+		const char *arg = argv[i];
+		bool has_value = i + 1 < argc;
+		
+		if (!strcmp(arg, "--rate") && has_value) options.sample_rate = atoi(argv[++i]);
+		else if (!strcmp(arg, "--period-ms") && has_value) options.period_ms = atoi(argv[++i]);
+		else if (!strcmp(arg, "--ring-ms") && has_value) options.ring_ms = atoi(argv[++i]);
+		else if (!strcmp(arg, "--out") && has_value) options.out_path = argv[++i];
+		else if (!strcmp(arg, "--hash")) options.hash = true;
+		else if (!strcmp(arg, "--preamp") && has_value) options.dsp.preamp_db = (float)atof(argv[++i]);
+		else if (!strcmp(arg, "--volume") && has_value) options.dsp.volume = (float)atof(argv[++i]);
+		else if (!strcmp(arg, "--convolve") && has_value) {
+			options.impulse_response_path = argv[++i];
+			options.dsp.convolution_enabled = true;
+		}
+		else if (!strcmp(arg, "--limiter") && has_value) {
+			options.dsp.limiter_enabled = true;
+			options.dsp.limiter_threshold_db = (float)atof(argv[++i]);
+		}
+		else if (!strcmp(arg, "--eq") && has_value) {
+			if (options.dsp.band_count == DSP_MAX_EQ_BANDS || 
+				!parse_eq_band(argv[++i], &options.dsp.bands[options.dsp.band_count++])) {
+				print_usage();
+				return 1;
+			}
+			options.dsp.eq_enabled = true;
+		}
+		else if (!strcmp(arg, "--quality") && has_value) {
+			if (!parse_quality(argv[++i], &options.quality)) {
+				print_usage();
+				return 1;
+			}
+		}
+		else if ((!strcmp(arg, "--seek") || !strcmp(arg, "--skip")) && has_value &&
+				 options.event_count < RENDER_MAX_EVENTS) {
+			Render_Event *event = &options.events[options.event_count++];
+			const char *value = argv[++i];
+			const char *to = strchr(value, '=');
+			
+			event->type = arg[3] == 'e' ? RENDER_EVENT_SEEK : RENDER_EVENT_SKIP;
+			if (event->type == RENDER_EVENT_SEEK && !to) {
+				print_usage();
+				return 1;
+			}
+			
+			event->at = atof(value);
+			event->to = to ? (float)atof(to + 1) : 0.f;
+		}
+		else if (arg[0] == '-') {
+			print_usage();
+			return 1;
+		}
+		else if (track_count < RENDER_MAX_TRACKS) {
+			utf8_to_utf16(arg, tracks[track_count++], 512);
+		}
+	}
+	
+	if (!track_count || !options.sample_rate || !options.period_ms || !options.ring_ms) {
+		print_usage();
+		return 1;
+	}
+	
+	// --rate can come after the events
+	for (u32 i = 0; i < options.event_count; ++i) {
+		options.events[i].at_frame = (u64)(options.events[i].at * options.sample_rate);
+	}
+	qsort(options.events, options.event_count, sizeof(Render_Event), &compare_events);
+	
+	Render_Sink sink;
+	if (!sink.open(options.out_path, options.hash)) {
+		log_error("Failed to open \"%s\" for writing\n", options.out_path);
+		return 1;
+	}
+	
+	PCM_Format output_format = {};
+	output_format.sample_rate = options.sample_rate;
+	output_format.sample_type = PCM_TYPE_F32;
+	output_format.sample_size = 4;
+	
+	const u32 period_frames = MAX((options.sample_rate * options.period_ms) / 1000, 1);
+	float *period = (float*)malloc(period_frames * 2 * sizeof(float));
+	
+	Playback_Pipeline pipeline = {};
+	pipeline.init(&output_format, (options.sample_rate * options.ring_ms) / 1000, (float)options.period_ms);
+	pipeline.resampler_quality.store(options.quality);
+	
+	Dsp_Chain dsp = {};
+	dsp.init(options.sample_rate, &options.dsp);
+	
+	Convolver convolver = {};
+	if (options.impulse_response_path) {
+		Impulse_Response impulse_response = {};
+		wchar_t path[512];
+		utf8_to_utf16(options.impulse_response_path, path, ARRAY_LENGTH(path));
+		
+		if (!load_impulse_response(path, options.sample_rate, &impulse_response) || !convolver.init(&impulse_response)) {
+			impulse_response.free();
+			return 1;
+		}
+		
+		impulse_response.free();
+		dsp.set_convolver(&convolver);
+	}
+	
+	u32 current_track = 0;
+	u32 next_event = 0;
+	u32 empty_periods = 0;
+	bool failed = !play_from(&pipeline, tracks, track_count, current_track);
+	u64 start_tick = time_get_tick();
+	
+	while (!failed) {
+		// Events land on period boundaries, like calls from the UI between device callbacks
+		while (next_event < options.event_count && options.events[next_event].at_frame <= sink.frame_count) {
+			const Render_Event *event = &options.events[next_event++];
+			
+			if (event->type == RENDER_EVENT_SEEK) {
+				seek_audible_track(&pipeline, event->to);
+			}
+			else if (current_track + 1 < track_count) {
+				failed = !play_from(&pipeline, tracks, track_count, ++current_track);
+			}
+			
+			// The player resets the chain along with the device
+			dsp.reset();
+		}
+		
+		if (failed) break;
+		
+		while (pipeline.produce());
+		
+		u32 read = pipeline.read(period, MIN(period_frames, pipeline.ring.get_fill()));
+		if (read < period_frames) memset(&period[read * 2], 0, (period_frames - read) * 2 * sizeof(float));
+		dsp.process(period, period_frames);
+		
+		if (pipeline.track_changed.exchange(false)) {
+			pipeline.close_previous_track();
+			current_track++;
+			pipeline.set_next(current_track + 1 < track_count ? tracks[current_track + 1] : NULL);
+		}
+		
+		// Nothing plays after the end of the queue, so stop at the last frame of it
+		if (pipeline.track_ended.exchange(false)) {
+			sink.write(period, read);
+			break;
+		}
+		
+		sink.write(period, period_frames);
+		
+		empty_periods = read ? 0 : empty_periods + 1;
+		if (empty_periods >= RENDER_MAX_EMPTY_PERIODS) {
+			log_error("The pipeline stopped producing audio\n");
+			failed = true;
+		}
+	}
+	
+	float wall_seconds = time_ticks_to_milliseconds(time_get_tick() - start_tick) / 1000.f;
+	float audio_seconds = sink.frame_count / (float)options.sample_rate;
+	XXH64_hash_t hash = sink.hash ? XXH64_digest(sink.hash) : 0;
+	
+	printf("Rendered %.3fs of audio at %uHz in %.3fs, %.1fx realtime\n", audio_seconds, options.sample_rate,
+		   wall_seconds, audio_seconds / MAX(wall_seconds, 1e-9f));
+	if (options.hash) printf("Hash: %016llx\n", (unsigned long long)hash);
+	
+	sink.close(options.sample_rate);
+	pipeline.free();
+	dsp.free();
+	convolver.free();
+	free(period);
+	
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,258 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+// Compares the built-in resampler against libsamplerate for quality and speed.
+// Quality is THD+N of a 1kHz tone and a tone near the top of the passband, and how much of a 
+// tone above the output Nyquist frequency leaks through when downsampling.
+#include "../player/common.h"
+#include "../player/cpu.h"
+#include "../player/resampler.h"
+#include <samplerate.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#define BENCH_SECONDS 10
+#define BENCH_BLOCK_FRAMES 4096
+#define PI 3.14159265358979323846
+
+struct Rate_Pair {
+	u32 input_rate;
+	u32 output_rate;
+};
+
+static const Rate_Pair g_rate_pairs[] = {
+	{44100, 48000},
+	{48000, 44100},
+	{88200, 48000},
+	{96000, 48000},
+	{192000, 48000},
+};
+
+static const struct {
+	const char *name;
+	int type;
+} g_src_converters[] = {
+	{"Fastest", SRC_SINC_FASTEST},
+	{"Medium", SRC_SINC_MEDIUM_QUALITY},
+	{"Best", SRC_SINC_BEST_QUALITY},
+};
+
+static double get_seconds() {
+#ifdef _WIN32
+	LARGE_INTEGER counter, frequency;
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+	return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec * 1e-9;
+#endif
+}
+
+static float *generate_tone(u32 sample_rate, double frequency, u32 frame_count) {
+	float *frames = (float*)malloc(frame_count * 2 * sizeof(float));
+	for (u32 i = 0; i < frame_count; ++i) {
+		float sample = (float)(0.5 * sin(2.0 * PI * frequency * i / sample_rate));
+		frames[i*2+0] = sample;
+		frames[i*2+1] = sample;
+	}
+	return frames;
+}
+
+// Fit a sine of the given frequency to the middle of the left channel by least squares and 
+// return the power of the fit and of what's left over
+static void measure_tone(const float *frames, u32 frame_count, u32 sample_rate, double frequency,
+						 double *tone_power, double *residual_power) {
+	u32 start = frame_count / 10;
+	u32 end = frame_count - frame_count / 10;
+	double ss = 0, sc = 0, cc = 0, xs = 0, xc = 0;
+	
+	for (u32 i = start; i < end; ++i) {
+		double angle = 2.0 * PI * frequency * i / sample_rate;
+		double s = sin(angle), c = cos(angle), x = frames[i*2];
+		ss += s*s; sc += s*c; cc += c*c;
+		xs += x*s; xc += x*c;
+	}
+	
+	double determinant = ss*cc - sc*sc;
+	double a = (xs*cc - xc*sc) / determinant;
+	double b = (xc*ss - xs*sc) / determinant;
+	double tone = 0, residual = 0;
+	
+	for (u32 i = start; i < end; ++i) {
+		double angle = 2.0 * PI * frequency * i / sample_rate;
+		double fit = a * sin(angle) + b * cos(angle);
+		double error = frames[i*2] - fit;
+		tone += fit*fit;
+		residual += error*error;
+	}
+	
+	*tone_power = tone / (end - start);
+	*residual_power = residual / (end - start);
+}
+
+static double to_db(double ratio) {
+	return 10.0 * log10(MAX(ratio, 1e-30));
+}
+
+struct Bench_Converter {
+	virtual void reset() = 0;
+	virtual void process(const float *in, u32 in_frames, float *out, u32 out_max, bool end, u32 *used, u32 *generated) = 0;
+};
+
+struct Native_Converter : Bench_Converter {
+	Resampler resampler;
+	void reset() { this->resampler.reset(); }
+	void process(const float *in, u32 in_frames, float *out, u32 out_max, bool end, u32 *used, u32 *generated) {
+		this->resampler.process(in, in_frames, out, out_max, end, used, generated);
+	}
+};
+
+struct Src_Converter : Bench_Converter {
+	SRC_STATE *state;
+	double ratio;
+	void reset() { src_reset(this->state); }
+	void process(const float *in, u32 in_frames, float *out, u32 out_max, bool end, u32 *used, u32 *generated) {
+		SRC_DATA data = {};
+		data.data_in = in;
+		data.input_frames = in_frames;
+		data.data_out = out;
+		data.output_frames = out_max;
+		data.src_ratio = this->ratio;
+		data.end_of_input = end;
+		src_process(this->state, &data);
+		*used = data.input_frames_used;
+		*generated = data.output_frames_gen;
+	}
+};
+
+// Run the whole input through in blocks the size the player uses. Returns seconds taken.
+static double run_converter(Bench_Converter *converter, const float *input, u32 input_frames, 
+							float *output, u32 output_max, u32 *output_frames) {
+	u32 consumed = 0, produced = 0;
+	double start = get_seconds();
+	
+	converter->reset();
+	
+	while (produced < output_max) {
+		u32 block = MIN(BENCH_BLOCK_FRAMES, input_frames - consumed);
+		bool end = consumed + block == input_frames;
+		u32 used, generated;
+		
+		converter->process(&input[consumed*2], block, &output[produced*2], MIN(output_max - produced, BENCH_BLOCK_FRAMES * 8),
+						   end, &used, &generated);
+		consumed += used;
+		produced += generated;
+		
+		if (end && !generated && used == block) break;
+	}
+	
+	*output_frames = produced;
+	return get_seconds() - start;
+}
+
+static void bench_converter(const char *engine, const char *quality, const char *kernel, Bench_Converter *converter, 
+							const Rate_Pair *rates) {
+	const u32 input_frames = rates->input_rate * BENCH_SECONDS;
+	const u32 output_max = (u32)((u64)input_frames * rates->output_rate / rates->input_rate) + 1024;
+	const double nyquist = MIN(rates->input_rate, rates->output_rate) / 2.0;
+	const double tones[2] = {1000.0, nyquist * 0.85};
+	float *output = (float*)malloc(output_max * 2 * sizeof(float));
+	double thd_n[2];
+	double alias_rejection = 0.0;
+	double seconds = 0.0;
+	u32 output_frames;
+	
+	for (u32 i = 0; i < 2; ++i) {
+		float *input = generate_tone(rates->input_rate, tones[i], input_frames);
+		double tone, residual;
+		seconds += run_converter(converter, input, input_frames, output, output_max, &output_frames);
+		measure_tone(output, output_frames, rates->output_rate, tones[i], &tone, &residual);
+		thd_n[i] = to_db(residual / tone);
+		free(input);
+	}
+	
+	// A tone past the output Nyquist frequency should disappear when downsampling
+	if (rates->output_rate < rates->input_rate) {
+		double frequency = rates->output_rate * 0.55;
+		float *input = generate_tone(rates->input_rate, frequency, input_frames);
+		double power = 0.0;
+		run_converter(converter, input, input_frames, output, output_max, &output_frames);
+		for (u32 i = output_frames / 10; i < output_frames - output_frames / 10; ++i) power += output[i*2] * output[i*2];
+		power /= output_frames - 2 * (output_frames / 10);
+		alias_rejection = -to_db(power / 0.125);
+		free(input);
+	}
+	
+	double realtime = (2.0 * BENCH_SECONDS) / seconds;
+	printf("%6u -> %-6u %-15s %-8s %-7s %9.1f %9.1f ", rates->input_rate, rates->output_rate, engine, quality, kernel, 
+		   thd_n[0], thd_n[1]);
+	if (alias_rejection > 0.0) printf("%9.1f ", alias_rejection);
+	else printf("%9s ", "-");
+	printf("%10.0fx\n", realtime);
+	
+	free(output);
+}
+
+int main(int argc, char **argv) {
+	u32 all_features = get_cpu_features();
+	u32 kernel_features[] = {all_features, all_features & ~(CPU_FEATURE_AVX2|CPU_FEATURE_FMA), 0};
+	
+	printf("Each converter runs %u seconds of stereo audio in %u frame blocks, twice\n", BENCH_SECONDS, BENCH_BLOCK_FRAMES);
+	printf("%-16s %-15s %-8s %-7s %9s %9s %9s %11s\n", "Rates", "Engine", "Quality", "Kernel", 
+		   "THD+N 1k", "THD+N hi", "Alias dB", "Speed");
+	
+	for (u32 r = 0; r < ARRAY_LENGTH(g_rate_pairs); ++r) {
+		const Rate_Pair *rates = &g_rate_pairs[r];
+		
+		for (u32 q = 0; q < RESAMPLER_QUALITY_COUNT; ++q) {
+			// Every distinct inner loop this CPU has, best first
+			for (u32 k = 0; k < ARRAY_LENGTH(kernel_features); ++k) {
+				if (k && kernel_features[k] == kernel_features[k-1]) continue;
+				
+				Native_Converter converter = {};
+				override_cpu_features(kernel_features[k]);
+				const char *kernel = get_resampler_kernel_name();
+				if (!converter.resampler.init(rates->input_rate, rates->output_rate, (Resampler_Quality)q)) continue;
+				
+				bench_converter("Verata", get_resampler_quality_name((Resampler_Quality)q), kernel, &converter, rates);
+				converter.resampler.free();
+			}
+		}
+		
+		override_cpu_features(all_features);
+		
+		for (u32 c = 0; c < ARRAY_LENGTH(g_src_converters); ++c) {
+			int error;
+			Src_Converter converter;
+			converter.state = src_new(g_src_converters[c].type, 2, &error);
+			converter.ratio = (double)rates->output_rate / rates->input_rate;
+			bench_converter("libsamplerate", g_src_converters[c].name, "-", &converter, rates);
+			src_delete(converter.state);
+		}
+	}
+	
+	return 0;
+}